@@ -24,800 +24,846 @@
 #define _6502_PRIVATE
 #include "6502.h"
 
+/* Plain memory is a page table lookup, anything else is up to the board */
+static inline uint8_t read6502(struct cpu6502 *c, uint16_t addr)
+{
+	uint8_t *p = c->rpage[addr >> 8];
+	if (p)
+		return p[addr & 0xFF];
+	return c->mem_read(c, addr);
+}
 
-//6502 CPU registers
-uint16_t pc;
-uint8_t sp, a, x, y, status;
+static inline void write6502(struct cpu6502 *c, uint16_t addr, uint8_t val)
+{
+	uint8_t *p = c->wpage[addr >> 8];
+	if (p)
+		p[addr & 0xFF] = val;
+	else
+		c->mem_write(c, addr, val);
+}
 
-//helper variables
-uint64_t instructions = 0;	//keep track of total instructions executed
-uint64_t clockticks6502 = 0, clockgoal6502 = 0;
-uint16_t oldpc, ea, reladdr, value, result;
-uint8_t opcode, oldstatus;
+/* For the instruction trace, must not have side effects */
+static uint8_t read6502_debug(struct cpu6502 *c, uint16_t addr)
+{
+	uint8_t *p = c->rpage[addr >> 8];
+	if (p)
+		return p[addr & 0xFF];
+	if (c->mem_debug)
+		return c->mem_debug(c, addr);
+	return 0xFF;
+}
 
 //a few general functions used by various other functions
-static void push16(uint16_t pushval)
+static void push16(struct cpu6502 *c, uint16_t pushval)
 {
-	write6502(BASE_STACK + sp, (pushval >> 8) & 0xFF);
-	write6502(BASE_STACK + ((sp - 1) & 0xFF), pushval & 0xFF);
-	sp -= 2;
+	write6502(c, BASE_STACK + c->sp, (pushval >> 8) & 0xFF);
+	write6502(c, BASE_STACK + ((c->sp - 1) & 0xFF), pushval & 0xFF);
+	c->sp -= 2;
 }
 
-static void push8(uint8_t pushval)
+static void push8(struct cpu6502 *c, uint8_t pushval)
 {
-	write6502(BASE_STACK + sp--, pushval);
+	write6502(c, BASE_STACK + c->sp--, pushval);
 }
 
-static uint16_t pull16(void)
+static uint16_t pull16(struct cpu6502 *c)
 {
 	uint16_t temp16;
-	temp16 = read6502(BASE_STACK + ((sp + 1) & 0xFF)) | ((uint16_t) read6502(BASE_STACK + ((sp + 2) & 0xFF)) << 8);
-	sp += 2;
+	temp16 = read6502(c, BASE_STACK + ((c->sp + 1) & 0xFF)) | ((uint16_t) read6502(c, BASE_STACK + ((c->sp + 2) & 0xFF)) << 8);
+	c->sp += 2;
 	return (temp16);
 }
 
-static uint8_t pull8(void)
+static uint8_t pull8(struct cpu6502 *c)
 {
-	return (read6502(BASE_STACK + ++sp));
+	return (read6502(c, BASE_STACK + ++c->sp));
 }
 
-void reset6502(void)
+void reset6502(struct cpu6502 *c)
 {
-	pc = (uint16_t) read6502(0xFFFC) | ((uint16_t) read6502(0xFFFD) << 8);
-	a = 0;
-	x = 0;
-	y = 0;
-	sp = 0xFF;
-	status |= FLAG_CONSTANT;
+	c->pc = (uint16_t) read6502(c, 0xFFFC) | ((uint16_t) read6502(c, 0xFFFD) << 8);
+	c->a = 0;
+	c->x = 0;
+	c->y = 0;
+	c->sp = 0xFF;
+	c->status |= FLAG_CONSTANT;
 }
 
-
-static void (*addrtable[256]) (void);
-static void (*optable[256]) (void);
-uint8_t penaltyop, penaltyaddr;
-
 //addressing mode functions, calculates effective addresses
-static void imp(void)
+static void imp(struct cpu6502 *c)
 {				//implied
 }
 
-static void acc(void)
+static void acc(struct cpu6502 *c)
 {				//accumulator
 }
 
-static void imm(void)
+static void imm(struct cpu6502 *c)
 {				//immediate
-	ea = pc++;
+	c->ea = c->pc++;
 }
 
-static void zp(void)
+static void zp(struct cpu6502 *c)
 {				//zero-page
-	ea = (uint16_t) read6502((uint16_t) pc++);
+	c->ea = (uint16_t) read6502(c, (uint16_t) c->pc++);
 }
 
-static void zpx(void)
+static void zpx(struct cpu6502 *c)
 {				//zero-page,X
-	ea = ((uint16_t) read6502((uint16_t) pc++) + (uint16_t) x) & 0xFF;	//zero-page wraparound
+	c->ea = ((uint16_t) read6502(c, (uint16_t) c->pc++) + (uint16_t) c->x) & 0xFF;	//zero-page wraparound
 }
 
-static void zpy(void)
+static void zpy(struct cpu6502 *c)
 {				//zero-page,Y
-	ea = ((uint16_t) read6502((uint16_t) pc++) + (uint16_t) y) & 0xFF;	//zero-page wraparound
+	c->ea = ((uint16_t) read6502(c, (uint16_t) c->pc++) + (uint16_t) c->y) & 0xFF;	//zero-page wraparound
 }
 
-static void rel(void)
+static void rel(struct cpu6502 *c)
 {				//relative for branch ops (8-bit immediate value, sign-extended)
-	reladdr = (uint16_t) read6502(pc++);
-	if (reladdr & 0x80)
-		reladdr |= 0xFF00;
+	c->reladdr = (uint16_t) read6502(c, c->pc++);
+	if (c->reladdr & 0x80)
+		c->reladdr |= 0xFF00;
 }
 
-static void abso(void)
+static void abso(struct cpu6502 *c)
 {				//absolute
-	ea = (uint16_t) read6502(pc) | ((uint16_t) read6502(pc + 1) << 8);
-	pc += 2;
+	c->ea = (uint16_t) read6502(c, c->pc) | ((uint16_t) read6502(c, c->pc + 1) << 8);
+	c->pc += 2;
 }
 
-static void absx(void)
+static void absx(struct cpu6502 *c)
 {				//absolute,X
 	uint16_t startpage;
-	ea = ((uint16_t) read6502(pc) | ((uint16_t) read6502(pc + 1) << 8));
-	startpage = ea & 0xFF00;
-	ea += (uint16_t) x;
+	c->ea = ((uint16_t) read6502(c, c->pc) | ((uint16_t) read6502(c, c->pc + 1) << 8));
+	startpage = c->ea & 0xFF00;
+	c->ea += (uint16_t) c->x;
 
-	if (startpage != (ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
-		penaltyaddr = 1;
+	if (startpage != (c->ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
+		c->penaltyaddr = 1;
 	}
 
-	pc += 2;
+	c->pc += 2;
 }
 
-static void absy(void)
+static void absy(struct cpu6502 *c)
 {				//absolute,Y
 	uint16_t startpage;
-	ea = ((uint16_t) read6502(pc) | ((uint16_t) read6502(pc + 1) << 8));
-	startpage = ea & 0xFF00;
-	ea += (uint16_t) y;
+	c->ea = ((uint16_t) read6502(c, c->pc) | ((uint16_t) read6502(c, c->pc + 1) << 8));
+	startpage = c->ea & 0xFF00;
+	c->ea += (uint16_t) c->y;
 
-	if (startpage != (ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
-		penaltyaddr = 1;
+	if (startpage != (c->ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
+		c->penaltyaddr = 1;
 	}
 
-	pc += 2;
+	c->pc += 2;
 }
 
-static void ind(void)
+static void ind(struct cpu6502 *c)
 {				//indirect
 	uint16_t eahelp, eahelp2;
-	eahelp = (uint16_t) read6502(pc) | (uint16_t) ((uint16_t) read6502(pc + 1) << 8);
+	eahelp = (uint16_t) read6502(c, c->pc) | (uint16_t) ((uint16_t) read6502(c, c->pc + 1) << 8);
 	eahelp2 = (eahelp & 0xFF00) | ((eahelp + 1) & 0x00FF);	//replicate 6502 page-boundary wraparound bug
-	ea = (uint16_t) read6502(eahelp) | ((uint16_t) read6502(eahelp2) << 8);
-	pc += 2;
+	c->ea = (uint16_t) read6502(c, eahelp) | ((uint16_t) read6502(c, eahelp2) << 8);
+	c->pc += 2;
 }
 
-static void indx(void)
+static void indx(struct cpu6502 *c)
 {				// (indirect,X)
 	uint16_t eahelp;
-	eahelp = (uint16_t) (((uint16_t) read6502(pc++) + (uint16_t) x) & 0xFF);	//zero-page wraparound for table pointer
-	ea = (uint16_t) read6502(eahelp & 0x00FF) | ((uint16_t) read6502((eahelp + 1) & 0x00FF) << 8);
+	eahelp = (uint16_t) (((uint16_t) read6502(c, c->pc++) + (uint16_t) c->x) & 0xFF);	//zero-page wraparound for table pointer
+	c->ea = (uint16_t) read6502(c, eahelp & 0x00FF) | ((uint16_t) read6502(c, (eahelp + 1) & 0x00FF) << 8);
 }
 
-static void indy(void)
+static void indy(struct cpu6502 *c)
 {				// (indirect),Y
 	uint16_t eahelp, eahelp2, startpage;
-	eahelp = (uint16_t) read6502(pc++);
+	eahelp = (uint16_t) read6502(c, c->pc++);
 	eahelp2 = (eahelp & 0xFF00) | ((eahelp + 1) & 0x00FF);	//zero-page wraparound
-	ea = (uint16_t) read6502(eahelp) | ((uint16_t) read6502(eahelp2) << 8);
-	startpage = ea & 0xFF00;
-	ea += (uint16_t) y;
+	c->ea = (uint16_t) read6502(c, eahelp) | ((uint16_t) read6502(c, eahelp2) << 8);
+	startpage = c->ea & 0xFF00;
+	c->ea += (uint16_t) c->y;
 
-	if (startpage != (ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
-		penaltyaddr = 1;
+	if (startpage != (c->ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
+		c->penaltyaddr = 1;
 	}
 }
 
-static uint16_t getvalue(void)
+/* ASL, ROL, LSR and ROR A are the only accumulator mode opcodes */
+#define accmode()	((c->opcode & 0x9F) == 0x0A)
+
+static uint16_t getvalue(struct cpu6502 *c)
 {
-	if (addrtable[opcode] == acc)
-		return ((uint16_t) a);
+	if (accmode())
+		return ((uint16_t) c->a);
 	else
-		return ((uint16_t) read6502(ea));
+		return ((uint16_t) read6502(c, c->ea));
 }
 
 #if 0
-static uint16_t getvalue16(void)
+static uint16_t getvalue16(struct cpu6502 *c)
 {
-	return ((uint16_t) read6502(ea) | ((uint16_t) read6502(ea + 1) << 8));
+	return ((uint16_t) read6502(c, c->ea) | ((uint16_t) read6502(c, c->ea + 1) << 8));
 }
 #endif
 
-static void putvalue(uint16_t saveval)
+static void putvalue(struct cpu6502 *c, uint16_t saveval)
 {
-	if (addrtable[opcode] == acc)
-		a = (uint8_t) (saveval & 0x00FF);
+	if (accmode())
+		c->a = (uint8_t) (saveval & 0x00FF);
 	else
-		write6502(ea, (saveval & 0x00FF));
+		write6502(c, c->ea, (saveval & 0x00FF));
 }
 
 
-//instruction handler functions
-static void adc(void)
+uint8_t nztable[256];
+
+#define FLAGS_NVZC	(FLAG_SIGN | FLAG_OVERFLOW | FLAG_ZERO | FLAG_CARRY)
+
+/* ADC and SBC hand back the new flags (N V Z C only) in the upper byte and
+   the result in the lower. Decimal mode follows the NMOS parts: Z is from
+   the binary sum, N and V come from ADC before the high digit is fixed up
+   and SBC sets all its flags as if in binary */
+static inline uint16_t adc_calc(unsigned int a, unsigned int v, unsigned int carry, unsigned int decimal)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a + value + (uint16_t) (status & FLAG_CARRY);
+	unsigned int r = a + v + carry;
+	unsigned int f = nztable[r & 0xFF] | (r >> 8);
 
-	carrycalc(result);
-	zerocalc(result);
-	overflowcalc(result, a, value);
-	signcalc(result);
+	f |= ((r ^ a) & (r ^ v) & 0x80) >> 1;
+	if (decimal) {
+		unsigned int lo = (a & 0x0F) + (v & 0x0F) + carry;
+		unsigned int hi;
 
-#ifndef NES_CPU
-	if (status & FLAG_DECIMAL) {
-		clearcarry();
+		if (lo > 0x09)
+			lo += 0x06;
+		hi = (a >> 4) + (v >> 4) + (lo > 0x0F);
+		f &= FLAG_ZERO;
+		f |= (hi << 4) & FLAG_SIGN;
+		f |= (~(a ^ v) & (a ^ (hi << 4)) & 0x80) >> 1;
+		if (hi > 0x09)
+			hi += 0x06;
+		if (hi > 0x0F)
+			f |= FLAG_CARRY;
+		r = (hi << 4) | (lo & 0x0F);
+	}
+	return (f << 8) | (r & 0xFF);
+}
 
-		if ((a & 0x0F) > 0x09) {
-			a += 0x06;
-		}
-		if ((a & 0xF0) > 0x90) {
-			a += 0x60;
-			setcarry();
+static inline uint16_t sbc_calc(unsigned int a, unsigned int v, unsigned int carry, unsigned int decimal)
+{
+	uint16_t r = adc_calc(a, v ^ 0xFF, carry, 0);
+
+	if (decimal) {
+		int lo = (a & 0x0F) - (v & 0x0F) - !carry;
+		int hi = (a >> 4) - (v >> 4);
+
+		if (lo < 0) {
+			lo -= 0x06;
+			hi--;
 		}
+		if (hi < 0)
+			hi -= 0x06;
+		r = (r & 0xFF00) | (((hi << 4) | (lo & 0x0F)) & 0xFF);
+	}
+	return r;
+}
+
+#ifdef NES_CPU
+#define decimalmode()	0
+#else
+#define decimalmode()	(c->status & FLAG_DECIMAL)
+#endif
+
+#ifdef CPU6502_ADC_TABLES
+/* Every ADC and SBC worked out in advance, indexed by decimal and carry
+   then by the accumulator and operand. 1MB between the two */
+static uint16_t adctable[4][65536];
+static uint16_t sbctable[4][65536];
+
+#define adcsbc(t, fn) \
+    t[(decimalmode() ? 2 : 0) | (c->status & FLAG_CARRY)][(c->a << 8) | (c->value & 0xFF)]
+#else
+#define adcsbc(t, fn) \
+    fn(c->a, c->value & 0xFF, c->status & FLAG_CARRY, decimalmode())
+#endif
 
-		clockticks6502++;
+static void adcsbc_tables(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++)
+		nztable[i] = (i ? 0 : FLAG_ZERO) | (i & FLAG_SIGN);
+#ifdef CPU6502_ADC_TABLES
+	for (i = 0; i < 4 * 65536; i++) {
+		adctable[i >> 16][i & 0xFFFF] = adc_calc((i >> 8) & 0xFF, i & 0xFF, (i >> 16) & 1, i >> 17);
+		sbctable[i >> 16][i & 0xFFFF] = sbc_calc((i >> 8) & 0xFF, i & 0xFF, (i >> 16) & 1, i >> 17);
 	}
 #endif
+}
+
+//instruction handler functions
+static void adc(struct cpu6502 *c)
+{
+	uint16_t r;
 
-	saveaccum(result);
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	r = adcsbc(adctable, adc_calc);
+	c->status = (c->status & ~FLAGS_NVZC) | (r >> 8);
+	c->a = (uint8_t) r;
+
+	if (decimalmode())
+		c->clockticks++;
 }
 
-static void and(void)
+static void and(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a & value;
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	c->result = (uint16_t) c->a & c->value;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(c->result);
 
-	saveaccum(result);
+	saveaccum(c->result);
 }
 
-static void asl(void)
+static void asl(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = value << 1;
+	c->value = getvalue(c);
+	c->result = c->value << 1;
 
-	carrycalc(result);
-	zerocalc(result);
-	signcalc(result);
+	carrycalc(c->result);
+	nzcalc(c->result);
 
-	putvalue(result);
+	putvalue(c, c->result);
 }
 
-static void bcc(void)
+static void bcc(struct cpu6502 *c)
 {
-	if ((status & FLAG_CARRY) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_CARRY) == 0) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void bcs(void)
+static void bcs(struct cpu6502 *c)
 {
-	if ((status & FLAG_CARRY) == FLAG_CARRY) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_CARRY) == FLAG_CARRY) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void beq(void)
+static void beq(struct cpu6502 *c)
 {
-	if ((status & FLAG_ZERO) == FLAG_ZERO) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_ZERO) == FLAG_ZERO) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void bit(void)
+static void bit(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = (uint16_t) a & value;
+	c->value = getvalue(c);
+	c->result = (uint16_t) c->a & c->value;
 
-	zerocalc(result);
-	status = (status & 0x3F) | (uint8_t) (value & 0xC0);
+	zerocalc(c->result);
+	c->status = (c->status & 0x3F) | (uint8_t) (c->value & 0xC0);
 }
 
-static void bmi(void)
+static void bmi(struct cpu6502 *c)
 {
-	if ((status & FLAG_SIGN) == FLAG_SIGN) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_SIGN) == FLAG_SIGN) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void bne(void)
+static void bne(struct cpu6502 *c)
 {
-	if ((status & FLAG_ZERO) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_ZERO) == 0) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void bpl(void)
+static void bpl(struct cpu6502 *c)
 {
-	if ((status & FLAG_SIGN) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_SIGN) == 0) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void brk(void)
+static void brk(struct cpu6502 *c)
 {
-	pc++;
-	push16(pc);		//push next instruction address onto stack
-	push8(status | FLAG_BREAK);	//push CPU status OR'd with break flag to stack
+	c->pc++;
+	push16(c, c->pc);		//push next instruction address onto stack
+	push8(c, c->status | FLAG_BREAK);	//push CPU status OR'd with break flag to stack
 	setinterrupt();		//set interrupt flag
-	pc = (uint16_t) read6502(0xFFFE) | ((uint16_t) read6502(0xFFFF) << 8);
+	c->pc = (uint16_t) read6502(c, 0xFFFE) | ((uint16_t) read6502(c, 0xFFFF) << 8);
 }
 
-static void bvc(void)
+static void bvc(struct cpu6502 *c)
 {
-	if ((status & FLAG_OVERFLOW) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_OVERFLOW) == 0) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void bvs(void)
+static void bvs(struct cpu6502 *c)
 {
-	if ((status & FLAG_OVERFLOW) == FLAG_OVERFLOW) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((c->status & FLAG_OVERFLOW) == FLAG_OVERFLOW) {
+		c->oldpc = c->pc;
+		c->pc += c->reladdr;
+		if ((c->oldpc & 0xFF00) != (c->pc & 0xFF00))
+			c->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			c->clockticks++;
 	}
 }
 
-static void clc(void)
+static void clc(struct cpu6502 *c)
 {
 	clearcarry();
 }
 
-static void cld(void)
+static void cld(struct cpu6502 *c)
 {
 	cleardecimal();
 }
 
-static void cli(void)
+static void cli(struct cpu6502 *c)
 {
 	clearinterrupt();
 }
 
-static void clv(void)
+static void clv(struct cpu6502 *c)
 {
 	clearoverflow();
 }
 
-static void cmp(void)
+static void cmp(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a - value;
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	c->result = (uint16_t) c->a - c->value;
 
-	if (a >= (uint8_t) (value & 0x00FF))
+	if (c->a >= (uint8_t) (c->value & 0x00FF))
 		setcarry();
 	else
 		clearcarry();
-	if (a == (uint8_t) (value & 0x00FF))
+	if (c->a == (uint8_t) (c->value & 0x00FF))
 		setzero();
 	else
 		clearzero();
-	signcalc(result);
+	signcalc(c->result);
 }
 
-static void cpx(void)
+static void cpx(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = (uint16_t) x - value;
+	c->value = getvalue(c);
+	c->result = (uint16_t) c->x - c->value;
 
-	if (x >= (uint8_t) (value & 0x00FF))
+	if (c->x >= (uint8_t) (c->value & 0x00FF))
 		setcarry();
 	else
 		clearcarry();
-	if (x == (uint8_t) (value & 0x00FF))
+	if (c->x == (uint8_t) (c->value & 0x00FF))
 		setzero();
 	else
 		clearzero();
-	signcalc(result);
+	signcalc(c->result);
 }
 
-static void cpy(void)
+static void cpy(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = (uint16_t) y - value;
+	c->value = getvalue(c);
+	c->result = (uint16_t) c->y - c->value;
 
-	if (y >= (uint8_t) (value & 0x00FF))
+	if (c->y >= (uint8_t) (c->value & 0x00FF))
 		setcarry();
 	else
 		clearcarry();
-	if (y == (uint8_t) (value & 0x00FF))
+	if (c->y == (uint8_t) (c->value & 0x00FF))
 		setzero();
 	else
 		clearzero();
-	signcalc(result);
+	signcalc(c->result);
 }
 
-static void dec(void)
+static void dec(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = value - 1;
+	c->value = getvalue(c);
+	c->result = c->value - 1;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(c->result);
 
-	putvalue(result);
+	putvalue(c, c->result);
 }
 
-static void dex(void)
+static void dex(struct cpu6502 *c)
 {
-	x--;
+	c->x--;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(c->x);
 }
 
-static void dey(void)
+static void dey(struct cpu6502 *c)
 {
-	y--;
+	c->y--;
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(c->y);
 }
 
-static void eor(void)
+static void eor(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a ^ value;
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	c->result = (uint16_t) c->a ^ c->value;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(c->result);
 
-	saveaccum(result);
+	saveaccum(c->result);
 }
 
-static void inc(void)
+static void inc(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = value + 1;
+	c->value = getvalue(c);
+	c->result = c->value + 1;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(c->result);
 
-	putvalue(result);
+	putvalue(c, c->result);
 }
 
-static void inx(void)
+static void inx(struct cpu6502 *c)
 {
-	x++;
+	c->x++;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(c->x);
 }
 
-static void iny(void)
+static void iny(struct cpu6502 *c)
 {
-	y++;
+	c->y++;
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(c->y);
 }
 
-static void jmp(void)
+static void jmp(struct cpu6502 *c)
 {
-	pc = ea;
+	c->pc = c->ea;
 }
 
-static void jsr(void)
+static void jsr(struct cpu6502 *c)
 {
-	push16(pc - 1);
-	pc = ea;
+	push16(c, c->pc - 1);
+	c->pc = c->ea;
 }
 
-static void lda(void)
+static void lda(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue();
-	a = (uint8_t) (value & 0x00FF);
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	c->a = (uint8_t) (c->value & 0x00FF);
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(c->a);
 }
 
-static void ldx(void)
+static void ldx(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue();
-	x = (uint8_t) (value & 0x00FF);
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	c->x = (uint8_t) (c->value & 0x00FF);
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(c->x);
 }
 
-static void ldy(void)
+static void ldy(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue();
-	y = (uint8_t) (value & 0x00FF);
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	c->y = (uint8_t) (c->value & 0x00FF);
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(c->y);
 }
 
-static void lsr(void)
+static void lsr(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = value >> 1;
+	c->value = getvalue(c);
+	c->result = c->value >> 1;
 
-	if (value & 1)
+	if (c->value & 1)
 		setcarry();
 	else
 		clearcarry();
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(c->result);
 
-	putvalue(result);
+	putvalue(c, c->result);
 }
 
-static void nop(void)
+static void nop(struct cpu6502 *c)
 {
-	switch (opcode) {
+	switch (c->opcode) {
 	case 0x1C:
 	case 0x3C:
 	case 0x5C:
 	case 0x7C:
 	case 0xDC:
 	case 0xFC:
-		penaltyop = 1;
+		c->penaltyop = 1;
 		break;
 	}
 }
 
-static void ora(void)
+static void ora(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a | value;
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	c->result = (uint16_t) c->a | c->value;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(c->result);
 
-	saveaccum(result);
+	saveaccum(c->result);
 }
 
-static void pha(void)
+static void pha(struct cpu6502 *c)
 {
-	push8(a);
+	push8(c, c->a);
 }
 
-static void php(void)
+static void php(struct cpu6502 *c)
 {
-	push8(status | FLAG_BREAK);
+	push8(c, c->status | FLAG_BREAK);
 }
 
-static void pla(void)
+static void pla(struct cpu6502 *c)
 {
-	a = pull8();
+	c->a = pull8(c);
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(c->a);
 }
 
-static void plp(void)
+static void plp(struct cpu6502 *c)
 {
-	status = pull8() | FLAG_CONSTANT;
+	c->status = pull8(c) | FLAG_CONSTANT;
 }
 
-static void rol(void)
+static void rol(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = (value << 1) | (status & FLAG_CARRY);
+	c->value = getvalue(c);
+	c->result = (c->value << 1) | (c->status & FLAG_CARRY);
 
-	carrycalc(result);
-	zerocalc(result);
-	signcalc(result);
+	carrycalc(c->result);
+	nzcalc(c->result);
 
-	putvalue(result);
+	putvalue(c, c->result);
 }
 
-static void ror(void)
+static void ror(struct cpu6502 *c)
 {
-	value = getvalue();
-	result = (value >> 1) | ((status & FLAG_CARRY) << 7);
+	c->value = getvalue(c);
+	c->result = (c->value >> 1) | ((c->status & FLAG_CARRY) << 7);
 
-	if (value & 1)
+	if (c->value & 1)
 		setcarry();
 	else
 		clearcarry();
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(c->result);
 
-	putvalue(result);
+	putvalue(c, c->result);
 }
 
-static void rti(void)
+static void rti(struct cpu6502 *c)
 {
-	status = pull8();
-	value = pull16();
-	pc = value;
+	c->status = pull8(c);
+	c->value = pull16(c);
+	c->pc = c->value;
 }
 
-static void rts(void)
+static void rts(struct cpu6502 *c)
 {
-	value = pull16();
-	pc = value + 1;
+	c->value = pull16(c);
+	c->pc = c->value + 1;
 }
 
-static void sbc(void)
+static void sbc(struct cpu6502 *c)
 {
-	penaltyop = 1;
-	value = getvalue() ^ 0x00FF;
-	result = (uint16_t) a + value + (uint16_t) (status & FLAG_CARRY);
-
-	carrycalc(result);
-	zerocalc(result);
-	overflowcalc(result, a, value);
-	signcalc(result);
+	uint16_t r;
 
-#ifndef NES_CPU
-	if (status & FLAG_DECIMAL) {
-		clearcarry();
-
-		a -= 0x66;
-		if ((a & 0x0F) > 0x09) {
-			a += 0x06;
-		}
-		if ((a & 0xF0) > 0x90) {
-			a += 0x60;
-			setcarry();
-		}
-
-		clockticks6502++;
-	}
-#endif
+	c->penaltyop = 1;
+	c->value = getvalue(c);
+	r = adcsbc(sbctable, sbc_calc);
+	c->status = (c->status & ~FLAGS_NVZC) | (r >> 8);
+	c->a = (uint8_t) r;
 
-	saveaccum(result);
+	if (decimalmode())
+		c->clockticks++;
 }
 
-static void sec(void)
+static void sec(struct cpu6502 *c)
 {
 	setcarry();
 }
 
-static void sed(void)
+static void sed(struct cpu6502 *c)
 {
 	setdecimal();
 }
 
-static void sei(void)
+static void sei(struct cpu6502 *c)
 {
 	setinterrupt();
 }
 
-static void sta(void)
+static void sta(struct cpu6502 *c)
 {
-	putvalue(a);
+	putvalue(c, c->a);
 }
 
-static void stx(void)
+static void stx(struct cpu6502 *c)
 {
-	putvalue(x);
+	putvalue(c, c->x);
 }
 
-static void sty(void)
+static void sty(struct cpu6502 *c)
 {
-	putvalue(y);
+	putvalue(c, c->y);
 }
 
-static void tax(void)
+static void tax(struct cpu6502 *c)
 {
-	x = a;
+	c->x = c->a;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(c->x);
 }
 
-static void tay(void)
+static void tay(struct cpu6502 *c)
 {
-	y = a;
+	c->y = c->a;
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(c->y);
 }
 
-static void tsx(void)
+static void tsx(struct cpu6502 *c)
 {
-	x = sp;
+	c->x = c->sp;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(c->x);
 }
 
-static void txa(void)
+static void txa(struct cpu6502 *c)
 {
-	a = x;
+	c->a = c->x;
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(c->a);
 }
 
-static void txs(void)
+static void txs(struct cpu6502 *c)
 {
-	sp = x;
+	c->sp = c->x;
 }
 
-static void tya(void)
+static void tya(struct cpu6502 *c)
 {
-	a = y;
+	c->a = c->y;
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(c->a);
 }
 
 //undocumented instructions
 #ifdef UNDOCUMENTED
-static void lax(void)
+static void lax(struct cpu6502 *c)
 {
-	lda();
-	ldx();
+	lda(c);
+	ldx(c);
 }
 
-static void sax(void)
+static void sax(struct cpu6502 *c)
 {
-	sta();
-	stx();
-	putvalue(a & x);
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	sta(c);
+	stx(c);
+	putvalue(c, c->a & c->x);
+	if (c->penaltyop && c->penaltyaddr)
+		c->clockticks--;
 }
 
-static void dcp(void)
+static void dcp(struct cpu6502 *c)
 {
-	dec();
-	cmp();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	dec(c);
+	cmp(c);
+	if (c->penaltyop && c->penaltyaddr)
+		c->clockticks--;
 }
 
-static void isb(void)
+static void isb(struct cpu6502 *c)
 {
-	inc();
-	sbc();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	inc(c);
+	sbc(c);
+	if (c->penaltyop && c->penaltyaddr)
+		c->clockticks--;
 }
 
-static void slo(void)
+static void slo(struct cpu6502 *c)
 {
-	asl();
-	ora();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	asl(c);
+	ora(c);
+	if (c->penaltyop && c->penaltyaddr)
+		c->clockticks--;
 }
 
-static void rla(void)
+static void rla(struct cpu6502 *c)
 {
-	rol();
-	and();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	rol(c);
+	and(c);
+	if (c->penaltyop && c->penaltyaddr)
+		c->clockticks--;
 }
 
-static void sre(void)
+static void sre(struct cpu6502 *c)
 {
-	lsr();
-	eor();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	lsr(c);
+	eor(c);
+	if (c->penaltyop && c->penaltyaddr)
+		c->clockticks--;
 }
 
-static void rra(void)
+static void rra(struct cpu6502 *c)
 {
-	ror();
-	adc();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	ror(c);
+	adc(c);
+	if (c->penaltyop && c->penaltyaddr)
+		c->clockticks--;
 }
 #else
 #define lax nop
@@ -831,7 +877,10 @@ static void rra(void)
 #endif
 
 
-static void (*addrtable[256]) (void) = {
+#ifdef CPU6502_TABLE_CORE
+/* The original core, a call through each of these per instruction. Kept
+   so the two can be compared */
+static void (*addrtable[256]) (struct cpu6502 *) = {
 /*        |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |  9  |  A  |  B  |  C  |  D  |  E  |  F  |     */
 													/* 0 */ imp, indx, imp, indx, zp, zp, zp, zp, imp, imm, acc, imm, abso, abso, abso, abso,
 													/* 0 */
@@ -867,7 +916,7 @@ static void (*addrtable[256]) (void) = {
 														/* F */
 };
 
-static void (*optable[256]) (void) = {
+static void (*optable[256]) (struct cpu6502 *) = {
 	brk, ora, nop, slo, nop, ora, asl, slo, php, ora, asl, nop, nop, ora, asl, slo, /* 0 */
 	bpl, ora, nop, slo, nop, ora, asl, slo, clc, ora, nop, slo, nop, ora, asl, slo,
 	jsr, and, nop, rla, bit, and, rol, rla, plp, and, rol, nop, bit, and, rol, rla,
@@ -886,6 +935,277 @@ static void (*optable[256]) (void) = {
 	beq, sbc, nop, isb, nop, sbc, inc, isb, sed, sbc, nop, isb, nop, sbc, inc, isb
 };
 
+static inline void dispatch6502(struct cpu6502 *c)
+{
+	(*addrtable[c->opcode]) (c);
+	(*optable[c->opcode]) (c);
+}
+#else
+/* One case per opcode with the addressing mode and operation called
+   directly, so the compiler can inline the lot */
+static inline void dispatch6502(struct cpu6502 *c)
+{
+	switch (c->opcode) {
+	case 0x00: imp(c); brk(c); break;
+	case 0x01: indx(c); ora(c); break;
+	case 0x02: imp(c); nop(c); break;
+	case 0x03: indx(c); slo(c); break;
+	case 0x04: zp(c); nop(c); break;
+	case 0x05: zp(c); ora(c); break;
+	case 0x06: zp(c); asl(c); break;
+	case 0x07: zp(c); slo(c); break;
+	case 0x08: imp(c); php(c); break;
+	case 0x09: imm(c); ora(c); break;
+	case 0x0A: acc(c); asl(c); break;
+	case 0x0B: imm(c); nop(c); break;
+	case 0x0C: abso(c); nop(c); break;
+	case 0x0D: abso(c); ora(c); break;
+	case 0x0E: abso(c); asl(c); break;
+	case 0x0F: abso(c); slo(c); break;
+	case 0x10: rel(c); bpl(c); break;
+	case 0x11: indy(c); ora(c); break;
+	case 0x12: imp(c); nop(c); break;
+	case 0x13: indy(c); slo(c); break;
+	case 0x14: zpx(c); nop(c); break;
+	case 0x15: zpx(c); ora(c); break;
+	case 0x16: zpx(c); asl(c); break;
+	case 0x17: zpx(c); slo(c); break;
+	case 0x18: imp(c); clc(c); break;
+	case 0x19: absy(c); ora(c); break;
+	case 0x1A: imp(c); nop(c); break;
+	case 0x1B: absy(c); slo(c); break;
+	case 0x1C: absx(c); nop(c); break;
+	case 0x1D: absx(c); ora(c); break;
+	case 0x1E: absx(c); asl(c); break;
+	case 0x1F: absx(c); slo(c); break;
+	case 0x20: abso(c); jsr(c); break;
+	case 0x21: indx(c); and(c); break;
+	case 0x22: imp(c); nop(c); break;
+	case 0x23: indx(c); rla(c); break;
+	case 0x24: zp(c); bit(c); break;
+	case 0x25: zp(c); and(c); break;
+	case 0x26: zp(c); rol(c); break;
+	case 0x27: zp(c); rla(c); break;
+	case 0x28: imp(c); plp(c); break;
+	case 0x29: imm(c); and(c); break;
+	case 0x2A: acc(c); rol(c); break;
+	case 0x2B: imm(c); nop(c); break;
+	case 0x2C: abso(c); bit(c); break;
+	case 0x2D: abso(c); and(c); break;
+	case 0x2E: abso(c); rol(c); break;
+	case 0x2F: abso(c); rla(c); break;
+	case 0x30: rel(c); bmi(c); break;
+	case 0x31: indy(c); and(c); break;
+	case 0x32: imp(c); nop(c); break;
+	case 0x33: indy(c); rla(c); break;
+	case 0x34: zpx(c); nop(c); break;
+	case 0x35: zpx(c); and(c); break;
+	case 0x36: zpx(c); rol(c); break;
+	case 0x37: zpx(c); rla(c); break;
+	case 0x38: imp(c); sec(c); break;
+	case 0x39: absy(c); and(c); break;
+	case 0x3A: imp(c); nop(c); break;
+	case 0x3B: absy(c); rla(c); break;
+	case 0x3C: absx(c); nop(c); break;
+	case 0x3D: absx(c); and(c); break;
+	case 0x3E: absx(c); rol(c); break;
+	case 0x3F: absx(c); rla(c); break;
+	case 0x40: imp(c); rti(c); break;
+	case 0x41: indx(c); eor(c); break;
+	case 0x42: imp(c); nop(c); break;
+	case 0x43: indx(c); sre(c); break;
+	case 0x44: zp(c); nop(c); break;
+	case 0x45: zp(c); eor(c); break;
+	case 0x46: zp(c); lsr(c); break;
+	case 0x47: zp(c); sre(c); break;
+	case 0x48: imp(c); pha(c); break;
+	case 0x49: imm(c); eor(c); break;
+	case 0x4A: acc(c); lsr(c); break;
+	case 0x4B: imm(c); nop(c); break;
+	case 0x4C: abso(c); jmp(c); break;
+	case 0x4D: abso(c); eor(c); break;
+	case 0x4E: abso(c); lsr(c); break;
+	case 0x4F: abso(c); sre(c); break;
+	case 0x50: rel(c); bvc(c); break;
+	case 0x51: indy(c); eor(c); break;
+	case 0x52: imp(c); nop(c); break;
+	case 0x53: indy(c); sre(c); break;
+	case 0x54: zpx(c); nop(c); break;
+	case 0x55: zpx(c); eor(c); break;
+	case 0x56: zpx(c); lsr(c); break;
+	case 0x57: zpx(c); sre(c); break;
+	case 0x58: imp(c); cli(c); break;
+	case 0x59: absy(c); eor(c); break;
+	case 0x5A: imp(c); nop(c); break;
+	case 0x5B: absy(c); sre(c); break;
+	case 0x5C: absx(c); nop(c); break;
+	case 0x5D: absx(c); eor(c); break;
+	case 0x5E: absx(c); lsr(c); break;
+	case 0x5F: absx(c); sre(c); break;
+	case 0x60: imp(c); rts(c); break;
+	case 0x61: indx(c); adc(c); break;
+	case 0x62: imp(c); nop(c); break;
+	case 0x63: indx(c); rra(c); break;
+	case 0x64: zp(c); nop(c); break;
+	case 0x65: zp(c); adc(c); break;
+	case 0x66: zp(c); ror(c); break;
+	case 0x67: zp(c); rra(c); break;
+	case 0x68: imp(c); pla(c); break;
+	case 0x69: imm(c); adc(c); break;
+	case 0x6A: acc(c); ror(c); break;
+	case 0x6B: imm(c); nop(c); break;
+	case 0x6C: ind(c); jmp(c); break;
+	case 0x6D: abso(c); adc(c); break;
+	case 0x6E: abso(c); ror(c); break;
+	case 0x6F: abso(c); rra(c); break;
+	case 0x70: rel(c); bvs(c); break;
+	case 0x71: indy(c); adc(c); break;
+	case 0x72: imp(c); nop(c); break;
+	case 0x73: indy(c); rra(c); break;
+	case 0x74: zpx(c); nop(c); break;
+	case 0x75: zpx(c); adc(c); break;
+	case 0x76: zpx(c); ror(c); break;
+	case 0x77: zpx(c); rra(c); break;
+	case 0x78: imp(c); sei(c); break;
+	case 0x79: absy(c); adc(c); break;
+	case 0x7A: imp(c); nop(c); break;
+	case 0x7B: absy(c); rra(c); break;
+	case 0x7C: absx(c); nop(c); break;
+	case 0x7D: absx(c); adc(c); break;
+	case 0x7E: absx(c); ror(c); break;
+	case 0x7F: absx(c); rra(c); break;
+	case 0x80: imm(c); nop(c); break;
+	case 0x81: indx(c); sta(c); break;
+	case 0x82: imm(c); nop(c); break;
+	case 0x83: indx(c); sax(c); break;
+	case 0x84: zp(c); sty(c); break;
+	case 0x85: zp(c); sta(c); break;
+	case 0x86: zp(c); stx(c); break;
+	case 0x87: zp(c); sax(c); break;
+	case 0x88: imp(c); dey(c); break;
+	case 0x89: imm(c); nop(c); break;
+	case 0x8A: imp(c); txa(c); break;
+	case 0x8B: imm(c); nop(c); break;
+	case 0x8C: abso(c); sty(c); break;
+	case 0x8D: abso(c); sta(c); break;
+	case 0x8E: abso(c); stx(c); break;
+	case 0x8F: abso(c); sax(c); break;
+	case 0x90: rel(c); bcc(c); break;
+	case 0x91: indy(c); sta(c); break;
+	case 0x92: imp(c); nop(c); break;
+	case 0x93: indy(c); nop(c); break;
+	case 0x94: zpx(c); sty(c); break;
+	case 0x95: zpx(c); sta(c); break;
+	case 0x96: zpy(c); stx(c); break;
+	case 0x97: zpy(c); sax(c); break;
+	case 0x98: imp(c); tya(c); break;
+	case 0x99: absy(c); sta(c); break;
+	case 0x9A: imp(c); txs(c); break;
+	case 0x9B: absy(c); nop(c); break;
+	case 0x9C: absx(c); nop(c); break;
+	case 0x9D: absx(c); sta(c); break;
+	case 0x9E: absy(c); nop(c); break;
+	case 0x9F: absy(c); nop(c); break;
+	case 0xA0: imm(c); ldy(c); break;
+	case 0xA1: indx(c); lda(c); break;
+	case 0xA2: imm(c); ldx(c); break;
+	case 0xA3: indx(c); lax(c); break;
+	case 0xA4: zp(c); ldy(c); break;
+	case 0xA5: zp(c); lda(c); break;
+	case 0xA6: zp(c); ldx(c); break;
+	case 0xA7: zp(c); lax(c); break;
+	case 0xA8: imp(c); tay(c); break;
+	case 0xA9: imm(c); lda(c); break;
+	case 0xAA: imp(c); tax(c); break;
+	case 0xAB: imm(c); nop(c); break;
+	case 0xAC: abso(c); ldy(c); break;
+	case 0xAD: abso(c); lda(c); break;
+	case 0xAE: abso(c); ldx(c); break;
+	case 0xAF: abso(c); lax(c); break;
+	case 0xB0: rel(c); bcs(c); break;
+	case 0xB1: indy(c); lda(c); break;
+	case 0xB2: imp(c); nop(c); break;
+	case 0xB3: indy(c); lax(c); break;
+	case 0xB4: zpx(c); ldy(c); break;
+	case 0xB5: zpx(c); lda(c); break;
+	case 0xB6: zpy(c); ldx(c); break;
+	case 0xB7: zpy(c); lax(c); break;
+	case 0xB8: imp(c); clv(c); break;
+	case 0xB9: absy(c); lda(c); break;
+	case 0xBA: imp(c); tsx(c); break;
+	case 0xBB: absy(c); lax(c); break;
+	case 0xBC: absx(c); ldy(c); break;
+	case 0xBD: absx(c); lda(c); break;
+	case 0xBE: absy(c); ldx(c); break;
+	case 0xBF: absy(c); lax(c); break;
+	case 0xC0: imm(c); cpy(c); break;
+	case 0xC1: indx(c); cmp(c); break;
+	case 0xC2: imm(c); nop(c); break;
+	case 0xC3: indx(c); dcp(c); break;
+	case 0xC4: zp(c); cpy(c); break;
+	case 0xC5: zp(c); cmp(c); break;
+	case 0xC6: zp(c); dec(c); break;
+	case 0xC7: zp(c); dcp(c); break;
+	case 0xC8: imp(c); iny(c); break;
+	case 0xC9: imm(c); cmp(c); break;
+	case 0xCA: imp(c); dex(c); break;
+	case 0xCB: imm(c); nop(c); break;
+	case 0xCC: abso(c); cpy(c); break;
+	case 0xCD: abso(c); cmp(c); break;
+	case 0xCE: abso(c); dec(c); break;
+	case 0xCF: abso(c); dcp(c); break;
+	case 0xD0: rel(c); bne(c); break;
+	case 0xD1: indy(c); cmp(c); break;
+	case 0xD2: imp(c); nop(c); break;
+	case 0xD3: indy(c); dcp(c); break;
+	case 0xD4: zpx(c); nop(c); break;
+	case 0xD5: zpx(c); cmp(c); break;
+	case 0xD6: zpx(c); dec(c); break;
+	case 0xD7: zpx(c); dcp(c); break;
+	case 0xD8: imp(c); cld(c); break;
+	case 0xD9: absy(c); cmp(c); break;
+	case 0xDA: imp(c); nop(c); break;
+	case 0xDB: absy(c); dcp(c); break;
+	case 0xDC: absx(c); nop(c); break;
+	case 0xDD: absx(c); cmp(c); break;
+	case 0xDE: absx(c); dec(c); break;
+	case 0xDF: absx(c); dcp(c); break;
+	case 0xE0: imm(c); cpx(c); break;
+	case 0xE1: indx(c); sbc(c); break;
+	case 0xE2: imm(c); nop(c); break;
+	case 0xE3: indx(c); isb(c); break;
+	case 0xE4: zp(c); cpx(c); break;
+	case 0xE5: zp(c); sbc(c); break;
+	case 0xE6: zp(c); inc(c); break;
+	case 0xE7: zp(c); isb(c); break;
+	case 0xE8: imp(c); inx(c); break;
+	case 0xE9: imm(c); sbc(c); break;
+	case 0xEA: imp(c); nop(c); break;
+	case 0xEB: imm(c); sbc(c); break;
+	case 0xEC: abso(c); cpx(c); break;
+	case 0xED: abso(c); sbc(c); break;
+	case 0xEE: abso(c); inc(c); break;
+	case 0xEF: abso(c); isb(c); break;
+	case 0xF0: rel(c); beq(c); break;
+	case 0xF1: indy(c); sbc(c); break;
+	case 0xF2: imp(c); nop(c); break;
+	case 0xF3: indy(c); isb(c); break;
+	case 0xF4: zpx(c); nop(c); break;
+	case 0xF5: zpx(c); sbc(c); break;
+	case 0xF6: zpx(c); inc(c); break;
+	case 0xF7: zpx(c); isb(c); break;
+	case 0xF8: imp(c); sed(c); break;
+	case 0xF9: absy(c); sbc(c); break;
+	case 0xFA: imp(c); nop(c); break;
+	case 0xFB: absy(c); isb(c); break;
+	case 0xFC: absx(c); nop(c); break;
+	case 0xFD: absx(c); sbc(c); break;
+	case 0xFE: absx(c); inc(c); break;
+	case 0xFF: absx(c); isb(c); break;
+	}
+}
+#endif
+
 static const uint32_t ticktable[256] = {
 	7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
 	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
@@ -906,106 +1226,129 @@ static const uint32_t ticktable[256] = {
 };
 
 
-void nmi6502(void)
+void nmi6502(struct cpu6502 *c)
 {
-	push16(pc);
-	push8(status);
-	status |= FLAG_INTERRUPT;
-	pc = (uint16_t) read6502(0xFFFA) | ((uint16_t) read6502(0xFFFB) << 8);
+	push16(c, c->pc);
+	push8(c, c->status);
+	c->status |= FLAG_INTERRUPT;
+	c->pc = (uint16_t) read6502(c, 0xFFFA) | ((uint16_t) read6502(c, 0xFFFB) << 8);
 }
 
-void irq6502(void)
+void irq6502(struct cpu6502 *c)
 {
-	if ((status & FLAG_INTERRUPT) == FLAG_INTERRUPT)
+	if ((c->status & FLAG_INTERRUPT) == FLAG_INTERRUPT)
 		return;		//abort if interrupts are inhibited
-	push16(pc);
-	push8(status);
-	status |= FLAG_INTERRUPT;
-	pc = (uint16_t) read6502(0xFFFE) | ((uint16_t) read6502(0xFFFF) << 8);
+	push16(c, c->pc);
+	push8(c, c->status);
+	c->status |= FLAG_INTERRUPT;
+	c->pc = (uint16_t) read6502(c, 0xFFFE) | ((uint16_t) read6502(c, 0xFFFF) << 8);
 }
 
-static void (*loopexternal) (void);
+void set_irq_line(struct cpu6502 *c, int onoff)
+{
+	c->irq_line = onoff;
+	c->intcheck = c->irq_line | c->nmi_pending;
+}
 
-int log_6502 = 0;
+void set_nmi_line(struct cpu6502 *c, int onoff)
+{
+	if (onoff && !c->nmi_line)
+		c->nmi_pending = 1;
+	c->nmi_line = onoff;
+	c->intcheck = c->irq_line | c->nmi_pending;
+}
+
+static void check_ints(struct cpu6502 *c)
+{
+	if (c->nmi_pending) {
+		c->nmi_pending = 0;
+		c->intcheck = c->irq_line;
+		nmi6502(c);
+	} else if (c->irq_line)
+		irq6502(c);
+}
 
-uint64_t exec6502(uint64_t tickcount)
+uint64_t exec6502(struct cpu6502 *c, uint64_t tickcount)
 {
 	uint64_t startticks;
-	clockgoal6502 += tickcount;
-
-	startticks = clockticks6502;
-	while (clockticks6502 < clockgoal6502) {
-		opcode = read6502(pc++);
-		status |= FLAG_CONSTANT;
-		if (log_6502) {
-			uint8_t c[3];
+	c->clockgoal += tickcount;
+
+	startticks = c->clockticks;
+	while (c->clockticks < c->clockgoal) {
+		c->opcode = read6502(c, c->pc++);
+		c->status |= FLAG_CONSTANT;
+		if (c->trace) {
+			uint8_t buf[3];
 			char *dis;
-			c[0] = opcode;
-			c[1] = read6502_debug(pc);
-			c[2] = read6502_debug(pc + 1);
-			dis = dis6502(pc - 1, c);
+			buf[0] = c->opcode;
+			buf[1] = read6502_debug(c, c->pc);
+			buf[2] = read6502_debug(c, c->pc + 1);
+			dis = dis6502(c->pc - 1, buf);
 			fprintf(stderr, "%02X %02X %02X %02X %02X | %04X %s\n",
-				a, x, y, sp, status, pc - 1, dis);
+				c->a, c->x, c->y, c->sp, c->status, c->pc - 1, dis);
 		}
-		penaltyop = 0;
-		penaltyaddr = 0;
+		c->penaltyop = 0;
+		c->penaltyaddr = 0;
 
-		(*addrtable[opcode]) ();
-		(*optable[opcode]) ();
-		clockticks6502 += ticktable[opcode];
-		if (penaltyop && penaltyaddr)
-			clockticks6502++;
+		dispatch6502(c);
+		c->clockticks += ticktable[c->opcode];
+		if (c->penaltyop && c->penaltyaddr)
+			c->clockticks++;
 
-		instructions++;
+		c->instructions++;
 
-		if (loopexternal)
-			(*loopexternal) ();
+		if (c->intcheck)
+			check_ints(c);
+		if (c->loopexternal)
+			(*c->loopexternal) (c);
 	}
 
-	return (clockticks6502 - startticks);
+	return (c->clockticks - startticks);
 }
 
-void step6502(void)
+void step6502(struct cpu6502 *c)
 {
-	opcode = read6502(pc++);
-	status |= FLAG_CONSTANT;
+	c->opcode = read6502(c, c->pc++);
+	c->status |= FLAG_CONSTANT;
 
-	penaltyop = 0;
-	penaltyaddr = 0;
+	c->penaltyop = 0;
+	c->penaltyaddr = 0;
 
-	(*addrtable[opcode]) ();
-	(*optable[opcode]) ();
-	clockticks6502 += ticktable[opcode];
+	dispatch6502(c);
+	c->clockticks += ticktable[c->opcode];
 	//if (penaltyop && penaltyaddr) clockticks6502++;
-	clockgoal6502 = clockticks6502;
+	c->clockgoal = c->clockticks;
 
-	instructions++;
+	c->instructions++;
 
-	if (loopexternal)
-		(*loopexternal) ();
+	if (c->intcheck)
+		check_ints(c);
+	if (c->loopexternal)
+		(*c->loopexternal) (c);
 }
 
-void hookexternal(void (*funcptr) (void))
+void hookexternal(struct cpu6502 *c, void (*funcptr) (struct cpu6502 *))
 {
-	loopexternal = funcptr;
+	c->loopexternal = funcptr;
 }
 
-uint16_t getPC(void)
+uint16_t getPC(struct cpu6502 *c)
 {
-	return (pc);
+	return (c->pc);
 }
 
-uint64_t getclockticks(void)
+uint64_t getclockticks(struct cpu6502 *c)
 {
-	return (clockticks6502);
+	return (c->clockticks);
 }
 
-void waitstates(uint32_t n)
+void waitstates(struct cpu6502 *c, uint32_t n)
 {
-	clockticks6502 += n;
+	c->clockticks += n;
 }
 
 void init6502(void)
 {
+	adcsbc_tables();
 	disassembler_init();
 }
@@ -1,36 +1,74 @@
 #ifndef __6502_H__
 #define __6502_H__
 
+/*
+ *	All the state for one 6502, so a process can run as many as it likes.
+ *	The board fills in the memory map and callbacks before reset6502().
+ *
+ *	rpage and wpage give the host address of each 256 byte page for
+ *	reading and writing. A NULL entry sends accesses to that page to
+ *	mem_read or mem_write instead, which is how the board sees I/O, ROM
+ *	writes and anything it wants to trace. The board rewrites the tables
+ *	when it switches banks. mem_debug, if set, is used for NULL pages
+ *	when the trace disassembles and must not have side effects.
+ */
+struct cpu6502 {
+	uint16_t pc;
+	uint8_t sp, a, x, y, status;
+
+	uint8_t *rpage[256];
+	uint8_t *wpage[256];
+	uint8_t (*mem_read)(struct cpu6502 *c, uint16_t addr);
+	void (*mem_write)(struct cpu6502 *c, uint16_t addr, uint8_t val);
+	uint8_t (*mem_debug)(struct cpu6502 *c, uint16_t addr);
+	void (*loopexternal)(struct cpu6502 *c);
+	void *private;		/* For the board */
+	int trace;		/* Log each instruction to stderr */
+
+	uint64_t instructions;
+	uint64_t clockticks, clockgoal;
+
+	/* Interrupt inputs. IRQ is a level, NMI fires on the rising edge.
+	   intcheck is set while either wants looking at between instructions */
+	uint8_t irq_line, nmi_pending, nmi_line;
+	uint8_t intcheck;
+
+	/* Working state for the instruction being run */
+	uint16_t oldpc, ea, reladdr, value, result;
+	uint8_t opcode, oldstatus;
+	uint8_t penaltyop, penaltyaddr;
+};
+
 extern void init6502(void);
-extern void reset6502(void);
-extern void nmi6502(void);
-extern void irq6502(void);
-extern uint64_t exec6502(uint64_t tickcount);
-extern void step6502(void);
-extern void hookexternal(void (*loopexternal)(void));
-extern uint16_t getPC(void);
-extern uint64_t getclockticks(void);
-extern void waitstates(uint32_t n);
-
-//externally supplied functions
-extern uint8_t read6502(uint16_t address);
-extern uint8_t read6502_debug(uint16_t address);
-extern void write6502(uint16_t address, uint8_t value);
-
-extern int log_6502;
+extern void reset6502(struct cpu6502 *c);
+extern void nmi6502(struct cpu6502 *c);
+extern void irq6502(struct cpu6502 *c);
+extern uint64_t exec6502(struct cpu6502 *c, uint64_t tickcount);
+extern void step6502(struct cpu6502 *c);
+extern void set_irq_line(struct cpu6502 *c, int onoff);
+extern void set_nmi_line(struct cpu6502 *c, int onoff);
+extern void hookexternal(struct cpu6502 *c, void (*loopexternal)(struct cpu6502 *c));
+extern uint16_t getPC(struct cpu6502 *c);
+extern uint64_t getclockticks(struct cpu6502 *c);
+extern void waitstates(struct cpu6502 *c, uint32_t n);
 
 #ifdef _6502_PRIVATE
 
 extern void disassembler_init(void);
 extern char *dis6502(uint16_t addr, uint8_t *p);
 
-
-extern uint8_t sp, a, x, y, status;
-extern uint16_t pc;
-
 //6502 defines
+#ifndef NO_UNDOCUMENTED
 #define UNDOCUMENTED //when this is defined, undocumented opcodes are handled.
                      //otherwise, they're simply treated as NOPs.
+                     //build with -DNO_UNDOCUMENTED to leave them out.
+#endif
+
+//build with -DCPU6502_TABLE_CORE for the older function table dispatch
+//instead of the single switch
+
+//build with -DCPU6502_ADC_TABLES to look up ADC and SBC results and flags
+//in tables built by init6502() (1MB) rather than working them out
 
 #undef NES_CPU       //when this is defined, the binary-coded decimal (BCD)
                      //status flag is not honored by ADC and SBC. the 2A03
@@ -48,45 +86,39 @@ extern uint16_t pc;
 
 #define BASE_STACK     0x100
 
-#define saveaccum(n) a = (uint8_t)((n) & 0x00FF)
+#define saveaccum(n) c->a = (uint8_t)((n) & 0x00FF)
 
 
 //flag modifier macros
-#define setcarry() status |= FLAG_CARRY
-#define clearcarry() status &= (~FLAG_CARRY)
-#define setzero() status |= FLAG_ZERO
-#define clearzero() status &= (~FLAG_ZERO)
-#define setinterrupt() status |= FLAG_INTERRUPT
-#define clearinterrupt() status &= (~FLAG_INTERRUPT)
-#define setdecimal() status |= FLAG_DECIMAL
-#define cleardecimal() status &= (~FLAG_DECIMAL)
-#define setbreak() status |= FLAG_BREAK
-#define clearbreak() status &= (~FLAG_BREAK)
-#define setoverflow() status |= FLAG_OVERFLOW
-#define clearoverflow() status &= (~FLAG_OVERFLOW)
-#define setsign() status |= FLAG_SIGN
-#define clearsign() status &= (~FLAG_SIGN)
-
-
-//flag calculation macros
-#define zerocalc(n) {\
-    if ((n) & 0x00FF) clearzero();\
-        else setzero();\
-}
-
-#define signcalc(n) {\
-    if ((n) & 0x0080) setsign();\
-        else clearsign();\
-}
-
-#define carrycalc(n) {\
-    if ((n) & 0xFF00) setcarry();\
-        else clearcarry();\
-}
-
-#define overflowcalc(n, m, o) { /* n = result, m = accumulator, o = memory */ \
-    if (((n) ^ (uint16_t)(m)) & ((n) ^ (o)) & 0x0080) setoverflow();\
-        else clearoverflow();\
-}
+#define setcarry() c->status |= FLAG_CARRY
+#define clearcarry() c->status &= (~FLAG_CARRY)
+#define setzero() c->status |= FLAG_ZERO
+#define clearzero() c->status &= (~FLAG_ZERO)
+#define setinterrupt() c->status |= FLAG_INTERRUPT
+#define clearinterrupt() c->status &= (~FLAG_INTERRUPT)
+#define setdecimal() c->status |= FLAG_DECIMAL
+#define cleardecimal() c->status &= (~FLAG_DECIMAL)
+#define setbreak() c->status |= FLAG_BREAK
+#define clearbreak() c->status &= (~FLAG_BREAK)
+#define setoverflow() c->status |= FLAG_OVERFLOW
+#define clearoverflow() c->status &= (~FLAG_OVERFLOW)
+#define setsign() c->status |= FLAG_SIGN
+#define clearsign() c->status &= (~FLAG_SIGN)
+
+
+//flag calculation macros, nztable holds the N and Z flags for each byte
+extern uint8_t nztable[256];
+
+#define nzcalc(n) \
+    c->status = (c->status & ~(FLAG_ZERO | FLAG_SIGN)) | nztable[(n) & 0x00FF]
+
+#define zerocalc(n) \
+    c->status = (c->status & ~FLAG_ZERO) | (nztable[(n) & 0x00FF] & FLAG_ZERO)
+
+#define signcalc(n) \
+    c->status = (c->status & ~FLAG_SIGN) | ((n) & FLAG_SIGN)
+
+#define carrycalc(n) \
+    c->status = (c->status & ~FLAG_CARRY) | !!((n) & 0xFF00)
 #endif
 #endif
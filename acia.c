@@ -4,8 +4,12 @@
 #include <string.h>
 #include <unistd.h>
 #include "system.h"
+#include "serial.h"
 #include "acia.h"
 
+/* The usual RC2014 7.3728MHz clock, 115200 baud at divide by 64 */
+#define ACIA_CLOCK	7372800
+
 struct acia {
     uint8_t status;
     uint8_t config;
@@ -14,6 +18,9 @@ struct acia {
     uint8_t inint;
     uint8_t inreset;
     uint8_t trace;
+    uint8_t baud;		/* SERIAL_BAUD_ pacing */
+    uint64_t rxtime;		/* ns of receive line time not yet used */
+    uint64_t txbusy;		/* ns until the transmitter is free */
 };
 
 
@@ -61,11 +68,45 @@ static void acia_transmit(struct acia *acia)
 	}
 }
 
-void acia_timer(struct acia *acia)
+/* Line time of one character from the divider and word select */
+static uint64_t acia_chartime(struct acia *acia)
+{
+	static const uint8_t div[4] = { 1, 16, 64, 64 };
+	static const uint8_t bits[8] = { 11, 11, 10, 10, 11, 10, 11, 11 };
+
+	return (uint64_t)bits[(acia->config >> 2) & 7] * div[acia->config & 3] *
+		1000000000ULL / ACIA_CLOCK;
+}
+
+/*
+ *	By default a byte is taken every tick and overruns if the guest
+ *	didn't get to the last one. At the real rate, or flat out, the host
+ *	waits until the receive register is free so nothing is lost.
+ */
+void acia_timer(struct acia *acia, unsigned int ns)
 {
 	int s = check_chario();
-	if ((s & 1) && acia->input)
+
+	if (acia->baud == SERIAL_BAUD_REAL) {
+		uint64_t t = acia_chartime(acia);
+
+		acia->rxtime += ns;
+		if (acia->rxtime > t)
+			acia->rxtime = t;
+		if (acia->rxtime < t)
+			s &= ~1;
+		if (acia->txbusy > ns) {
+			acia->txbusy -= ns;
+			s &= ~2;
+		} else
+			acia->txbusy = 0;
+	}
+	if (acia->baud != SERIAL_BAUD_DEFAULT && (acia->status & 1))
+		s &= ~1;
+	if ((s & 1) && acia->input) {
 		acia_receive(acia);
+		acia->rxtime = 0;
+	}
 	if (s & 2)
 		acia_transmit(acia);
 	if (s)
@@ -74,6 +115,8 @@ void acia_timer(struct acia *acia)
 
 uint8_t acia_read(struct acia *acia, uint16_t addr)
 {
+	uint8_t r;
+
 	if (acia->trace)
 		fprintf(stderr, "acia_read %d ", addr);
 	switch (addr) {
@@ -92,10 +135,15 @@ uint8_t acia_read(struct acia *acia, uint16_t addr)
 		   and also updates the error bits to match the new byte */
 		/* Clear receive ready and rx overrun */
 		acia->status &= ~0x21;
+		r = acia->rxchar;
+		/* Flat out the next byte arrives as soon as this one is gone */
+		if (acia->baud == SERIAL_BAUD_MAX && acia->input &&
+		    (check_chario() & 1))
+			acia_receive(acia);
 		acia_irq_compute(acia);
 		if (acia->trace)
-			fprintf(stderr, "acia_char %d\n", acia->rxchar);
-		return acia->rxchar;
+			fprintf(stderr, "acia_char %d\n", r);
+		return r;
 	default:
 		fprintf(stderr, "acia: bad addr.\n");
 		exit(1);
@@ -126,6 +174,10 @@ void acia_write(struct acia *acia, uint16_t addr, uint8_t val)
 		write(1, &val, 1);
 		/* Clear TDRE - we now have a byte */
 		acia->status &= ~0x02;
+		if (acia->baud == SERIAL_BAUD_REAL)
+			acia->txbusy = acia_chartime(acia);
+		else if (acia->baud == SERIAL_BAUD_MAX)
+			acia->status |= 0x02;
 		acia_irq_compute(acia);
 		break;
 	}
@@ -136,6 +188,11 @@ void acia_set_input(struct acia *acia, int onoff)
 	acia->input = onoff;
 }
 
+void acia_set_baud(struct acia *acia, unsigned int mode)
+{
+	acia->baud = mode;
+}
+
 void acia_reset(struct acia *acia)
 {
     memset(acia, 0, sizeof(struct acia));
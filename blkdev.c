@@ -0,0 +1,872 @@
+/*
+ *	Host side block cache for the emulated disk devices
+ *
+ *	All the storage emulations (IDE, SD, PropIO, MBC2 IOS) work in 512
+ *	byte sectors. Rather than doing a seek/read per sector we keep a
+ *	small LRU cache of 4K lines per image, detect sequential access and
+ *	pull further lines in with a single readv. Writes are normally
+ *	written straight through but the cache can also run in write back
+ *	mode where dirty blocks are held until eviction or an explicit sync.
+ *	Every open device is synced on exit.
+ *
+ *	An image may also be a copy on write overlay of a read only base
+ *	(see blkdev.h). This is detected when the file is opened so anything
+ *	that takes a disk image can be given an overlay instead.
+ *
+ *	Sparse images (see makedisk) have holes that must read back as a
+ *	fill pattern rather than zero. For those we ask the host where the
+ *	holes are when loading a line. Before writing we fill in any holes
+ *	in the host allocation units being written (st_blksize, which can
+ *	be far bigger than a line) so the file system never zeroes sectors
+ *	around a guest write.
+ *
+ *	Finally the base image can be a compressed archive (see blkdev.h).
+ *	The chunks are unpacked into a small chunk cache as lines are loaded
+ *	and any writes go into an overlay.
+ */
+
+#define _GNU_SOURCE		/* SEEK_HOLE/SEEK_DATA */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "blkdev.h"
+
+#define LINE_BLOCKS	8		/* 4K cache lines */
+#define LINE_SIZE	(LINE_BLOCKS * BLKDEV_BLOCK)
+#define NLINES		64		/* 256K of cache per device */
+#define MAX_RA		8		/* Read ahead up to 32K */
+#define PACK_CACHE	4		/* Unpacked chunks to keep */
+
+struct blkline {
+	off_t line;		/* Line number or -1 if empty */
+	unsigned int valid;	/* Blocks present (short at end of image) */
+	uint8_t dirty;		/* Dirty block mask (write back only) */
+	struct blkline *prev;
+	struct blkline *next;
+	uint8_t data[LINE_SIZE];
+};
+
+struct blkchunk {
+	off_t chunk;		/* Chunk number or -1 if empty */
+	unsigned int age;
+	uint8_t *data;
+};
+
+struct blkpack {
+	unsigned int chunkblocks;
+	unsigned int nchunks;
+	off_t *index;		/* File offset of each chunk and the end */
+	uint8_t *cbuf;		/* Compressed data being unpacked */
+	unsigned int clock;
+	struct blkchunk cache[PACK_CACHE];
+};
+
+struct blkdev {
+	int fd;			/* Image, or base image of an overlay */
+	int dfd;		/* Overlay delta or -1 */
+	off_t blocks;		/* Overlay or packed size in blocks */
+	off_t dbase;		/* Block in the delta where data begins */
+	uint8_t *map;		/* Overlay bitmap of blocks in the delta */
+	int fill;		/* Fill byte for holes or -1 */
+	off_t fillunit;		/* Host allocation unit when filling */
+	struct blkpack *pack;	/* Compressed base image */
+	unsigned int flags;
+	off_t lastmiss;		/* Last line loaded from disk */
+	unsigned int ra;	/* Current read ahead window in lines */
+	struct blkline *head;	/* Most recently used */
+	struct blkline *tail;	/* Least recently used */
+	struct blkline line[NLINES];
+	struct blkdev *next;	/* Chain of open devices */
+	uint8_t trace;
+};
+
+static struct blkdev *blkdev_list;
+static uint8_t blkdev_atexit;
+
+static void lru_unlink(struct blkdev *b, struct blkline *l)
+{
+	if (l->prev)
+		l->prev->next = l->next;
+	else
+		b->head = l->next;
+	if (l->next)
+		l->next->prev = l->prev;
+	else
+		b->tail = l->prev;
+}
+
+/* Make this line the most recently used */
+static void lru_head(struct blkdev *b, struct blkline *l)
+{
+	if (b->head == l)
+		return;
+	lru_unlink(b, l);
+	l->prev = NULL;
+	l->next = b->head;
+	b->head->prev = l;
+	b->head = l;
+}
+
+/* Make this line the first to be reused */
+static void lru_tail(struct blkdev *b, struct blkline *l)
+{
+	if (b->tail == l)
+		return;
+	lru_unlink(b, l);
+	l->next = NULL;
+	l->prev = b->tail;
+	b->tail->next = l;
+	b->tail = l;
+}
+
+static struct blkline *line_find(struct blkdev *b, off_t line)
+{
+	struct blkline *l = b->head;
+	while (l) {
+		if (l->line == line)
+			return l;
+		l = l->next;
+	}
+	return NULL;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const uint8_t *p)
+{
+	return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static void putle32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+#define MAPPED(b, n)	((b)->map[(n) >> 3] & (1 << ((n) & 7)))
+
+/* Write n blocks to the image, or to the delta for an overlay */
+static int blk_store(struct blkdev *b, off_t block, const uint8_t *buf,
+	unsigned int n)
+{
+	off_t i;
+	off_t mapdirty = -1;
+
+	if (b->dfd == -1) {
+		if (pwrite(b->fd, buf, n * BLKDEV_BLOCK, block * BLKDEV_BLOCK)
+			!= n * BLKDEV_BLOCK)
+			return -1;
+		return 0;
+	}
+	if (block + n > b->blocks) {
+		errno = ENXIO;
+		return -1;
+	}
+	if (pwrite(b->dfd, buf, n * BLKDEV_BLOCK,
+		(b->dbase + block) * BLKDEV_BLOCK) != n * BLKDEV_BLOCK)
+		return -1;
+	/* Mark them present and write back any bitmap blocks we changed */
+	for (i = block; i < block + n; i++) {
+		if (MAPPED(b, i))
+			continue;
+		b->map[i >> 3] |= 1 << (i & 7);
+		if (mapdirty != -1 && mapdirty != i >> 12) {
+			if (pwrite(b->dfd, b->map + mapdirty * BLKDEV_BLOCK,
+				BLKDEV_BLOCK, (mapdirty + 1) * BLKDEV_BLOCK) != BLKDEV_BLOCK)
+				return -1;
+		}
+		mapdirty = i >> 12;
+	}
+	if (mapdirty != -1 && pwrite(b->dfd, b->map + mapdirty * BLKDEV_BLOCK,
+			BLKDEV_BLOCK, (mapdirty + 1) * BLKDEV_BLOCK) != BLKDEV_BLOCK)
+		return -1;
+	return 0;
+}
+
+/* Replace any blocks of a freshly loaded line that live in the delta */
+static int blk_overlay_fetch(struct blkdev *b, struct blkline *l)
+{
+	off_t first = l->line * LINE_BLOCKS;
+	unsigned int i = 0;
+	unsigned int n;
+
+	while (i < l->valid) {
+		if (!MAPPED(b, first + i)) {
+			i++;
+			continue;
+		}
+		n = i;
+		while (n < l->valid && MAPPED(b, first + n))
+			n++;
+		if (pread(b->dfd, l->data + i * BLKDEV_BLOCK,
+			(n - i) * BLKDEV_BLOCK, (b->dbase + first + i) * BLKDEV_BLOCK)
+			!= (n - i) * BLKDEV_BLOCK)
+			return -1;
+		i = n;
+	}
+	return 0;
+}
+
+/*
+ *	Write the fill byte over any holes in the allocation units covering
+ *	start to end. Writing into a hole allocates the whole unit and the
+ *	rest of it would otherwise read back as zero.
+ */
+static int blk_fill_units(struct blkdev *b, off_t start, off_t end)
+{
+	uint8_t buf[LINE_SIZE];
+	struct stat st;
+	off_t hole, data;
+	ssize_t len;
+
+#ifdef SEEK_HOLE
+	if (fstat(b->fd, &st) == -1)
+		return -1;
+	start -= start % b->fillunit;
+	end += b->fillunit - 1;
+	end -= end % b->fillunit;
+	if (end > st.st_size)
+		end = st.st_size;
+	memset(buf, b->fill, LINE_SIZE);
+	while (start < end) {
+		hole = lseek(b->fd, start, SEEK_HOLE);
+		if (hole == -1)
+			return -1;
+		if (hole >= end)
+			break;
+		data = lseek(b->fd, hole, SEEK_DATA);
+		if (data == -1 || data > end)
+			data = end;
+		for (start = hole; start < data; start += len) {
+			len = data - start > LINE_SIZE ? LINE_SIZE : data - start;
+			if (pwrite(b->fd, buf, len, start) != len)
+				return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/* Write the dirty blocks of a line back, merging adjacent blocks */
+static int line_writeback(struct blkdev *b, struct blkline *l)
+{
+	unsigned int i = 0;
+	unsigned int n;
+
+	if (b->fill != -1 && b->dfd == -1 && l->dirty &&
+	    blk_fill_units(b, l->line * LINE_SIZE,
+			   l->line * LINE_SIZE + l->valid * BLKDEV_BLOCK)) {
+		perror("blkdev: fill");
+		return -1;
+	}
+	while (l->dirty) {
+		while (!(l->dirty & (1 << i)))
+			i++;
+		n = i;
+		while (n < LINE_BLOCKS && (l->dirty & (1 << n)))
+			n++;
+		if (b->trace)
+			fprintf(stderr, "blkdev: write back %lld+%d.\n",
+				(long long)(l->line * LINE_BLOCKS + i), n - i);
+		if (blk_store(b, l->line * LINE_BLOCKS + i,
+			l->data + i * BLKDEV_BLOCK, n - i)) {
+			perror("blkdev: write back");
+			return -1;
+		}
+		while (i < n)
+			l->dirty &= ~(1 << i++);
+	}
+	return 0;
+}
+
+static void line_drop(struct blkdev *b, struct blkline *l)
+{
+	l->line = -1;
+	l->valid = 0;
+	l->dirty = 0;
+	lru_tail(b, l);
+}
+
+/*
+ *	Take the least recently used line for reuse. If its dirty blocks
+ *	can't be written back it stays put, still dirty, and we fail rather
+ *	than lose data the guest was told had been written.
+ */
+static struct blkline *line_evict(struct blkdev *b)
+{
+	struct blkline *l = b->tail;
+	if (l->dirty && line_writeback(b, l))
+		return NULL;
+	line_drop(b, l);
+	return l;
+}
+
+/* PackBits: n < 128 is n + 1 literals, n > 128 is 257 - n repeats */
+static int unpackbits(const uint8_t *in, unsigned int inlen, uint8_t *out,
+	unsigned int outlen)
+{
+	const uint8_t *ie = in + inlen;
+	uint8_t *oe = out + outlen;
+	unsigned int n;
+
+	while (in < ie && out < oe) {
+		n = *in++;
+		if (n < 128) {
+			n++;
+			if (n > ie - in || n > oe - out)
+				return -1;
+			memcpy(out, in, n);
+			in += n;
+			out += n;
+		} else if (n > 128) {
+			n = 257 - n;
+			if (in == ie || n > oe - out)
+				return -1;
+			memset(out, *in++, n);
+			out += n;
+		}
+	}
+	return out == oe ? 0 : -1;
+}
+
+/* Find or unpack a chunk of a compressed image */
+static uint8_t *pack_chunk(struct blkdev *b, off_t chunk)
+{
+	struct blkpack *p = b->pack;
+	struct blkchunk *c = p->cache;
+	unsigned int csize = p->chunkblocks * BLKDEV_BLOCK;
+	unsigned int osize = csize;
+	off_t len;
+	int i;
+
+	for (i = 0; i < PACK_CACHE; i++) {
+		if (p->cache[i].chunk == chunk) {
+			p->cache[i].age = ++p->clock;
+			return p->cache[i].data;
+		}
+		if (p->cache[i].age < c->age)
+			c = p->cache + i;
+	}
+	c->chunk = -1;
+	if (chunk >= p->nchunks) {
+		errno = ENXIO;
+		return NULL;
+	}
+	/* The last chunk may be short */
+	if ((chunk + 1) * p->chunkblocks > b->blocks)
+		osize = (b->blocks - chunk * p->chunkblocks) * BLKDEV_BLOCK;
+	len = p->index[chunk + 1] - p->index[chunk];
+	if (len < 0 || len > osize) {
+		errno = EIO;
+		return NULL;
+	}
+	if (b->trace)
+		fprintf(stderr, "blkdev: unpack chunk %lld (%lld).\n",
+			(long long)chunk, (long long)len);
+	if (len == osize) {
+		if (pread(b->fd, c->data, len, p->index[chunk]) != len)
+			return NULL;
+	} else if (pread(b->fd, p->cbuf, len, p->index[chunk]) != len ||
+		unpackbits(p->cbuf, len, c->data, osize)) {
+		errno = EIO;
+		return NULL;
+	}
+	c->chunk = chunk;
+	c->age = ++p->clock;
+	return c->data;
+}
+
+/* Load lines from a compressed base image, giving the bytes we got */
+static ssize_t pack_read(struct blkdev *b, struct blkline **lp,
+	unsigned int n, off_t line)
+{
+	struct blkpack *p = b->pack;
+	ssize_t r = 0;
+	off_t first;
+	unsigned int len;
+	uint8_t *data;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		first = (line + i) * LINE_BLOCKS;
+		if (first >= b->blocks)
+			break;
+		data = pack_chunk(b, first / p->chunkblocks);
+		if (data == NULL)
+			return -1;
+		len = LINE_BLOCKS;
+		if (first + len > b->blocks)
+			len = b->blocks - first;
+		memcpy(lp[i]->data, data + (first % p->chunkblocks) * BLKDEV_BLOCK,
+			len * BLKDEV_BLOCK);
+		r += len * BLKDEV_BLOCK;
+		if (len < LINE_BLOCKS)
+			break;
+	}
+	return r;
+}
+
+/* Replace the holes in what we just read with the fill pattern */
+static void blk_fill_holes(struct blkdev *b, struct blkline **lp,
+	off_t start, off_t end)
+{
+	off_t pos = start;
+	off_t hole, data;
+	off_t o;
+	unsigned int len;
+
+#ifdef SEEK_HOLE
+	while (pos < end) {
+		hole = lseek(b->fd, pos, SEEK_HOLE);
+		if (hole == -1 || hole >= end)
+			return;
+		data = lseek(b->fd, hole, SEEK_DATA);
+		if (data == -1 || data > end)
+			data = end;
+		for (pos = hole; pos < data; pos += len) {
+			o = (pos - start) % LINE_SIZE;
+			len = LINE_SIZE - o;
+			if (len > data - pos)
+				len = data - pos;
+			memset(lp[(pos - start) / LINE_SIZE]->data + o, b->fill, len);
+		}
+	}
+#endif
+}
+
+/*
+ *	Load a line that missed the cache. If the misses are walking
+ *	through the disk then read further ahead each time so that
+ *	streaming a file becomes a few large reads.
+ */
+static struct blkline *line_load(struct blkdev *b, off_t line)
+{
+	struct blkline *lp[MAX_RA];
+	struct iovec iov[MAX_RA];
+	unsigned int n;
+	unsigned int i;
+	ssize_t r;
+
+	if (line == b->lastmiss + 1) {
+		if (b->ra < MAX_RA)
+			b->ra <<= 1;
+	} else
+		b->ra = 1;
+
+	for (n = 0; n < b->ra; n++) {
+		if (n && line_find(b, line + n))
+			break;
+		lp[n] = line_evict(b);
+		/* Settle for less read ahead, but the line itself must load */
+		if (lp[n] == NULL) {
+			if (n == 0)
+				return NULL;
+			break;
+		}
+		lp[n]->line = line + n;
+		iov[n].iov_base = lp[n]->data;
+		iov[n].iov_len = LINE_SIZE;
+		/* Keep it away from the tail so the next evict skips it */
+		lru_head(b, lp[n]);
+	}
+	if (b->trace)
+		fprintf(stderr, "blkdev: load line %lld (%d).\n",
+			(long long)line, n);
+
+	if (b->pack)
+		r = pack_read(b, lp, n, line);
+	else
+		r = preadv(b->fd, iov, n, line * LINE_SIZE);
+	if (r < 0) {
+		for (i = 0; i < n; i++)
+			line_drop(b, lp[i]);
+		return NULL;
+	}
+	if (b->fill != -1)
+		blk_fill_holes(b, lp, line * LINE_SIZE, line * LINE_SIZE + r);
+	for (i = 0; i < n; i++) {
+		if (r >= LINE_SIZE) {
+			lp[i]->valid = LINE_BLOCKS;
+			r -= LINE_SIZE;
+		} else {
+			lp[i]->valid = r / BLKDEV_BLOCK;
+			r = 0;
+		}
+		if (b->dfd != -1) {
+			off_t first = (line + i) * LINE_BLOCKS;
+			if (first >= b->blocks)
+				lp[i]->valid = 0;
+			else if (first + lp[i]->valid > b->blocks)
+				lp[i]->valid = b->blocks - first;
+			if (blk_overlay_fetch(b, lp[i])) {
+				for (i = 0; i < n; i++)
+					line_drop(b, lp[i]);
+				return NULL;
+			}
+		}
+	}
+	b->lastmiss = line + n - 1;
+	lru_head(b, lp[0]);
+	return lp[0];
+}
+
+static struct blkline *line_get(struct blkdev *b, off_t line)
+{
+	struct blkline *l = line_find(b, line);
+	if (l) {
+		lru_head(b, l);
+		return l;
+	}
+	return line_load(b, line);
+}
+
+int blkdev_read(struct blkdev *b, off_t block, uint8_t *buf)
+{
+	struct blkline *l;
+	unsigned int off = block % LINE_BLOCKS;
+
+	if (block < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	l = line_get(b, block / LINE_BLOCKS);
+	if (l == NULL)
+		return -1;
+	/* Beyond the end of the image */
+	if (off >= l->valid) {
+		errno = ENXIO;
+		return -1;
+	}
+	memcpy(buf, l->data + off * BLKDEV_BLOCK, BLKDEV_BLOCK);
+	return 0;
+}
+
+int blkdev_write(struct blkdev *b, off_t block, const uint8_t *buf)
+{
+	struct blkline *l;
+	unsigned int off = block % LINE_BLOCKS;
+
+	if (block < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((b->flags & BLKDEV_WRITEBACK) || b->fill != -1) {
+		l = line_get(b, block / LINE_BLOCKS);
+		if (l == NULL)
+			return -1;
+		if (off < l->valid) {
+			memcpy(l->data + off * BLKDEV_BLOCK, buf, BLKDEV_BLOCK);
+			l->dirty |= 1 << off;
+			if (b->flags & BLKDEV_WRITEBACK)
+				return 0;
+			return line_writeback(b, l);
+		}
+		/* Extending the image: put it on disk and forget the line */
+		if (l->dirty && line_writeback(b, l))
+			return -1;
+		line_drop(b, l);
+	} else if ((l = line_find(b, block / LINE_BLOCKS)) != NULL) {
+		if (off < l->valid)
+			memcpy(l->data + off * BLKDEV_BLOCK, buf, BLKDEV_BLOCK);
+		else
+			line_drop(b, l);
+	}
+	return blk_store(b, block, buf, 1);
+}
+
+int blkdev_sync(struct blkdev *b)
+{
+	struct blkline *l;
+	int err = 0;
+
+	for (l = b->head; l; l = l->next)
+		if (l->dirty && line_writeback(b, l))
+			err = -1;
+	return err;
+}
+
+void blkdev_sync_all(void)
+{
+	struct blkdev *b;
+	for (b = blkdev_list; b; b = b->next)
+		blkdev_sync(b);
+}
+
+off_t blkdev_blocks(struct blkdev *b)
+{
+	struct stat st;
+	if (b->dfd != -1 || b->pack)
+		return b->blocks;
+	if (fstat(b->fd, &st) == -1)
+		return -1;
+	return st.st_size / BLKDEV_BLOCK;
+}
+
+/*
+ *	Holes in the image read as fill. Anything already cached was read
+ *	without the pattern so throw it away.
+ *
+ *	A sparse image always has a hole after its header. If the host
+ *	can't find one then either the file system doesn't report holes
+ *	(NFSv3 for one) or the image was copied without keeping them, and
+ *	unwritten sectors would read back as zero, so refuse it.
+ */
+int blkdev_set_fill(struct blkdev *b, uint8_t fill)
+{
+	struct blkline *l;
+	struct stat st;
+	off_t hole;
+
+	/* Packing already expanded any holes */
+	if (b->pack)
+		return 0;
+	if (fstat(b->fd, &st) == -1)
+		return -1;
+#ifdef SEEK_HOLE
+	hole = lseek(b->fd, 0, SEEK_HOLE);
+	if (hole == -1 || hole >= st.st_size) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+	blkdev_sync(b);
+	for (l = b->head; l; l = l->next)
+		l->line = -1;
+	b->fill = fill;
+	b->fillunit = st.st_blksize > BLKDEV_BLOCK ? st.st_blksize : BLKDEV_BLOCK;
+	return 0;
+}
+
+void blkdev_trace(struct blkdev *b, int onoff)
+{
+	b->trace = onoff;
+}
+
+static void *blk_alloc(size_t len)
+{
+	void *p = calloc(1, len);
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* Size of a base image, which may itself be packed */
+static off_t blk_base_blocks(int fd)
+{
+	struct blkdev_pack h;
+	struct stat st;
+
+	if (pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+		memcmp(h.magic, BLKDEV_PACK_MAGIC, 8) == 0)
+		return le32(h.blocks);
+	if (fstat(fd, &st) == -1)
+		return -1;
+	return st.st_size / BLKDEV_BLOCK;
+}
+
+/*
+ *	Set up an empty overlay of base in the file fd
+ */
+int blkdev_overlay_create(const char *base, int fd)
+{
+	struct blkdev_overlay h;
+	char path[PATH_MAX];
+	off_t size;
+	uint32_t blocks, mapblocks;
+	int bfd;
+
+	if (realpath(base, path) == NULL)
+		return -1;
+	if (strlen(path) >= sizeof(h.base)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	bfd = open(path, O_RDONLY);
+	if (bfd == -1)
+		return -1;
+	size = blk_base_blocks(bfd);
+	close(bfd);
+	if (size == -1)
+		return -1;
+	blocks = size;
+	mapblocks = (blocks + 8 * BLKDEV_BLOCK - 1) / (8 * BLKDEV_BLOCK);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BLKDEV_OVERLAY_MAGIC, 8);
+	putle32(h.blocks, blocks);
+	putle32(h.mapblocks, mapblocks);
+	strcpy(h.base, path);
+	/* The bitmap and data are holes until something is written */
+	if (ftruncate(fd, 0) == -1 ||
+		pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+		ftruncate(fd, (1 + mapblocks + (off_t)blocks) * BLKDEV_BLOCK) == -1)
+		return -1;
+	return 0;
+}
+
+static void blkdev_pack_open(struct blkdev *b, struct blkdev_pack *h)
+{
+	struct blkpack *p = blk_alloc(sizeof(struct blkpack));
+	unsigned int csize;
+	uint8_t *idx;
+	unsigned int i;
+
+	b->pack = p;
+	b->blocks = le32(h->blocks);
+	p->chunkblocks = le32(h->chunkblocks);
+	p->nchunks = le32(h->nchunks);
+	if (p->chunkblocks == 0 || (p->chunkblocks % LINE_BLOCKS) ||
+		p->chunkblocks > 65536 ||
+		p->nchunks != (b->blocks + p->chunkblocks - 1) / p->chunkblocks) {
+		fprintf(stderr, "blkdev: bad packed image header.\n");
+		exit(1);
+	}
+	csize = p->chunkblocks * BLKDEV_BLOCK;
+	idx = blk_alloc((p->nchunks + 1) * 8);
+	if (pread(b->fd, idx, (p->nchunks + 1) * 8, sizeof(*h)) !=
+		(p->nchunks + 1) * 8) {
+		fprintf(stderr, "blkdev: packed image is corrupt.\n");
+		exit(1);
+	}
+	p->index = blk_alloc((p->nchunks + 1) * sizeof(off_t));
+	for (i = 0; i <= p->nchunks; i++)
+		p->index[i] = le64(idx + 8 * i);
+	free(idx);
+	p->cbuf = blk_alloc(csize);
+	for (i = 0; i < PACK_CACHE; i++) {
+		p->cache[i].chunk = -1;
+		p->cache[i].data = blk_alloc(csize);
+	}
+}
+
+/* Open the base of an overlay, which may be packed */
+static void blkdev_base_open(struct blkdev *b, const char *path)
+{
+	struct blkdev_pack h;
+
+	b->fd = open(path, O_RDONLY);
+	if (b->fd == -1) {
+		perror(path);
+		exit(1);
+	}
+	if (pread(b->fd, &h, sizeof(h), 0) == sizeof(h) &&
+		memcmp(h.magic, BLKDEV_PACK_MAGIC, 8) == 0)
+		blkdev_pack_open(b, &h);
+}
+
+/*
+ *	A packed image used directly gets a throwaway overlay so that the
+ *	guest can still write to it.
+ */
+static void blkdev_overlay_temp(struct blkdev *b)
+{
+	char path[] = "/tmp/blkdevXXXXXX";
+	off_t mapblocks = (b->blocks + 8 * BLKDEV_BLOCK - 1) / (8 * BLKDEV_BLOCK);
+
+	b->dfd = mkstemp(path);
+	if (b->dfd == -1) {
+		perror(path);
+		exit(1);
+	}
+	unlink(path);
+	b->dbase = 1 + mapblocks;
+	b->map = blk_alloc(mapblocks * BLKDEV_BLOCK);
+}
+
+static void blkdev_overlay_open(struct blkdev *b, struct blkdev_overlay *h)
+{
+	size_t len = le32(h->mapblocks) * BLKDEV_BLOCK;
+
+	h->base[sizeof(h->base) - 1] = 0;
+	b->dfd = b->fd;
+	blkdev_base_open(b, h->base);
+	b->blocks = le32(h->blocks);
+	b->dbase = 1 + le32(h->mapblocks);
+	b->map = blk_alloc(len);
+	if (pread(b->dfd, b->map, len, BLKDEV_BLOCK) != len) {
+		fprintf(stderr, "blkdev: overlay of '%s' is corrupt.\n", h->base);
+		exit(1);
+	}
+}
+
+struct blkdev *blkdev_open(int fd, unsigned int flags)
+{
+	struct blkdev *b = blk_alloc(sizeof(struct blkdev));
+	union {
+		struct blkdev_overlay o;
+		struct blkdev_pack p;
+	} h;
+	int i;
+
+	b->fd = fd;
+	b->dfd = -1;
+	b->fill = -1;
+	b->flags = flags;
+	if (pread(fd, &h, sizeof(h), 0) == sizeof(h)) {
+		if (memcmp(h.o.magic, BLKDEV_OVERLAY_MAGIC, 8) == 0)
+			blkdev_overlay_open(b, &h.o);
+		else if (memcmp(h.p.magic, BLKDEV_PACK_MAGIC, 8) == 0) {
+			blkdev_pack_open(b, &h.p);
+			blkdev_overlay_temp(b);
+		}
+	}
+	b->lastmiss = -2;
+	b->ra = 1;
+	for (i = 0; i < NLINES; i++) {
+		b->line[i].line = -1;
+		b->line[i].prev = i ? &b->line[i - 1] : NULL;
+		b->line[i].next = i < NLINES - 1 ? &b->line[i + 1] : NULL;
+	}
+	b->head = b->line;
+	b->tail = b->line + NLINES - 1;
+
+	b->next = blkdev_list;
+	blkdev_list = b;
+	if (!blkdev_atexit) {
+		atexit(blkdev_sync_all);
+		blkdev_atexit = 1;
+	}
+	return b;
+}
+
+void blkdev_close(struct blkdev *b)
+{
+	struct blkdev **p = &blkdev_list;
+	int i;
+
+	blkdev_sync(b);
+	while (*p != b)
+		p = &(*p)->next;
+	*p = b->next;
+	close(b->fd);
+	if (b->dfd != -1)
+		close(b->dfd);
+	if (b->pack) {
+		for (i = 0; i < PACK_CACHE; i++)
+			free(b->pack->cache[i].data);
+		free(b->pack->cbuf);
+		free(b->pack->index);
+		free(b->pack);
+	}
+	free(b->map);
+	free(b);
+}
@@ -0,0 +1,58 @@
+#ifndef __BLKDEV_H
+#define __BLKDEV_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* All block devices use 512 byte blocks */
+#define BLKDEV_BLOCK	512
+
+/* Flags for blkdev_open */
+#define BLKDEV_WRITEBACK	1	/* Hold dirty blocks until sync/evict */
+
+/*
+ *	Copy on write overlay. The delta file starts with this header,
+ *	followed by a bitmap of which blocks have been written and then
+ *	a sparse copy of the image holding just those blocks. Reads of
+ *	anything else fall through to the read only base image.
+ */
+#define BLKDEV_OVERLAY_MAGIC	"1DEDDE17"
+
+struct blkdev_overlay {
+	uint8_t magic[8];
+	uint8_t blocks[4];	/* Size of the base in blocks (LE) */
+	uint8_t mapblocks[4];	/* Blocks of bitmap following (LE) */
+	char base[BLKDEV_BLOCK - 16];	/* Absolute path of the base */
+};
+
+/*
+ *	Compressed image for archiving. The header is followed by an index of
+ *	nchunks + 1 little endian 64bit file offsets, then the chunks. Each
+ *	chunk holds chunkblocks blocks (a multiple of 8) PackBits compressed,
+ *	or stored as is if that didn't help. Packed images are never written,
+ *	changes go to an overlay (a temporary one if the image is used
+ *	directly).
+ */
+#define BLKDEV_PACK_MAGIC	"1DEDCA5E"
+
+struct blkdev_pack {
+	uint8_t magic[8];
+	uint8_t blocks[4];	/* Size of the image in blocks (LE) */
+	uint8_t chunkblocks[4];	/* Blocks per chunk (LE) */
+	uint8_t nchunks[4];	/* Number of chunks (LE) */
+};
+
+struct blkdev;
+
+extern struct blkdev *blkdev_open(int fd, unsigned int flags);
+extern void blkdev_close(struct blkdev *b);
+extern int blkdev_read(struct blkdev *b, off_t block, uint8_t *buf);
+extern int blkdev_write(struct blkdev *b, off_t block, const uint8_t *buf);
+extern int blkdev_sync(struct blkdev *b);
+extern void blkdev_sync_all(void);
+extern off_t blkdev_blocks(struct blkdev *b);
+extern int blkdev_set_fill(struct blkdev *b, uint8_t fill);
+extern int blkdev_overlay_create(const char *base, int fd);
+extern void blkdev_trace(struct blkdev *b, int onoff);
+
+#endif
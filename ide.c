@@ -17,6 +17,8 @@
  *	along with IDE-emu.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE		/* SEEK_HOLE */
+
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -25,8 +27,10 @@
 #include <errno.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
 
 #include "ide.h"
+#include "blkdev.h"
 
 #define IDE_IDLE	0
 #define IDE_CMD		1
@@ -314,7 +318,7 @@ static void cmd_readsectors_complete(struct ide_taskfile *tf)
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
   /* fprintf(stderr, "READ %d SECTORS @ %ld\n", d->length, d->offset); */
-  if (d->offset == -1 ||  lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (d->offset == -1) {
     tf->status |= ST_ERR;
     tf->status &= ~ST_DSC;
     tf->error |= ERR_IDNF;
@@ -337,7 +341,7 @@ static void cmd_verifysectors_complete(struct ide_taskfile *tf)
   d->offset = xlate_block(tf);
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
-  if (d->offset == -1 || lseek(d->fd, 512 * (d->offset + d->length - 1), SEEK_SET) == -1) {
+  if (d->offset == -1 || d->offset + d->length > blkdev_blocks(d->blk)) {
     tf->status &= ~ST_DSC;
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
@@ -366,7 +370,7 @@ static void cmd_seek_complete(struct ide_taskfile *tf)
   if (d->failed)
     drive_failed(tf);
   d->offset = xlate_block(tf);
-  if (d->offset == -1 || lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (d->offset == -1) {
     tf->status &= ~ST_DSC;
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
@@ -412,7 +416,7 @@ static void cmd_writesectors_complete(struct ide_taskfile *tf)
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
 /*  fprintf(stderr, "WRITE %d SECTORS @ %ld\n", d->length, d->offset); */
-  if (d->offset == -1 ||  lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (d->offset == -1) {
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
     tf->status &= ~ST_DSC;
@@ -449,37 +453,60 @@ static void ide_set_error(struct ide_drive *d)
 
 static int ide_read_sector(struct ide_drive *d)
 {
-  int len;
-
   d->dptr = d->data;
-  if ((len = read(d->fd, d->data, 512)) != 512) {
+  if (blkdev_read(d->blk, d->offset, d->data) < 0) {
     perror("ide_read_sector");
     d->taskfile.status |= ST_ERR;
     d->taskfile.status &= ~ST_DSC;
-    ide_xlate_errno(&d->taskfile, len);
+    ide_xlate_errno(&d->taskfile, -1);
     return -1;
   }
 //  hexdump(d->data);
-  d->offset += 512;
+  d->offset++;
   return 0;
 }
 
 static int ide_write_sector(struct ide_drive *d)
 {
-  int len;
-
   d->dptr = d->data;
-  if ((len = write(d->fd, d->data, 512)) != 512) {
+  if (blkdev_write(d->blk, d->offset, d->data) < 0) {
     d->taskfile.status |= ST_ERR;
     d->taskfile.status &= ~ST_DSC;
-    ide_xlate_errno(&d->taskfile, len);
+    ide_xlate_errno(&d->taskfile, -1);
     return -1;
   }
 //  hexdump(d->data);
-  d->offset += 512;
+  d->offset++;
   return 0;
 }
 
+/* The host has taken the last of the sector buffer */
+static void ide_data_in_done(struct ide_drive *d)
+{
+  d->length--;
+  d->intrq = 1;		/* we don't yet emulate multimode */
+  if (d->length == 0) {
+    d->state = IDE_IDLE;
+    completed(&d->taskfile);
+  }
+}
+
+/* The host has filled the sector buffer */
+static void ide_data_out_done(struct ide_drive *d)
+{
+  if (ide_write_sector(d) < 0) {
+    ide_set_error(d);
+    return;
+  }
+  d->length--;
+  d->intrq = 1;
+  if (d->length == 0) {
+    d->state = IDE_IDLE;
+    d->taskfile.status |= ST_DSC;
+    completed(&d->taskfile);
+  }
+}
+
 static uint16_t ide_data_in(struct ide_drive *d, int len)
 {
   uint16_t v;
@@ -498,14 +525,8 @@ static uint16_t ide_data_in(struct ide_drive *d, int len)
     } else
       d->dptr++;
     d->taskfile.data = v;
-    if (d->dptr == d->data + 512) {
-      d->length--;
-      d->intrq = 1;		/* we don't yet emulate multimode */
-      if (d->length == 0) {
-        d->state = IDE_IDLE;
-        completed(&d->taskfile);
-      }
-    }
+    if (d->dptr == d->data + 512)
+      ide_data_in_done(d);
   } else
     ide_fault(d, "bad data read");
 
@@ -528,20 +549,78 @@ static void ide_data_out(struct ide_drive *d, uint16_t v, int len)
       *d->dptr++ = v >> 8;
       d->taskfile.data = v >> 8;
     }
-    if (d->dptr == d->data + 512) {
-      if (ide_write_sector(d) < 0) {
-        ide_set_error(d);
-        return;	
-      }
-      d->length--;
-      d->intrq = 1;
-      if (d->length == 0) {
-        d->state = IDE_IDLE;
-        d->taskfile.status |= ST_DSC;
-        completed(&d->taskfile);
-      }
-    }
+    if (d->dptr == d->data + 512)
+      ide_data_out_done(d);
+  }
+}
+
+/* Is the selected drive asking for data (DRQ) in this direction ? */
+int ide_data_ready(struct ide_controller *c, int write)
+{
+  struct ide_drive *d = &c->drive[c->selected];
+  return d->state == (write ? IDE_DATA_OUT : IDE_DATA_IN);
+}
+
+/*
+ *	Move a run of data register traffic in one call, up to the end of
+ *	the current sector. In 8bit mode each byte is one data register
+ *	access, otherwise each pair of bytes is one 16bit access (low byte
+ *	first). Returns the number of bytes moved, 0 if the drive is not
+ *	transferring data or failed.
+ */
+int ide_read_block(struct ide_controller *c, uint8_t *buf, unsigned int len)
+{
+  struct ide_drive *d = &c->drive[c->selected];
+  unsigned int n;
+
+  if (d->state != IDE_DATA_IN) {
+    ide_fault(d, "bad data read");
+    return 0;
+  }
+  if (d->dptr == d->data + 512 && ide_read_sector(d) < 0) {
+    ide_set_error(d);
+    return 0;
+  }
+  n = d->data + 512 - d->dptr;
+  if (len < n)
+    n = len;
+  if (!d->eightbit)
+    n &= ~1;
+  if (n == 0)
+    return 0;
+  memcpy(buf, d->dptr, n);
+  d->dptr += n;
+  if (d->eightbit)
+    d->taskfile.data = d->dptr[-1];
+  else
+    d->taskfile.data = d->dptr[-2] | (d->dptr[-1] << 8);
+  if (d->dptr == d->data + 512)
+    ide_data_in_done(d);
+  return n;
+}
+
+int ide_write_block(struct ide_controller *c, const uint8_t *buf, unsigned int len)
+{
+  struct ide_drive *d = &c->drive[c->selected];
+  unsigned int n;
+
+  if (d->state != IDE_DATA_OUT) {
+    ide_fault(d, "bad data write");
+    return 0;
   }
+  n = d->data + 512 - d->dptr;
+  if (len < n)
+    n = len;
+  if (!d->eightbit)
+    n &= ~1;
+  if (n == 0)
+    return 0;
+  memcpy(d->dptr, buf, n);
+  d->dptr += n;
+  d->taskfile.data = d->dptr[-1];
+  if (d->dptr == d->data + 512)
+    ide_data_out_done(d);
+  return n;
 }
 
 static void ide_issue_command(struct ide_taskfile *t)
@@ -731,26 +810,34 @@ struct ide_controller *ide_allocate(const char *name)
 }
 
 /*
- *	Attach a file to a device on the controller
+ *	Attach a block device to a device on the controller
  */
-int ide_attach(struct ide_controller *c, int drive, int fd)
+int ide_attach_blkdev(struct ide_controller *c, int drive, struct blkdev *b)
 {
   struct ide_drive *d = &c->drive[drive];
   if (d->present) {
     ide_fault(d, "double attach");
     return -1;
   }
-  d->fd = fd;
-  if (read(d->fd, d->data, 512) != 512 ||
-      read(d->fd, d->identify, 512) != 512) {
+  if (blkdev_read(b, 0, d->data) < 0 ||
+      blkdev_read(b, 1, (uint8_t *)d->identify) < 0) {
     ide_fault(d, "i/o error on attach");
+    blkdev_close(b);
     return -1;
   }
   if (memcmp(d->data, ide_magic, 8)) {
     ide_fault(d, "bad magic");
+    blkdev_close(b);
     return -1;
   }
-  d->fd = fd;
+  /* Sparse images read unwritten sectors as the fill byte */
+  if ((d->data[IDE_HDR_FLAGS] & IDE_FLAG_FILL) &&
+      blkdev_set_fill(b, d->data[IDE_HDR_FILLBYTE]) < 0) {
+    ide_fault(d, "sparse image but the host reports no holes");
+    blkdev_close(b);
+    return -1;
+  }
+  d->blk = b;
   d->present = 1;
   d->heads = d->identify[3];
   d->sectors = d->identify[6];
@@ -762,13 +849,21 @@ int ide_attach(struct ide_controller *c, int drive, int fd)
   return 0;
 }
 
+/*
+ *	Attach a file to a device on the controller
+ */
+int ide_attach(struct ide_controller *c, int drive, int fd)
+{
+  return ide_attach_blkdev(c, drive, blkdev_open(fd, 0));
+}
+
 /*
  *	Detach an IDE device from the interface (not hot pluggable)
  */
 void ide_detach(struct ide_drive *d)
 {
-  close(d->fd);
-  d->fd = -1;
+  blkdev_close(d->blk);
+  d->blk = NULL;
   d->present = 0;
 }
 
@@ -837,18 +932,28 @@ static void make_serial(uint16_t *p)
   make_ascii(p, buf, 20);
 }
 
-int ide_make_drive(uint8_t type, int fd)
+#define FILL_CHUNK	65536
+
+static int make_drive(uint8_t type, int fd, int sparse)
 {
   uint8_t s, h;
   uint16_t c;
   uint32_t sectors;
   uint16_t ident[256];
+  uint8_t *fill;
+  struct stat st;
+  off_t left, chunk = FILL_CHUNK;
+  int n;
 
   if (type < 1 || type > MAX_DRIVE_TYPE)
     return -2;
   
   memset(ident, 0, 512);
   memcpy(ident, ide_magic, 8);
+  if (sparse) {
+    ((uint8_t *)ident)[IDE_HDR_FLAGS] = IDE_FLAG_FILL;
+    ((uint8_t *)ident)[IDE_HDR_FILLBYTE] = 0xE5;
+  }
   if (write(fd, ident, 512) != 512)
     return -1;
 
@@ -925,10 +1030,46 @@ int ide_make_drive(uint8_t type, int fd)
   ident[61] = ident[58];
   if (write(fd, ident, 512) != 512)
     return -1;
-  
-  memset(ident, 0xE5, 512);
-  while(sectors--)
-    if (write(fd, ident, 512) != 512)
-      return -1;  
+
+  fill = malloc(FILL_CHUNK);
+  if (fill == NULL)
+    return -1;
+  memset(fill, 0xE5, FILL_CHUNK);
+  left = (off_t)sectors * 512;
+  /* A sparse image only needs the rest of the first chunk filling in so
+     that the block holding the header has no zero sectors in it. The
+     holes after it read back as the fill byte. The chunk must cover a
+     whole host allocation unit, which may be bigger than ours */
+  if (sparse && fstat(fd, &st) == 0 && st.st_blksize > chunk)
+    chunk = (st.st_blksize + FILL_CHUNK - 1) / FILL_CHUNK * FILL_CHUNK;
+  if (sparse && left > chunk - 1024)
+    left = chunk - 1024;
+  while(left) {
+    n = left > FILL_CHUNK ? FILL_CHUNK : left;
+    if (write(fd, fill, n) != n) {
+      free(fill);
+      return -1;
+    }
+    left -= n;
+  }
+  free(fill);
+  if (sparse && ftruncate(fd, ((off_t)sectors + 2) * 512) == -1)
+    return -1;
+  /* No use if the holes can't be found again */
+  if (sparse && (off_t)sectors * 512 > chunk - 1024 &&
+      lseek(fd, 0, SEEK_HOLE) != chunk) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
   return 0;
 }
+
+int ide_make_drive(uint8_t type, int fd)
+{
+  return make_drive(type, fd, 0);
+}
+
+int ide_make_sparse_drive(uint8_t type, int fd)
+{
+  return make_drive(type, fd, 1);
+}
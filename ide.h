@@ -2,6 +2,9 @@
 #define __IDE_H
 
 #include <stdint.h>
+#include <sys/types.h>
+
+struct blkdev;
 
 #define ACME_ROADRUNNER		1	/* 504MB classic IDE drive */
 #define ACME_COYOTE		2	/* 20MB early IDE drive */
@@ -55,7 +58,7 @@ struct ide_drive {
   uint16_t identify[256];
   uint8_t *dptr;
   int state;
-  int fd;
+  struct blkdev *blk;
   off_t offset;
   int length;
 };
@@ -69,6 +72,12 @@ struct ide_controller {
 
 extern const uint8_t ide_magic[8];
 
+/* The first block of an image holds the magic and then these */
+#define IDE_HDR_FLAGS		8
+#define IDE_HDR_FILLBYTE	9
+
+#define IDE_FLAG_FILL		0x01	/* Holes read as the fill byte */
+
 void ide_reset_begin(struct ide_controller *c);
 uint8_t ide_read8(struct ide_controller *c, uint8_t r);
 void ide_write8(struct ide_controller *c, uint8_t r, uint8_t v);
@@ -76,11 +85,16 @@ uint16_t ide_read16(struct ide_controller *c, uint8_t r);
 void ide_write16(struct ide_controller *c, uint8_t r, uint16_t v);
 uint8_t ide_read_latched(struct ide_controller *c, uint8_t r);
 void ide_write_latched(struct ide_controller *c, uint8_t r, uint8_t v);
+int ide_data_ready(struct ide_controller *c, int write);
+int ide_read_block(struct ide_controller *c, uint8_t *buf, unsigned int len);
+int ide_write_block(struct ide_controller *c, const uint8_t *buf, unsigned int len);
 
 struct ide_controller *ide_allocate(const char *name);
 int ide_attach(struct ide_controller *c, int drive, int fd);
+int ide_attach_blkdev(struct ide_controller *c, int drive, struct blkdev *b);
 void ide_detach(struct ide_drive *d);
 void ide_free(struct ide_controller *c);
 
 int ide_make_drive(uint8_t type, int fd);
+int ide_make_sparse_drive(uint8_t type, int fd);
 #endif
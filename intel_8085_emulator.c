@@ -36,52 +36,77 @@
 #include <string.h>
 #include "intel_8085_emulator.h"
 
-#define reg16_PSW (((uint16_t)reg8[A] << 8) | (uint16_t)reg8[FLAGS])
-#define reg16_BC (((uint16_t)reg8[B] << 8) | (uint16_t)reg8[C])
-#define reg16_DE (((uint16_t)reg8[D] << 8) | (uint16_t)reg8[E])
-#define reg16_HL (((uint16_t)reg8[H] << 8) | (uint16_t)reg8[L])
+#define reg16_PSW (((uint16_t)c->reg8[A] << 8) | (uint16_t)c->reg8[FLAGS])
+#define reg16_BC (((uint16_t)c->reg8[B] << 8) | (uint16_t)c->reg8[C])
+#define reg16_DE (((uint16_t)c->reg8[D] << 8) | (uint16_t)c->reg8[E])
+#define reg16_HL (((uint16_t)c->reg8[H] << 8) | (uint16_t)c->reg8[L])
 
-uint8_t reg8[9], INTE = 0;
-uint16_t reg_SP, reg_PC;
-uint8_t reg_IM = 0x07;	/* Verified with a Tundra CA80C85B */
-uint8_t intprotect;
-#define set_S() reg8[FLAGS] |= 0x80
-#define set_Z() reg8[FLAGS] |= 0x40
-#define set_K() reg8[FLAGS] |= 0x20
-#define set_AC() reg8[FLAGS] |= 0x10
-#define set_P() reg8[FLAGS] |= 0x04
-#define set_V() reg8[FLAGS] |= 0x02
-#define set_C() reg8[FLAGS] |= 0x01
-#define clear_S() reg8[FLAGS] &= 0x7F
-#define clear_Z() reg8[FLAGS] &= 0xBF
-#define clear_K() reg8[FLAGS] &= 0xDF
-#define clear_AC() reg8[FLAGS] &= 0xEF
-#define clear_P() reg8[FLAGS] &= 0xFB
-#define clear_V() reg8[FLAGS] &= 0xFD
-#define clear_C() reg8[FLAGS] &= 0xFE
-#define test_S() (reg8[FLAGS] & 0x80)
-#define test_Z() (reg8[FLAGS] & 0x40)
-#define test_K() (reg8[FLAGS] & 0x20)
-#define test_AC() (reg8[FLAGS] & 0x10)
-#define test_P() (reg8[FLAGS] & 0x04)
-#define test_V() (reg8[FLAGS] & 0x02)
-#define test_C() (reg8[FLAGS] & 0x01)
+#define set_S() c->reg8[FLAGS] |= 0x80
+#define set_Z() c->reg8[FLAGS] |= 0x40
+#define set_K() c->reg8[FLAGS] |= 0x20
+#define set_AC() c->reg8[FLAGS] |= 0x10
+#define set_P() c->reg8[FLAGS] |= 0x04
+#define set_V() c->reg8[FLAGS] |= 0x02
+#define set_C() c->reg8[FLAGS] |= 0x01
+#define clear_S() c->reg8[FLAGS] &= 0x7F
+#define clear_Z() c->reg8[FLAGS] &= 0xBF
+#define clear_K() c->reg8[FLAGS] &= 0xDF
+#define clear_AC() c->reg8[FLAGS] &= 0xEF
+#define clear_P() c->reg8[FLAGS] &= 0xFB
+#define clear_V() c->reg8[FLAGS] &= 0xFD
+#define clear_C() c->reg8[FLAGS] &= 0xFE
+#define test_S() (c->reg8[FLAGS] & 0x80)
+#define test_Z() (c->reg8[FLAGS] & 0x40)
+#define test_K() (c->reg8[FLAGS] & 0x20)
+#define test_AC() (c->reg8[FLAGS] & 0x10)
+#define test_P() (c->reg8[FLAGS] & 0x04)
+#define test_V() (c->reg8[FLAGS] & 0x02)
+#define test_C() (c->reg8[FLAGS] & 0x01)
 
-static uint8_t intpend;
-static uint8_t halted;
+/* S, Z and P for each result byte */
+static const uint8_t szp_table[0x100] = {
+	0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84
+};
 
-static const uint8_t parity[0x100] = {
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1
+/* Base T-states for each opcode, including any memory operand. Taken
+   conditional jumps, calls and returns and a taken RSTV add the rest
+   in the instruction. PUSH is 12 on the 8085 (11 on the 8080) and
+   PCHL 6 (5 on the 8080) */
+static const uint8_t cycle_table[0x100] = {
+	 4, 10,  7,  6,  4,  4,  7,  4, 10, 10,  7,  6,  4,  4,  7,  4,
+	 7, 10,  7,  6,  4,  4,  7,  4, 10, 10,  7,  6,  4,  4,  7,  4,
+	 4, 10, 16,  6,  4,  4,  7,  4, 10, 10, 16,  6,  4,  4,  7,  4,
+	 4, 10, 13,  6, 10, 10, 10,  4, 10, 10, 13,  6,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 7,  7,  7,  7,  7,  7,  7,  7,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 6, 10,  7, 10,  9, 12,  7, 12,  6, 10,  7,  6,  9, 18,  7, 12,
+	 6, 10,  7, 10,  9, 12,  7, 12,  6, 10,  7, 10,  9,  7,  7, 12,
+	 6, 10,  7, 16,  9, 12,  7, 12,  6,  6,  7,  5,  9, 10,  7, 12,
+	 6, 10,  7,  4,  9, 12,  7, 12,  6,  6,  7,  4,  9,  7,  7, 12
 };
 
-uint16_t read_RP(uint8_t rp) {
+static uint16_t read_RP(struct i8085 *c, uint8_t rp) {
 	switch (rp) {
 		case 0x00:
 			return reg16_BC;
@@ -90,12 +115,12 @@ uint16_t read_RP(uint8_t rp) {
 		case 0x02:
 			return reg16_HL;
 		case 0x03:
-			return reg_SP;
+			return c->sp;
 	}
 	return 0;
 }
 
-uint16_t read_RP_PUSHPOP(uint8_t rp) {
+static uint16_t read_RP_PUSHPOP(struct i8085 *c, uint8_t rp) {
 	switch (rp) {
 		case 0x00:
 			return reg16_BC;
@@ -109,74 +134,52 @@ uint16_t read_RP_PUSHPOP(uint8_t rp) {
 	return 0;
 }
 
-void write_RP(uint8_t rp, uint8_t lb, uint8_t hb) {
-	switch (rp) {
-		case 0x00:
-			reg8[C] = lb;
-			reg8[B] = hb;
-			break;
-		case 0x01:
-			reg8[E] = lb;
-			reg8[D] = hb;
-			break;
-		case 0x02:
-			reg8[L] = lb;
-			reg8[H] = hb;
-			break;
-		case 0x03:
-			reg_SP = (uint16_t)lb | ((uint16_t)hb << 8);
-			break;
-	}
-}
-
-void write16_RP(uint8_t rp, uint16_t value) {
+static void write16_RP(struct i8085 *c, uint8_t rp, uint16_t value) {
 	switch (rp) {
 		case 0x00:
-			reg8[C] = value & 0x00FF;
-			reg8[B] = value >> 8;
+			c->reg8[C] = value & 0x00FF;
+			c->reg8[B] = value >> 8;
 			break;
 		case 0x01:
-			reg8[E] = value & 0x00FF;
-			reg8[D] = value >> 8;
+			c->reg8[E] = value & 0x00FF;
+			c->reg8[D] = value >> 8;
 			break;
 		case 0x02:
-			reg8[L] = value & 0x00FF;
-			reg8[H] = value >> 8;
+			c->reg8[L] = value & 0x00FF;
+			c->reg8[H] = value >> 8;
 			break;
 		case 0x03:
-			reg_SP = value;
+			c->sp = value;
 			break;
 	}
 }
 
-void write16_RP_PUSHPOP(uint8_t rp, uint16_t value) {
+static void write16_RP_PUSHPOP(struct i8085 *c, uint8_t rp, uint16_t value) {
 	switch (rp) {
 		case 0x00:
-			reg8[C] = value & 0x00FF;
-			reg8[B] = value >> 8;
+			c->reg8[C] = value & 0x00FF;
+			c->reg8[B] = value >> 8;
 			break;
 		case 0x01:
-			reg8[E] = value & 0x00FF;
-			reg8[D] = value >> 8;
+			c->reg8[E] = value & 0x00FF;
+			c->reg8[D] = value >> 8;
 			break;
 		case 0x02:
-			reg8[L] = value & 0x00FF;
-			reg8[H] = value >> 8;
+			c->reg8[L] = value & 0x00FF;
+			c->reg8[H] = value >> 8;
 			break;
 		case 0x03:
-			reg8[FLAGS] = (value & 0x00FF) & 0xF7;
-			reg8[A] = value >> 8;
+			c->reg8[FLAGS] = (value & 0x00FF) & 0xF7;
+			c->reg8[A] = value >> 8;
 			break;
 	}
 }
 
-void calc_SZP(uint8_t value) {
-	if (value == 0) set_Z(); else clear_Z();
-	if (value & 0x80) set_S(); else clear_S();
-	if (parity[value]) set_P(); else clear_P();
+static void calc_SZP(struct i8085 *c, uint8_t value) {
+	c->reg8[FLAGS] = (c->reg8[FLAGS] & 0x3B) | szp_table[value];
 }
 
-void calc_AC(uint8_t val1, uint8_t val2) {
+static void calc_AC(struct i8085 *c, uint8_t val1, uint8_t val2) {
 	if (((val1 & 0x0F) + (val2 & 0x0F)) > 0x0F) {
 		set_AC();
 	} else {
@@ -184,7 +187,7 @@ void calc_AC(uint8_t val1, uint8_t val2) {
 	}
 }
 
-void calc_AC_carry(uint8_t val1, uint8_t val2) {
+static void calc_AC_carry(struct i8085 *c, uint8_t val1, uint8_t val2) {
 	if (((val1 & 0x0F) + (val2 & 0x0F)) >= 0x0F) {
 		set_AC();
 	} else {
@@ -192,7 +195,7 @@ void calc_AC_carry(uint8_t val1, uint8_t val2) {
 	}
 }
 
-void calc_subAC(int8_t val1, uint8_t val2) {
+static void calc_subAC(struct i8085 *c, int8_t val1, uint8_t val2) {
 	if ((val2 & 0x0F) <= (val1 & 0x0F)) {
 		set_AC();
 	} else {
@@ -200,7 +203,7 @@ void calc_subAC(int8_t val1, uint8_t val2) {
 	}
 }
 
-void calc_subAC_borrow(int8_t val1, uint8_t val2) {
+static void calc_subAC_borrow(struct i8085 *c, int8_t val1, uint8_t val2) {
 	if ((val2 & 0x0F) < (val1 & 0x0F)) {
 		set_AC();
 	} else {
@@ -208,12 +211,12 @@ void calc_subAC_borrow(int8_t val1, uint8_t val2) {
 	}
 }
 
-void calc_Vadd(int8_t val1, int8_t val2, int c)
+static void calc_Vadd(struct i8085 *c, int8_t val1, int8_t val2, int cin)
 {
 	/* Did adding bits 0-6 together carry into bit 7 ? */
-	uint8_t c6 = ((val1 & 0x7F) + (val2 & 0x7F) + c) & 0x80;
+	uint8_t c6 = ((val1 & 0x7F) + (val2 & 0x7F) + cin) & 0x80;
 	/* Did adding bits 0-7 together carry into bit 8 ? */
-	uint16_t c7 = ((uint16_t)val1 + val2 + c) & 0x100;
+	uint16_t c7 = ((uint16_t)val1 + val2 + cin) & 0x100;
 	/* V is the xor of the two carries */
 	/* Annoying C has no ^^ operator */
 	if ((!!c6) ^ (!!c7))
@@ -223,31 +226,25 @@ void calc_Vadd(int8_t val1, int8_t val2, int c)
 }
 
 /* 16bit maths is actually 8bit maths done twice */
-void calc_Vadd16(int16_t val1, int16_t val2)
+static void calc_Vadd16(struct i8085 *c, int16_t val1, int16_t val2)
 {
 	/* Internal carry of the first add */
-	int c = ((val1 & 0xFF) + (val2 & 0xFF)) & 0x100;
+	int cin = ((val1 & 0xFF) + (val2 & 0xFF)) & 0x100;
 	/* Fed into the carry of the following adc */
-	calc_Vadd(val1 >> 8, val2 >> 8, !!c);
+	calc_Vadd(c, val1 >> 8, val2 >> 8, !!cin);
 }
 
-void calc_Vsub(int8_t val1, int8_t val2, int c)
+static void calc_Vsub(struct i8085 *c, int8_t val1, int8_t val2, int cin)
 {
-	uint8_t c6 = ((val1 & 0x7F) - (val2 & 0x7F) - c) & 0x80;
-	uint16_t c7 = ((val1 - val2 - c) & 0x100) >> 1;
+	uint8_t c6 = ((val1 & 0x7F) - (val2 & 0x7F) - cin) & 0x80;
+	uint16_t c7 = ((val1 - val2 - cin) & 0x100) >> 1;
 	if (c6 ^ c7)
 		set_V();
 	else
 		clear_V();
 }
 
-void calc_Vsub16(int16_t val1, int16_t val2)
-{
-	int c = (val1 & 0xFF) < (val2 & 0xFF);
-	calc_Vsub(val1 >> 8, val2 >> 8, c);
-}
-
-void calc_K(int8_t r)
+static void calc_K(struct i8085 *c, int8_t r)
 {
 	if ((!!test_V()) ^ !!(r & 0x80))
 		set_K();
@@ -255,13 +252,13 @@ void calc_K(int8_t r)
 		clear_K();
 }
 
-void calc_KVlogic(uint8_t val)
+static void calc_KVlogic(struct i8085 *c, uint8_t val)
 {
 	clear_V();
-	calc_K(val);
+	calc_K(c, val);
 }
 
-uint8_t test_cond(uint8_t code) {
+static uint8_t test_cond(struct i8085 *c, uint8_t code) {
 	switch (code) {
 		case 0: //Z not set
 			if (!test_Z()) return 1; else return 0;
@@ -283,76 +280,95 @@ uint8_t test_cond(uint8_t code) {
 	return 0;
 }
 
-void i8085_push(uint16_t value) {
-	i8085_write(--reg_SP, value >> 8);
-	i8085_write(--reg_SP, (uint8_t)value);
+static void i8085_push(struct i8085 *c, uint16_t value) {
+	c->write(c, --c->sp, value >> 8);
+	c->write(c, --c->sp, (uint8_t)value);
 }
 
-uint16_t i8085_pop() {
+static uint16_t i8085_pop(struct i8085 *c) {
 	uint16_t temp;
-	temp = i8085_read(reg_SP++);
-	temp |= (uint16_t)i8085_read(reg_SP++) << 8;
+	temp = c->read(c, c->sp++);
+	temp |= (uint16_t)c->read(c, c->sp++) << 8;
 	return temp;
 }
 
-void i8085_set_int(int n)
+static inline uint8_t i8085_fetch(struct i8085 *c, uint16_t addr)
 {
-	intpend |= n;
+	uint8_t *p = c->fetch_map[addr >> 14];
+	if (p)
+		return p[addr & 0x3FFF];
+	return c->read(c, addr);
 }
 
-void i8085_clear_int(int n)
+static inline uint16_t i8085_fetch16(struct i8085 *c, uint16_t addr)
 {
-	intpend &= ~n;
+	uint8_t *p = c->fetch_map[addr >> 14];
+	uint16_t r;
+
+	if (p && (addr & 0x3FFF) != 0x3FFF) {
+		p += addr & 0x3FFF;
+		return p[0] | (p[1] << 8);
+	}
+	/* The two reads must go on the bus in order */
+	r = i8085_fetch(c, addr);
+	return r | (i8085_fetch(c, addr + 1) << 8);
 }
 
+void i8085_set_int(struct i8085 *c, int n)
+{
+	c->intpend |= n;
+}
 
-void i8085_jump(uint16_t addr) {
-	reg_PC = addr;
+void i8085_clear_int(struct i8085 *c, int n)
+{
+	c->intpend &= ~n;
 }
 
-void i8085_reset() {
-	reg_PC = reg_SP = 0x0000;
+
+void i8085_reset(struct i8085 *c) {
+	c->pc = c->sp = 0x0000;
+	c->im = 0x07;	/* Verified with a Tundra CA80C85B */
 	//reg8[FLAGS] = 0x02;
 }
 
-void i8085_write_reg8(reg_t reg, uint8_t value) {
+void i8085_write_reg8(struct i8085 *c, reg_t reg, uint8_t value) {
 	if (reg == M) {
-		i8085_write(reg16_HL, value);
+		c->write(c, reg16_HL, value);
 	} else {
-		reg8[reg] = value;
+		c->reg8[reg] = value;
 	}
 }
 
-uint8_t i8085_read_reg8(reg_t reg) {
+uint8_t i8085_read_reg8(struct i8085 *c, reg_t reg) {
 	if (reg == M) {
-		return i8085_read(reg16_HL);
+		return c->read(c, reg16_HL);
 	} else {
-		return reg8[reg];
+		return c->reg8[reg];
 	}
 }
 
-uint16_t i8085_read_reg16(reg_t reg) {
+uint16_t i8085_read_reg16(struct i8085 *c, reg_t reg) {
 	switch (reg) {
 		case AF: return reg16_PSW;
 		case BC: return reg16_BC;
 		case DE: return reg16_DE;
 		case HL: return reg16_HL;
-		case SP: return reg_SP;
-		case PC: return reg_PC;
+		case SP: return c->sp;
+		case PC: return c->pc;
 		default:
 			fprintf(stderr, "bogus rr16\n");
 	}
 	return 0;
 }
 
-void i8085_write_reg16(reg_t reg, uint16_t value) {
+void i8085_write_reg16(struct i8085 *c, reg_t reg, uint16_t value) {
 	switch (reg) {
-		case AF: reg8[A] = value>>8; reg8[FLAGS] = value; break;
-		case BC: reg8[B] = value>>8; reg8[C] = value; break;
-		case DE: reg8[D] = value>>8; reg8[E] = value; break;
-		case HL: reg8[H] = value>>8; reg8[L] = value; break;
-		case SP: reg_SP = value; break;
-		case PC: reg_PC = value; break;
+		case AF: c->reg8[A] = value>>8; c->reg8[FLAGS] = value; break;
+		case BC: c->reg8[B] = value>>8; c->reg8[C] = value; break;
+		case DE: c->reg8[D] = value>>8; c->reg8[E] = value; break;
+		case HL: c->reg8[H] = value>>8; c->reg8[L] = value; break;
+		case SP: c->sp = value; break;
+		case PC: c->pc = value; break;
 		default:
 			fprintf(stderr, "bogus rr16\n");
 	}
@@ -376,138 +392,133 @@ static char *i8085_flags(uint8_t v)
 	return buf;
 }
 
-int i8085_exec(int cycles) {
+/* Run until the cycle counter reaches deadline. Instructions are not
+   split so it may go a few T-states past, which the caller keeps as it
+   continues from the counter */
+uint64_t i8085_exec_until(struct i8085 *c, uint64_t deadline) {
 	uint8_t opcode, temp8, reg, reg2;
 	uint16_t temp16;
 	uint32_t temp32;
 	uint8_t vec;
 
-	while (cycles > 0) {
+	while (c->cycles < deadline) {
 		/* TRAP is edge and level - must see the edge and it held */
-		if (intpend & INT_NMI) {	/* TRAP - NMI */
-			INTE = 0;
-			intpend &= ~8;
-			if (halted)
-				i8085_push(reg_PC + 1);
+		if (c->intpend & INT_NMI) {	/* TRAP - NMI */
+			c->inte = 0;
+			c->intpend &= ~8;
+			if (c->halted)
+				i8085_push(c, c->pc + 1);
 			else
-				i8085_push(reg_PC);
-			reg_PC = 0x24;
-			cycles -= 12; /* Check me */
-			if (i8085_log)
-				fprintf(i8085_log, "NMI taken.\n");
+				i8085_push(c, c->pc);
+			c->pc = 0x24;
+			c->cycles += 12; /* Check me */
+			if (c->log)
+				fprintf(c->log, "NMI taken.\n");
 		/* The others are level except 0x3C which is positive edge.
 		   The 8085 prioritizes so we must do likewise */
-		} else if (INTE && intprotect == 0 && (intpend & ~reg_IM)) {
-			INTE = 0;
-			temp8 = intpend & ~reg_IM;
+		} else if (c->inte && c->intprotect == 0 && (c->intpend & ~c->im)) {
+			c->inte = 0;
+			temp8 = c->intpend & ~c->im;
 
-			if (i8085_log)
-				fprintf(i8085_log, "IRQ taken (%x)\n", temp8);
+			if (c->log)
+				fprintf(c->log, "IRQ taken (%x)\n", temp8);
 
 			if (temp8 & INT_RST75) {
 				/* FIXME: we should temporarily mask not
 				   clear here. We clear in SIM */
 				vec = 0x3C;
-				intpend &= ~INT_RST75;
+				c->intpend &= ~INT_RST75;
 			} else if (temp8 & INT_RST65)
 				vec = 0x34;
 			else if (temp8 & INT_RST55)
 				vec = 0x2C;
 			else
 				vec = 0x38;
-			if (halted)
-				i8085_push(reg_PC + 1);
+			if (c->halted)
+				i8085_push(c, c->pc + 1);
 			else
-				i8085_push(reg_PC);
-			reg_PC = vec;
-			cycles -= 12;	/* Check me */
+				i8085_push(c, c->pc);
+			c->pc = vec;
+			c->cycles += 12;	/* Check me */
 		}
-		intprotect = 0;
-		halted = 0;
+		c->intprotect = 0;
+		c->halted = 0;
 
-		opcode = i8085_read(reg_PC);
+		opcode = i8085_fetch(c, c->pc);
 		
-		if (i8085_log)
-			fprintf(i8085_log, "%04X : %02x %02X %02X : %6s %02X %04X %04X %04X %04X\n",
-				reg_PC, i8085_debug_read(reg_PC), i8085_debug_read(reg_PC + 1), i8085_debug_read(reg_PC + 2),
-				i8085_flags(reg8[FLAGS]), reg8[A], reg16_BC, reg16_DE, reg16_HL, reg_SP);
+		if (c->log)
+			fprintf(c->log, "%04X : %02x %02X %02X : %6s %02X %04X %04X %04X %04X\n",
+				c->pc, c->debug_read(c, c->pc), c->debug_read(c, c->pc + 1), c->debug_read(c, c->pc + 2),
+				i8085_flags(c->reg8[FLAGS]), c->reg8[A], reg16_BC, reg16_DE, reg16_HL, c->sp);
 		
-		reg_PC++;
+		c->pc++;
+		c->cycles += cycle_table[opcode];
 
 		switch (opcode) {
 			case 0x3A: //LDA a - load A from memory
-				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				reg8[A] = i8085_read(temp16);
-				reg_PC += 2;
-				cycles -= 13;
+				temp16 = i8085_fetch16(c, c->pc);
+				c->reg8[A] = c->read(c, temp16);
+				c->pc += 2;
 				break;
 			case 0x32: //STA a - store A to memory
-				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				i8085_write(temp16, reg8[A]);
-				reg_PC += 2;
-				cycles -= 13;
+				temp16 = i8085_fetch16(c, c->pc);
+				c->write(c, temp16, c->reg8[A]);
+				c->pc += 2;
 				break;
 			case 0x2A: //LHLD a - load H:L from memory
-				temp16 = (uint16_t)i8085_read(reg_PC);
-				temp16 |= ((uint16_t)i8085_read(reg_PC+1)<<8);
-				reg8[L] = i8085_read(temp16++);
-				reg8[H] = i8085_read(temp16);
-				reg_PC += 2;
-				cycles -= 16;
+				temp16 = i8085_fetch16(c, c->pc);
+				c->reg8[L] = c->read(c, temp16++);
+				c->reg8[H] = c->read(c, temp16);
+				c->pc += 2;
 				break;
 			case 0x22: //SHLD a - store H:L to memory
-				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				i8085_write(temp16++, reg8[L]);
-				i8085_write(temp16, reg8[H]);
-				reg_PC += 2;
-				cycles -= 16;
+				temp16 = i8085_fetch16(c, c->pc);
+				c->write(c, temp16++, c->reg8[L]);
+				c->write(c, temp16, c->reg8[H]);
+				c->pc += 2;
 				break;
 			case 0xEB: //XCHG - exchange DE and HL content
-				temp8 = reg8[D];
-				reg8[D] = reg8[H];
-				reg8[H] = temp8;
-				temp8 = reg8[E];
-				reg8[E] = reg8[L];
-				reg8[L] = temp8;
-				cycles -= 5;
+				temp8 = c->reg8[D];
+				c->reg8[D] = c->reg8[H];
+				c->reg8[H] = temp8;
+				temp8 = c->reg8[E];
+				c->reg8[E] = c->reg8[L];
+				c->reg8[L] = temp8;
 				break;
 			case 0xC6: //ADI # - add immediate to A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8;
+				temp8 = i8085_fetch(c, c->pc++);
+				temp16 = (uint16_t)c->reg8[A] + (uint16_t)temp8;
 				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_AC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vadd(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
-				cycles -= 7;
+				calc_AC(c, c->reg8[A], temp8);
+				calc_SZP(c, (uint8_t)temp16);
+				calc_Vadd(c, c->reg8[A], temp8, 0);
+				calc_K(c, (uint8_t)temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0xCE: //ACI # - add immediate to A with carry
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
-				if (test_C()) calc_AC_carry(reg8[A], temp8); else calc_AC(reg8[A], temp8);
+				temp8 = i8085_fetch(c, c->pc++);
+				temp16 = (uint16_t)c->reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
+				if (test_C()) calc_AC_carry(c, c->reg8[A], temp8); else calc_AC(c, c->reg8[A], temp8);
 				/* The carry out is computed including the
 				   carry in of the bit before */
-				calc_Vadd(reg8[A], temp8, test_C());
+				calc_Vadd(c, c->reg8[A], temp8, test_C());
 				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
-				cycles -= 7;
+				calc_SZP(c, (uint8_t)temp16);
+				calc_K(c, (uint8_t)temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0xD6: //SUI # - subtract immediate from A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
-				cycles -= 7;
+				temp8 = i8085_fetch(c, c->pc++);
+				temp16 = (uint16_t)c->reg8[A] - (uint16_t)temp8;
+				if (((temp16 & 0x00FF) >= c->reg8[A]) && temp8) set_C(); else clear_C();
+				calc_subAC(c, c->reg8[A], temp8);
+				calc_SZP(c, (uint8_t)temp16);
+				calc_Vsub(c, c->reg8[A], temp8, 0);
+				calc_K(c, (uint8_t)temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0x27: //DAA - decimal adjust accumulator
-				temp8 = reg8[A];
+				temp8 = c->reg8[A];
 				temp16 = temp8;
 				if (((temp16 & 0x0F) > 0x09) || test_AC()) {
 					if (((temp16 & 0x0F) + 0x06) & 0xF0) set_AC(); else clear_AC();
@@ -518,113 +529,99 @@ int i8085_exec(int cycles) {
 					temp16 += 0x60;
 					if (temp16 & 0xFF00) set_C(); //doesn't clear it if this clause is false
 				}
-				calc_SZP((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				calc_SZP(c, (uint8_t)temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				/* Verify this behaviour */
 				if ((temp8 & 0xF0) == 0x70 &&
 					(temp16 & 0xF0) == 0x80)
 					set_V();
 				else
 					clear_V();
-				calc_K(reg8[A]);
-				cycles -= 4;
+				calc_K(c, c->reg8[A]);
 				break;
 			case 0xE6: //ANI # - AND immediate with A
-				temp8 = i8085_read(reg_PC++);
-				if ((reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
-				reg8[A] &= temp8;
+				temp8 = i8085_fetch(c, c->pc++);
+				if ((c->reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
+				c->reg8[A] &= temp8;
 				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				cycles -= 7;
+				calc_SZP(c, c->reg8[A]);
+				calc_KVlogic(c, c->reg8[A]);
 				break;
 			case 0xF6: //ORI # - OR immediate with A
-				reg8[A] |= i8085_read(reg_PC++);
+				c->reg8[A] |= i8085_fetch(c, c->pc++);
 				clear_AC();
 				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				cycles -= 7;
+				calc_SZP(c, c->reg8[A]);
+				calc_KVlogic(c, c->reg8[A]);
 				break;
 			case 0xEE: //XRI # - XOR immediate with A
-				reg8[A] ^= i8085_read(reg_PC++);
+				c->reg8[A] ^= i8085_fetch(c, c->pc++);
 				clear_AC();
 				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				cycles -= 7;
+				calc_SZP(c, c->reg8[A]);
+				calc_KVlogic(c, c->reg8[A]);
 				break;
 			case 0xDE: //SBI # - subtract immediate from A with borrow
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
-				if (test_C()) calc_subAC_borrow(reg8[A], temp8); else calc_subAC(reg8[A], temp8);
-				calc_Vsub(reg8[A], temp8, test_C());
-				if (((temp16 & 0x00FF) >= reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
-				cycles -= 7;
+				temp8 = i8085_fetch(c, c->pc++);
+				temp16 = (uint16_t)c->reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
+				if (test_C()) calc_subAC_borrow(c, c->reg8[A], temp8); else calc_subAC(c, c->reg8[A], temp8);
+				calc_Vsub(c, c->reg8[A], temp8, test_C());
+				if (((temp16 & 0x00FF) >= c->reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
+				calc_SZP(c, (uint8_t)temp16);
+				calc_K(c, (uint8_t)temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0xFE: //CPI # - compare immediate with A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
-				cycles -= 7;
+				temp8 = i8085_fetch(c, c->pc++);
+				temp16 = (uint16_t)c->reg8[A] - (uint16_t)temp8;
+				if (((temp16 & 0x00FF) >= c->reg8[A]) && temp8) set_C(); else clear_C();
+				calc_subAC(c, c->reg8[A], temp8);
+				calc_SZP(c, (uint8_t)temp16);
+				calc_Vsub(c, c->reg8[A], temp8, 0);
+				calc_K(c, (uint8_t)temp16);
 				break;
 			case 0x07: //RLC - rotate A left
-				if (reg8[A] & 0x80) set_C(); else clear_C();
-				calc_Vadd(reg8[A],reg8[A], reg8[A] & 0x80);
-				reg8[A] = (reg8[A] >> 7) | (reg8[A] << 1);
-				calc_K(reg8[A]);
-				cycles -= 4;
+				if (c->reg8[A] & 0x80) set_C(); else clear_C();
+				calc_Vadd(c, c->reg8[A],c->reg8[A], c->reg8[A] & 0x80);
+				c->reg8[A] = (c->reg8[A] >> 7) | (c->reg8[A] << 1);
+				calc_K(c, c->reg8[A]);
 				break;
 			case 0x0F: //RRC - rotate A right
-				if (reg8[A] & 0x01) set_C(); else clear_C();
-				reg8[A] = (reg8[A] << 7) | (reg8[A] >> 1);
+				if (c->reg8[A] & 0x01) set_C(); else clear_C();
+				c->reg8[A] = (c->reg8[A] << 7) | (c->reg8[A] >> 1);
 				clear_V();
 				/* Verify if RR ops affect K */
-				cycles -= 4;
 				break;
 			case 0x17: //RAL - rotate A left through carry
 				temp8 = test_C();
-				if (reg8[A] & 0x80) set_C(); else clear_C();
-				calc_Vadd(reg8[A],reg8[A], temp8);
-				reg8[A] = (reg8[A] << 1) | temp8;
-				calc_K(reg8[A]);
-				cycles -= 4;
+				if (c->reg8[A] & 0x80) set_C(); else clear_C();
+				calc_Vadd(c, c->reg8[A],c->reg8[A], temp8);
+				c->reg8[A] = (c->reg8[A] << 1) | temp8;
+				calc_K(c, c->reg8[A]);
 				break;
 			case 0x1F: //RAR - rotate A right through carry
 				temp8 = test_C();
-				if (reg8[A] & 0x01) set_C(); else clear_C();
-				reg8[A] = (reg8[A] >> 1) | (temp8 << 7);
-				cycles -= 4;
+				if (c->reg8[A] & 0x01) set_C(); else clear_C();
+				c->reg8[A] = (c->reg8[A] >> 1) | (temp8 << 7);
 				/* Verify if RR ops affect K */
 				clear_V();
 				break;
 			case 0x2F: //CMA - complement A
-				reg8[A] = ~reg8[A];
-				cycles -= 4;
+				c->reg8[A] = ~c->reg8[A];
 				/* This does not affect flags */
 				break;
 			case 0x3F: //CMC - complement carry flag
-				reg8[FLAGS] ^= 1;
-				cycles -= 4;
+				c->reg8[FLAGS] ^= 1;
 				break;
 			case 0x37: //STC - set carry flag
 				set_C();
-				cycles -= 4;
 				break;
 			case 0xCB: //RSTv
 				if (test_V()) {
-					cycles -= 6;
-					i8085_push(reg_PC);
-					reg_PC = 0x40;
+					c->cycles += 6;
+					i8085_push(c, c->pc);
+					c->pc = 0x40;
 				}
-				cycles -= 6;
 				break;
 			case 0xC7: //RST n - restart (call n*8)
 			case 0xD7:
@@ -634,75 +631,63 @@ int i8085_exec(int cycles) {
 			case 0xDF:
 			case 0xEF:
 			case 0xFF:
-				i8085_push(reg_PC);
-				reg_PC = (uint16_t)((opcode >> 3) & 7) << 3;
-				cycles -= 12;
+				i8085_push(c, c->pc);
+				c->pc = (uint16_t)((opcode >> 3) & 7) << 3;
 				break;
 			case 0xE9: //PCHL - jump to address in H:L
-				reg_PC = reg16_HL;
-				/* 6 on 8085 5 on 8080 ... */
-				cycles -= 6;
+				c->pc = reg16_HL;
 				break;
 			case 0xE3: //XTHL - swap H:L with top word on stack
-				temp16 = i8085_pop();
-				i8085_push(reg16_HL);
-				write16_RP(2, temp16);
-				cycles -= 16;
+				temp16 = i8085_pop(c);
+				i8085_push(c, reg16_HL);
+				write16_RP(c, 2, temp16);
 				break;
 			case 0xF9: //SPHL - set SP to content of HL
-				reg_SP = reg16_HL;
-				cycles -= 6;
+				c->sp = reg16_HL;
 				break;
 			case 0xDB: //IN p - read input port into A
-				reg8[A] = i8085_inport(i8085_read(reg_PC++));
-				cycles -= 10;
+				c->reg8[A] = c->inport(c, i8085_fetch(c, c->pc++));
 				break;
 			case 0xD3: //OUT p - write A to output port
-				i8085_outport(i8085_read(reg_PC++), reg8[A]);
-				cycles -= 10;
+				c->outport(c, i8085_fetch(c, c->pc++), c->reg8[A]);
 				break;
 			case 0xFB: //EI - enable intersrupts
-				INTE = 1;
-				intprotect = 1;
-				cycles -= 4;
+				c->inte = 1;
+				c->intprotect = 1;
 				break;
 			case 0xF3: //DI - disbale interrupts
-				INTE = 0;
-				cycles -= 4;
+				c->inte = 0;
 				break;
 			case 0x76: //HLT - halt processor
-				reg_PC--;
-				cycles -= 7;
-				halted = 1;
+				c->pc--;
+				c->halted = 1;
 				break;
 			case 0x00: //NOP - no operation
-				cycles -= 4;
 				break;
 			case 0x08: // DSUB - 16bit subtraction
 				/* Does SUB L,C; SBC H,B for flags */
-				temp8 = reg8[C];
-				temp16 = (uint16_t)reg8[L] - (uint16_t)temp8;
-				if ((temp16 & 0x00FF) >= reg8[L] && temp8)
+				temp8 = c->reg8[C];
+				temp16 = (uint16_t)c->reg8[L] - (uint16_t)temp8;
+				if ((temp16 & 0x00FF) >= c->reg8[L] && temp8)
 					set_C();
 				else
 					clear_C();
-				reg8[L] = (uint8_t)temp16;
+				c->reg8[L] = (uint8_t)temp16;
 				/* We don't need the other intermediate flags */
-				temp8 = reg8[B];
-				temp16 = (uint16_t)reg8[H] - (uint16_t)temp8 - (uint16_t)test_C();
+				temp8 = c->reg8[B];
+				temp16 = (uint16_t)c->reg8[H] - (uint16_t)temp8 - (uint16_t)test_C();
 				if (test_C())
-					calc_subAC_borrow(reg8[H], temp8);
+					calc_subAC_borrow(c, c->reg8[H], temp8);
 				else
-					calc_subAC(reg8[H], temp8);				
-				calc_Vsub(reg8[H], temp8, test_C());
-				if ((temp16 & 0x00FF) >= reg8[H] && (temp8 | test_C()))
+					calc_subAC(c, c->reg8[H], temp8);				
+				calc_Vsub(c, c->reg8[H], temp8, test_C());
+				if ((temp16 & 0x00FF) >= c->reg8[H] && (temp8 | test_C()))
 					set_C();
 				else
 					clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[H] = (uint8_t)temp16;
-				cycles -= 10;
+				calc_SZP(c, (uint8_t)temp16);
+				calc_K(c, temp16);
+				c->reg8[H] = (uint8_t)temp16;
 				break;					
 			case 0x10: // ARHL
 				if (reg16_HL & 1)
@@ -712,48 +697,42 @@ int i8085_exec(int cycles) {
 				temp16 = reg16_HL >> 1;
 				if (temp16 & 0x4000)
 					temp16 |= 0x8000;
-				i8085_write_reg16(HL, temp16);
-				cycles -= 7;
+				i8085_write_reg16(c, HL, temp16);
 				break;
 			case 0x18: // RDEL
 				/* Affects only CY and V */
 				temp16 = reg16_DE;
 				temp8 = test_C();
-				i8085_write_reg16(DE, (temp16 << 1) + temp8);
+				i8085_write_reg16(c, DE, (temp16 << 1) + temp8);
 				if (temp16 & 0x8000)
 					set_C();
 				else
 					clear_C();
-				cycles -= 10;
 				/* This seems to be a DAD D,D with carry but
 				   I'm not enitrely sure. FIXME */
-				calc_Vadd16(temp16, temp16 + temp8);
+				calc_Vadd16(c, temp16, temp16 + temp8);
 				break;
 			case 0x20: // RIM
-				temp8 = reg_IM & 0x07;
-				if (intpend & INT_RST75)
+				temp8 = c->im & 0x07;
+				if (c->intpend & INT_RST75)
 					temp8 |= 0x10;
-				temp8 |= i8085_get_input() ? 0x80: 0x00;
-				temp8 |= (intpend & 7)  << 4;
-				reg8[A] = temp8;
-				cycles -= 4;
+				temp8 |= c->get_input(c) ? 0x80: 0x00;
+				temp8 |= (c->intpend & 7)  << 4;
+				c->reg8[A] = temp8;
 				break;
 			case 0x28: // LDHI
-				i8085_write_reg16(DE, reg16_HL + i8085_read(reg_PC++));
-				cycles -= 10;
+				i8085_write_reg16(c, DE, reg16_HL + i8085_fetch(c, c->pc++));
 				break;
 			case 0x30: // SIM
-				if (reg8[A] & 0x08)
-					reg_IM = reg8[A] & 0x07;
-				if (reg8[A] & 0x10)
-					intpend &= ~INT_RST75;
-				if (reg8[A] & 0x40)
-					i8085_set_output(reg8[A] & 0x80);
-				cycles -= 4;
+				if (c->reg8[A] & 0x08)
+					c->im = c->reg8[A] & 0x07;
+				if (c->reg8[A] & 0x10)
+					c->intpend &= ~INT_RST75;
+				if (c->reg8[A] & 0x40)
+					c->set_output(c, c->reg8[A] & 0x80);
 				break;
 			case 0x38: // LDSI
-				i8085_write_reg16(DE, reg_SP + i8085_read(reg_PC++));
-				cycles -= 10;
+				i8085_write_reg16(c, DE, c->sp + i8085_fetch(c, c->pc++));
 				break;
 			case 0x40: case 0x50: case 0x60: case 0x70: //MOV D,S - move register to register
 			case 0x41: case 0x51: case 0x61: case 0x71:
@@ -773,12 +752,7 @@ int i8085_exec(int cycles) {
 			case 0x4F: case 0x5F: case 0x6F: case 0x7F:
 				reg = (opcode >> 3) & 7;
 				reg2 = opcode & 7;
-				i8085_write_reg8(reg, i8085_read_reg8(reg2));
-				if ((reg == M) || (reg2 == M)) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				i8085_write_reg8(c, reg, i8085_read_reg8(c, reg2));
 				break;
 			case 0x06: //MVI D,# - move immediate to register
 			case 0x16:
@@ -789,40 +763,27 @@ int i8085_exec(int cycles) {
 			case 0x2E:
 			case 0x3E:
 				reg = (opcode >> 3) & 7;
-				i8085_write_reg8(reg, i8085_read(reg_PC++));
-				if (reg == M) {
-					cycles -= 10;
-				} else {
-					cycles -= 7;
-				}
+				i8085_write_reg8(c, reg, i8085_fetch(c, c->pc++));
 				break;
 			case 0x01: //LXI RP,# - load register pair immediate
 			case 0x11:
 			case 0x21:
 			case 0x31:
 				reg = (opcode >> 4) & 3;
-				/* Although there are not internal side effects we must put
-				   the two reads on the bus in order */
-				temp8 = i8085_read(reg_PC);
-				write_RP(reg, temp8, i8085_read(reg_PC + 1));
-				reg_PC += 2;
-				cycles -= 10;
+				write16_RP(c, reg, i8085_fetch16(c, c->pc));
+				c->pc += 2;
 				break;
 			case 0x0A: //LDAX BC - load A indirect through BC
-				reg8[A] = i8085_read(reg16_BC);
-				cycles -= 7;
+				c->reg8[A] = c->read(c, reg16_BC);
 				break;
 			case 0x1A: //LDAX DE - load A indirect through DE
-				reg8[A] = i8085_read(reg16_DE);
-				cycles -= 7;
+				c->reg8[A] = c->read(c, reg16_DE);
 				break;
 			case 0x02: //STAX BC - store A indirect through BC
-				i8085_write(reg16_BC, reg8[A]);
-				cycles -= 7;
+				c->write(c, reg16_BC, c->reg8[A]);
 				break;
 			case 0x12: //STAX DE - store A indirect through DE
-				i8085_write(reg16_DE, reg8[A]);
-				cycles -= 7;
+				c->write(c, reg16_DE, c->reg8[A]);
 				break;
 			case 0x04: //INR D - increment register
 			case 0x14:
@@ -833,20 +794,15 @@ int i8085_exec(int cycles) {
 			case 0x2C:
 			case 0x3C:
 				reg = (opcode >> 3) & 7;
-				temp8 = i8085_read_reg8(reg); //reg8[reg];
-				calc_AC(temp8, 1);
-				calc_SZP(temp8 + 1);
+				temp8 = i8085_read_reg8(c, reg); //reg8[reg];
+				calc_AC(c, temp8, 1);
+				calc_SZP(c, temp8 + 1);
 				if (temp8 == 0x7F)
 					set_V();
 				else
 					clear_V();
-				calc_K(temp8+1);
-				i8085_write_reg8(reg, temp8 + 1); //reg8[reg]++;
-				if (reg == M) {
-					cycles -= 10;
-				} else {
-					cycles -= 4;
-				}
+				calc_K(c, temp8+1);
+				i8085_write_reg8(c, reg, temp8 + 1); //reg8[reg]++;
 				break;
 			case 0x05: //DCR D - decrement register
 			case 0x15:
@@ -857,27 +813,22 @@ int i8085_exec(int cycles) {
 			case 0x2D:
 			case 0x3D:
 				reg = (opcode >> 3) & 7;
-				temp8 = i8085_read_reg8(reg); //reg8[reg];
-				calc_subAC(temp8, 1);
-				calc_SZP(temp8 - 1);
+				temp8 = i8085_read_reg8(c, reg); //reg8[reg];
+				calc_subAC(c, temp8, 1);
+				calc_SZP(c, temp8 - 1);
 				if (temp8 == 0x80)
 					set_V();
 				else
 					clear_V();
-				calc_K(temp8 - 1);
-				i8085_write_reg8(reg, temp8 - 1); //reg8[reg]--;
-				if (reg == M) {
-					cycles -= 10;
-				} else {
-					cycles -= 4;
-				}
+				calc_K(c, temp8 - 1);
+				i8085_write_reg8(c, reg, temp8 - 1); //reg8[reg]--;
 				break;
 			case 0x03: //INX RP - increment register pair
 			case 0x13:
 			case 0x23:
 			case 0x33:
 				reg = (opcode >> 4) & 3;
-				temp16 = read_RP(reg) + 1;
+				temp16 = read_RP(c, reg) + 1;
 				if (temp16 == 0x8000)
 					set_V();
 				else
@@ -886,15 +837,14 @@ int i8085_exec(int cycles) {
 					set_K();
 				else
 					clear_K();
-				write16_RP(reg, temp16);
-				cycles -= 6;
+				write16_RP(c, reg, temp16);
 				break;
 			case 0x0B: //DCX RP - decrement register pair
 			case 0x1B:
 			case 0x2B:
 			case 0x3B:
 				reg = (opcode >> 4) & 3;
-				temp16 = read_RP(reg) - 1;
+				temp16 = read_RP(c, reg) - 1;
 				if (temp16 == 0x7FFF)
 					set_V();
 				else
@@ -903,20 +853,18 @@ int i8085_exec(int cycles) {
 					set_K();
 				else
 					clear_K();
-				write16_RP(reg, temp16);
-				cycles -= 6;
+				write16_RP(c, reg, temp16);
 				break;
 			case 0x09: //DAD RP - add register pair to HL
 			case 0x19:
 			case 0x29:
 			case 0x39:
 				reg = (opcode >> 4) & 3;
-				calc_Vadd16(reg16_HL, read_RP(reg));
-				temp32 = (uint32_t)reg16_HL + (uint32_t)read_RP(reg);
-				write16_RP(2, (uint16_t)temp32);
+				calc_Vadd16(c, reg16_HL, read_RP(c, reg));
+				temp32 = (uint32_t)reg16_HL + (uint32_t)read_RP(c, reg);
+				write16_RP(c, 2, (uint16_t)temp32);
 				if (temp32 & 0xFFFF0000) set_C(); else clear_C();
-				calc_K(temp32 >> 8);;
-				cycles -= 10;
+				calc_K(c, temp32 >> 8);;
 				break;
 			case 0x80: //ADD S - add register or memory to A
 			case 0x81:
@@ -927,19 +875,14 @@ int i8085_exec(int cycles) {
 			case 0x86:
 			case 0x87:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8;
+				temp8 = i8085_read_reg8(c, reg);
+				temp16 = (uint16_t)c->reg8[A] + (uint16_t)temp8;
 				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_AC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vadd(reg8[A], temp8, 0);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				calc_AC(c, c->reg8[A], temp8);
+				calc_SZP(c, (uint8_t)temp16);
+				calc_Vadd(c, c->reg8[A], temp8, 0);
+				calc_K(c, temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0x88: //ADC S - add register or memory to A with carry
 			case 0x89:
@@ -950,19 +893,14 @@ int i8085_exec(int cycles) {
 			case 0x8E:
 			case 0x8F:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
-				if (test_C()) calc_AC_carry(reg8[A], temp8); else calc_AC(reg8[A], temp8);
-				calc_Vadd(reg8[A], temp8, test_C());
+				temp8 = i8085_read_reg8(c, reg);
+				temp16 = (uint16_t)c->reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
+				if (test_C()) calc_AC_carry(c, c->reg8[A], temp8); else calc_AC(c, c->reg8[A], temp8);
+				calc_Vadd(c, c->reg8[A], temp8, test_C());
 				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				calc_SZP(c, (uint8_t)temp16);
+				calc_K(c, temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0x90: //SUB S - subtract register or memory from A
 			case 0x91:
@@ -973,19 +911,14 @@ int i8085_exec(int cycles) {
 			case 0x96:
 			case 0x97:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				temp8 = i8085_read_reg8(c, reg);
+				temp16 = (uint16_t)c->reg8[A] - (uint16_t)temp8;
+				if (((temp16 & 0x00FF) >= c->reg8[A]) && temp8) set_C(); else clear_C();
+				calc_subAC(c, c->reg8[A], temp8);
+				calc_SZP(c, (uint8_t)temp16);
+				calc_Vsub(c, c->reg8[A], temp8, 0);
+				calc_K(c, temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0x98: //SBB S - subtract register or memory from A with borrow
 			case 0x99:
@@ -996,19 +929,14 @@ int i8085_exec(int cycles) {
 			case 0x9E:
 			case 0x9F:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
-				if (test_C()) calc_subAC_borrow(reg8[A], temp8); else calc_subAC(reg8[A], temp8);
-				calc_Vsub(reg8[A], temp8, test_C());
-				if (((temp16 & 0x00FF) >= reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				temp8 = i8085_read_reg8(c, reg);
+				temp16 = (uint16_t)c->reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
+				if (test_C()) calc_subAC_borrow(c, c->reg8[A], temp8); else calc_subAC(c, c->reg8[A], temp8);
+				calc_Vsub(c, c->reg8[A], temp8, test_C());
+				if (((temp16 & 0x00FF) >= c->reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
+				calc_SZP(c, (uint8_t)temp16);
+				calc_K(c, temp16);
+				c->reg8[A] = (uint8_t)temp16;
 				break;
 			case 0xA0: //ANA S - AND register with A
 			case 0xA1:
@@ -1019,17 +947,12 @@ int i8085_exec(int cycles) {
 			case 0xA6:
 			case 0xA7:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				if ((reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
-				reg8[A] &= temp8;
+				temp8 = i8085_read_reg8(c, reg);
+				if ((c->reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
+				c->reg8[A] &= temp8;
 				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				calc_SZP(c, c->reg8[A]);
+				calc_KVlogic(c, c->reg8[A]);
 				break;
 			case 0xB0: //ORA S - OR register with A
 			case 0xB1:
@@ -1040,16 +963,11 @@ int i8085_exec(int cycles) {
 			case 0xB6:
 			case 0xB7:
 				reg = opcode & 7;
-				reg8[A] |= i8085_read_reg8(reg);
+				c->reg8[A] |= i8085_read_reg8(c, reg);
 				clear_AC();
 				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				calc_SZP(c, c->reg8[A]);
+				calc_KVlogic(c, c->reg8[A]);
 				break;
 			case 0xA8: //XRA S - XOR register with A
 			case 0xA9:
@@ -1060,16 +978,11 @@ int i8085_exec(int cycles) {
 			case 0xAE:
 			case 0xAF:
 				reg = opcode & 7;
-				reg8[A] ^= i8085_read_reg8(reg);
+				c->reg8[A] ^= i8085_read_reg8(c, reg);
 				clear_AC();
 				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				calc_SZP(c, c->reg8[A]);
+				calc_KVlogic(c, c->reg8[A]);
 				break;
 			case 0xB8: //CMP S - compare register with A
 			case 0xB9:
@@ -1080,24 +993,17 @@ int i8085_exec(int cycles) {
 			case 0xBE:
 			case 0xBF:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K(temp16);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+				temp8 = i8085_read_reg8(c, reg);
+				temp16 = (uint16_t)c->reg8[A] - (uint16_t)temp8;
+				if (((temp16 & 0x00FF) >= c->reg8[A]) && temp8) set_C(); else clear_C();
+				calc_subAC(c, c->reg8[A], temp8);
+				calc_SZP(c, (uint8_t)temp16);
+				calc_Vsub(c, c->reg8[A], temp8, 0);
+				calc_K(c, temp16);
 				break;
 			case 0xC3: //JMP a - unconditional jump
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				reg_PC = temp16;
-				cycles -= 10;
+				temp16 = i8085_fetch16(c, c->pc);
+				c->pc = temp16;
 				break;
 			case 0xC2: //Jccc - conditional jumps
 			case 0xCA:
@@ -1107,49 +1013,37 @@ int i8085_exec(int cycles) {
 			case 0xEA:
 			case 0xF2:
 			case 0xFA:
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				if (test_cond((opcode >> 3) & 7)) {
-					reg_PC = temp16;
-					cycles -= 10;
-				} else {
-					reg_PC += 2;
-					cycles -= 7;
-				}
+				temp16 = i8085_fetch16(c, c->pc);
+				if (test_cond(c, (opcode >> 3) & 7)) {
+					c->pc = temp16;
+					c->cycles += 3;
+				} else
+					c->pc += 2;
 				break;
 			case 0xDD: // JNK
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
+				temp16 = i8085_fetch16(c, c->pc);
 				if (!test_K()) {
-					reg_PC = temp16;
-					cycles -= 10;
-				} else {
-					reg_PC += 2;
-					cycles -= 7;
-				}
+					c->pc = temp16;
+					c->cycles += 3;
+				} else
+					c->pc += 2;
 				break;
 			case 0xED:
-				reg8[L] = i8085_read(reg16_DE);
-				reg8[H] = i8085_read(reg16_DE + 1);
-				cycles -= 10;
+				c->reg8[L] = c->read(c, reg16_DE);
+				c->reg8[H] = c->read(c, reg16_DE + 1);
 				break;
 			case 0xFD:
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
+				temp16 = i8085_fetch16(c, c->pc);
 				if (!test_K()) {
-					reg_PC = temp16;
-					cycles -= 10;
-				} else {
-					reg_PC += 2;
-					cycles -= 7;
-				}
+					c->pc = temp16;
+					c->cycles += 3;
+				} else
+					c->pc += 2;
 				break;
 			case 0xCD: //CALL a - unconditional call
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				i8085_push(reg_PC + 2);
-				reg_PC = temp16;
-				cycles -= 18;
+				temp16 = i8085_fetch16(c, c->pc);
+				i8085_push(c, c->pc + 2);
+				c->pc = temp16;
 				break;
 			case 0xC4: //Cccc - conditional calls
 			case 0xCC:
@@ -1159,25 +1053,20 @@ int i8085_exec(int cycles) {
 			case 0xEC:
 			case 0xF4:
 			case 0xFC:
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				if (test_cond((opcode >> 3) & 7)) {
-					i8085_push(reg_PC + 2);
-					reg_PC = temp16;
-					cycles -= 18;
-				} else {
-					reg_PC += 2;
-					cycles -= 9;
-				}
+				temp16 = i8085_fetch16(c, c->pc);
+				if (test_cond(c, (opcode >> 3) & 7)) {
+					i8085_push(c, c->pc + 2);
+					c->pc = temp16;
+					c->cycles += 9;
+				} else
+					c->pc += 2;
 				break;
 			case 0xD9: //SHLX
-				i8085_write(reg16_DE, reg8[L]);
-				i8085_write(reg16_DE+1, reg8[H]);
-				cycles -= 10;
+				c->write(c, reg16_DE, c->reg8[L]);
+				c->write(c, reg16_DE+1, c->reg8[H]);
 				break;
 			case 0xC9: //RET - unconditional return
-				reg_PC = i8085_pop();
-				cycles -= 10;
+				c->pc = i8085_pop(c);
 				break;
 			case 0xC0: //Rccc - conditional returns
 			case 0xC8:
@@ -1187,11 +1076,9 @@ int i8085_exec(int cycles) {
 			case 0xE8:
 			case 0xF0:
 			case 0xF8:
-				if (test_cond((opcode >> 3) & 7)) {
-					reg_PC = i8085_pop();
-					cycles -= 12;
-				} else {
-					cycles -= 6;
+				if (test_cond(c, (opcode >> 3) & 7)) {
+					c->pc = i8085_pop(c);
+					c->cycles += 6;
 				}
 				break;
 			case 0xC5: //PUSH RP - push register pair on the stack
@@ -1199,23 +1086,29 @@ int i8085_exec(int cycles) {
 			case 0xE5:
 			case 0xF5:
 				reg = (opcode >> 4) & 3;
-				i8085_push(read_RP_PUSHPOP(reg));
-				/* 11 on 8080 12 on 8085 */
-				cycles -= 12;
+				i8085_push(c, read_RP_PUSHPOP(c, reg));
 				break;
 			case 0xC1: //POP RP - pop register pair from the stack
 			case 0xD1:
 			case 0xE1:
 			case 0xF1:
 				reg = (opcode >> 4) & 3;
-				write16_RP_PUSHPOP(reg, i8085_pop());
-				cycles -= 10;
+				write16_RP_PUSHPOP(c, reg, i8085_pop(c));
 				break;
 			default:
-				printf("UNRECOGNIZED INSTRUCTION @ %04Xh: %02X\n", reg_PC - 1, opcode);
+				printf("UNRECOGNIZED INSTRUCTION @ %04Xh: %02X\n", c->pc - 1, opcode);
 				exit(0);
 		}
 
 	}
-	return cycles;
+	return c->cycles;
+}
+
+/* Run for a number of T-states, returning how far short (or with a
+   negative value how far over) it stopped */
+int i8085_exec(struct i8085 *c, int cycles) {
+	uint64_t start = c->cycles;
+	if (cycles > 0)
+		i8085_exec_until(c, start + cycles);
+	return cycles - (int)(c->cycles - start);
 }
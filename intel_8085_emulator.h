@@ -8,16 +8,36 @@ typedef enum
 }
 reg_t;
 
-extern uint8_t i8085_read(uint16_t addr);
-extern void i8085_write(uint16_t addr, uint8_t value);
-extern uint8_t i8085_debug_read(uint16_t addr);
-extern uint8_t i8085_inport(uint8_t port);
-extern void i8085_outport(uint8_t port, uint8_t value);
-extern int i8085_get_input(void);
-extern void i8085_set_output(int value);
-
-extern void i8085_set_int(int n);
-extern void i8085_clear_int(int n);
+/*
+ *	One 8085. The board fills in the hooks before i8085_reset() and can
+ *	run as many of these as it likes.
+ *
+ *	fetch_map gives the host address of each 16K for instruction and
+ *	operand fetches, a NULL entry fetches through read(). Everything
+ *	else goes through the hooks. cycles counts T-states since the
+ *	structure was cleared.
+ */
+struct i8085 {
+	uint8_t reg8[9];
+	uint16_t sp, pc;
+	uint8_t inte, im;
+	uint8_t intprotect, intpend, halted;
+	uint64_t cycles;
+
+	uint8_t *fetch_map[4];
+	uint8_t (*read)(struct i8085 *c, uint16_t addr);
+	void (*write)(struct i8085 *c, uint16_t addr, uint8_t value);
+	uint8_t (*debug_read)(struct i8085 *c, uint16_t addr);	/* No side effects */
+	uint8_t (*inport)(struct i8085 *c, uint8_t port);
+	void (*outport)(struct i8085 *c, uint8_t port, uint8_t value);
+	int (*get_input)(struct i8085 *c);		/* SID */
+	void (*set_output)(struct i8085 *c, int value);	/* SOD */
+	void *private;			/* For the board */
+	FILE *log;			/* Instruction trace or NULL */
+};
+
+extern void i8085_set_int(struct i8085 *c, int n);
+extern void i8085_clear_int(struct i8085 *c, int n);
 
 #define INT_NMI		0x80
 #define INT_EXTERN	0x40	/* Assumed to provide 0xFF */
@@ -28,16 +48,15 @@ extern void i8085_clear_int(int n);
 #define INT_RST55	0x01
 
 
-extern uint8_t i8085_read_reg8(reg_t reg);
-extern void i8085_write_reg8(reg_t reg, uint8_t value);
-
-extern uint16_t i8085_read_reg16(reg_t reg);
-extern void i8085_write_reg16(reg_t reg, uint16_t value);
+extern uint8_t i8085_read_reg8(struct i8085 *c, reg_t reg);
+extern void i8085_write_reg8(struct i8085 *c, reg_t reg, uint8_t value);
 
-extern void i8085_reset();
+extern uint16_t i8085_read_reg16(struct i8085 *c, reg_t reg);
+extern void i8085_write_reg16(struct i8085 *c, reg_t reg, uint16_t value);
 
-extern int i8085_exec(int cycles);
+extern void i8085_reset(struct i8085 *c);
 
-FILE *i8085_log;
+extern uint64_t i8085_exec_until(struct i8085 *c, uint64_t deadline);
+extern int i8085_exec(struct i8085 *c, int cycles);
 
 #endif
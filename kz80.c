@@ -20,6 +20,8 @@
 #include <time.h>
 #include <unistd.h>
 #include "libz80/z80.h"
+#include "sio.h"
+#include "serial.h"
 
 
 /*
@@ -181,352 +183,19 @@ recalc_interrupts(void)
 }
 
 
-struct z80_sio_chan {
-        uint8_t wr[8];
-        uint8_t rr[3];
-        uint8_t data[3];
-        uint8_t dptr;
-        uint8_t irq;
-        uint8_t rxint;
-        uint8_t txint;
-        uint8_t intbits;
-#define INT_TX  1
-#define INT_RX  2
-#define INT_ERR 4
-        uint8_t pending;        /* Interrupt bits pending as an IRQ cause */
-        uint8_t vector;         /* Vector pending to deliver */
-};
-
-
-static int	sio2_input = 1;
-static struct	z80_sio_chan sio[2];
-
-/*
- *      Interrupts. We don't handle IM2 yet.
- */
-
-static void
-sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	if (trace & TRACE_IRQ) {
-		fprintf(stderr, "Clear intbits %d %x\n",
-				(int)(chan - sio), m);
-	}
-	chan->intbits &= ~m;
-	chan->pending &= ~m;
-
-	/* Check me - does it auto clear down or do you have to reti it ? */
-	if (!(sio->intbits | sio[1].intbits)) {
-		sio->rr[1] &= ~0x02;
-		chan->irq = 0;
-	}
-	recalc_interrupts();
-}
-
-
-static void
-sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
-{
-        uint8_t new = (chan->intbits ^ m) & m;
-        chan->intbits |= m;
-        if ((trace & TRACE_SIO) && new)
-                fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
-        if (new) {
-                if (!sio->irq) {
-                        chan->irq = 1;
-                        sio->rr[1] |= 0x02;
-                        recalc_interrupts();
-                }
-        }
-}
-
-
-static void
-sio2_reti(struct z80_sio_chan *chan)
-{
-        /* Recalculate the pending state and vectors */
-        /* FIXME: what really goes here */
-        sio->irq = 0;
-        recalc_interrupts();
-}
+static struct sio	*sio;
 
 
 static int
-sio2_check_im2(struct z80_sio_chan *chan)
+sio2_check_im2(unsigned int chan)
 {
-        uint8_t	vector = sio[1].wr[2];
-        /* See if we have an IRQ pending and if so deliver it and return 1 */
-        if (chan->irq) {
-                /* Do the vector calculation in the right place */
-                /* FIXME: move this to other platforms */
-                if (sio[1].wr[1] & 0x04) {
-                        /* This is a subset of the real options. FIXME: add
-                           external status change */
-                        if (sio[1].wr[1] & 0x04) {
-                                vector &= 0xF1;
-                                if (chan == sio)
-                                        vector |= 1 << 3;
-                                if (chan->intbits & INT_RX)
-                                        vector |= 4;
-                                else if (chan->intbits & INT_ERR)
-                                        vector |= 2;
-                        }
-                        if (trace & TRACE_SIO)
-                                fprintf(stderr, "SIO2 interrupt %02X\n", vector);
-                        chan->vector = vector;
-                } else {
-                        chan->vector = vector;
-                }
-                if (trace & (TRACE_IRQ|TRACE_SIO))
-                        fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
-                                (int)(chan - sio), chan->vector);
-                if (chan == sio)
-                        live_irq = IRQ_SIOA;
-                else
-                        live_irq = IRQ_SIOB;
-                Z80INT(&cpu_z80, chan->vector);
-                return 1;
-        }
-        return 0;
-}
+	int	vector = sio_check_im2(sio, chan);
 
-
-/*
- *      The SIO replaces the last character in the FIFO on an
- *      overrun.
- */
-static void
-sio2_queue(struct z80_sio_chan *chan, uint8_t c)
-{
-	if (trace & TRACE_SIO)
-		fprintf(stderr, "SIO %d queue %d: ", (int) (chan - sio), c);
-	/* Receive disabled */
-	if (!(chan->wr[3] & 1)) {
-		fprintf(stderr, "RX disabled.\n");
-		return;
-	}
-	/* Overrun */
-	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Overrun.\n");
-		chan->data[2] = c;
-		chan->rr[1] |= 0x20;    /* Overrun flagged */
-		/* What are the rules for overrun delivery FIXME */
-		sio2_raise_int(chan, INT_ERR);
-	} else {
-		/* FIFO add */
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Queued %d (mode %d)\n", chan->dptr, chan->wr[1] & 0x18);
-		chan->data[chan->dptr++] = c;
-		chan->rr[0] |= 1;
-		switch (chan->wr[1] & 0x18) {
-			case 0x00:
-				break;
-			case 0x08:
-				if (chan->dptr == 1)
-					sio2_raise_int(chan, INT_RX);
-				break;
-			case 0x10:
-			case 0x18:
-				sio2_raise_int(chan, INT_RX);
-				break;
-		}
-	}
-	/* Need to deal with interrupt results */
-}
-
-
-static void
-sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
-{
-        if (ab == 0) {
-                int c = check_chario();
-
-                if (sio2_input) {
-                        if (c & 1)
-                                sio2_queue(chan, next_char());
-                }
-                if (c & 2) {
-                        if (!(chan->rr[0] & 0x04)) {
-                                chan->rr[0] |= 0x04;
-                                if (chan->wr[1] & 0x02)
-                                        sio2_raise_int(chan, INT_TX);
-                        }
-                }
-        } else {
-                if (!(chan->rr[0] & 0x04)) {
-                        chan->rr[0] |= 0x04;
-                        if (chan->wr[1] & 0x02)
-                                sio2_raise_int(chan, INT_TX);
-                }
-        }
-}
-
-
-static void
-sio2_timer(void)
-{
-        sio2_channel_timer(sio, 0);
-        sio2_channel_timer(sio + 1, 1);
-}
-
-
-static void
-sio2_channel_reset(struct z80_sio_chan *chan)
-{
-	chan->rr[0] = 0x2C;
-	chan->rr[1] = 0x01;
-	chan->rr[2] = 0;
-	sio2_clear_int(chan, INT_RX | INT_TX | INT_ERR);
-}
-
-
-static void
-sio_reset(void)
-{
-        sio2_channel_reset(sio);
-        sio2_channel_reset(sio + 1);
-}
-
-
-static uint8_t
-sio2_read(uint16_t addr)
-{
-        struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
-
-        if (!(addr & 1)) {
-                /* Control */
-                uint8_t r = chan->wr[0] & 007;
-                chan->wr[0] &= ~007;
-
-                chan->rr[0] &= ~2;
-                if (chan == sio && (sio[0].intbits | sio[1].intbits))
-                        chan->rr[0] |= 2;
-                if (trace & TRACE_SIO)
-                        fprintf(stderr, "sio%c read reg %d = ", (addr & 2) ? 'b' : 'a', r);
-                switch (r) {
-                case 0:
-                case 1:
-                        if (trace & TRACE_SIO)
-                                fprintf(stderr, "%02X\n", chan->rr[r]);
-                        return chan->rr[r];
-                case 2:
-                        if (chan != sio) {
-                                if (trace & TRACE_SIO)
-                                        fprintf(stderr, "%02X\n", chan->rr[2]);
-                                return chan->rr[2];
-                        }
-                case 3:
-                       /* What does the hw report ?? */
-                        fprintf(stderr, "INVALID(0xFF)\n");
-                        return 0xFF;
-                }
-        } else {
-                /* FIXME: irq handling */
-                uint8_t c = chan->data[0];
-                chan->data[0] = chan->data[1];
-                chan->data[1] = chan->data[2];
-                if (chan->dptr)
-                        chan->dptr--;
-                if (chan->dptr == 0)
-                        chan->rr[0] &= 0xFE;    /* Clear RX pending */
-                sio2_clear_int(chan, INT_RX);
-                chan->rr[0] &= 0x3F;
-                chan->rr[1] &= 0x3F;
-                if (trace & TRACE_SIO)
-                        fprintf(stderr, "sio%c read data %d\n", (addr & 2) ? 'b' : 'a', c);
-                if (chan->dptr && (chan->wr[1] & 0x10))
-                        sio2_raise_int(chan, INT_RX);
-                return c;
-        }
-        return 0xFF;
-}
-
-
-static void
-sio2_write(uint16_t addr, uint8_t val)
-{
-        struct z80_sio_chan	*chan = (addr & 2) ? sio + 1 : sio;
-        uint8_t			 r;
-
-        if (!(addr & 1)) {
-                if (trace & TRACE_SIO)
-                        fprintf(stderr, "sio%c write reg %d with %02X\n", (addr & 2) ? 'b' : 'a', chan->wr[0] & 7, val);
-                switch (chan->wr[0] & 007) {
-                case 0:
-                        chan->wr[0] = val;
-                       /* FIXME: CRC reset bits ? */
-                        switch (val & 070) {
-                        case 000:       /* NULL */
-                                break;
-                        case 010:       /* Send Abort SDLC */
-                                /* SDLC specific no-op for async */
-                                break;
-                        case 020:       /* Reset external/status interrupts */
-                                sio2_clear_int(chan, INT_ERR);
-                                chan->rr[1] &= 0xCF;    /* Clear status bits on rr0 */
-                                break;
-                        case 030:       /* Channel reset */
-                                if (trace & TRACE_SIO)
-                                        fprintf(stderr, "[channel reset]\n");
-                                sio2_channel_reset(chan);
-                                break;
-                        case 040:       /* Enable interrupt on next rx */
-                                chan->rxint = 1;
-                                break;
-                        case 050:       /* Reset transmitter interrupt pending */
-                                chan->txint = 0;
-                                sio2_clear_int(chan, INT_TX);
-                                break;
-                        case 060:       /* Reset the error latches */
-                                chan->rr[1] &= 0x8F;
-                                break;
-                        case 070:       /* Return from interrupt (channel A) */
-                                if (chan == sio) {
-                                        sio->irq = 0;
-                                        sio->rr[1] &= ~0x02;
-                                        sio2_clear_int(sio, INT_RX | INT_TX | INT_ERR);
-                                        sio2_clear_int(sio + 1, INT_RX | INT_TX | INT_ERR);
-                                }
-                                break;
-                        }
-                       break;
-                case 1:
-                case 2:
-                case 3:
-                case 4:
-                case 5:
-                case 6:
-                case 7:
-                        r = chan->wr[0] & 7;
-                        if (trace & TRACE_SIO)
-                                fprintf(stderr, "sio%c: wrote r%d to %02X\n",
-                                        (addr & 2) ? 'b' : 'a', r, val);
-                        chan->wr[r] = val;
-                        if (chan != sio && r == 2)
-                                chan->rr[2] = val;
-                        chan->wr[0] &= ~007;
-                        break;
-                }
-                /* Control */
-        } else {
-                /* Strictly we should emulate this as two bytes, one going out and
-                   the visible queue - FIXME */
-                /* FIXME: irq handling */
-                chan->rr[0] &= ~(1 << 2);       /* Transmit buffer no longer empty */
-                chan->txint = 1;
-                /* Should check chan->wr[5] & 8 */
-                sio2_clear_int(chan, INT_TX);
-                if (trace & TRACE_SIO)
-                        fprintf(stderr, "sio%c write data %d\n", (addr & 2) ? 'b' : 'a', val);
-                if (chan == sio)
-                       write(1, &val, 1);
-                else {
-//                      write(1, "\033[1m;", 5);
-                        write(1, &val,1);
-//                      write(1, "\033[0m;", 5);
-                }
-        }
+	if (vector < 0)
+		return 0;
+	live_irq = chan ? IRQ_SIOB : IRQ_SIOA;
+	Z80INT(&cpu_z80, vector);
+	return 1;
 }
 
 
@@ -544,7 +213,7 @@ io_read(int unused, uint16_t addr)
 			fprintf(stderr, " [SIO/2]: ");
 		}
 		/* return sio2_read(); */
-		v = sio2_read(addr & 3);
+		v = sio_read(sio, addr & 3);
 	}
 	else {
 		if (trace & TRACE_IO) {
@@ -573,7 +242,7 @@ io_write(int unused, uint16_t addr, uint8_t val)
 		if (trace & TRACE_IO) {
 			fprintf(stderr, "[SIO/2]");
 		}
-		sio2_write(addr & 3, val);
+		sio_write(sio, addr & 3, val);
 	}
 	else {
 		if (trace & TRACE_IO) {
@@ -599,8 +268,8 @@ poll_irq_event(void)
         }
 	 */
 
-	if (sio2_check_im2(sio) == 0) {
-		sio2_check_im2(sio + 1);
+	if (sio2_check_im2(0) == 0) {
+		sio2_check_im2(1);
 		
 	}
 }
@@ -614,10 +283,10 @@ reti_event(void)
 	if (has_im2) {
 		switch(live_irq) {
 		case IRQ_SIOA:
-			sio2_reti(sio);
+			sio_reti(sio, 0);
 			break;
 		case IRQ_SIOB:
-			sio2_reti(sio + 1);
+			sio_reti(sio, 1);
 			break;
 	/*
 	 * CTC isn't enabled on the KZ80 (yet!).
@@ -633,8 +302,8 @@ reti_event(void)
 		/* If IM2 is not wired then all the things respond at the same
 		   time. I think they can also fight over the vector but ignore
 		   that */
-		sio2_reti(sio);
-		sio2_reti(sio + 1);
+		sio_reti(sio, 0);
+		sio_reti(sio, 1);
 		/*
 		if (have_ctc) {
 			ctc_reti(0);
@@ -670,7 +339,7 @@ exit_cleanup(void)
 static void
 usage(void)
 {
-	fprintf(stderr, "kz80: [-r rompath] [-d tracemask]\n");
+	fprintf(stderr, "kz80: [-r rompath] [-T real|max] [-P port] [-d tracemask]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -682,8 +351,10 @@ main(int argc, char *argv[])
 	int			 opt;
 	int			 fd;
 	char			*rompath = "kz80.rom";
+	unsigned int		 baud = SERIAL_BAUD_DEFAULT;
+	char			*portspec = NULL;
 
-	while ((opt = getopt(argc, argv, "d:r:")) != -1) {
+	while ((opt = getopt(argc, argv, "d:r:T:P:")) != -1) {
 		switch (opt) {
 		case 'd':
 			trace = atoi(optarg);
@@ -691,6 +362,12 @@ main(int argc, char *argv[])
 		case 'r':
 			rompath = optarg;
 			break;
+		case 'T':
+			baud = serial_baud_mode(optarg);
+			break;
+		case 'P':
+			portspec = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -708,7 +385,13 @@ main(int argc, char *argv[])
 	}
 	close(fd);
 
-	sio_reset();
+	sio = sio_create();
+	if (trace & TRACE_SIO)
+		sio_trace(sio, 1);
+	sio_set_input(sio, 0, 1);
+	sio_set_baud(sio, 0, baud);
+	if (portspec)
+		sio_attach(sio, 1, serial_open(portspec));
 
 	/*
 	 * No real need for interrupt accuracy so just go with the
@@ -746,8 +429,10 @@ main(int argc, char *argv[])
                 /* 36400 T states for base KZ80 - varies for others */
                 for (i = 0; i < 100; i++) {
                         Z80ExecuteTStates(&cpu_z80, tstate_steps);
-			sio2_timer();
+			sio_timer(sio, 50000);
 		}
+		/* Console input and any attached port */
+		serial_poll();
 		nanosleep(&tc, NULL);
 
                 if (int_recalc) {
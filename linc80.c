@@ -8,13 +8,14 @@
  *	Zilog PIO at 0x18-0x1B					MINIMAL
  *	IDE at 0x10-0x17 no high or control access		DONE
  *	Control register at 0x38-0x3F				DONE
+ *	SD card on PIO port B bitbang				DONE
+ *	Byte wide SPI pseudo port at 0xFC (emulator only)	DONE
  *
  *	Additional optional peripherals (own and RC2014)	ABSENT
  *
  *	TODO:
  *	- debug interrupt blocking
  *	- Z80 PIO
- *	? SD card on Z80 PIO bitbang
  *
  *	Currently we model
  *
@@ -37,7 +38,11 @@
 #include <time.h>
 #include <unistd.h>
 #include "libz80/z80.h"
+#include "sio.h"
+#include "serial.h"
 #include "ide.h"
+#include "blkdev.h"
+#include "sdcard.h"
 
 static uint8_t rom[65536];
 static uint8_t ram[65536];	/* We never use the banked 16K */
@@ -153,12 +158,12 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
 		ram[addr] = val;
 }
 
-static void recalc_interrupts(void)
+void recalc_interrupts(void)
 {
 	int_recalc = 1;
 }
 
-static int check_chario(void)
+int check_chario(void)
 {
 	fd_set i, o;
 	struct timeval tv;
@@ -182,7 +187,7 @@ static int check_chario(void)
 	return r;
 }
 
-static unsigned int next_char(void)
+unsigned int next_char(void)
 {
 	char c;
 	if (read(0, &c, 1) != 1) {
@@ -194,330 +199,24 @@ static unsigned int next_char(void)
 	return c;
 }
 
-struct z80_sio_chan {
-	uint8_t wr[8];
-	uint8_t rr[3];
-	uint8_t data[3];
-	uint8_t dptr;
-	uint8_t irq;
-	uint8_t rxint;
-	uint8_t txint;
-	uint8_t intbits;
-#define INT_TX	1
-#define INT_RX	2
-#define INT_ERR	4
-	uint8_t pending;	/* Interrupt bits pending as an IRQ cause */
-	uint8_t vector;		/* Vector pending to deliver */
-};
-
-static struct z80_sio_chan sio[2];
-
-/*
- *	Interrupts
- */
-
-static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	chan->intbits &= ~m;
-	chan->pending &= ~m;
-
-	if (!(sio->intbits | sio[1].intbits)) {
-		sio->rr[1] &= ~0x02;
-		chan->irq = 0;
-	}
-}
-
-static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	uint8_t new = (chan->intbits ^ m) & m;
-	uint8_t vector;
-	chan->intbits |= m;
-	chan->pending |= new;
-	if (trace & TRACE_SIO)
-		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
-	if (chan->pending) {
-		if (!sio->irq) {
-			chan->irq = 1;
-			sio->rr[1] |= 0x02;
-			vector = 0;
-			/* This is a subset of the real options. FIXME: add
-			   external status change */
-			if (sio[1].wr[1] & 0x04) {
-				vector &= 0xF1;
-				if (chan == sio)
-					vector |= 1 << 3;
-				if (chan->intbits & INT_RX)
-					vector |= 4;
-				else if (chan->intbits & INT_ERR)
-					vector |= 2;
-			}
-			if (trace & (TRACE_SIO | TRACE_IRQ))
-				fprintf(stderr,
-					"SIO2 interrupt %02X\n", vector);
-			chan->vector = vector;
-			recalc_interrupts();
-		}
-	}
-}
-
-static void sio2_reti(struct z80_sio_chan *chan)
-{
-	if (chan->irq)
-		chan->irq = 0;
-	/* Recalculate the pending state and vectors */
-	sio2_raise_int(chan, 0);
-	if (trace & (TRACE_IRQ|TRACE_SIO))
-		fprintf(stderr, "Acked interrupt from SIO.\n");
-}
-
-static int sio2_check_im2(struct z80_sio_chan *chan)
-{
-	/* See if we have an IRQ pending and if so deliver it and return 1 */
-	if (chan->irq) {
-		/* FIXME: quick fix for now but the vector calculation should all be
-		   done here it seems */
-		if (sio[1].wr[1] & 0x04)
-			chan->vector += (sio[1].wr[2] & 0xF1);
-		else
-			chan->vector += sio[1].wr[2];
-		if (trace & (TRACE_IRQ|TRACE_SIO))
-			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
-				(int)(chan - sio), chan->vector);
-		if (chan == sio)
-			live_irq = IRQ_SIOA;
-		else
-			live_irq = IRQ_SIOB;
-		Z80INT(&cpu_z80, chan->vector);
-		return 1;
-	}
-	return 0;
-}
-
-/*
- *	The SIO replaces the last character in the FIFO on an
- *	overrun.
- */
-static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
-{
-	if (trace & TRACE_SIO)
-		fprintf(stderr, "SIO %d queue %d: ",
-			(int) (chan - sio), c);
-	/* Receive disabled */
-	if (!(chan->wr[3] & 1)) {
-		fprintf(stderr, "RX disabled.\n");
-		return;
-	}
-	/* Overrun */
-	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Overrun.\n");
-		chan->data[2] = c;
-		chan->rr[1] |= 0x20;	/* Overrun flagged */
-		/* What are the rules for overrun delivery FIXME */
-		sio2_raise_int(chan, INT_ERR);
-	} else {
-		/* FIFO add */
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Queued %d (mode %d)\n",
-				chan->dptr, chan->wr[1] & 0x18);
-		chan->data[chan->dptr++] = c;
-		chan->rr[0] |= 1;
-		switch (chan->wr[1] & 0x18) {
-		case 0x00:
-			break;
-		case 0x08:
-			if (chan->dptr == 1)
-				sio2_raise_int(chan, INT_RX);
-			break;
-		case 0x10:
-		case 0x18:
-			sio2_raise_int(chan, INT_RX);
-			break;
-		}
-	}
-	/* Need to deal with interrupt results */
-}
+static struct sio *sio;
 
-static void sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
+static int sio2_check_im2(unsigned int chan)
 {
-	/* The monitor comes up on the B channel so use B */
-	if (ab == 1) {
-		int c = check_chario();
-		if (c & 1)
-			sio2_queue(chan, next_char());
-		if (c & 2) {
-			if (!(chan->rr[0] & 0x04)) {
-				chan->rr[0] |= 0x04;
-				if (chan->wr[1] & 0x02)
-					sio2_raise_int(chan, INT_TX);
-			}
-		}
-	} else {
-		if (!(chan->rr[0] & 0x04)) {
-			chan->rr[0] |= 0x04;
-			if (chan->wr[1] & 0x02)
-				sio2_raise_int(chan, INT_TX);
-		}
-	}
+	int vector = sio_check_im2(sio, chan);
+	if (vector < 0)
+		return 0;
+	live_irq = chan ? IRQ_SIOB : IRQ_SIOA;
+	Z80INT(&cpu_z80, vector);
+	return 1;
 }
 
-static void sio2_timer(void)
+/* The channel is on A0 and control/data on A1 */
+static uint8_t sio_addr(uint16_t addr)
 {
-	sio2_channel_timer(sio, 0);
-	sio2_channel_timer(sio + 1, 1);
-}
-
-static void sio2_channel_reset(struct z80_sio_chan *chan)
-{
-	chan->rr[0] = 0x2C;
-	chan->rr[1] = 0x01;
-	chan->rr[2] = 0;
-	sio2_clear_int(chan, INT_RX | INT_TX | INT_ERR);
-}
-
-static void sio_reset(void)
-{
-	sio2_channel_reset(sio);
-	sio2_channel_reset(sio + 1);
-}
-
-static uint8_t sio2_read(uint16_t addr)
-{
-	struct z80_sio_chan *chan = (addr & 1) ? sio + 1 : sio;
-	if (addr & 2) {
-		/* Control */
-		uint8_t r = chan->wr[0] & 007;
-		chan->wr[0] &= ~007;
-
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read reg %d = ",
-				(addr & 1) ? 'b' : 'a', r);
-		switch (r) {
-		case 0:
-		case 1:
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "%02X\n", chan->rr[r]);
-			return chan->rr[r];
-		case 2:
-			if (chan != sio) {
-				if (trace & TRACE_SIO)
-					fprintf(stderr, "%02X\n",
-						chan->rr[2]);
-				return chan->rr[2];
-			}
-		case 3:
-			/* What does the hw report ?? */
-			fprintf(stderr, "INVALID(0xFF)\n");
-			return 0xFF;
-		}
-	} else {
-		/* FIXME: irq handling */
-		uint8_t c = chan->data[0];
-		chan->data[0] = chan->data[1];
-		chan->data[1] = chan->data[2];
-		if (chan->dptr)
-			chan->dptr--;
-		if (chan->dptr == 0)
-			chan->rr[0] &= 0xFE;	/* Clear RX pending */
-		sio2_clear_int(chan, INT_RX);
-		chan->rr[0] &= 0x3F;
-		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read data %d\n",
-				(addr & 1) ? 'b' : 'a', c);
-		if (chan->dptr && (chan->wr[1] & 0x10))
-			sio2_raise_int(chan, INT_RX);
-		return c;
-	}
-	return 0xFF;
+	return ((addr & 1) << 1) | !(addr & 2);
 }
 
-static void sio2_write(uint16_t addr, uint8_t val)
-{
-	struct z80_sio_chan *chan = (addr & 1) ? sio + 1 : sio;
-	uint8_t r;
-	if (addr & 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr,
-				"sio%c write reg %d with %02X\n",
-				(addr & 1) ? 'b' : 'a',
-				chan->wr[0] & 7, val);
-		switch (chan->wr[0] & 007) {
-		case 0:
-			chan->wr[0] = val;
-			/* FIXME: CRC reset bits ? */
-			switch (val & 070) {
-			case 000:	/* NULL */
-				break;
-			case 010:	/* Send Abort SDLC */
-				/* SDLC specific no-op for async */
-				break;
-			case 020:	/* Reset external/status interrupts */
-				sio2_clear_int(chan, INT_ERR);
-				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
-				break;
-			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
-					fprintf(stderr,
-						"[channel reset]\n");
-				sio2_channel_reset(chan);
-				break;
-			case 040:	/* Enable interrupt on next rx */
-				chan->rxint = 1;
-				break;
-			case 050:	/* Reset transmitter interrupt pending */
-				chan->txint = 0;
-				sio2_clear_int(chan, INT_TX);
-				break;
-			case 060:	/* Reset the error latches */
-				chan->rr[1] &= 0x8F;
-				break;
-			case 070:	/* Return from interrupt (channel A) */
-				if (chan == sio) {
-					sio->irq = 0;
-					sio->rr[1] &= ~0x02;
-					sio2_clear_int(sio,
-						       INT_RX |
-						       INT_TX | INT_ERR);
-					sio2_clear_int(sio + 1,
-						       INT_RX |
-						       INT_TX | INT_ERR);
-				}
-				break;
-			}
-			break;
-		case 1:
-		case 2:
-		case 3:
-		case 4:
-		case 5:
-		case 6:
-		case 7:
-			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
-					(addr & 2) ? 'b' : 'a', r, val);
-			chan->wr[r] = val;
-			if (chan != sio && r == 2)
-				chan->rr[2] = val;
-			chan->wr[0] &= ~007;
-			break;
-		}
-		/* Control */
-	} else {
-		/* Strictly we should emulate this as two bytes, one going out and
-		   the visible queue - FIXME */
-		/* FIXME: irq handling */
-		chan->rr[0] &= ~(1 << 2);	/* Transmit buffer no longer empty */
-		chan->txint = 1;
-		/* Should check chan->wr[5] & 8 */
-		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c write data %d\n",
-				(addr & 1) ? 'b' : 'a', val);
-		write(1, &val, 1);
-	}
-}
 
 static int ide = 0;
 struct ide_controller *ide0;
@@ -537,10 +236,12 @@ static void my_ide_write(uint16_t addr, uint8_t val)
  */
 
 struct z80_ctc {
-	uint16_t count;
+	uint32_t count;
 	uint16_t reload;
 	uint8_t vector;
 	uint8_t ctrl;
+	uint64_t when;		/* CTC clock count was last worked out */
+	uint64_t due;		/* CTC clock it next passes zero */
 #define CTC_IRQ		0x80
 #define CTC_COUNTER	0x40
 #define CTC_PRESCALER	0x20
@@ -552,9 +253,13 @@ struct z80_ctc {
 };
 
 #define CTC_STOPPED(c)	(((c)->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET))
+/* Count units per clock, the count is held scaled by 256 */
+#define CTC_SCALE(c)	(((c)->ctrl & CTC_PRESCALER) ? 1 : 16)
 
 struct z80_ctc ctc[4];
 uint8_t ctc_irqmask;
+static uint64_t ctc_now;	/* CTC clocks elapsed */
+static uint64_t ctc_next;	/* Earliest timer event */
 
 static void ctc_reset(struct z80_ctc *c)
 {
@@ -613,33 +318,80 @@ static int ctc_check_im2(void)
 }		
 
 /* Model the chains between the CTC devices */
-static void ctc_receive_pulse(int i);
+static void ctc_receive_pulses(int i, unsigned int n);
 
-static void ctc_pulse(int i)
+static void ctc_pulse(int i, unsigned int n)
 {
 	/* Model CTC 2 chained into CTC 3 */
 	if (i == 2)
-		ctc_receive_pulse(3);
+		ctc_receive_pulses(3, n);
 }
 
 /* We don't worry about edge directions just a logical pulse model */
-static void ctc_receive_pulse(int i)
+static void ctc_receive_pulses(int i, unsigned int n)
 {
 	struct z80_ctc *c = ctc + i;
-	if (c->ctrl & CTC_COUNTER) {
-		if (CTC_STOPPED(c))
-			return;
-		if (c->count >= 0x0100)
-			c->count -= 0x100;	/* No scaling on pulses */
-		if ((c->count & 0xFF00) == 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			c->count = c->reload << 8;
-		}
-	} else {
+	unsigned int count, period;
+
+	if (n == 0)
+		return;
+	if (!(c->ctrl & CTC_COUNTER)) {
 		if (c->ctrl & CTC_PULSE)
 			c->ctrl &= ~CTC_PULSE;
+		return;
+	}
+	if (CTC_STOPPED(c))
+		return;
+	/* Pulses until we next hit zero, then whole reload periods */
+	count = c->count >> 8;
+	if (count == 0)
+		count = 1;
+	if (n < count) {
+		c->count -= n << 8;
+		return;
+	}
+	n -= count;
+	period = c->reload ? c->reload : 256;
+	c->count = (period - n % period) << 8;
+	ctc_interrupt(c);
+	ctc_pulse(i, 1 + n / period);
+}
+
+/*
+ *	Timers are not stepped. Each one holds its count as of CTC clock
+ *	'when' and the clock at which it next passes zero, so that between
+ *	events a tick is just a compare and reads work the count out.
+ */
+static void ctc_catchup(struct z80_ctc *c)
+{
+	int64_t n;
+	unsigned int period, k;
+
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER)) {
+		c->when = ctc_now;
+		return;
+	}
+	n = (int64_t)c->count - (int64_t)(ctc_now - c->when) * CTC_SCALE(c);
+	c->when = ctc_now;
+	if (n >= 0) {
+		c->count = n;
+		return;
 	}
+	period = (c->reload ? c->reload : 256) << 8;
+	k = (-n + period - 1) / period;
+	c->count = n + (int64_t)k * period;
+	ctc_interrupt(c);
+	ctc_pulse(c - ctc, k);
+}
+
+static void ctc_schedule(struct z80_ctc *c)
+{
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER))
+		c->due = UINT64_MAX;
+	else
+		c->due = c->when + c->count / CTC_SCALE(c) + 1;
+	if (c->due < ctc_next)
+		ctc_next = c->due;
 }
 
 /* Model counters */
@@ -647,45 +399,29 @@ static void ctc_tick(unsigned int clocks)
 {
 	struct z80_ctc *c = ctc;
 	int i;
-	int n;
-	int decby;
 
+	ctc_now += clocks;
+	if (ctc_now < ctc_next)
+		return;
+	ctc_next = UINT64_MAX;
 	for (i = 0; i < 4; i++, c++) {
-		/* Waiting a value */
-		if (CTC_STOPPED(c))
-			continue;
-		/* Pulse trigger mode */
-		if (c->ctrl & CTC_COUNTER)
-			continue;
-		/* 256x downscaled */
-		decby = clocks;
-		/* 16x not 256x downscale - so increase by 16x */
-		if (!(c->ctrl & CTC_PRESCALER))
-			decby <<= 4;
-		/* Now iterate over the events. We need to deal with wraps
-		   because we might have something counters chained */
-		n = c->count - decby;
-		while (n < 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			if (c->reload == 0)
-				n += 256 << 8;
-			else
-				n += c->reload << 8;
-		}
-		c->count = n;
+		if (c->due <= ctc_now)
+			ctc_catchup(c);
+		ctc_schedule(c);
 	}
 }
 
 static void ctc_write(uint8_t channel, uint8_t val)
 {
 	struct z80_ctc *c = ctc + channel;
+	/* Bring the count up to date under the old settings */
+	ctc_catchup(c);
 	if (c->ctrl & CTC_TCONST) {
 		if (trace & TRACE_CTC)
 			fprintf(stderr, "CTC %d constant loaded with %02X\n", channel, val);
 		c->reload = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET)) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -698,7 +434,7 @@ static void ctc_write(uint8_t channel, uint8_t val)
 			fprintf(stderr, "CTC %d control loaded with %02X\n", channel, val);
 		c->ctrl = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == CTC_RESET) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -716,174 +452,23 @@ static void ctc_write(uint8_t channel, uint8_t val)
 			fprintf(stderr, "CTC %d vector loaded with %02X\n", channel, val);
 		c->vector = val;
 	}
+	ctc_schedule(c);
 }
 
 static uint8_t ctc_read(uint8_t channel)
 {
-	uint8_t val = ctc[channel].count >> 8;
+	struct z80_ctc *c = ctc + channel;
+	uint8_t val;
+
+	ctc_catchup(c);
+	ctc_schedule(c);
+	val = c->count >> 8;
 	if (trace & TRACE_CTC)
 		fprintf(stderr, "CTC %d reads %02x\n", channel, val);
 	return val;
 }
 
-static int sd_mode = 0;
-static int sd_cmdp = 0;
-static int sd_ext = 0;
-static uint8_t sd_cmd[6];
-static uint8_t sd_in[520];
-static int sd_inlen, sd_inp;
-static uint8_t sd_out[520];
-static int sd_outlen, sd_outp;
-static int sd_fd = -1;
-static off_t sd_lba;
-static int sd_stuff;
-static uint8_t sd_poststuff;
-static const uint8_t sd_csd[17] = {
-
-	0xFE,		/* Sync byte before CSD */
-	/* Taken from a Toshiba 64MB card c/o softgun */
-	0x00, 0x2D, 0x00, 0x32,
-	0x13, 0x59, 0x83, 0xB1,
-	0xF6, 0xD9, 0xCF, 0x80,
-	0x16, 0x40, 0x00, 0x00
-};
-
-static uint8_t sd_process_command(void)
-{
-	if (sd_ext) {
-		sd_ext = 0;
-		switch(sd_cmd[0]) {
-		default:
-			return 0xFF;
-		}
-	}
-	if (trace & TRACE_SD)
-		fprintf(stderr, "Command received %x\n", sd_cmd[0]);
-	sd_stuff = 1 + (rand() & 7);
-	switch(sd_cmd[0]) {
-	case 0x40+0:		/* CMD 0 */
-		return 0x01;	/* Just respond 0x01 */
-	case 0x40+1:		/* CMD 1 - leave idle */
-		return 0x00;	/* Immediately indicate we did */
-	case 0x40+9:		/* CMD 9 - read the CSD */
-		memcpy(sd_out,sd_csd, 17);
-		sd_outlen = 17;
-		sd_outp = 0;
-		sd_mode = 2;
-		return 0x00;
-	case 0x40+16:		/* CMD 16 - set block size */
-		/* Should check data is 512 !! FIXME */
-		return 0x00;	/* Sure */
-	case 0x40+17:		/* Read */
-		sd_outlen = 514;
-		sd_outp = 0;
-		/* Sync mark then data */
-		sd_out[0] = 0xFF;
-		sd_out[1] = 0xFE;
-		sd_lba = sd_cmd[4] + 256 * sd_cmd[3] + 65536 * sd_cmd[2] +
-			16777216 * sd_cmd[1];
-		if (trace & TRACE_SD)
-			fprintf(stderr, "Read LBA %lx\n", sd_lba);
-		if (lseek(sd_fd, sd_lba, SEEK_SET) < 0 || read(sd_fd, sd_out + 2, 512) != 512) {
-			if (trace & TRACE_SD)
-				fprintf(stderr, "Read LBA failed.\n");
-			return 0x01;
-		}
-		sd_mode = 2;
-		/* Result */
-		return 0x00;
-	case 0x40+24:		/* Write */
-		/* Will send us FE data FF FF */
-		if (trace & TRACE_SD)
-			fprintf(stderr, "Write LBA %lx\n", sd_lba);
-		sd_inlen = 514;	/* Data FF FF */
-		sd_lba = sd_cmd[4] + 256 * sd_cmd[3] + 65536 * sd_cmd[2] +
-			16777216 * sd_cmd[1];
-		sd_inp = 0;
-		sd_mode = 4;	/* Send a pad then go to mode 3 */
-		return 0x00;	/* The expected OK */
-	case 0x40+55:
-		sd_ext = 1;
-		return 0x01;
-	default:
-		return 0x7F;
-	}
-}
-
-static uint8_t sd_process_data(void)
-{
-	switch(sd_cmd[0]) {
-	case 0x40+24:		/* Write */
-		sd_mode = 0;
-		if (lseek(sd_fd, sd_lba, SEEK_SET) < 0 ||
-			write(sd_fd, sd_in, 512) != 512) {
-			if (trace & TRACE_SD)
-				fprintf(stderr, "Write failed.\n");
-			return 0x1E;	/* Need to look up real values */
-		}
-		return 0x05;	/* Indicate it worked */
-	default:
-		sd_mode = 0;
-		return 0xFF;
-	}
-}
-
-static uint8_t sd_card_byte(uint8_t in)
-{
-	/* No card present */
-	if (sd_fd == -1)
-		return 0xFF;
-
-	/* Stuffing on commands */
-	if (sd_stuff) {
-		if (--sd_stuff)
-			return 0xFF;
-		return sd_poststuff;
-	}
-
-	if (sd_mode == 0) {
-		if (in != 0xFF) {
-			sd_mode = 1;	/* Command wait */
-			sd_cmdp = 1;
-			sd_cmd[0] = in;
-		}
-		return 0xFF;
-	}
-	if (sd_mode == 1) {
-		sd_cmd[sd_cmdp++] = in;
-		if (sd_cmdp == 6) {	/* Command complete */
-			sd_cmdp = 0;
-			sd_mode = 0;
-			/* Queue byte and begin stuffing */
-			sd_poststuff = sd_process_command();
-			return 0xFF;
-		}
-		/* Keep talking */
-		return 0xFF;
-	}
-	/* Writing out the response */
-	if (sd_mode == 2) {
-		if (sd_outp + 1 == sd_outlen)
-			sd_mode = 0;
-		return sd_out[sd_outp++];
-	}
-	/* Commands that need input blocks first */
-	if (sd_mode == 3) {
-		sd_in[sd_inp++] = in;
-		if (sd_inp == sd_inlen)
-			return sd_process_data();
-		/* Keep sending */
-		return 0xFF;
-	}
-	/* Sync up before data flow starts */
-	if (sd_mode == 4) {
-		/* Sync */
-		if (in == 0xFE)
-			sd_mode = 3;
-		return 0xFF;
-	}
-	return 0xFF;
-}
+static struct sdcard *sdcard;
 
 struct z80_pio {
 	uint8_t data[2];
@@ -903,27 +488,31 @@ static struct z80_pio pio[1];
 
 static uint8_t spi_byte_sent(uint8_t val)
 {
-	uint8_t r = sd_card_byte(val);
+	uint8_t r = sdcard_byte(sdcard, val);
 	if (trace & TRACE_SPI)
 		fprintf(stderr,	"[SPI %02X:%02X]\n", val, r);
-	fflush(stdout);
 	return r;
 }
 
+static uint8_t spi_old = 0xFF;
+static uint8_t rxbits = 0xFF;
+
 static void bitbang_spi(uint8_t val)
 {
-	static uint8_t old = 0xFF;
 	static uint8_t bits;
 	static uint8_t bitct;
-	static uint8_t rxbits = 0xFF;
-	uint8_t delta = val ^ old;
-	old = val;
+	uint8_t delta = val ^ spi_old;
+	spi_old = val;
 
 	if (val & 0x08) {		/* CS high - deselected */
-		if ((trace & TRACE_SPI) && (delta & 0x08))
-			fprintf(stderr,	"[Raised \\CS]\n");
-		bits = 0;
-		sd_mode = 0;	/* FIXME: layering */
+		if (delta & 0x08) {
+			if (trace & TRACE_SPI)
+				fprintf(stderr,	"[Raised \\CS]\n");
+			bits = 0;
+			bitct = 0;
+			rxbits = 0xFF;
+			sdcard_select(sdcard, 0);
+		}
 		return;
 	}
 	if ((trace & TRACE_SPI) && (delta & 0x08))
@@ -1108,13 +697,16 @@ static uint8_t io_read(int unused, uint16_t addr)
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x07)
-		return sio2_read(addr & 3);
+		return sio_read(sio, sio_addr(addr));
 	if (addr >= 0x08 && addr <= 0x0F)
 		return ctc_read(addr & 3);
 	if (addr >= 0x10 && addr <= 0x17)
 		return my_ide_read(addr & 7);
 	if (addr >= 0x18 && addr <= 0x1F)
 		return pio_read(addr & 3);
+	/* Byte wide SPI, chip select stays on the PIO */
+	if (addr == 0xFC)
+		return (spi_old & 0x08) ? 0xFF : sdcard_spi_port(sdcard, 0xFF);
 	if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
@@ -1126,7 +718,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x07)
-		sio2_write(addr & 3, val);
+		sio_write(sio, sio_addr(addr), val);
 	else if (addr >= 0x08 && addr <= 0x0B)
 		ctc_write(addr & 3, val);
 	else if (addr >= 0x10 && addr <= 0x17)
@@ -1135,6 +727,10 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 		pio_write(addr & 3, val);
 	else if (addr >= 0x38 && addr <= 0x3F)
 		memory_control(val);
+	else if (addr == 0xFC) {
+		if (!(spi_old & 0x08))
+			sdcard_spi_port(sdcard, val);
+	}
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
@@ -1152,10 +748,10 @@ static void reti_event(void)
 {
 	switch(live_irq) {
 	case IRQ_SIOA:
-		sio2_reti(sio);
+		sio_reti(sio, 0);
 		break;
 	case IRQ_SIOB:
-		sio2_reti(sio + 1);
+		sio_reti(sio, 1);
 		break;
 	case IRQ_CTC:
 	case IRQ_CTC + 1:
@@ -1173,7 +769,7 @@ static void reti_event(void)
 	live_irq = 0;
 
 	/* See who delivers next */
-	!intdis && !sio2_check_im2(sio) && !sio2_check_im2(sio + 1)
+	!intdis && !sio2_check_im2(0) && !sio2_check_im2(1)
 		&& !ctc_check_im2();
 
 	/* If nothing is pending we end up here and we continue with live_irq
@@ -1197,7 +793,7 @@ static void exit_cleanup(void)
 static void usage(void)
 {
 	fprintf(stderr,
-		"linc80: [-x] [-f] [-b banks] [-r rompath] [-i idepath] [-s sdcard] [-d debug]\n");
+		"linc80: [-x] [-f] [-b banks] [-r rompath] [-i idepath] [-s sdcard] [-T real|max] [-P port] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -1210,8 +806,10 @@ int main(int argc, char *argv[])
 	char *idepath = "linc80.ide";
 	char *sdpath = NULL;
 	int banks = 1;
+	unsigned int baud = SERIAL_BAUD_DEFAULT;
+	char *portspec = NULL;
 
-	while ((opt = getopt(argc, argv, "r:i:d:fxb:s:")) != -1) {
+	while ((opt = getopt(argc, argv, "r:i:d:fxb:s:T:P:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -1236,6 +834,12 @@ int main(int argc, char *argv[])
 		case 'b':
 			banks = atoi(optarg);
 			break;
+		case 'T':
+			baud = serial_baud_mode(optarg);
+			break;
+		case 'P':
+			portspec = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -1285,15 +889,28 @@ int main(int argc, char *argv[])
 			exit(1);
 	}
 
+	sdcard = sdcard_create();
+	/* Delay responses by a random few bytes as real cards do */
+	sdcard_set_ncr(sdcard, 1);
+	if (trace & TRACE_SD)
+		sdcard_trace(sdcard, 1);
 	if (sdpath) {
-		sd_fd = open(sdpath, O_RDWR);
+		int sd_fd = open(sdpath, O_RDWR);
 		if (sd_fd == -1) {
 			perror(sdpath);
 			exit(1);
 		}
+		sdcard_attach(sdcard, blkdev_open(sd_fd, 0));
 	}
 
-	sio_reset();
+	sio = sio_create();
+	if (trace & TRACE_SIO)
+		sio_trace(sio, 1);
+	/* The monitor comes up on the B channel so use B */
+	sio_set_input(sio, 1, 1);
+	sio_set_baud(sio, 1, baud);
+	if (portspec)
+		sio_attach(sio, 0, serial_open(portspec));
 	ctc_init();
 	pio_reset();
 
@@ -1336,9 +953,11 @@ int main(int argc, char *argv[])
 		/* 36400 T states */
 		for (i = 0; i < 100; i++) {
 			Z80ExecuteTStates(&cpu_z80, 369);
-			sio2_timer();
+			sio_timer(sio, 50000);
 			ctc_tick(364);
 		}
+		/* Console input and any attached port */
+		serial_poll();
 		/* Do 5ms of I/O and delays */
 		if (!fast)
 			nanosleep(&tc, NULL);
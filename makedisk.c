@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "ide.h"
@@ -7,13 +8,24 @@
 int main(int argc, const char *argv[])
 {
   int t, fd;
+  int sparse = 0;
+  const char *name = argv[0];
+
+  if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+    sparse = 1;
+    argv++;
+    argc--;
+  }
   if (argc != 3) {
-    fprintf(stderr, "%s [type] [path]\n", argv[0]);
+    fprintf(stderr, "%s [-s] [type] [path]\n", name);
+    fprintf(stderr, "  -s  sparse, unwritten sectors read as E5. Copy it with\n"
+                    "      cp --sparse=always, a plain copy turns the holes into\n"
+                    "      zeros and the emulators will refuse the image.\n");
     exit(1);
   }
   t = atoi(argv[1]);
   if (t < 1 || t > MAX_DRIVE_TYPE) {
-    fprintf(stderr, "%s: unknown drive type.\n", argv[0]);
+    fprintf(stderr, "%s: unknown drive type.\n", name);
     exit(1);
   }
   fd = open(argv[2], O_WRONLY|O_TRUNC|O_CREAT|O_EXCL, 0666);
@@ -21,7 +33,7 @@ int main(int argc, const char *argv[])
     perror(argv[2]);
     exit(1);
   }
-  if (ide_make_drive(t, fd) < 0) {
+  if ((sparse ? ide_make_sparse_drive(t, fd) : ide_make_drive(t, fd)) < 0) {
     perror(argv[2]);
     exit(1);
   }
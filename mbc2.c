@@ -22,6 +22,8 @@
 #include <time.h>
 #include <unistd.h>
 #include "libz80/z80.h"
+#include "blkdev.h"
+#include "vclock.h"
 
 static uint8_t ram[131072];
 
@@ -34,7 +36,10 @@ static uint16_t ios_track;
 static uint8_t ios_sector;
 static uint8_t ios_error;
 static uint8_t ios_sysflag = 2;	/* RTC */
-static int ios_fd;
+static struct blkdev *ios_blk;
+static struct blkdev *ios_disks[100];	/* Whole disk set, opened at start */
+static unsigned int blkflags;
+static off_t ios_block;
 static uint8_t ios_cmd;
 static int ios_dptr;
 static int ios_data;
@@ -142,16 +147,8 @@ static uint8_t ios_rx_char(void)
 
 static void ios_rtc_load(void)
 {
-	struct tm *tm;
-	time_t t;
+	const struct tm *tm = vclock_tm(0);
 
-	time(&t);
-	tm = gmtime(&t);
-
-	if (tm == NULL) {
-		fprintf(stderr, "mbc2: unable to get time.\n");
-		exit(1);
-	}
 	ios_buf[0] = tm->tm_sec;
 	ios_buf[1] = tm->tm_min;
 	ios_buf[2] = tm->tm_hour;
@@ -161,42 +158,50 @@ static void ios_rtc_load(void)
 	ios_buf[6] = (uint8_t)-40;	/* Silly value for temperature */
 }
 
-static void ios_open(void)
+/*
+ *	Open every disk in the set once so that selecting a disk is just a
+ *	pointer change and each keeps its own block cache. Drive to drive
+ *	copies would otherwise reopen an image for every sector.
+ */
+static void ios_open_set(void)
 {
 	char buf[32];
+	int fd;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		snprintf(buf, 32, "DS%dN%02d.DSK", diskset, i);
+		fd = open(buf, O_RDWR);
+		if (fd != -1)
+			ios_disks[i] = blkdev_open(fd, blkflags);
+		if ((trace & TRACE_DISK) && fd != -1)
+			fprintf(stderr, "IOS: Opened %s.\n", buf);
+	}
+}
 
+static void ios_open(void)
+{
 	if (trace & TRACE_DISK)
 		fprintf(stderr, "IOS: Open disk %d.\n", ios_disk);
 	if (ios_disk > 99) {
 		ios_error = 16;
 		return;
 	}
-	snprintf(buf, 32, "DS%dN%02d.DSK", diskset, ios_disk);
-	if (ios_fd)
-		close(ios_fd);
-	ios_fd = open(buf, O_RDWR);
-	if (ios_fd == -1)
+	ios_blk = ios_disks[ios_disk];
+	if (ios_blk == NULL)
 		ios_error = 3;
-	if (trace & TRACE_DISK)
-		fprintf(stderr, "IOS: Open %d result %d.\n", ios_disk, ios_fd);
 }
 
 static int ios_seek(void)
 {
-	off_t offset;
-
 	if (trace & TRACE_DISK)
-		fprintf(stderr, "IOS: Seek %d %d %d.\n", ios_fd, ios_track, ios_sector);
+		fprintf(stderr, "IOS: Seek %d %d %d.\n", ios_disk, ios_track, ios_sector);
 
-	if (ios_fd == -1 || ios_sector > 31 || ios_track > 511) {
+	if (ios_blk == NULL || ios_sector > 31 || ios_track > 511) {
 		ios_error = 18;
 		return -1;
 	}
-	offset = (ios_track * 32 + ios_sector) * 512;
-	if (lseek(ios_fd, offset, SEEK_SET) == -1) {
-		ios_error =  19;
-		return -1;
-	}
+	ios_block = ios_track * 32 + ios_sector;
 	return 0;
 }
 
@@ -206,8 +211,8 @@ static void ios_read_sector(void)
 		return;
 	if (trace & TRACE_DISK)
 		fprintf(stderr, "IOS: Read.\n");
-	if (read(ios_fd, ios_buf, 512) != 512)
-		ios_error = 19; 
+	if (blkdev_read(ios_blk, ios_block, ios_buf) < 0)
+		ios_error = 19;
 }
 
 static void ios_write_sector(void)
@@ -216,8 +221,8 @@ static void ios_write_sector(void)
 		return;
 	if (trace & TRACE_DISK)
 		fprintf(stderr, "IOS: Write.\n");
-	if (write(ios_fd, ios_buf, 512) != 512)
-		ios_error = 19; 
+	if (blkdev_write(ios_blk, ios_block, ios_buf) < 0)
+		ios_error = 19;
 }
 
 static void ios_op(uint8_t val)
@@ -382,7 +387,7 @@ static struct termios saved_term, term;
 static void cleanup(int sig)
 {
 	tcsetattr(0, TCSADRAIN, &saved_term);
-	exit(1);
+	done = 1;
 }
 
 static void exit_cleanup(void)
@@ -392,7 +397,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "mbc2: [-f] [-i] [-s diskset] [-d debug] [-b image] [-a addr]\n");
+	fprintf(stderr, "mbc2: [-C clock] [-f] [-i] [-s diskset] [-W] [-d debug] [-b image] [-a addr]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -400,14 +405,14 @@ int main(int argc, char *argv[])
 {
 	static struct timespec tc;
 	int opt;
-	int diskset;
 	int fd;
 	int l;
 	int fast;
+	int synctick = 0;
 	char *image = "fuzix.bin";
 	uint16_t addr = 0x0000;
 
-	while ((opt = getopt(argc, argv, "d:s:ib:a:f")) != -1) {
+	while ((opt = getopt(argc, argv, "C:d:s:ib:a:fW")) != -1) {
 		switch (opt) {
 		case 's':
 			diskset = atoi(optarg);
@@ -426,6 +431,13 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'W':
+			blkflags |= BLKDEV_WRITEBACK;
+			break;
+		case 'C':
+			if (vclock_option(optarg))
+				usage();
+			break;
 		case 'a':
 			addr = atoi(optarg);
 			break;
@@ -454,11 +466,16 @@ int main(int argc, char *argv[])
 	}
 	printf("Loaded %d bytes at %04X.\n", l, addr);
 
+	ios_open_set();
+
 	/* 5ms - it's a balance between nice behaviour and simulation
 	   smoothness */
 	tc.tv_sec = 0;
 	tc.tv_nsec = 5000000L;
 
+	/* Make sure a write back disk cache is flushed if we are killed */
+	signal(SIGTERM, cleanup);
+
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -495,6 +512,7 @@ int main(int argc, char *argv[])
 			}
 			if (int_on && (check_chario() & 1))
 				Z80INT(&cpu_z80, 0xFF);
+			vclock_tick(tc.tv_nsec);
 			/* Do 5ms of I/O and delays */
 			if (!fast)
 				nanosleep(&tc, NULL);
@@ -502,6 +520,11 @@ int main(int argc, char *argv[])
 		ios_timer_expired = 1;
 		if (int_on)
 			Z80INT(&cpu_z80, 0xFF);
+		/* Write back dirty disk blocks about once a second */
+		if ((blkflags & BLKDEV_WRITEBACK) && ++synctick == 20) {
+			blkdev_sync_all();
+			synctick = 0;
+		}
 	}
 	exit(0);
 }
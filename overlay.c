@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "blkdev.h"
+
+/*
+ *	Manage copy on write overlays of disk images
+ *
+ *	overlay create base delta	make an empty overlay of base
+ *	overlay commit delta		write the changes into the base
+ *	overlay discard delta		throw the changes away
+ */
+
+static uint32_t le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int load_header(const char *path, int fd, struct blkdev_overlay *h)
+{
+  if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+      memcmp(h->magic, BLKDEV_OVERLAY_MAGIC, 8)) {
+    fprintf(stderr, "%s: not an overlay.\n", path);
+    return -1;
+  }
+  h->base[sizeof(h->base) - 1] = 0;
+  return 0;
+}
+
+static int commit(const char *path, int fd, struct blkdev_overlay *h)
+{
+  uint32_t blocks = le32(h->blocks);
+  uint32_t mapblocks = le32(h->mapblocks);
+  uint8_t buf[BLKDEV_BLOCK];
+  uint8_t *map;
+  uint32_t i;
+  int bfd;
+
+  bfd = open(h->base, O_RDWR);
+  if (bfd == -1) {
+    perror(h->base);
+    return -1;
+  }
+  /* Packed images are archives, unpack them first */
+  if (pread(bfd, buf, 8, 0) == 8 && memcmp(buf, BLKDEV_PACK_MAGIC, 8) == 0) {
+    fprintf(stderr, "%s: cannot commit to a packed image.\n", h->base);
+    return -1;
+  }
+  map = malloc(mapblocks * BLKDEV_BLOCK);
+  if (map == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  if (pread(fd, map, mapblocks * BLKDEV_BLOCK, BLKDEV_BLOCK) !=
+      mapblocks * BLKDEV_BLOCK) {
+    perror(path);
+    return -1;
+  }
+  for (i = 0; i < blocks; i++) {
+    if (!(map[i >> 3] & (1 << (i & 7))))
+      continue;
+    if (pread(fd, buf, BLKDEV_BLOCK,
+        ((off_t)1 + mapblocks + i) * BLKDEV_BLOCK) != BLKDEV_BLOCK) {
+      perror(path);
+      return -1;
+    }
+    if (pwrite(bfd, buf, BLKDEV_BLOCK, (off_t)i * BLKDEV_BLOCK) != BLKDEV_BLOCK) {
+      perror(h->base);
+      return -1;
+    }
+  }
+  free(map);
+  if (close(bfd) == -1) {
+    perror(h->base);
+    return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *p)
+{
+  fprintf(stderr, "%s create [base] [delta]\n", p);
+  fprintf(stderr, "%s commit [delta]\n", p);
+  fprintf(stderr, "%s discard [delta]\n", p);
+  exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+  struct blkdev_overlay h;
+  const char *path;
+  int fd;
+
+  if (argc == 4 && strcmp(argv[1], "create") == 0) {
+    path = argv[3];
+    fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0666);
+    if (fd == -1) {
+      perror(path);
+      exit(1);
+    }
+    if (blkdev_overlay_create(argv[2], fd) < 0) {
+      perror(argv[2]);
+      exit(1);
+    }
+    return 0;
+  }
+  if (argc != 3)
+    usage(argv[0]);
+
+  path = argv[2];
+  fd = open(path, O_RDWR);
+  if (fd == -1) {
+    perror(path);
+    exit(1);
+  }
+  if (load_header(path, fd, &h) < 0)
+    exit(1);
+  if (strcmp(argv[1], "commit") == 0) {
+    if (commit(path, fd, &h) < 0)
+      exit(1);
+  } else if (strcmp(argv[1], "discard"))
+    usage(argv[0]);
+  /* Committed or discarded, either way start a clean overlay */
+  if (blkdev_overlay_create(h.base, fd) < 0) {
+    perror(h.base);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "blkdev.h"
+#include "ide.h"
+
+/*
+ *	Convert disk images to and from the compressed archive format
+ *
+ *	packdisk image packed		compress an image
+ *	packdisk -d packed image	expand it again
+ *
+ *	Packed images can be used directly or as the base of an overlay.
+ */
+
+#define CHUNK_BLOCKS	128		/* 64K chunks */
+
+static void putle32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void putle64(uint8_t *p, uint64_t v)
+{
+  putle32(p, v);
+  putle32(p + 4, v >> 32);
+}
+
+static uint8_t *literals(uint8_t *op, const uint8_t *lit, unsigned int len)
+{
+  if (len) {
+    *op++ = len - 1;
+    memcpy(op, lit, len);
+    op += len;
+  }
+  return op;
+}
+
+/* PackBits: n < 128 is n + 1 literals, n > 128 is 257 - n repeats */
+static unsigned int packbits(const uint8_t *in, unsigned int len, uint8_t *out)
+{
+  const uint8_t *ie = in + len;
+  const uint8_t *lit = in;
+  uint8_t *op = out;
+  unsigned int n;
+
+  while (in < ie) {
+    n = 1;
+    while (in + n < ie && n < 128 && in[n] == *in)
+      n++;
+    if (n >= 3) {
+      op = literals(op, lit, in - lit);
+      *op++ = 257 - n;
+      *op++ = *in;
+      in += n;
+      lit = in;
+    } else if (++in - lit == 128) {
+      op = literals(op, lit, 128);
+      lit = in;
+    }
+  }
+  return literals(op, lit, in - lit) - out;
+}
+
+static struct blkdev *open_image(const char *path)
+{
+  struct blkdev *b;
+  uint8_t buf[BLKDEV_BLOCK];
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) {
+    perror(path);
+    exit(1);
+  }
+  b = blkdev_open(fd, 0);
+  /* Sparse IDE images must be packed with their holes filled */
+  if (blkdev_read(b, 0, buf) == 0 && memcmp(buf, ide_magic, 8) == 0 &&
+      (buf[IDE_HDR_FLAGS] & IDE_FLAG_FILL) &&
+      blkdev_set_fill(b, buf[IDE_HDR_FILLBYTE]) < 0) {
+    fprintf(stderr, "%s: sparse image but the host reports no holes.\n", path);
+    exit(1);
+  }
+  return b;
+}
+
+static int pack(struct blkdev *b, int fd)
+{
+  struct blkdev_pack h;
+  off_t blocks = blkdev_blocks(b);
+  uint32_t nchunks = (blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+  uint8_t *index, *data, *cbuf;
+  off_t pos, blk;
+  unsigned int i, n, len;
+
+  if (blocks <= 0 || blocks > 0xFFFFFFFFUL) {
+    fprintf(stderr, "packdisk: unsupported image size.\n");
+    return -1;
+  }
+  index = calloc(nchunks + 1, 8);
+  data = malloc(CHUNK_BLOCKS * BLKDEV_BLOCK);
+  /* PackBits can grow the data by 1 in 128 */
+  cbuf = malloc(CHUNK_BLOCKS * BLKDEV_BLOCK * 2);
+  if (index == NULL || data == NULL || cbuf == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BLKDEV_PACK_MAGIC, 8);
+  putle32(h.blocks, blocks);
+  putle32(h.chunkblocks, CHUNK_BLOCKS);
+  putle32(h.nchunks, nchunks);
+
+  pos = sizeof(h) + (nchunks + 1) * 8;
+  for (i = 0; i < nchunks; i++) {
+    blk = (off_t)i * CHUNK_BLOCKS;
+    n = CHUNK_BLOCKS;
+    if (blk + n > blocks)
+      n = blocks - blk;
+    for (len = 0; len < n; len++) {
+      if (blkdev_read(b, blk + len, data + len * BLKDEV_BLOCK) < 0) {
+        perror("packdisk");
+        return -1;
+      }
+    }
+    putle64(index + 8 * i, pos);
+    len = packbits(data, n * BLKDEV_BLOCK, cbuf);
+    /* Store it as is if packing didn't help */
+    if (len >= n * BLKDEV_BLOCK) {
+      len = n * BLKDEV_BLOCK;
+      memcpy(cbuf, data, len);
+    }
+    if (pwrite(fd, cbuf, len, pos) != len) {
+      perror("packdisk");
+      return -1;
+    }
+    pos += len;
+  }
+  putle64(index + 8 * nchunks, pos);
+  if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+      pwrite(fd, index, (nchunks + 1) * 8, sizeof(h)) != (nchunks + 1) * 8) {
+    perror("packdisk");
+    return -1;
+  }
+  free(cbuf);
+  free(data);
+  free(index);
+  return 0;
+}
+
+static int unpack(struct blkdev *b, int fd)
+{
+  uint8_t buf[BLKDEV_BLOCK];
+  off_t blocks = blkdev_blocks(b);
+  off_t i;
+
+  for (i = 0; i < blocks; i++) {
+    if (blkdev_read(b, i, buf) < 0 ||
+        pwrite(fd, buf, BLKDEV_BLOCK, i * BLKDEV_BLOCK) != BLKDEV_BLOCK) {
+      perror("packdisk");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+  struct blkdev *b;
+  const char *name = argv[0];
+  int expand = 0;
+  int fd;
+
+  if (argc == 4 && strcmp(argv[1], "-d") == 0) {
+    expand = 1;
+    argv++;
+    argc--;
+  }
+  if (argc != 3) {
+    fprintf(stderr, "%s [-d] [from] [to]\n", name);
+    exit(1);
+  }
+  b = open_image(argv[1]);
+  fd = open(argv[2], O_WRONLY|O_TRUNC|O_CREAT|O_EXCL, 0666);
+  if (fd == -1) {
+    perror(argv[2]);
+    exit(1);
+  }
+  if ((expand ? unpack(b, fd) : pack(b, fd)) < 0) {
+    unlink(argv[2]);
+    exit(1);
+  }
+  return 0;
+}
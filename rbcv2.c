@@ -21,10 +21,13 @@
  *	Whine/break on invalid PPIDE sequences to help debug code
  *	Memory jumpers (is it really 16/48 or 48/16 ?)
  *	Z80 CTC card (ECB)
- *	4UART needs connecting to something as does uart0 when in PropIO
+ *	uart0 needs connecting to something when in PropIO
  *	SCG would be fun but major work (does provide vblank though)
  *
  *	Fix usage!
+ *
+ *	-P attaches the 4UART ports in turn to a host serial port (see
+ *	serial.h).
  */
 
 #include <stdio.h>
@@ -40,7 +43,12 @@
 #include <sys/mman.h>
 #include "libz80/z80.h"
 #include "ide.h"
+#include "uart16x50.h"
+#include "serial.h"
+#include "blkdev.h"
 #include "w5100.h"
+#include "vnet.h"
+#include "vclock.h"
 
 #define HIRAM	63
 
@@ -114,7 +122,7 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
             (rombank & 0x1F), addr);
 }
 
-static int check_chario(void)
+int check_chario(void)
 {
     fd_set i, o;
     struct timeval tv;
@@ -138,7 +146,7 @@ static int check_chario(void)
     return r;
 }
 
-static unsigned int next_char(void)
+unsigned int next_char(void)
 {
     char c;
     if (read(0, &c, 1) != 1) {
@@ -222,253 +230,21 @@ static uint8_t pio_read(uint8_t addr)
     return pioreg[addr];
 }
 
-/* UART: very mimimal for the moment */
-
-struct uart16x50 {
-    uint8_t ier;
-    uint8_t iir;
-    uint8_t fcr;
-    uint8_t lcr;
-    uint8_t mcr;
-    uint8_t lsr;
-    uint8_t msr;
-    uint8_t scratch;
-    uint8_t ls;
-    uint8_t ms;
-    uint8_t dlab;
-    uint8_t irq;
-#define RXDA	1
-#define TEMT	2
-#define MODEM	8
-    uint8_t irqline;
-};
-
-static struct uart16x50 uart[5];
-
-static void uart_init(struct uart16x50 *uptr)
+void recalc_interrupts(void)
 {
-    uptr->dlab = 0;
-}
-
-/* Compute the interrupt indicator register from what is pending */
-static void uart_recalc_iir(struct uart16x50 *uptr)
-{
-    if (uptr->irq & RXDA)
-        uptr->iir = 0x04;
-    else if (uptr->irq & TEMT)
-        uptr->iir = 0x02;
-    else if (uptr->irq & MODEM)
-        uptr->iir = 0x00;
-    else {
-        uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
-    uptr->irqline = uptr->irq;
     Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
-    
-}
-
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
-        return;
-    uptr->irq |= n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (!(uptr->irq & n))
-        return;
-    uptr->irq &= ~n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_event(struct uart16x50 *uptr)
-{
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-    if (r & 1)
-        uptr->lsr |= 0x01;	/* RX not empty */
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart_interrupt(uptr, TEMT);
-}
-
-static void show_settings(struct uart16x50 *uptr)
-{
-    uint32_t baud;
-
-    if (!(trace & TRACE_UART))
-        return;
-
-    baud = uptr->ls + (uptr->ms << 8);
-    if (baud == 0)
-        baud = 1843200;
-    baud = 1843200 / baud;
-    baud /= 16;
-    fprintf(stderr, "[%d:%d",
-            baud, (uptr->lcr &3) + 5);
-    switch(uptr->lcr & 0x38) {
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-            fprintf(stderr, "N");
-            break;
-        case 0x08:
-            fprintf(stderr, "O");
-            break;
-        case 0x18:
-            fprintf(stderr, "E");
-            break;
-        case 0x28:
-            fprintf(stderr, "M");
-            break;
-        case 0x38:
-            fprintf(stderr, "S");
-            break;
-    }
-    fprintf(stderr, "%d ",
-            (uptr->lcr & 4) ? 2 : 1);
-
-    if (uptr->lcr & 0x40)
-        fprintf(stderr, "break ");
-    if (uptr->lcr & 0x80)
-        fprintf(stderr, "dlab ");
-    if (uptr->mcr & 1)
-        fprintf(stderr, "DTR ");
-    if (uptr->mcr & 2)
-        fprintf(stderr, "RTS ");
-    if (uptr->mcr & 4)
-        fprintf(stderr, "OUT1 ");
-    if (uptr->mcr & 8)
-        fprintf(stderr, "OUT2 ");
-    if (uptr->mcr & 16)
-        fprintf(stderr, "LOOP ");
-    fprintf(stderr, "ier %02x]\n", uptr->ier);
 }
 
-static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
-{
-    switch(addr) {
-    case 0:	/* If dlab = 0, then write else LS*/
-        if (uptr->dlab == 0) {
-            if (uptr == &uart[0]) {
-                putchar(val);
-                fflush(stdout);
-            }
-            uart_clear_interrupt(uptr, TEMT);
-            uart_interrupt(uptr, TEMT);
-        } else {
-            uptr->ls = val;
-            show_settings(uptr);
-        }
-        break;
-    case 1:	/* If dlab = 0, then IER */
-        if (uptr->dlab) {
-            uptr->ms= val;
-            show_settings(uptr);
-        }
-        else
-            uptr->ier = val;
-        break;
-    case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
-        break;
-    case 3:	/* LCR */
-        uptr->lcr = val;
-        uptr->dlab = (uptr->lcr & 0x80);
-        show_settings(uptr);
-        break;
-    case 4:	/* MCR */
-        uptr->mcr = val & 0x3F;
-        show_settings(uptr);
-        break;
-    case 5:	/* LSR (r/o) */
-        break;
-    case 6:	/* MSR (r/o) */
-        break;
-    case 7:	/* Scratch */
-        uptr->scratch = val;
-        break;
-    }
-}
-
-static uint8_t uart_read(struct uart16x50 *uptr, uint8_t addr)
-{
-    uint8_t r;
-
-    switch(addr) {
-    case 0:
-        /* receive buffer */
-        if (!prop && uptr == &uart[0] && uptr->dlab == 0) {
-            uart_clear_interrupt(uptr, RXDA);
-            return next_char();
-        }
-        break;
-    case 1:
-        /* IER */
-        return uptr->ier;
-    case 2:
-        /* IIR */
-        return uptr->iir;
-    case 3:
-        /* LCR */
-        return uptr->lcr;
-    case 4:
-        /* mcr */
-        return uptr->mcr;
-    case 5:
-        /* lsr */
-        if (!prop) {
-            r = check_chario();
-            uptr->lsr = 0;
-            if (!prop && (r & 1))
-                 uptr->lsr |= 0x01;	/* Data ready */
-            if (r & 2)
-                 uptr->lsr |= 0x60;	/* TX empty | holding empty */
-            /* Reading the LSR causes these bits to clear */
-            r = uptr->lsr;
-            uptr->lsr &= 0xF0;
-            return r;
-        }
-        return 0x60;
-    case 6:
-        /* msr */
-        r = uptr->msr;
-        /* Reading clears the delta bits */
-        uptr->msr &= 0xF0;
-        uart_clear_interrupt(uptr, MODEM);
-        return r;
-    case 7:
-        return uptr->scratch;
-    }
-    return 0xFF;
-}
+static struct uart16x50 *uart[5];
+static uint8_t timer_msr;
 
 /* Clock timer hack. The (signal level) DSR line on the jumpers is connected
    to a slow clock generator */
 static void timer_pulse(void)
 {
-    struct uart16x50 *uptr = uart;
     if (timerhack) {
-        uptr->msr ^= 0x20;	/* DSR toggles */
-        uptr->msr |= 0x02;	/* DSR delta */
-        uart_interrupt(uptr, MODEM);
+        timer_msr ^= 0x20;	/* DSR toggles */
+        uart16x50_signal_change(uart[0], timer_msr);
     }
 }
 
@@ -489,7 +265,7 @@ static uint8_t rtcwp = 0x80;
 static uint8_t rtc24 = 1;
 static uint8_t rtcbp = 0;
 static uint8_t rtcbc = 0;
-static struct tm *rtc_tm;
+static const struct tm *rtc_tm;
 
 static uint8_t rtc_read(void)
 {
@@ -672,8 +448,7 @@ static void rtc_write(uint8_t val)
             rtcstate = 0;
         } else {
             /* Latch imaginary registers on rising edge */
-            time_t t= time(NULL);
-            rtc_tm = localtime(&t);
+            rtc_tm = vclock_tm(1);
             if (trace & TRACE_RTC)
                 fprintf(stderr, "RTC CE raised and latched time.\n");
         }
@@ -701,7 +476,7 @@ static uint8_t *prop_tptr;
 static uint16_t prop_tlen;
 static uint8_t prop_st;
 static uint8_t prop_err;
-static int prop_fd;
+static struct blkdev *prop_blk;
 static off_t prop_cardsize;
 
 static uint32_t buftou32(void)
@@ -728,15 +503,16 @@ static void u32tobuf(uint32_t t)
     
 static void prop_init(void)
 {
-    prop_fd = open(sdcard_path, O_RDWR);
-    if (prop_fd == -1) {
+    int fd = open(sdcard_path, O_RDWR);
+    if (fd == -1) {
         perror(sdcard_path);
         return;
     }
-    if ((prop_cardsize = lseek(prop_fd, 0L, SEEK_END)) == -1) {
+    prop_blk = blkdev_open(fd, 0);
+    if ((prop_cardsize = blkdev_blocks(prop_blk)) == -1) {
         perror(sdcard_path);
-        close(prop_fd);
-        prop_fd = -1;
+        blkdev_close(prop_blk);
+        prop_blk = NULL;
     }
     prop_rptr = prop_rbuf;
     prop_tptr = prop_rbuf;
@@ -812,7 +588,7 @@ static void prop_write(uint8_t addr, uint8_t val)
                 prop_rptr = prop_rbuf;
                 prop_rlen = 1;
                 prop_st = 0;
-                if (prop_fd == -1) {
+                if (prop_blk == NULL) {
                     *prop_rbuf = 0;
                     prop_err = -9;
                     prop_st |= 0x40;
@@ -821,7 +597,7 @@ static void prop_write(uint8_t addr, uint8_t val)
                 break;
             case 0x03:	/* CAP */
                 prop_err = 0;
-                u32tobuf(prop_cardsize >> 9);
+                u32tobuf(prop_cardsize);
                 break;
             case 0x04:	/* CSD */
                 prop_err = 0;
@@ -838,7 +614,7 @@ static void prop_write(uint8_t addr, uint8_t val)
                 prop_rlen = 4;
                 break;
             case 0x20:	/* INIT */
-                if (prop_fd == -1) {
+                if (prop_blk == NULL) {
                     prop_st = 0x40;
                     prop_err = -9;
                     /* Error packet */
@@ -849,11 +625,9 @@ static void prop_write(uint8_t addr, uint8_t val)
                 break;
             case 0x30:	/* READ */
                 lba = buftou32();
-                lba <<= 9;
                 prop_err = 0;
                 prop_st = 0;
-                if (lseek(prop_fd, lba, SEEK_SET) < 0 ||
-                    read(prop_fd, prop_sbuf, 512) != 512) {
+                if (prop_blk == NULL || blkdev_read(prop_blk, lba, prop_sbuf) < 0) {
                     prop_err = -6;
                     /* Do error packet FIXME */
                 } else {
@@ -873,11 +647,9 @@ static void prop_write(uint8_t addr, uint8_t val)
                 break;
             case 0x50:	/* WRITE */
                 lba = buftou32();
-                lba <<= 9;
                 prop_err = 0;
                 prop_st = 0;
-                if (lseek(prop_fd, lba, SEEK_SET) < 0 ||
-                    write(prop_fd, prop_sbuf, 512) != 512) {
+                if (prop_blk == NULL || blkdev_write(prop_blk, lba, prop_sbuf) < 0) {
                     prop_err = -6;
                     /* FIXME: do error packet */
                 }
@@ -980,7 +752,7 @@ static uint8_t io_read(int unused, uint16_t addr)
     if (addr >= 0x60 && addr <= 0x67) 	/* Aliased */
         return pio_read(addr & 3);
     if (addr >= 0x68 && addr < 0x70)
-        return uart_read(&uart[0], addr & 7);
+        return uart16x50_read(uart[0], addr & 7);
     if (addr >= 0x70 && addr <= 0x77)
         return rtc_read();
     if (ramf && (addr >= 0xA0 && addr <= 0xA7))
@@ -988,7 +760,7 @@ static uint8_t io_read(int unused, uint16_t addr)
     if (prop && (addr >= 0xA8 && addr <= 0xAF))
         return prop_read(addr & 7);
     if (addr >= 0xC0 && addr <= 0xDF)
-        return uart_read(&uart[((addr - 0xC0) >> 3) + 1], addr & 7);
+        return uart16x50_read(uart[((addr - 0xC0) >> 3) + 1], addr & 7);
     if (trace & TRACE_UNK)
         fprintf(stderr, "Unknown read from port %04X\n", addr);
     return 0xFF;
@@ -1004,7 +776,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
     else if (addr >= 0x60 && addr <= 0x67)	/* Aliased */
         pio_write(addr & 3, val);
     else if (addr >= 0x68 && addr < 0x70)
-        uart_write(&uart[0], addr & 7, val);
+        uart16x50_write(uart[0], addr & 7, val);
     else if (addr >= 0x70 && addr <= 0x77)
         rtc_write(val);
     else if (addr >= 0x78 && addr <= 0x79) {
@@ -1024,7 +796,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
     else if (prop && addr >= 0xA8 && addr <= 0xAF)
         prop_write(addr & 0x07, val);
     else if (addr >= 0xC0 && addr <= 0xDF)
-        uart_write(&uart[((addr - 0xC0) >> 3) + 1], addr & 7, val);
+        uart16x50_write(uart[((addr - 0xC0) >> 3) + 1], addr & 7, val);
     else if (addr == 0xFD) {
         printf("trace set to %d\n", val);
         trace = val;
@@ -1049,7 +821,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-    fprintf(stderr, "rcbv2: [-r rompath] [-i idepath] [-t] [-p] [-s sdcardpath] [-d tracemask] [-R]\n");
+    fprintf(stderr, "rcbv2: [-r rompath] [-i idepath] [-t] [-p] [-s sdcardpath] [-P port] [-T real|max] [-d tracemask] [-R] [-w] [-N loop|bench] [-C clock]\n");
     exit(EXIT_FAILURE);
 }
 
@@ -1060,9 +832,13 @@ int main(int argc, char *argv[])
     int fd;
     char *rompath = "sbc.rom";
     char *idepath[2] = { NULL, NULL };
+    char *portspec[4];
+    int ports = 0;
+    unsigned int baud = SERIAL_BAUD_DEFAULT;
+    int vnet = -1;
     int i;
 
-    while((opt = getopt(argc, argv, "r:i:s:ptd:fRw")) != -1) {
+    while((opt = getopt(argc, argv, "C:r:i:s:ptd:fRwN:P:T:")) != -1) {
         switch(opt) {
             case 'r':
                 rompath = optarg;
@@ -1088,12 +864,34 @@ int main(int argc, char *argv[])
             case 'f':
                 fast = 1;
                 break;
+            case 'C':
+                if (vclock_option(optarg))
+                    usage();
+                break;
             case 'R':
                 ramf = 1;
                 break;
             case 'w':
                 wiznet = 1;
                 break;
+            case 'N':
+                if (strcmp(optarg, "loop") == 0)
+                    vnet = 0;
+                else if (strcmp(optarg, "bench") == 0)
+                    vnet = 1;
+                else
+                    usage();
+                wiznet = 1;
+                break;
+            case 'P':
+                if (ports == 4)
+                    fprintf(stderr, "sbcv2: only four 4UART ports.\n");
+                else
+                    portspec[ports++] = optarg;
+                break;
+            case 'T':
+                baud = serial_baud_mode(optarg);
+                break;
             default:
                 usage();
         }
@@ -1142,15 +940,26 @@ int main(int argc, char *argv[])
     if (ramf)
         ramf_init();
 
-    uart_init(&uart[0]);
-    uart_init(&uart[1]);
-    uart_init(&uart[2]);
-    uart_init(&uart[3]);
-    uart_init(&uart[4]);
+    for (i = 0; i < 5; i++) {
+        uart[i] = uart16x50_create();
+        if (trace & TRACE_UART)
+            uart16x50_trace(uart[i], 1);
+    }
+    /* With PropIO the console is on the Propeller */
+    uart16x50_set_input(uart[0], !prop);
+    uart16x50_set_output(uart[0], 1);
+    uart16x50_set_baud(uart[0], baud);
+    for (i = 0; i < ports; i++) {
+        struct serial *port = serial_open(portspec[i]);
+        uart16x50_attach(uart[i + 1], port);
+        uart16x50_set_baud(uart[i + 1], serial_baud(port));
+    }
 
     if (wiznet) {
         wiz = nic_w5100_alloc();
         nic_w5100_reset(wiz);
+        if (vnet != -1)
+            nic_w5100_set_vnet(wiz, vnet_create(vnet));
     }
 
     /* No real need for interrupt accuracy so just go with the timer. If we
@@ -1186,11 +995,21 @@ int main(int argc, char *argv[])
 
     /* 4MHz Z80 - 4,000,000 tstates / second */
     while (!done) {
-        Z80ExecuteTStates(&cpu_z80, 400000);
+        for (i = 0; i < 100; i++) {
+            Z80ExecuteTStates(&cpu_z80, 4000);
+            uart16x50_timer(uart[0], 1000000);
+            uart16x50_timer(uart[1], 1000000);
+            uart16x50_timer(uart[2], 1000000);
+            uart16x50_timer(uart[3], 1000000);
+            uart16x50_timer(uart[4], 1000000);
+            if (wiznet)
+                w5100_timer(wiz, 1000000);
+            serial_poll();
+        }
+	vclock_tick(tc.tv_nsec);
 	/* Do 100ms of I/O and delays */
 	if (!fast)
 	    nanosleep(&tc, NULL);
-	uart_event(uart);
 	timer_pulse();
         if (wiznet)
             w5100_process(wiz);
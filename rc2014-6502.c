@@ -27,9 +27,16 @@
 #include <unistd.h>
 #include <errno.h>
 #include "6502.h"
+#include "acia.h"
+#include "sio.h"
+#include "uart16x50.h"
+#include "serial.h"
 #include "ide.h"
 #include "w5100.h"
+#include "vnet.h"
+#include "vclock.h"
 
+static struct cpu6502 cpu;
 static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
 
 static unsigned int bankreg[4];
@@ -79,7 +86,7 @@ static int trace = 0;
 static void reti_event(void);
 
 
-static int check_chario(void)
+int check_chario(void)
 {
 	fd_set i, o;
 	struct timeval tv;
@@ -105,7 +112,7 @@ static int check_chario(void)
 	return r;
 }
 
-static unsigned int next_char(void)
+unsigned int next_char(void)
 {
 	char c;
 	if (read(0, &c, 1) != 1) {
@@ -120,675 +127,81 @@ static unsigned int next_char(void)
 static void int_set(int src)
 {
 	live_irq |= (1 << src);
+	set_irq_line(&cpu, 1);
 }
 
 static void int_clear(int src)
 {
 	live_irq &= ~(1 << src);
+	set_irq_line(&cpu, live_irq != 0);
 }
 
 
-/* FIXME: need to add 16550A */
-
-static uint8_t acia_status = 2;
-static uint8_t acia_config;
-static uint8_t acia_char;
-static uint8_t acia;
+struct acia *acia;
+static uint8_t has_acia;
 static uint8_t acia_input;
-static uint8_t acia_inint = 0;
 static uint8_t acia_narrow;
 
-static void acia_irq_compute(void)
+static void acia_check_irq(struct acia *acia)
 {
-	if (!acia_inint && acia_config && acia_status & 0x80) {
-		if (trace & TRACE_ACIA)
-			fprintf(stderr, "ACIA interrupt.\n");
-		acia_inint = 1;
+	if (acia_irq_pending(acia))
 		int_set(IRQ_ACIA);
-	}
-	if (acia_inint) {
+	else
 		int_clear(IRQ_ACIA);
-		acia_inint = 0;
-	}
-}
-
-static void acia_receive(void)
-{
-	uint8_t old_status = acia_status;
-	acia_status = old_status & 0x02;
-	if (old_status & 1)
-		acia_status |= 0x20;
-	acia_char = next_char();
-	if (trace & TRACE_ACIA)
-		fprintf(stderr, "ACIA rx.\n");
-	acia_status |= 0x81;	/* IRQ, and rx data full */
-}
-
-static void acia_transmit(void)
-{
-	if (!(acia_status & 2)) {
-		if (trace & TRACE_ACIA)
-			fprintf(stderr, "ACIA tx is clear.\n");
-		acia_status |= 0x82;	/* IRQ, and tx data empty */
-	}
 }
 
-static void acia_timer(void)
+static uint8_t my_acia_read(uint16_t addr)
 {
-	int s = check_chario();
-	if ((s & 1) && acia_input)
-		acia_receive();
-	if (s & 2)
-		acia_transmit();
-	if (s)
-		acia_irq_compute();
+	uint8_t r = acia_read(acia, addr);
+	acia_check_irq(acia);
+	return r;
 }
 
-/* Very crude for initial testing ! */
-static uint8_t acia_read(uint8_t addr)
+static void my_acia_write(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_ACIA)
-		fprintf(stderr, "acia_read %d ", addr);
-	switch (addr) {
-	case 0:
-		/* bits 7: irq pending, 6 parity error, 5 rx over
-		 * 4 framing error, 3 cts, 2 dcd, 1 tx empty, 0 rx full.
-		 * Bits are set on char arrival and cleared on next not by
-		 * user
-		 */
-		acia_status &= ~0x80;
-		acia_irq_compute();
-		if (trace & TRACE_ACIA)
-			fprintf(stderr, "acia_status %d\n", acia_status);
-		return acia_status;
-	case 1:
-		acia_status &= ~0x81;	/* No IRQ, rx empty */
-		acia_irq_compute();
-		if (trace & TRACE_ACIA)
-			fprintf(stderr, "acia_char %d\n", acia_char);
-		return acia_char;
-	default:
-		fprintf(stderr, "acia: bad addr.\n");
-		exit(1);
-	}
+	acia_write(acia, addr, val);
+	acia_check_irq(acia);
 }
 
-static void acia_write(uint16_t addr, uint8_t val)
-{
-	if (trace & TRACE_ACIA)
-		fprintf(stderr, "acia_write %d %d\n", addr, val);
-	switch (addr) {
-	case 0:
-		/* bit 7 enables interrupts, bits 5-6 are tx control
-		   bits 2-4 select the word size and 0-1 counter divider
-		   except 11 in them means reset */
-		acia_config = val;
-		if ((acia_config & 3) == 3)
-			acia_status = 2;
-		acia_irq_compute();
-		return;
-	case 1:
-		write(1, &val, 1);
-		/* Clear any existing int state and tx empty */
-		acia_status &= ~0x82;
-		break;
-	}
-}
-
-struct z80_sio_chan {
-	uint8_t wr[8];
-	uint8_t rr[3];
-	uint8_t data[3];
-	uint8_t dptr;
-	uint8_t irq;
-	uint8_t rxint;
-	uint8_t txint;
-	uint8_t intbits;
-#define INT_TX	1
-#define INT_RX	2
-#define INT_ERR	4
-	uint8_t pending;	/* Interrupt bits pending as an IRQ cause */
-	uint8_t vector;		/* Vector pending to deliver */
-};
-
 static int sio2;
 static int sio2_input;
-static struct z80_sio_chan sio[2];
+static struct sio *sio;
 
-/*
- *	Interrupts. We don't handle IM2 yet.
- */
-
-static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
+/* The SIO is polled from the main loop so there is nothing to do here */
+void recalc_interrupts(void)
 {
-	if (trace & TRACE_IRQ) {
-		fprintf(stderr, "Clear intbits %d %x\n",
-			(int)(chan - sio), m);
-	}
-	chan->intbits &= ~m;
-	chan->pending &= ~m;
-	if (!(sio->intbits | sio[1].intbits)) {
-		sio->rr[1] &= ~0x02;
-		chan->irq = 0;
-	}
-}
-
-static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	uint8_t new = (chan->intbits ^ m) & m;
-	uint8_t vector;
-	chan->intbits |= m;
-	if ((trace & TRACE_SIO) && new)
-		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
-	if (new) {
-		if (!sio->irq) {
-			chan->irq = 1;
-			sio->rr[1] |= 0x02;
-			vector = 0; /* sio[1].wr[2]; */
-			/* This is a subset of the real options. FIXME: add
-			   external status change */
-			if (sio[1].wr[1] & 0x04) {
-				vector &= 0xF1;
-				if (chan == sio)
-					vector |= 1 << 3;
-				if (chan->intbits & INT_RX)
-					vector |= 4;
-				else if (chan->intbits & INT_ERR)
-					vector |= 2;
-			}
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "SIO2 interrupt %02X\n", vector);
-			chan->vector = vector;
-		}
-	}
-}
-
-static int sio2_check_im2(struct z80_sio_chan *chan)
-{
-	int src;
-	/* See if we have an IRQ pending and if so deliver it and return 1 */
-	if (chan->irq) {
-		/* FIXME: quick fix for now but the vector calculation should all be
-		   done here it seems */
-		if (sio[1].wr[1] & 0x04)
-			chan->vector += (sio[1].wr[2] & 0xF1);
-		else
-			chan->vector += sio[1].wr[2];
-		if (trace & (TRACE_IRQ|TRACE_SIO))
-			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
-				(int)(chan - sio), chan->vector);
-		if (chan == sio)
-			src = IRQ_SIOA;
-		else
-			src = IRQ_SIOB;
-		int_set(src);
-		return 1;
-	}
-	return 0;
 }
 
-static void sio2_reti(struct z80_sio_chan *chan)
+static int sio2_check_im2(unsigned int chan)
 {
-	/* Recalculate the pending state and vectors */
-	/* FIXME: what really goes here */
-	sio->irq = 0;
-	int_clear(IRQ_SIOA);
-	int_clear(IRQ_SIOB);
-	sio2_check_im2(chan);
+	if (sio_check_im2(sio, chan) < 0)
+		return 0;
+	int_set(chan ? IRQ_SIOB : IRQ_SIOA);
+	return 1;
 }
 
-
-/*
- *	The SIO replaces the last character in the FIFO on an
- *	overrun.
- */
-static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
-{
-	if (trace & TRACE_SIO)
-		fprintf(stderr, "SIO %d queue %d: ", (int) (chan - sio), c);
-	/* Receive disabled */
-	if (!(chan->wr[3] & 1)) {
-		fprintf(stderr, "RX disabled.\n");
-		return;
-	}
-	/* Overrun */
-	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Overrun.\n");
-		chan->data[2] = c;
-		chan->rr[1] |= 0x20;	/* Overrun flagged */
-		/* What are the rules for overrun delivery FIXME */
-		sio2_raise_int(chan, INT_ERR);
-	} else {
-		/* FIFO add */
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Queued %d (mode %d)\n", chan->dptr, chan->wr[1] & 0x18);
-		chan->data[chan->dptr++] = c;
-		chan->rr[0] |= 1;
-		switch (chan->wr[1] & 0x18) {
-		case 0x00:
-			break;
-		case 0x08:
-			if (chan->dptr == 1)
-				sio2_raise_int(chan, INT_RX);
-			break;
-		case 0x10:
-		case 0x18:
-			sio2_raise_int(chan, INT_RX);
-			break;
-		}
-	}
-	/* Need to deal with interrupt results */
-}
-
-static void sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
-{
-	if (ab == 0) {
-		int c = check_chario();
-
-		if (sio2_input) {
-			if (c & 1)
-				sio2_queue(chan, next_char());
-		}
-		if (c & 2) {
-			if (!(chan->rr[0] & 0x04)) {
-				chan->rr[0] |= 0x04;
-				if (chan->wr[1] & 0x02)
-					sio2_raise_int(chan, INT_TX);
-			}
-		}
-	} else {
-		if (!(chan->rr[1] & 0x04)) {
-			chan->rr[1] |= 0x04;
-			if (chan->wr[1] & 0x02)
-				sio2_raise_int(chan, INT_TX);
-		}
-	}
-}
-
-static void sio2_timer(void)
-{
-	sio2_channel_timer(sio, 0);
-	sio2_channel_timer(sio + 1, 1);
-}
-
-static void sio2_channel_reset(struct z80_sio_chan *chan)
-{
-	chan->rr[0] = 0x2C;
-	chan->rr[1] = 0x01;
-	chan->rr[2] = 0;
-	sio2_clear_int(chan, INT_RX | INT_TX | INT_ERR);
-}
-
-static void sio_reset(void)
-{
-	sio2_channel_reset(sio);
-	sio2_channel_reset(sio + 1);
-}
-
-static uint8_t sio2_read(uint16_t addr)
-{
-	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
-	if (!(addr & 1)) {
-		/* Control */
-		uint8_t r = chan->wr[0] & 007;
-		chan->wr[0] &= ~007;
-
-		chan->rr[0] &= ~2;
-		if (chan == sio && (sio[0].intbits | sio[1].intbits))
-			chan->rr[0] |= 2;
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read reg %d = ", (addr & 2) ? 'b' : 'a', r);
-		switch (r) {
-		case 0:
-		case 1:
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "%02X\n", chan->rr[r]);
-			return chan->rr[r];
-		case 2:
-			if (chan != sio) {
-				if (trace & TRACE_SIO)
-					fprintf(stderr, "%02X\n", chan->rr[2]);
-				return chan->rr[2];
-			}
-		case 3:
-			/* What does the hw report ?? */
-			fprintf(stderr, "INVALID(0xFF)\n");
-			return 0xFF;
-		}
-	} else {
-		/* FIXME: irq handling */
-		uint8_t c = chan->data[0];
-		chan->data[0] = chan->data[1];
-		chan->data[1] = chan->data[2];
-		if (chan->dptr)
-			chan->dptr--;
-		if (chan->dptr == 0)
-			chan->rr[0] &= 0xFE;	/* Clear RX pending */
-		sio2_clear_int(chan, INT_RX);
-		chan->rr[0] &= 0x3F;
-		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read data %d\n", (addr & 2) ? 'b' : 'a', c);
-		if (chan->dptr && (chan->wr[1] & 0x10))
-			sio2_raise_int(chan, INT_RX);
-		return c;
-	}
-	return 0xFF;
-}
-
-static void sio2_write(uint16_t addr, uint8_t val)
-{
-	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
-	uint8_t r;
-	if (!(addr & 1)) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c write reg %d with %02X\n", (addr & 2) ? 'b' : 'a', chan->wr[0] & 7, val);
-		switch (chan->wr[0] & 007) {
-		case 0:
-			chan->wr[0] = val;
-			/* FIXME: CRC reset bits ? */
-			switch (val & 070) {
-			case 000:	/* NULL */
-				break;
-			case 010:	/* Send Abort SDLC */
-				/* SDLC specific no-op for async */
-				break;
-			case 020:	/* Reset external/status interrupts */
-				sio2_clear_int(chan, INT_ERR);
-				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
-				break;
-			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
-					fprintf(stderr, "[channel reset]\n");
-				sio2_channel_reset(chan);
-				break;
-			case 040:	/* Enable interrupt on next rx */
-				chan->rxint = 1;
-				break;
-			case 050:	/* Reset transmitter interrupt pending */
-				chan->txint = 0;
-				sio2_clear_int(chan, INT_TX);
-				break;
-			case 060:	/* Reset the error latches */
-				chan->rr[1] &= 0x8F;
-				break;
-			case 070:	/* Return from interrupt (channel A) */
-				if (chan == sio) {
-					sio->irq = 0;
-					sio->rr[1] &= ~0x02;
-					sio2_clear_int(sio, INT_RX | INT_TX | INT_ERR);
-					sio2_clear_int(sio + 1, INT_RX | INT_TX | INT_ERR);
-				}
-				break;
-			}
-			break;
-		case 1:
-		case 2:
-		case 3:
-		case 4:
-		case 5:
-		case 6:
-		case 7:
-			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
-					(addr & 2) ? 'b' : 'a', r, val);
-			chan->wr[r] = val;
-			if (chan != sio && r == 2)
-				chan->rr[2] = val;
-			chan->wr[0] &= ~007;
-			break;
-		}
-		/* Control */
-	} else {
-		/* Strictly we should emulate this as two bytes, one going out and
-		   the visible queue - FIXME */
-		/* FIXME: irq handling */
-		chan->rr[0] &= ~(1 << 2);	/* Transmit buffer no longer empty */
-		chan->txint = 1;
-		/* Should check chan->wr[5] & 8 */
-		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c write data %d\n", (addr & 2) ? 'b' : 'a', val);
-		write(1, &val, 1);
-	}
-}
-
-/* UART: very mimimal for the moment */
-
-struct uart16x50 {
-    uint8_t ier;
-    uint8_t iir;
-    uint8_t fcr;
-    uint8_t lcr;
-    uint8_t mcr;
-    uint8_t lsr;
-    uint8_t msr;
-    uint8_t scratch;
-    uint8_t ls;
-    uint8_t ms;
-    uint8_t dlab;
-    uint8_t irq;
-#define RXDA	1
-#define TEMT	2
-#define MODEM	8
-    uint8_t irqline;
-};
-
-static struct uart16x50 uart;
+static struct uart16x50 *uart;
 static unsigned int uart_16550a;
 
-static void uart_init(struct uart16x50 *uptr)
-{
-    uptr->dlab = 0;
-}
-
-/* Compute the interrupt indicator register from what is pending */
-static void uart_recalc_iir(struct uart16x50 *uptr)
-{
-    if (uptr->irq & RXDA)
-        uptr->iir = 0x04;
-    else if (uptr->irq & TEMT)
-        uptr->iir = 0x02;
-    else if (uptr->irq & MODEM)
-        uptr->iir = 0x00;
-    else {
-        uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        int_clear(IRQ_16550A);
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
-    uptr->irqline = uptr->irq;
-    int_set(IRQ_16550A);
-}
-
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart_interrupt(struct uart16x50 *uptr, uint8_t n)
+static void uart_check_irq(struct uart16x50 *uptr)
 {
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
-        return;
-    uptr->irq |= n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (!(uptr->irq & n))
-        return;
-    uptr->irq &= ~n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_event(struct uart16x50 *uptr)
-{
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-    if (r & 1)
-        uptr->lsr |= 0x01;	/* RX not empty */
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart_interrupt(uptr, TEMT);
-}
-
-static void show_settings(struct uart16x50 *uptr)
-{
-    uint32_t baud;
-
-    if (!(trace & TRACE_UART))
-        return;
-
-    baud = uptr->ls + (uptr->ms << 8);
-    if (baud == 0)
-        baud = 1843200;
-    baud = 1843200 / baud;
-    baud /= 16;
-    fprintf(stderr, "[%d:%d",
-            baud, (uptr->lcr &3) + 5);
-    switch(uptr->lcr & 0x38) {
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-            fprintf(stderr, "N");
-            break;
-        case 0x08:
-            fprintf(stderr, "O");
-            break;
-        case 0x18:
-            fprintf(stderr, "E");
-            break;
-        case 0x28:
-            fprintf(stderr, "M");
-            break;
-        case 0x38:
-            fprintf(stderr, "S");
-            break;
-    }
-    fprintf(stderr, "%d ",
-            (uptr->lcr & 4) ? 2 : 1);
-
-    if (uptr->lcr & 0x40)
-        fprintf(stderr, "break ");
-    if (uptr->lcr & 0x80)
-        fprintf(stderr, "dlab ");
-    if (uptr->mcr & 1)
-        fprintf(stderr, "DTR ");
-    if (uptr->mcr & 2)
-        fprintf(stderr, "RTS ");
-    if (uptr->mcr & 4)
-        fprintf(stderr, "OUT1 ");
-    if (uptr->mcr & 8)
-        fprintf(stderr, "OUT2 ");
-    if (uptr->mcr & 16)
-        fprintf(stderr, "LOOP ");
-    fprintf(stderr, "ier %02x]\n", uptr->ier);
+	if (uart16x50_irq_pending(uptr))
+		int_set(IRQ_16550A);
+	else
+		int_clear(IRQ_16550A);
 }
 
-static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
+static uint8_t my_uart_read(uint16_t addr)
 {
-    switch(addr) {
-    case 0:	/* If dlab = 0, then write else LS*/
-        if (uptr->dlab == 0) {
-            if (uptr == &uart) {
-                putchar(val);
-                fflush(stdout);
-            }
-            uart_clear_interrupt(uptr, TEMT);
-            uart_interrupt(uptr, TEMT);
-        } else {
-            uptr->ls = val;
-            show_settings(uptr);
-        }
-        break;
-    case 1:	/* If dlab = 0, then IER */
-        if (uptr->dlab) {
-            uptr->ms= val;
-            show_settings(uptr);
-        }
-        else
-            uptr->ier = val;
-        break;
-    case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
-        break;
-    case 3:	/* LCR */
-        uptr->lcr = val;
-        uptr->dlab = (uptr->lcr & 0x80);
-        show_settings(uptr);
-        break;
-    case 4:	/* MCR */
-        uptr->mcr = val & 0x3F;
-        show_settings(uptr);
-        break;
-    case 5:	/* LSR (r/o) */
-        break;
-    case 6:	/* MSR (r/o) */
-        break;
-    case 7:	/* Scratch */
-        uptr->scratch = val;
-        break;
-    }
+	uint8_t r = uart16x50_read(uart, addr);
+	uart_check_irq(uart);
+	return r;
 }
 
-static uint8_t uart_read(struct uart16x50 *uptr, uint8_t addr)
+static void my_uart_write(uint16_t addr, uint8_t val)
 {
-    uint8_t r;
-
-    switch(addr) {
-    case 0:
-        /* receive buffer */
-        if (uptr == &uart && uptr->dlab == 0) {
-            uart_clear_interrupt(uptr, RXDA);
-            return next_char();
-        }
-        break;
-    case 1:
-        /* IER */
-        return uptr->ier;
-    case 2:
-        /* IIR */
-        return uptr->iir;
-    case 3:
-        /* LCR */
-        return uptr->lcr;
-    case 4:
-        /* mcr */
-        return uptr->mcr;
-    case 5:
-        /* lsr */
-        r = check_chario();
-        uptr->lsr = 0;
-        if (r & 1)
-             uptr->lsr |= 0x01;	/* Data ready */
-        if (r & 2)
-             uptr->lsr |= 0x60;	/* TX empty | holding empty */
-        /* Reading the LSR causes these bits to clear */
-        r = uptr->lsr;
-        uptr->lsr &= 0xF0;
-        return r;
-    case 6:
-        /* msr */
-        r = uptr->msr;
-        /* Reading clears the delta bits */
-        uptr->msr &= 0xF0;
-        uart_clear_interrupt(uptr, MODEM);
-        return r;
-    case 7:
-        return uptr->scratch;
-    }
-    return 0xFF;
+	uart16x50_write(uart, addr, val);
+	uart_check_irq(uart);
 }
 
 static int ide = 0;
@@ -821,7 +234,7 @@ static uint8_t rtcwp = 0x80;
 static uint8_t rtc24 = 1;
 static uint8_t rtcbp = 0;
 static uint8_t rtcbc = 0;
-static struct tm *rtc_tm;
+static const struct tm *rtc_tm;
 
 static uint8_t rtc_read(void)
 {
@@ -997,8 +410,7 @@ static void rtc_write(uint8_t val)
 			rtcstate = 0;
 		} else {
 			/* Latch imaginary registers on rising edge */
-			time_t t = time(NULL);
-			rtc_tm = localtime(&t);
+			rtc_tm = vclock_tm(1);
 			if (trace & TRACE_RTC)
 				fprintf(stderr, "RTC CE raised and latched time.\n");
 		}
@@ -1012,10 +424,12 @@ static void rtc_write(uint8_t val)
  */
 
 struct z80_ctc {
-	uint16_t count;
+	uint32_t count;
 	uint16_t reload;
 	uint8_t vector;
 	uint8_t ctrl;
+	uint64_t when;		/* CTC clock count was last worked out */
+	uint64_t due;		/* CTC clock it next passes zero */
 #define CTC_IRQ		0x80
 #define CTC_COUNTER	0x40
 #define CTC_PRESCALER	0x20
@@ -1030,9 +444,13 @@ struct z80_ctc {
 };
 
 #define CTC_STOPPED(c)	(((c)->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET))
+/* Count units per clock, the count is held scaled by 256 */
+#define CTC_SCALE(c)	(((c)->ctrl & CTC_PRESCALER) ? 1 : 16)
 
 struct z80_ctc ctc[4];
 uint8_t ctc_irqmask;
+static uint64_t ctc_now;	/* CTC clocks elapsed */
+static uint64_t ctc_next;	/* Earliest timer event */
 
 static void ctc_reset(struct z80_ctc *c)
 {
@@ -1097,33 +515,80 @@ static int ctc_check_im2(void)
 }
 
 /* Model the chains between the CTC devices */
-static void ctc_receive_pulse(int i);
+static void ctc_receive_pulses(int i, unsigned int n);
 
-static void ctc_pulse(int i)
+static void ctc_pulse(int i, unsigned int n)
 {
 	/* Model CTC 2 chained into CTC 3 */
 	if (i == 2)
-		ctc_receive_pulse(3);
+		ctc_receive_pulses(3, n);
 }
 
 /* We don't worry about edge directions just a logical pulse model */
-static void ctc_receive_pulse(int i)
+static void ctc_receive_pulses(int i, unsigned int n)
 {
 	struct z80_ctc *c = ctc + i;
-	if (c->ctrl & CTC_COUNTER) {
-		if (CTC_STOPPED(c))
-			return;
-		if (c->count >= 0x0100)
-			c->count -= 0x100;	/* No scaling on pulses */
-		if ((c->count & 0xFF00) == 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			c->count = c->reload << 8;
-		}
-	} else {
+	unsigned int count, period;
+
+	if (n == 0)
+		return;
+	if (!(c->ctrl & CTC_COUNTER)) {
 		if (c->ctrl & CTC_PULSE)
 			c->ctrl &= ~CTC_PULSE;
+		return;
+	}
+	if (CTC_STOPPED(c))
+		return;
+	/* Pulses until we next hit zero, then whole reload periods */
+	count = c->count >> 8;
+	if (count == 0)
+		count = 1;
+	if (n < count) {
+		c->count -= n << 8;
+		return;
+	}
+	n -= count;
+	period = c->reload ? c->reload : 256;
+	c->count = (period - n % period) << 8;
+	ctc_interrupt(c);
+	ctc_pulse(i, 1 + n / period);
+}
+
+/*
+ *	Timers are not stepped. Each one holds its count as of CTC clock
+ *	'when' and the clock at which it next passes zero, so that between
+ *	events a tick is just a compare and reads work the count out.
+ */
+static void ctc_catchup(struct z80_ctc *c)
+{
+	int64_t n;
+	unsigned int period, k;
+
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER)) {
+		c->when = ctc_now;
+		return;
+	}
+	n = (int64_t)c->count - (int64_t)(ctc_now - c->when) * CTC_SCALE(c);
+	c->when = ctc_now;
+	if (n >= 0) {
+		c->count = n;
+		return;
 	}
+	period = (c->reload ? c->reload : 256) << 8;
+	k = (-n + period - 1) / period;
+	c->count = n + (int64_t)k * period;
+	ctc_interrupt(c);
+	ctc_pulse(c - ctc, k);
+}
+
+static void ctc_schedule(struct z80_ctc *c)
+{
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER))
+		c->due = UINT64_MAX;
+	else
+		c->due = c->when + c->count / CTC_SCALE(c) + 1;
+	if (c->due < ctc_next)
+		ctc_next = c->due;
 }
 
 /* Model counters */
@@ -1131,45 +596,29 @@ static void ctc_tick(unsigned int clocks)
 {
 	struct z80_ctc *c = ctc;
 	int i;
-	int n;
-	int decby;
 
+	ctc_now += clocks;
+	if (ctc_now < ctc_next)
+		return;
+	ctc_next = UINT64_MAX;
 	for (i = 0; i < 4; i++, c++) {
-		/* Waiting a value */
-		if (CTC_STOPPED(c))
-			continue;
-		/* Pulse trigger mode */
-		if (c->ctrl & CTC_COUNTER)
-			continue;
-		/* 256x downscaled */
-		decby = clocks;
-		/* 16x not 256x downscale - so increase by 16x */
-		if (!(c->ctrl & CTC_PRESCALER))
-			decby <<= 4;
-		/* Now iterate over the events. We need to deal with wraps
-		   because we might have something counters chained */
-		n = c->count - decby;
-		while (n < 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			if (c->reload == 0)
-				n += 256 << 8;
-			else
-				n += c->reload << 8;
-		}
-		c->count = n;
+		if (c->due <= ctc_now)
+			ctc_catchup(c);
+		ctc_schedule(c);
 	}
 }
 
 static void ctc_write(uint8_t channel, uint8_t val)
 {
 	struct z80_ctc *c = ctc + channel;
+	/* Bring the count up to date under the old settings */
+	ctc_catchup(c);
 	if (c->ctrl & CTC_TCONST) {
 		if (trace & TRACE_CTC)
 			fprintf(stderr, "CTC %d constant loaded with %02X\n", channel, val);
 		c->reload = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET)) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -1181,7 +630,7 @@ static void ctc_write(uint8_t channel, uint8_t val)
 			fprintf(stderr, "CTC %d control loaded with %02X\n", channel, val);
 		c->ctrl = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == CTC_RESET) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -1200,11 +649,17 @@ static void ctc_write(uint8_t channel, uint8_t val)
 			fprintf(stderr, "CTC %d vector loaded with %02X\n", channel, val);
 		c->vector = val;
 	}
+	ctc_schedule(c);
 }
 
 static uint8_t ctc_read(uint8_t channel)
 {
-	uint8_t val = ctc[channel].count >> 8;
+	struct z80_ctc *c = ctc + channel;
+	uint8_t val;
+
+	ctc_catchup(c);
+	ctc_schedule(c);
+	val = c->count >> 8;
 	if (trace & TRACE_CTC)
 		fprintf(stderr, "CTC %d reads %02x\n", channel, val);
 	return val;
@@ -1460,17 +915,50 @@ void via_write(uint8_t addr, uint8_t val)
 }
 
 
+/* Rebuild the CPU page table for the 16K the given bank register serves.
+   The I/O page, ROM writes and everything while tracing memory or
+   snooping for M1 are left NULL so they take the slow path */
+static void map_bank(unsigned int bank)
+{
+	unsigned int page = ((bank << 14) ^ addrinvert) >> 8;
+	unsigned int i;
+	uint8_t *p = ramrom;
+	int rom = 1;
+	int slow = (trace & TRACE_MEM) || fake_m1;
+
+	/* When banking is off the entire 64K is occupied by repeats of ROM 0 */
+	if (bankenable) {
+		p += bankreg[bank] << 14;
+		rom = bankreg[bank] < 32;
+	}
+	for (i = 0; i < 64; i++, page++, p += 256) {
+		if (slow || page == iopage) {
+			cpu.rpage[page] = NULL;
+			cpu.wpage[page] = NULL;
+		} else {
+			cpu.rpage[page] = p;
+			cpu.wpage[page] = rom ? NULL : p;
+		}
+	}
+}
+
+static void map_all(void)
+{
+	unsigned int i;
+	for (i = 0; i < 4; i++)
+		map_bank(i);
+}
 
 uint8_t mmio_read_6502(uint8_t addr)
 {
 	if (trace & TRACE_IO)
 		fprintf(stderr, "read %02x\n", addr);
 	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow)
-		return acia_read(addr & 1);
+		return my_acia_read(addr & 1);
 	if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
-		return acia_read(addr & 1);
+		return my_acia_read(addr & 1);
 	if ((addr >= 0x80 && addr <= 0x83) && sio2)
-		return sio2_read(addr & 3);
+		return sio_read(sio, addr & 3);
 	if ((addr >= 0x10 && addr <= 0x17) && ide)
 		return my_ide_read(addr & 7);
 	if (addr >= 0x28 && addr <= 0x2C && wiznet)
@@ -1480,7 +968,7 @@ uint8_t mmio_read_6502(uint8_t addr)
 	if (addr == 0xC0 && rtc)
 		return rtc_read();
 	if (addr >= 0xC0 && addr <= 0xCF && uart_16550a)
-		return uart_read(&uart, addr & 0x0F);
+		return my_uart_read(addr & 0x0F);
 	/* Scott Baker is 0x90-93, suggested defaults for the
 	   Stephen Cousins boards at 0x88-0x8B. No doubt we'll get
 	   an official CTC board at another address  */
@@ -1497,11 +985,11 @@ void mmio_write_6502(uint8_t addr, uint8_t val)
 	if (trace & TRACE_IO)
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow)
-		acia_write(addr & 1, val);
+		my_acia_write(addr & 1, val);
 	if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
-		acia_write(addr & 1, val);
+		my_acia_write(addr & 1, val);
 	else if ((addr >= 0x80 && addr <= 0x83) && sio2)
-		sio2_write(addr & 3, val);
+		sio_write(sio, addr & 3, val);
 	else if ((addr >= 0x10 && addr <= 0x17) && ide)
 		my_ide_write(addr & 7, val);
 	else if (addr >= 0x28 && addr <= 0x2C && wiznet)
@@ -1513,23 +1001,23 @@ void mmio_write_6502(uint8_t addr, uint8_t val)
 		bankreg[addr & 3] = val & 0x3F;
 		if (trace & TRACE_512)
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
+		map_bank(addr & 3);
 	} else if (addr >= 0x7C && addr <= 0x7F) {
 		if (trace & TRACE_512)
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
+		map_all();
 	} else if (addr == 0xC0 && rtc)
 		rtc_write(val);
 	else if (addr >= 0x88 && addr <= 0x8B && have_ctc)
 		ctc_write(addr & 3, val);
 	else if (addr >= 0xC0 && addr <= 0xCF && uart_16550a)
-		uart_write(&uart, addr & 0x0F, val);
+		my_uart_write(addr & 0x0F, val);
 	else if (addr == 0x00) {
 		printf("trace set to %d\n", val);
 		trace = val;
-		if (trace & TRACE_CPU)
-			log_6502 = 1;
-		else
-			log_6502 = 0;
+		cpu.trace = !!(trace & TRACE_CPU);
+		map_all();
 	} else if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
@@ -1552,7 +1040,8 @@ uint8_t do_6502_read(uint16_t addr)
 	return ramrom[xaddr & 0x3FFF];
 }
 
-uint8_t read6502(uint16_t addr)
+/* Pages the CPU can't read directly */
+uint8_t mem_read_6502(struct cpu6502 *c, uint16_t addr)
 {
 	static uint8_t rstate = 0;
 	uint8_t r;
@@ -1581,7 +1070,7 @@ uint8_t read6502(uint16_t addr)
 	return r;
 }
 
-uint8_t read6502_debug(uint16_t addr)
+uint8_t mem_debug_6502(struct cpu6502 *c, uint16_t addr)
 {
 	/* Avoid side effects for debug */
 	if (addr >> 8 == iopage)
@@ -1590,8 +1079,7 @@ uint8_t read6502_debug(uint16_t addr)
 	return do_6502_read(addr);
 }
 
-
-void write6502(uint16_t addr, uint8_t val)
+void mem_write_6502(struct cpu6502 *c, uint16_t addr, uint8_t val)
 {
 	uint16_t xaddr = addr ^ addrinvert;
 
@@ -1621,7 +1109,7 @@ void write6502(uint16_t addr, uint8_t val)
 static void poll_irq_event(void)
 {
 	/* The SIO has IE0/IE1 working internally but not globally */
-	!sio2_check_im2(sio) && !sio2_check_im2(sio + 1);
+	sio2 && !sio2_check_im2(0) && !sio2_check_im2(1);
 	/* The CTC has nothing wired to IE0/IE1 at all */
 	ctc_check_im2();
 }
@@ -1632,8 +1120,9 @@ static void reti_event(void)
 	   time. I think they can also fight over the vector but ignore
 	   that */
 	if (sio2) {
-		sio2_reti(sio);
-		sio2_reti(sio + 1);
+		sio_reti(sio, 0);
+		int_clear(IRQ_SIOA);
+		int_clear(IRQ_SIOB);
 	}
 	if (have_ctc) {
 		ctc_reti(0);
@@ -1643,15 +1132,10 @@ static void reti_event(void)
 	}
 	/* The ACIA and 16550A do not care about reti */
 	live_irq &= ~(1 << (IRQ_ACIA | IRQ_16550A));
+	set_irq_line(&cpu, live_irq != 0);
 	poll_irq_event();
 }
 
-static void irqnotify(void)
-{
-	if(live_irq)
-		irq6502();
-}
-
 static struct termios saved_term, term;
 
 static void cleanup(int sig)
@@ -1667,7 +1151,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014: [-1] [-A] [-a] [-c] [-f] [-R] [-r rompath] [-s] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014: [-1] [-A] [-a] [-c] [-f] [-R] [-r rompath] [-s] [-T real|max] [-P port] [-w] [-N loop|bench] [-d debug] [-C clock]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -1678,23 +1162,26 @@ int main(int argc, char *argv[])
 	int fd;
 	char *rompath = "rc2014-6502.rom";
 	char *idepath;
+	int vnet = -1;
+	unsigned int baud = SERIAL_BAUD_DEFAULT;
+	char *portspec = NULL;
 
-	while ((opt = getopt(argc, argv, "1Aacd:fi:r:sRw")) != -1) {
+	while ((opt = getopt(argc, argv, "C:1Aacd:fi:N:P:r:sRT:w")) != -1) {
 		switch (opt) {
 		case '1':
 			uart_16550a = 1;
-			acia = 0;
+			has_acia = 0;
 			sio2 = 0;
 			break;
 		case 'a':
-			acia = 1;
+			has_acia = 1;
 			acia_input = 1;
 			acia_narrow = 0;
 			sio2 = 0;
 			uart_16550a = 0;
 			break;
 		case 'A':
-			acia = 1;
+			has_acia = 1;
 			acia_narrow = 1;
 			acia_input = 1;
 			sio2 = 0;
@@ -1706,7 +1193,7 @@ int main(int argc, char *argv[])
 		case 's':
 			sio2 = 1;
 			sio2_input = 1;
-			acia = 0;
+			has_acia = 0;
 			uart_16550a = 0;
 			break;
 		case 'i':
@@ -1722,12 +1209,31 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'C':
+			if (vclock_option(optarg))
+				usage();
+			break;
 		case 'R':
 			rtc = 1;
 			break;
 		case 'w':
 			wiznet = 1;
 			break;
+		case 'N':
+			if (strcmp(optarg, "loop") == 0)
+				vnet = 0;
+			else if (strcmp(optarg, "bench") == 0)
+				vnet = 1;
+			else
+				usage();
+			wiznet = 1;
+			break;
+		case 'T':
+			baud = serial_baud_mode(optarg);
+			break;
+		case 'P':
+			portspec = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -1735,10 +1241,14 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
-	if (acia == 0 && sio2 == 0 && uart_16550a == 0) {
+	if (has_acia == 0 && sio2 == 0 && uart_16550a == 0) {
 		fprintf(stderr, "rc2014: no UART selected, defaulting to 16550A\n");
 		uart_16550a = 1;
 	}
+	if (portspec && !sio2) {
+		fprintf(stderr, "rc2014: -P needs an SIO.\n");
+		exit(EXIT_FAILURE);
+	}
 	if (rtc && uart_16550a) {
 		fprintf(stderr, "rc2014: RTC and 16550A clash at 0xC0.\n");
 		exit(1);
@@ -1771,16 +1281,38 @@ int main(int argc, char *argv[])
 			ide = 0;
 	}
 
-	if (sio2)
-		sio_reset();
+	if (sio2) {
+		sio = sio_create();
+		if (trace & TRACE_SIO)
+			sio_trace(sio, 1);
+		sio_set_input(sio, 0, sio2_input);
+		sio_set_baud(sio, 0, baud);
+		if (portspec)
+			sio_attach(sio, 1, serial_open(portspec));
+	}
+	if (has_acia) {
+		acia = acia_create();
+		if (trace & TRACE_ACIA)
+			acia_trace(acia, 1);
+		acia_set_input(acia, acia_input);
+		acia_set_baud(acia, baud);
+	}
 	if (have_ctc)
 		ctc_init();
-	if (uart_16550a)
-		uart_init(&uart);
+	if (uart_16550a) {
+		uart = uart16x50_create();
+		if (trace & TRACE_UART)
+			uart16x50_trace(uart, 1);
+		uart16x50_set_input(uart, 1);
+		uart16x50_set_output(uart, 1);
+		uart16x50_set_baud(uart, baud);
+	}
 
 	if (wiznet) {
 		wiz = nic_w5100_alloc();
 		nic_w5100_reset(wiz);
+		if (vnet != -1)
+			nic_w5100_set_vnet(wiz, vnet_create(vnet));
 	}
 
 	/* 5ms - it's a balance between nice behaviour and simulation
@@ -1803,12 +1335,14 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-	if (trace & TRACE_CPU)
-		log_6502 = 1;
+	cpu.mem_read = mem_read_6502;
+	cpu.mem_write = mem_write_6502;
+	cpu.mem_debug = mem_debug_6502;
+	cpu.trace = !!(trace & TRACE_CPU);
+	map_all();
 
 	init6502();
-	reset6502();
-	hookexternal(irqnotify);
+	reset6502(&cpu);
 
 	/* This is the wrong way to do it but it's easier for the moment. We
 	   should track how much real time has occurred and try to keep cycle
@@ -1823,19 +1357,28 @@ int main(int argc, char *argv[])
 		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
 			/* FIXME: should check return and keep adjusting */
-			exec6502(tstate_steps);
-			if (acia)
-				acia_timer();
+			exec6502(&cpu, tstate_steps);
+			if (acia) {
+				acia_timer(acia, 50000);
+				acia_check_irq(acia);
+			}
 			if (sio2)
-				sio2_timer();
+				sio_timer(sio, 50000);
+			if (wiznet)
+				w5100_timer(wiz, 50000);
 			if (have_ctc)
 				ctc_tick(tstate_steps);
-			if (uart_16550a)
-				uart_event(&uart);
+			if (uart) {
+				uart16x50_timer(uart, 50000);
+				uart_check_irq(uart);
+			}
 			via_tick(tstate_steps);
 		}
+		if (sio2)
+			serial_poll();
 		if (wiznet)
 			w5100_process(wiz);
+		vclock_tick(tc.tv_nsec);
 		/* Do 5ms of I/O and delays */
 		if (!fast)
 			nanosleep(&tc, NULL);
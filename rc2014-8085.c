@@ -31,11 +31,15 @@
 #include <errno.h>
 #include "intel_8085_emulator.h"
 #include "acia.h"
+#include "uart16x50.h"
+#include "serial.h"
 #include "ide.h"
 #include "ppide.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "vclock.h"
 
+static struct i8085 cpu;
 static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
 
 static unsigned int bankreg[4];
@@ -83,20 +87,50 @@ static volatile int done;
 
 static int trace = 0;
 
+/* The 64K bank the high MMU selects for an address */
+static uint32_t mmu_higha(uint16_t addr)
+{
+	uint8_t reg = mmureg;
+	uint32_t higha;
+	if (addr < 0xE000)
+		reg >>= 1;
+	higha = (reg & 0x40) ? 1 : 0;
+	higha |= (reg & 0x10) ? 2 : 0;
+	higha |= (reg & 0x4) ? 4 : 0;
+	higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
+	return higha;
+}
+
+/* Tell the CPU where each 16K can be fetched from without going through
+   the read hook. Called whenever the mapping changes. The top 16K is split
+   by the high MMU so is only direct if both halves land in the same bank,
+   and memory tracing wants to see everything */
+static void set_fetch_map(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		uint8_t *p = ramrom + (i << 14);
+		if (bankhigh) {
+			if (i == 3 && mmu_higha(0xC000) != mmu_higha(0xE000))
+				p = NULL;
+			else
+				p += mmu_higha(i << 14) << 16;
+		} else if (bankenable)
+			p = ramrom + (bankreg[i] << 14);
+		if (trace & TRACE_MEM)
+			p = NULL;
+		cpu.fetch_map[i] = p;
+	}
+}
+
 /* FIXME: emulate paging off correctly, also be nice to emulate with less
    memory fitted */
 uint8_t i8085_do_read(uint16_t addr)
 {
 	if (bankhigh) {
-		uint8_t reg = mmureg;
 		uint8_t val;
-		uint32_t higha;
-		if (addr < 0xE000)
-			reg >>= 1;
-		higha = (reg & 0x40) ? 1 : 0;
-		higha |= (reg & 0x10) ? 2 : 0;
-		higha |= (reg & 0x4) ? 4 : 0;
-		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
+		uint32_t higha = mmu_higha(addr);
 
 		val = ramrom[(higha << 16) + addr];
 		if (trace & TRACE_MEM) {
@@ -118,29 +152,22 @@ uint8_t i8085_do_read(uint16_t addr)
 	return ramrom[addr];
 }
 
-uint8_t i8085_debug_read(uint16_t addr)
+static uint8_t mem_debug_read(struct i8085 *c, uint16_t addr)
 {
 	return i8085_do_read(addr);	/* No side effects */
 }
 
-uint8_t i8085_read(uint16_t addr)
+static uint8_t mem_read(struct i8085 *c, uint16_t addr)
 {
 	return i8085_do_read(addr);
 }
 
 
-void i8085_write(uint16_t addr, uint8_t val)
+static void mem_write(struct i8085 *c, uint16_t addr, uint8_t val)
 {
 	if (bankhigh) {
-		uint8_t reg = mmureg;
-		uint8_t higha;
-		if (addr < 0xE000)
-			reg >>= 1;
-		higha = (reg & 0x40) ? 1 : 0;
-		higha |= (reg & 0x10) ? 2 : 0;
-		higha |= (reg & 0x4) ? 4 : 0;
-		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
-		
+		uint8_t higha = mmu_higha(addr);
+
 		if (trace & TRACE_MEM) {
 			fprintf(stderr, "W %04X[%02X] = %02X\n",
 				(unsigned int)addr,
@@ -215,9 +242,9 @@ unsigned int next_char(void)
 void recalc_interrupts(void)
 {
 	if (live_irq)
-		i8085_set_int(INT_RST65);
+		i8085_set_int(&cpu, INT_RST65);
 	else
-		i8085_clear_int(INT_RST65);
+		i8085_clear_int(&cpu, INT_RST65);
 }
 
 static void int_set(int src)
@@ -244,244 +271,28 @@ static void acia_check_irq(struct acia *acia)
 }
 
 
-/* UART: very mimimal for the moment */
-
-struct uart16x50 {
-    uint8_t ier;
-    uint8_t iir;
-    uint8_t fcr;
-    uint8_t lcr;
-    uint8_t mcr;
-    uint8_t lsr;
-    uint8_t msr;
-    uint8_t scratch;
-    uint8_t ls;
-    uint8_t ms;
-    uint8_t dlab;
-    uint8_t irq;
-#define RXDA	1
-#define TEMT	2
-#define MODEM	8
-    uint8_t irqline;
-};
-
-static struct uart16x50 uart;
+static struct uart16x50 *uart;
 static unsigned int uart_16550a;
 
-static void uart_init(struct uart16x50 *uptr)
-{
-    uptr->dlab = 0;
-}
-
-/* Compute the interrupt indicator register from what is pending */
-static void uart_recalc_iir(struct uart16x50 *uptr)
-{
-    if (uptr->irq & RXDA)
-        uptr->iir = 0x04;
-    else if (uptr->irq & TEMT)
-        uptr->iir = 0x02;
-    else if (uptr->irq & MODEM)
-        uptr->iir = 0x00;
-    else {
-        uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        int_clear(IRQ_16550A);
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
-    uptr->irqline = uptr->irq;
-    int_set(IRQ_16550A);
-}
-
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart_interrupt(struct uart16x50 *uptr, uint8_t n)
+static void uart_check_irq(struct uart16x50 *uptr)
 {
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
-        return;
-    uptr->irq |= n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (!(uptr->irq & n))
-        return;
-    uptr->irq &= ~n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_event(struct uart16x50 *uptr)
-{
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-    if (r & 1)
-        uptr->lsr |= 0x01;	/* RX not empty */
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart_interrupt(uptr, TEMT);
-}
-
-static void show_settings(struct uart16x50 *uptr)
-{
-    uint32_t baud;
-
-    if (!(trace & TRACE_UART))
-        return;
-
-    baud = uptr->ls + (uptr->ms << 8);
-    if (baud == 0)
-        baud = 1843200;
-    baud = 1843200 / baud;
-    baud /= 16;
-    fprintf(stderr, "[%d:%d",
-            baud, (uptr->lcr &3) + 5);
-    switch(uptr->lcr & 0x38) {
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-            fprintf(stderr, "N");
-            break;
-        case 0x08:
-            fprintf(stderr, "O");
-            break;
-        case 0x18:
-            fprintf(stderr, "E");
-            break;
-        case 0x28:
-            fprintf(stderr, "M");
-            break;
-        case 0x38:
-            fprintf(stderr, "S");
-            break;
-    }
-    fprintf(stderr, "%d ",
-            (uptr->lcr & 4) ? 2 : 1);
-
-    if (uptr->lcr & 0x40)
-        fprintf(stderr, "break ");
-    if (uptr->lcr & 0x80)
-        fprintf(stderr, "dlab ");
-    if (uptr->mcr & 1)
-        fprintf(stderr, "DTR ");
-    if (uptr->mcr & 2)
-        fprintf(stderr, "RTS ");
-    if (uptr->mcr & 4)
-        fprintf(stderr, "OUT1 ");
-    if (uptr->mcr & 8)
-        fprintf(stderr, "OUT2 ");
-    if (uptr->mcr & 16)
-        fprintf(stderr, "LOOP ");
-    fprintf(stderr, "ier %02x]\n", uptr->ier);
+	if (uart16x50_irq_pending(uptr))
+		int_set(IRQ_16550A);
+	else
+		int_clear(IRQ_16550A);
 }
 
-static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
+static uint8_t my_uart_read(uint16_t addr)
 {
-    switch(addr) {
-    case 0:	/* If dlab = 0, then write else LS*/
-        if (uptr->dlab == 0) {
-            if (uptr == &uart) {
-                putchar(val);
-                fflush(stdout);
-            }
-            uart_clear_interrupt(uptr, TEMT);
-            uart_interrupt(uptr, TEMT);
-        } else {
-            uptr->ls = val;
-            show_settings(uptr);
-        }
-        break;
-    case 1:	/* If dlab = 0, then IER */
-        if (uptr->dlab) {
-            uptr->ms= val;
-            show_settings(uptr);
-        }
-        else
-            uptr->ier = val;
-        break;
-    case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
-        break;
-    case 3:	/* LCR */
-        uptr->lcr = val;
-        uptr->dlab = (uptr->lcr & 0x80);
-        show_settings(uptr);
-        break;
-    case 4:	/* MCR */
-        uptr->mcr = val & 0x3F;
-        show_settings(uptr);
-        break;
-    case 5:	/* LSR (r/o) */
-        break;
-    case 6:	/* MSR (r/o) */
-        break;
-    case 7:	/* Scratch */
-        uptr->scratch = val;
-        break;
-    }
+	uint8_t r = uart16x50_read(uart, addr);
+	uart_check_irq(uart);
+	return r;
 }
 
-static uint8_t uart_read(struct uart16x50 *uptr, uint8_t addr)
+static void my_uart_write(uint16_t addr, uint8_t val)
 {
-    uint8_t r;
-
-    switch(addr) {
-    case 0:
-	if (uptr->dlab)
-		return uptr->ls;
-        /* receive buffer */
-        if (uptr == &uart && uptr->dlab == 0) {
-            uart_clear_interrupt(uptr, RXDA);
-            return next_char();
-        }
-        break;
-    case 1:
-	if (uptr->dlab)
-		return uptr->ms;
-        /* IER */
-        return uptr->ier;
-    case 2:
-        /* IIR */
-        return uptr->iir;
-    case 3:
-        /* LCR */
-        return uptr->lcr;
-    case 4:
-        /* mcr */
-        return uptr->mcr;
-    case 5:
-        /* lsr */
-        r = check_chario();
-        uptr->lsr = 0;
-        if (r & 1)
-             uptr->lsr |= 0x01;	/* Data ready */
-        if (r & 2)
-             uptr->lsr |= 0x60;	/* TX empty | holding empty */
-        /* Reading the LSR causes these bits to clear */
-        r = uptr->lsr;
-        uptr->lsr &= 0xF0;
-        return r;
-    case 6:
-        /* msr */
-        r = uptr->msr;
-        /* Reading clears the delta bits */
-        uptr->msr &= 0xF0;
-        uart_clear_interrupt(uptr, MODEM);
-        return r;
-    case 7:
-        return uptr->scratch;
-    }
-    return 0xFF;
+	uart16x50_write(uart, addr, val);
+	uart_check_irq(uart);
 }
 
 static int ide = 0;
@@ -504,7 +315,7 @@ static void my_ide_write(uint16_t addr, uint8_t val)
    
  */
 
-uint8_t i8085_inport(uint8_t addr)
+static uint8_t io_read(struct i8085 *c, uint8_t addr)
 {
 	if (trace & TRACE_IO)
 		fprintf(stderr, "read %02x\n", addr);
@@ -521,13 +332,13 @@ uint8_t i8085_inport(uint8_t addr)
 	if (addr == 0x0C && rtc)
 		return rtc_read(rtcdev);
 	else if (addr >= 0xC0 && addr <= 0xCF && uart_16550a)
-		return uart_read(&uart, addr & 0x0F);
+		return my_uart_read(addr & 0x0F);
 	if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
-void i8085_outport(uint8_t addr, uint8_t val)
+static void io_write(struct i8085 *c, uint8_t addr, uint8_t val)
 {
 	if (trace & TRACE_IO)
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
@@ -535,6 +346,7 @@ void i8085_outport(uint8_t addr, uint8_t val)
 		mmureg = val;
 		if (trace & TRACE_512)
 			fprintf(stderr, "MMUreg set to %02X\n", val);
+		set_fetch_map();
 	} else if ((addr >= 0xA0 && addr <= 0xA7) && acia)
 		acia_write(acia, addr & 1, val);
 	else if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
@@ -550,31 +362,35 @@ void i8085_outport(uint8_t addr, uint8_t val)
 		bankreg[addr & 3] = val & 0x3F;
 		if (trace & TRACE_512)
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
+		set_fetch_map();
 	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
 		if (trace & TRACE_512)
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
+		set_fetch_map();
 	} else if (addr == 0x0C && rtc)
 		rtc_write(rtcdev, val);
 	else if (addr >= 0xC0 && addr <= 0xCF && uart_16550a)
-		uart_write(&uart, addr & 0x0F, val);
+		my_uart_write(addr & 0x0F, val);
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
+		cpu.log = (trace & TRACE_CPU) ? stderr : NULL;
+		set_fetch_map();
 	} else if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
 /* For now we don't emulate the bitbang port */
 
-int i8085_get_input(void)
+static int sid_read(struct i8085 *c)
 {
 	return 0;
 }
 
 /* And we emulate wiring the SIM bit to M1 */
 
-void i8085_set_output(int value)
+static void sod_write(struct i8085 *c, int value)
 {
 }
 
@@ -599,7 +415,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014: [-1] [-A] [-b] [-f] [-R] [-r rompath] [-e rombank] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014: [-1] [-A] [-b] [-f] [-R] [-r rompath] [-e rombank] [-T real|max] [-w] [-d debug] [-C clock]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -613,8 +429,10 @@ int main(int argc, char *argv[])
 	char *rompath = "rc2014-8085.rom";
 	char *idepath;
 	int acia_input;
+	unsigned int baud = SERIAL_BAUD_DEFAULT;
+	uint64_t deadline = 0;
 
-	while ((opt = getopt(argc, argv, "1abBd:e:fi:I:r:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "C:1abBd:e:fi:I:r:RT:w")) != -1) {
 		switch (opt) {
 		case '1':
 			uart_16550a = 1;
@@ -655,12 +473,19 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'C':
+			if (vclock_option(optarg))
+				usage();
+			break;
 		case 'R':
 			rtc = 1;
 			break;
 		case 'w':
 			wiznet = 1;
 			break;
+		case 'T':
+			baud = serial_baud_mode(optarg);
+			break;
 		default:
 			usage();
 		}
@@ -747,9 +572,16 @@ int main(int argc, char *argv[])
 		if (trace & TRACE_ACIA)
 			acia_trace(acia, 1);
 		acia_set_input(acia, acia_input);
+		acia_set_baud(acia, baud);
+	}
+	if (uart_16550a) {
+		uart = uart16x50_create();
+		if (trace & TRACE_UART)
+			uart16x50_trace(uart, 1);
+		uart16x50_set_input(uart, 1);
+		uart16x50_set_output(uart, 1);
+		uart16x50_set_baud(uart, baud);
 	}
-	if (uart_16550a)
-		uart_init(&uart);
 
 	if (wiznet) {
 		wiz = nic_w5100_alloc();
@@ -783,10 +615,17 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-	i8085_reset();
-	if (trace & TRACE_CPU) {
-		i8085_log = stderr;
-	}
+	cpu.read = mem_read;
+	cpu.write = mem_write;
+	cpu.debug_read = mem_debug_read;
+	cpu.inport = io_read;
+	cpu.outport = io_write;
+	cpu.get_input = sid_read;
+	cpu.set_output = sod_write;
+	if (trace & TRACE_CPU)
+		cpu.log = stderr;
+	i8085_reset(&cpu);
+	set_fetch_map();
 
 	/* This is the wrong way to do it but it's easier for the moment. We
 	   should track how much real time has occurred and try to keep cycle
@@ -800,14 +639,20 @@ int main(int argc, char *argv[])
 		int i;
 		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
-			i8085_exec(tstate_steps);
+			deadline += tstate_steps;
+			i8085_exec_until(&cpu, deadline);
 			if (acia)
-				acia_timer(acia);
-			if (uart_16550a)
-				uart_event(&uart);
+				acia_timer(acia, 50000);
+			if (uart) {
+				uart16x50_timer(uart, 50000);
+				uart_check_irq(uart);
+			}
+			if (wiznet)
+				w5100_timer(wiz, 50000);
 		}
 		if (wiznet)
 			w5100_process(wiz);
+		vclock_tick(tc.tv_nsec);
 		/* Do 5ms of I/O and delays */
 		if (!fast)
 			nanosleep(&tc, NULL);
@@ -10,9 +10,10 @@
  *	RTC at 0xC0
  *	16550A at 0xC8
  *
- *	Known bugs
- *	Not convinced we have all the INT clear cases right for SIO error
+ *	SIO channel B can be attached to a host serial port with -P (see
+ *	serial.h), otherwise its output goes to the console.
  *
+ *	Known bugs
  *	Add support for using real CF card
  *
  *	For the Easy-Z80 still need to update the CTC model
@@ -40,11 +41,18 @@
 #include "libz80/z80.h"
 
 #include "acia.h"
+#include "uart16x50.h"
+#include "serial.h"
+#include "sio.h"
+#include "blkdev.h"
 #include "ide.h"
 #include "ppide.h"
+#include "sdcard.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "vnet.h"
 #include "z80dma.h"
+#include "vclock.h"
 
 static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
 
@@ -88,6 +96,7 @@ static uint8_t live_irq;
 static Z80Context cpu_z80;
 
 static nic_w5100_t *wiz;
+static struct z80dma *dma;
 
 static volatile int done;
 
@@ -108,6 +117,7 @@ static volatile int done;
 #define TRACE_SPI	16384
 #define TRACE_SD	32768
 #define TRACE_PPIDE	65536
+#define TRACE_DMA	131072
 
 static int trace = 0;
 
@@ -323,6 +333,48 @@ static void mem_write_micro80(uint16_t addr, uint8_t val)
 		*p = val;
 }
 
+/* Where the DMA finds plain memory. NULL for ROM writes, and for
+   everything when tracing so each access is still logged. A mapping is
+   good to the end of its 4K page */
+static uint8_t *dma_mmu(uint16_t addr, int write)
+{
+	unsigned int bank;
+
+	if (trace & TRACE_MEM)
+		return NULL;
+	switch (cpuboard) {
+	case CPUBOARD_Z80:
+	case CPUBOARD_EASYZ80:
+		if (bankenable) {
+			bank = bankreg[(addr & 0xC000) >> 14];
+			if (write && bank < 32)
+				return NULL;
+			return &ramrom[(bank << 14) + (addr & 0x3FFF)];
+		}
+		if (write && (addr < 8192 || bank512))
+			return NULL;
+		return &ramrom[addr];
+	case CPUBOARD_SC108:
+	case CPUBOARD_SC114:
+	case CPUBOARD_SC121:
+		if (addr < 0x8000 && !(port38 & 0x01)) {
+			if (write)
+				return NULL;
+			return &ramrom[addr];
+		}
+		if (cpuboard == CPUBOARD_SC108 ? (port38 & 0x80) : (port30 & 0x01))
+			return &ramrom[addr + 131072];
+		return &ramrom[addr + 65536];
+	case CPUBOARD_Z80SBC64:
+		if (addr >= 0x8000)
+			return &ramrom[addr];
+		return &ramrom[bankreg[0] * 0x8000 + addr];
+	case CPUBOARD_MICRO80:
+		return mmu_micro80_z84c15(addr, write);
+	}
+	return NULL;
+}
+
 uint8_t mem_read(int unused, uint16_t addr)
 {
 	static uint8_t rstate = 0;
@@ -453,584 +505,44 @@ static void acia_check_irq(struct acia *acia)
 }
 
 
-/* UART: very mimimal for the moment */
-
-struct uart16x50 {
-    uint8_t ier;
-    uint8_t iir;
-    uint8_t fcr;
-    uint8_t lcr;
-    uint8_t mcr;
-    uint8_t lsr;
-    uint8_t msr;
-    uint8_t scratch;
-    uint8_t ls;
-    uint8_t ms;
-    uint8_t dlab;
-    uint8_t irq;
-#define RXDA	1
-#define TEMT	2
-#define MODEM	8
-    uint8_t irqline;
-};
-
-static struct uart16x50 uart[1];
-
-static void uart_init(struct uart16x50 *uptr)
-{
-    uptr->dlab = 0;
-}
+static struct uart16x50 *uart;
 
 static void uart_check_irq(struct uart16x50 *uptr)
 {
-    if (uptr->irqline)
+    if (uart16x50_irq_pending(uptr))
 	    Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
 }
 
-/* Compute the interrupt indicator register from what is pending */
-static void uart_recalc_iir(struct uart16x50 *uptr)
-{
-    if (uptr->irq & RXDA)
-        uptr->iir = 0x04;
-    else if (uptr->irq & TEMT)
-        uptr->iir = 0x02;
-    else if (uptr->irq & MODEM)
-        uptr->iir = 0x00;
-    else {
-        uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
-    uptr->irqline = uptr->irq;
-
-}
-
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
-        return;
-    uptr->irq |= n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (!(uptr->irq & n))
-        return;
-    uptr->irq &= ~n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_event(struct uart16x50 *uptr)
-{
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-#if 0
-    if (r & 1)
-        uptr->lsr |= 0x01;	/* RX not empty */
-#endif
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart_interrupt(uptr, TEMT);
-}
-
-static void show_settings(struct uart16x50 *uptr)
-{
-    uint32_t baud;
-
-    if (!(trace & TRACE_UART))
-        return;
-
-    baud = uptr->ls + (uptr->ms << 8);
-    if (baud == 0)
-        baud = 1843200;
-    baud = 1843200 / baud;
-    baud /= 16;
-    fprintf(stderr, "[%d:%d",
-            baud, (uptr->lcr &3) + 5);
-    switch(uptr->lcr & 0x38) {
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-            fprintf(stderr, "N");
-            break;
-        case 0x08:
-            fprintf(stderr, "O");
-            break;
-        case 0x18:
-            fprintf(stderr, "E");
-            break;
-        case 0x28:
-            fprintf(stderr, "M");
-            break;
-        case 0x38:
-            fprintf(stderr, "S");
-            break;
-    }
-    fprintf(stderr, "%d ",
-            (uptr->lcr & 4) ? 2 : 1);
-
-    if (uptr->lcr & 0x40)
-        fprintf(stderr, "break ");
-    if (uptr->lcr & 0x80)
-        fprintf(stderr, "dlab ");
-    if (uptr->mcr & 1)
-        fprintf(stderr, "DTR ");
-    if (uptr->mcr & 2)
-        fprintf(stderr, "RTS ");
-    if (uptr->mcr & 4)
-        fprintf(stderr, "OUT1 ");
-    if (uptr->mcr & 8)
-        fprintf(stderr, "OUT2 ");
-    if (uptr->mcr & 16)
-        fprintf(stderr, "LOOP ");
-    fprintf(stderr, "ier %02x]\n", uptr->ier);
-}
-
-static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
-{
-    switch(addr) {
-    case 0:	/* If dlab = 0, then write else LS*/
-        if (uptr->dlab == 0) {
-            if (uptr == &uart[0]) {
-                putchar(val);
-                fflush(stdout);
-            }
-            uart_clear_interrupt(uptr, TEMT);
-            uart_interrupt(uptr, TEMT);
-        } else {
-            uptr->ls = val;
-            show_settings(uptr);
-        }
-        break;
-    case 1:	/* If dlab = 0, then IER */
-        if (uptr->dlab) {
-            uptr->ms= val;
-            show_settings(uptr);
-        }
-        else
-            uptr->ier = val;
-        break;
-    case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
-        break;
-    case 3:	/* LCR */
-        uptr->lcr = val;
-        uptr->dlab = (uptr->lcr & 0x80);
-        show_settings(uptr);
-        break;
-    case 4:	/* MCR */
-        uptr->mcr = val & 0x3F;
-        break;
-    case 5:	/* LSR (r/o) */
-        break;
-    case 6:	/* MSR (r/o) */
-        break;
-    case 7:	/* Scratch */
-        uptr->scratch = val;
-        break;
-    }
-}
-
-static uint8_t uart_read(struct uart16x50 *uptr, uint8_t addr)
-{
-    uint8_t r;
-
-    switch(addr) {
-    case 0:
-        /* receive buffer */
-        if (uptr == &uart[0] && uptr->dlab == 0) {
-            uart_clear_interrupt(uptr, RXDA);
-            if (check_chario() & 1)
-                return next_char();
-            return 0x00;
-        } else
-            return uptr->ls;
-        break;
-    case 1:
-        /* IER */
-        if (uptr->dlab == 0)
-            return uptr->ier;
-        return uptr->ms;
-    case 2:
-        /* IIR */
-        return uptr->iir;
-    case 3:
-        /* LCR */
-        return uptr->lcr;
-    case 4:
-        /* mcr */
-        return uptr->mcr;
-    case 5:
-        /* lsr */
-        r = check_chario();
-        uptr->lsr &=0x90;
-        if (r & 1)
-             uptr->lsr |= 0x01;	/* Data ready */
-        if (r & 2)
-             uptr->lsr |= 0x60;	/* TX empty | holding empty */
-        /* Reading the LSR causes these bits to clear */
-        r = uptr->lsr;
-        uptr->lsr &= 0xF0;
-        return r;
-    case 6:
-        /* msr */
-        uptr->msr &= 0x7F;
-        r = uptr->msr;
-        /* Reading clears the delta bits */
-        uptr->msr &= 0xF0;
-        uart_clear_interrupt(uptr, MODEM);
-        return r;
-    case 7:
-        return uptr->scratch;
-    }
-    return 0xFF;
-}
-
-
-struct z80_sio_chan {
-	uint8_t wr[8];
-	uint8_t rr[3];
-	uint8_t data[3];
-	uint8_t dptr;
-	uint8_t irq;
-	uint8_t rxint;
-	uint8_t txint;
-	uint8_t intbits;
-#define INT_TX	1
-#define INT_RX	2
-#define INT_ERR	4
-	uint8_t pending;	/* Interrupt bits pending as an IRQ cause */
-	uint8_t vector;		/* Vector pending to deliver */
-};
-
 static int sio2;
 static int sio2_input;
-static struct z80_sio_chan sio[2];
-
-/*
- *	Interrupts. We don't handle IM2 yet.
- */
-
-static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	if (trace & TRACE_IRQ) {
-		fprintf(stderr, "Clear intbits %d %x\n",
-			(int)(chan - sio), m);
-	}
-	chan->intbits &= ~m;
-	chan->pending &= ~m;
-	/* Check me - does it auto clear down or do you have to reti it ? */
-	if (!(sio->intbits | sio[1].intbits)) {
-		sio->rr[1] &= ~0x02;
-		chan->irq = 0;
-	}
-	recalc_interrupts();
-}
-
-static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	uint8_t new = (chan->intbits ^ m) & m;
-	chan->intbits |= m;
-	if ((trace & TRACE_SIO) && new)
-		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
-	if (new) {
-		if (!sio->irq) {
-			chan->irq = 1;
-			sio->rr[1] |= 0x02;
-			recalc_interrupts();
-		}
-	}
-}
-
-static void sio2_reti(struct z80_sio_chan *chan)
-{
-	/* Recalculate the pending state and vectors */
-	/* FIXME: what really goes here */
-	sio->irq = 0;
-	recalc_interrupts();
-}
-
-static int sio2_check_im2(struct z80_sio_chan *chan)
-{
-	uint8_t vector = sio[1].wr[2];
-	/* See if we have an IRQ pending and if so deliver it and return 1 */
-	if (chan->irq) {
-		/* Do the vector calculation in the right place */
-		/* FIXME: move this to other platforms */
-		if (sio[1].wr[1] & 0x04) {
-			/* This is a subset of the real options. FIXME: add
-			   external status change */
-			if (sio[1].wr[1] & 0x04) {
-				vector &= 0xF1;
-				if (chan == sio)
-					vector |= 1 << 3;
-				if (chan->intbits & INT_RX)
-					vector |= 4;
-				else if (chan->intbits & INT_ERR)
-					vector |= 2;
-			}
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "SIO2 interrupt %02X\n", vector);
-			chan->vector = vector;
-		} else {
-			chan->vector = vector;
-		}
-		if (trace & (TRACE_IRQ|TRACE_SIO))
-			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
-				(int)(chan - sio), chan->vector);
-		if (chan == sio)
-			live_irq = IRQ_SIOA;
-		else
-			live_irq = IRQ_SIOB;
-		Z80INT(&cpu_z80, chan->vector);
-		return 1;
-	}
-	return 0;
-}
-
-/*
- *	The SIO replaces the last character in the FIFO on an
- *	overrun.
- */
-static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
-{
-	if (trace & TRACE_SIO)
-		fprintf(stderr, "SIO %d queue %d: ", (int) (chan - sio), c);
-	/* Receive disabled */
-	if (!(chan->wr[3] & 1)) {
-		fprintf(stderr, "RX disabled.\n");
-		return;
-	}
-	/* Overrun */
-	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Overrun.\n");
-		chan->data[2] = c;
-		chan->rr[1] |= 0x20;	/* Overrun flagged */
-		/* What are the rules for overrun delivery FIXME */
-		sio2_raise_int(chan, INT_ERR);
-	} else {
-		/* FIFO add */
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Queued %d (mode %d)\n", chan->dptr, chan->wr[1] & 0x18);
-		chan->data[chan->dptr++] = c;
-		chan->rr[0] |= 1;
-		switch (chan->wr[1] & 0x18) {
-		case 0x00:
-			break;
-		case 0x08:
-			if (chan->dptr == 1)
-				sio2_raise_int(chan, INT_RX);
-			break;
-		case 0x10:
-		case 0x18:
-			sio2_raise_int(chan, INT_RX);
-			break;
-		}
-	}
-	/* Need to deal with interrupt results */
-}
-
-static void sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
-{
-	if (ab == 0) {
-		int c = check_chario();
-
-		if (sio2_input) {
-			if (c & 1)
-				sio2_queue(chan, next_char());
-		}
-		if (c & 2) {
-			if (!(chan->rr[0] & 0x04)) {
-				chan->rr[0] |= 0x04;
-				if (chan->wr[1] & 0x02)
-					sio2_raise_int(chan, INT_TX);
-			}
-		}
-	} else {
-		if (!(chan->rr[0] & 0x04)) {
-			chan->rr[0] |= 0x04;
-			if (chan->wr[1] & 0x02)
-				sio2_raise_int(chan, INT_TX);
-		}
-	}
-}
-
-static void sio2_timer(void)
-{
-	sio2_channel_timer(sio, 0);
-	sio2_channel_timer(sio + 1, 1);
-}
-
-static void sio2_channel_reset(struct z80_sio_chan *chan)
-{
-	chan->rr[0] = 0x2C;
-	chan->rr[1] = 0x01;
-	chan->rr[2] = 0;
-	sio2_clear_int(chan, INT_RX | INT_TX | INT_ERR);
-}
-
-static void sio_reset(void)
-{
-	sio2_channel_reset(sio);
-	sio2_channel_reset(sio + 1);
-}
+static struct sio *sio;
+static struct serial *sio_port;	/* Host side of channel B */
 
-static uint8_t sio2_read(uint16_t addr)
+static int sio2_check_im2(unsigned int chan)
 {
-	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
-	if (!(addr & 1)) {
-		/* Control */
-		uint8_t r = chan->wr[0] & 007;
-		chan->wr[0] &= ~007;
+	int vector;
 
-		chan->rr[0] &= ~2;
-		if (chan == sio && (sio[0].intbits | sio[1].intbits))
-			chan->rr[0] |= 2;
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read reg %d = ", (addr & 2) ? 'b' : 'a', r);
-		switch (r) {
-		case 0:
-		case 1:
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "%02X\n", chan->rr[r]);
-			return chan->rr[r];
-		case 2:
-			if (chan != sio) {
-				if (trace & TRACE_SIO)
-					fprintf(stderr, "%02X\n", chan->rr[2]);
-				return chan->rr[2];
-			}
-		case 3:
-			/* What does the hw report ?? */
-			fprintf(stderr, "INVALID(0xFF)\n");
-			return 0xFF;
-		}
-	} else {
-		/* FIXME: irq handling */
-		uint8_t c = chan->data[0];
-		chan->data[0] = chan->data[1];
-		chan->data[1] = chan->data[2];
-		if (chan->dptr)
-			chan->dptr--;
-		if (chan->dptr == 0)
-			chan->rr[0] &= 0xFE;	/* Clear RX pending */
-		sio2_clear_int(chan, INT_RX);
-		chan->rr[0] &= 0x3F;
-		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read data %d\n", (addr & 2) ? 'b' : 'a', c);
-		if (chan->dptr && (chan->wr[1] & 0x10))
-			sio2_raise_int(chan, INT_RX);
-		return c;
-	}
-	return 0xFF;
-}
-
-static void sio2_write(uint16_t addr, uint8_t val)
-{
-	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
-	uint8_t r;
-	if (!(addr & 1)) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c write reg %d with %02X\n", (addr & 2) ? 'b' : 'a', chan->wr[0] & 7, val);
-		switch (chan->wr[0] & 007) {
-		case 0:
-			chan->wr[0] = val;
-			/* FIXME: CRC reset bits ? */
-			switch (val & 070) {
-			case 000:	/* NULL */
-				break;
-			case 010:	/* Send Abort SDLC */
-				/* SDLC specific no-op for async */
-				break;
-			case 020:	/* Reset external/status interrupts */
-				sio2_clear_int(chan, INT_ERR);
-				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
-				break;
-			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
-					fprintf(stderr, "[channel reset]\n");
-				sio2_channel_reset(chan);
-				break;
-			case 040:	/* Enable interrupt on next rx */
-				chan->rxint = 1;
-				break;
-			case 050:	/* Reset transmitter interrupt pending */
-				chan->txint = 0;
-				sio2_clear_int(chan, INT_TX);
-				break;
-			case 060:	/* Reset the error latches */
-				chan->rr[1] &= 0x8F;
-				break;
-			case 070:	/* Return from interrupt (channel A) */
-				if (chan == sio) {
-					sio->irq = 0;
-					sio->rr[1] &= ~0x02;
-					sio2_clear_int(sio, INT_RX | INT_TX | INT_ERR);
-					sio2_clear_int(sio + 1, INT_RX | INT_TX | INT_ERR);
-				}
-				break;
-			}
-			break;
-		case 1:
-		case 2:
-		case 3:
-		case 4:
-		case 5:
-		case 6:
-		case 7:
-			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
-					(addr & 2) ? 'b' : 'a', r, val);
-			chan->wr[r] = val;
-			if (chan != sio && r == 2)
-				chan->rr[2] = val;
-			chan->wr[0] &= ~007;
-			break;
-		}
-		/* Control */
-	} else {
-		/* Strictly we should emulate this as two bytes, one going out and
-		   the visible queue - FIXME */
-		/* FIXME: irq handling */
-		chan->rr[0] &= ~(1 << 2);	/* Transmit buffer no longer empty */
-		chan->txint = 1;
-		/* Should check chan->wr[5] & 8 */
-		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c write data %d\n", (addr & 2) ? 'b' : 'a', val);
-		if (chan == sio)
-			write(1, &val, 1);
-		else {
-//			write(1, "\033[1m;", 5);
-			write(1, &val,1);
-//			write(1, "\033[0m;", 5);
-		}
-	}
+	if (sio == NULL)
+		return 0;
+	vector = sio_check_im2(sio, chan);
+	if (vector < 0)
+		return 0;
+	live_irq = chan ? IRQ_SIOB : IRQ_SIOA;
+	Z80INT(&cpu_z80, vector);
+	return 1;
 }
 
 static int ide = 0;
 struct ide_controller *ide0;
 
+static int z80_block_io(uint8_t *val, int write);
+
 static uint8_t my_ide_read(uint16_t addr)
 {
-	uint8_t r =  ide_read8(ide0, addr);
+	uint8_t r;
+	if (addr == 0 && z80_block_io(&r, 0))
+		return r;
+	r = ide_read8(ide0, addr);
 	if (trace & TRACE_IDE)
 		fprintf(stderr, "ide read %d = %02X\n", addr, r);
 	return r;
@@ -1040,9 +552,66 @@ static void my_ide_write(uint16_t addr, uint8_t val)
 {
 	if (trace & TRACE_IDE)
 		fprintf(stderr, "ide write %d = %02X\n", addr, val);
+	if (addr == 0 && z80_block_io(&val, 1))
+		return;
 	ide_write8(ide0, addr, val);
 }
 
+/* The DMA can stream the CF data register a sector at a time while the
+   drive has DRQ up. The end of sector and end of command handling, and so
+   the interrupts, are the same as for the CPU. The bus is 8bit so only a
+   drive in 8bit mode gives the same bytes as going through the port */
+static unsigned int dma_io_block(uint16_t port, uint8_t *buf, unsigned int len, int write)
+{
+	uint8_t base = cpuboard == CPUBOARD_MICRO80 ? 0x90 : 0x10;
+
+	if (ide != 1 || (port & 0xFF) != base || (trace & (TRACE_IO | TRACE_IDE)))
+		return 0;
+	if (!ide0->drive[ide0->selected].eightbit || !ide_data_ready(ide0, write))
+		return 0;
+	if (write)
+		return ide_write_block(ide0, buf, len);
+	return ide_read_block(ide0, buf, len);
+}
+
+/* INIR and OTIR on the data register: move the rest of the count, up to
+   the end of the sector, in one go. The I/O the instruction is doing
+   carries the last byte and HL and B are stepped on for the others, so
+   INI or OUTI then finishes as if the loop had run. OTIR leaves N, H and
+   C set from its first byte rather than its last */
+static int z80_block_io(uint8_t *val, int write)
+{
+	uint8_t buf[256];
+	uint16_t hl = cpu_z80.R1.wr.HL;
+	unsigned int len, n, i;
+
+	if (mem_read(0, cpu_z80.PC - 2) != 0xED ||
+	    mem_read(0, cpu_z80.PC - 1) != (write ? 0xB3 : 0xB2))
+		return 0;
+	if (write) {
+		/* OUTI has already counted this byte off B */
+		len = cpu_z80.R1.br.B + 1;
+		buf[0] = *val;
+		for (i = 1; i < len; i++)
+			buf[i] = mem_read(0, hl + i);
+	} else
+		len = cpu_z80.R1.br.B ? cpu_z80.R1.br.B : 256;
+	if (len < 2)
+		return 0;
+	n = dma_io_block(cpu_z80.R1.wr.BC, buf, len, write);
+	if (n == 0)
+		return 0;
+	if (!write) {
+		for (i = 0; i < n - 1; i++)
+			mem_write(0, hl + i, buf[i]);
+		*val = buf[n - 1];
+	}
+	cpu_z80.R1.wr.HL += n - 1;
+	cpu_z80.R1.br.B -= n - 1;
+	cpu_z80.tstates += 21 * (n - 1);
+	return 1;
+}
+
 struct rtc *rtc;
 
 /*
@@ -1050,10 +619,12 @@ struct rtc *rtc;
  */
 
 struct z80_ctc {
-	uint16_t count;
+	uint32_t count;
 	uint16_t reload;
 	uint8_t vector;
 	uint8_t ctrl;
+	uint64_t when;		/* CTC clock count was last worked out */
+	uint64_t due;		/* CTC clock it next passes zero */
 #define CTC_IRQ		0x80
 #define CTC_COUNTER	0x40
 #define CTC_PRESCALER	0x20
@@ -1068,9 +639,13 @@ struct z80_ctc {
 };
 
 #define CTC_STOPPED(c)	(((c)->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET))
+/* Count units per clock, the count is held scaled by 256 */
+#define CTC_SCALE(c)	(((c)->ctrl & CTC_PRESCALER) ? 1 : 16)
 
 struct z80_ctc ctc[4];
 uint8_t ctc_irqmask;
+static uint64_t ctc_now;	/* CTC clocks elapsed */
+static uint64_t ctc_next;	/* Earliest timer event */
 
 static void ctc_reset(struct z80_ctc *c)
 {
@@ -1131,36 +706,83 @@ static int ctc_check_im2(void)
 }
 
 /* Model the chains between the CTC devices */
-static void ctc_receive_pulse(int i);
+static void ctc_receive_pulses(int i, unsigned int n);
 
-static void ctc_pulse(int i)
+static void ctc_pulse(int i, unsigned int n)
 {
 	if (cpuboard != CPUBOARD_SC121) {
 		/* Model CTC 2 chained into CTC 3 */
 		if (i == 2)
-			ctc_receive_pulse(3);
+			ctc_receive_pulses(3, n);
 	}
 	/* The SC121 has 0-2 for SIO baud and only 3 for a timer */
 }
 
 /* We don't worry about edge directions just a logical pulse model */
-static void ctc_receive_pulse(int i)
+static void ctc_receive_pulses(int i, unsigned int n)
 {
 	struct z80_ctc *c = ctc + i;
-	if (c->ctrl & CTC_COUNTER) {
-		if (CTC_STOPPED(c))
-			return;
-		if (c->count >= 0x0100)
-			c->count -= 0x100;	/* No scaling on pulses */
-		if ((c->count & 0xFF00) == 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			c->count = c->reload << 8;
-		}
-	} else {
+	unsigned int count, period;
+
+	if (n == 0)
+		return;
+	if (!(c->ctrl & CTC_COUNTER)) {
 		if (c->ctrl & CTC_PULSE)
 			c->ctrl &= ~CTC_PULSE;
+		return;
+	}
+	if (CTC_STOPPED(c))
+		return;
+	/* Pulses until we next hit zero, then whole reload periods */
+	count = c->count >> 8;
+	if (count == 0)
+		count = 1;
+	if (n < count) {
+		c->count -= n << 8;
+		return;
+	}
+	n -= count;
+	period = c->reload ? c->reload : 256;
+	c->count = (period - n % period) << 8;
+	ctc_interrupt(c);
+	ctc_pulse(i, 1 + n / period);
+}
+
+/*
+ *	Timers are not stepped. Each one holds its count as of CTC clock
+ *	'when' and the clock at which it next passes zero, so that between
+ *	events a tick is just a compare and reads work the count out.
+ */
+static void ctc_catchup(struct z80_ctc *c)
+{
+	int64_t n;
+	unsigned int period, k;
+
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER)) {
+		c->when = ctc_now;
+		return;
+	}
+	n = (int64_t)c->count - (int64_t)(ctc_now - c->when) * CTC_SCALE(c);
+	c->when = ctc_now;
+	if (n >= 0) {
+		c->count = n;
+		return;
 	}
+	period = (c->reload ? c->reload : 256) << 8;
+	k = (-n + period - 1) / period;
+	c->count = n + (int64_t)k * period;
+	ctc_interrupt(c);
+	ctc_pulse(c - ctc, k);
+}
+
+static void ctc_schedule(struct z80_ctc *c)
+{
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER))
+		c->due = UINT64_MAX;
+	else
+		c->due = c->when + c->count / CTC_SCALE(c) + 1;
+	if (c->due < ctc_next)
+		ctc_next = c->due;
 }
 
 /* Model counters */
@@ -1168,45 +790,29 @@ static void ctc_tick(unsigned int clocks)
 {
 	struct z80_ctc *c = ctc;
 	int i;
-	int n;
-	int decby;
 
+	ctc_now += clocks;
+	if (ctc_now < ctc_next)
+		return;
+	ctc_next = UINT64_MAX;
 	for (i = 0; i < 4; i++, c++) {
-		/* Waiting a value */
-		if (CTC_STOPPED(c))
-			continue;
-		/* Pulse trigger mode */
-		if (c->ctrl & CTC_COUNTER)
-			continue;
-		/* 256x downscaled */
-		decby = clocks;
-		/* 16x not 256x downscale - so increase by 16x */
-		if (!(c->ctrl & CTC_PRESCALER))
-			decby <<= 4;
-		/* Now iterate over the events. We need to deal with wraps
-		   because we might have something counters chained */
-		n = c->count - decby;
-		while (n < 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			if (c->reload == 0)
-				n += 256 << 8;
-			else
-				n += c->reload << 8;
-		}
-		c->count = n;
+		if (c->due <= ctc_now)
+			ctc_catchup(c);
+		ctc_schedule(c);
 	}
 }
 
 static void ctc_write(uint8_t channel, uint8_t val)
 {
 	struct z80_ctc *c = ctc + channel;
+	/* Bring the count up to date under the old settings */
+	ctc_catchup(c);
 	if (c->ctrl & CTC_TCONST) {
 		if (trace & TRACE_CTC)
 			fprintf(stderr, "CTC %d constant loaded with %02X\n", channel, val);
 		c->reload = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET)) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -1218,7 +824,7 @@ static void ctc_write(uint8_t channel, uint8_t val)
 			fprintf(stderr, "CTC %d control loaded with %02X\n", channel, val);
 		c->ctrl = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == CTC_RESET) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -1239,164 +845,23 @@ static void ctc_write(uint8_t channel, uint8_t val)
 		if (channel == 0)
 			c->vector = val;
 	}
+	ctc_schedule(c);
 }
 
 static uint8_t ctc_read(uint8_t channel)
 {
-	uint8_t val = ctc[channel].count >> 8;
+	struct z80_ctc *c = ctc + channel;
+	uint8_t val;
+
+	ctc_catchup(c);
+	ctc_schedule(c);
+	val = c->count >> 8;
 	if (trace & TRACE_CTC)
 		fprintf(stderr, "CTC %d reads %02x\n", channel, val);
 	return val;
 }
 
-static int sd_mode = 0;
-static int sd_cmdp = 0;
-static int sd_ext = 0;
-static uint8_t sd_cmd[6];
-static uint8_t sd_in[520];
-static int sd_inlen, sd_inp;
-static uint8_t sd_out[520];
-static int sd_outlen, sd_outp;
-static int sd_fd = -1;
-static off_t sd_lba;
-static const uint8_t sd_csd[17] = {
-
-	0xFE,		/* Sync byte before CSD */
-	/* Taken from a Toshiba 64MB card c/o softgun */
-	0x00, 0x2D, 0x00, 0x32,
-	0x13, 0x59, 0x83, 0xB1,
-	0xF6, 0xD9, 0xCF, 0x80,
-	0x16, 0x40, 0x00, 0x00
-};
-
-static uint8_t sd_process_command(void)
-{
-	if (sd_ext) {
-		sd_ext = 0;
-		switch(sd_cmd[0]) {
-		default:
-			return 0xFF;
-		}
-	}
-	if (trace & TRACE_SD)
-		fprintf(stderr, "Command received %x\n", sd_cmd[0]);
-	switch(sd_cmd[0]) {
-	case 0x40+0:		/* CMD 0 */
-		return 0x01;	/* Just respond 0x01 */
-	case 0x40+1:		/* CMD 1 - leave idle */
-		return 0x00;	/* Immediately indicate we did */
-	case 0x40+9:		/* CMD 9 - read the CSD */
-		memcpy(sd_out,sd_csd, 17);
-		sd_outlen = 17;
-		sd_outp = 0;
-		sd_mode = 2;
-		return 0x00;
-	case 0x40+16:		/* CMD 16 - set block size */
-		/* Should check data is 512 !! FIXME */
-		return 0x00;	/* Sure */
-	case 0x40+17:		/* Read */
-		sd_outlen = 514;
-		sd_outp = 0;
-		/* Sync mark then data */
-		sd_out[0] = 0xFF;
-		sd_out[1] = 0xFE;
-		sd_lba = sd_cmd[4] + 256 * sd_cmd[3] + 65536 * sd_cmd[2] +
-			16777216 * sd_cmd[1];
-		if (trace & TRACE_SD)
-			fprintf(stderr, "Read LBA %lx\n", sd_lba);
-		if (lseek(sd_fd, sd_lba, SEEK_SET) < 0 || read(sd_fd, sd_out + 2, 512) != 512) {
-			if (trace & TRACE_SD)
-				fprintf(stderr, "Read LBA failed.\n");
-			return 0x01;
-		}
-		sd_mode = 2;
-		/* Result */
-		return 0x00;
-	case 0x40+24:		/* Write */
-		/* Will send us FE data FF FF */
-		if (trace & TRACE_SD)
-			fprintf(stderr, "Write LBA %lx\n", sd_lba);
-		sd_inlen = 514;	/* Data FF FF */
-		sd_lba = sd_cmd[4] + 256 * sd_cmd[3] + 65536 * sd_cmd[2] +
-			16777216 * sd_cmd[1];
-		sd_inp = 0;
-		sd_mode = 4;	/* Send a pad then go to mode 3 */
-		return 0x00;	/* The expected OK */
-	case 0x40+55:
-		sd_ext = 1;
-		return 0x01;
-	default:
-		return 0x7F;
-	}
-}
-
-static uint8_t sd_process_data(void)
-{
-	switch(sd_cmd[0]) {
-	case 0x40+24:		/* Write */
-		sd_mode = 0;
-		if (lseek(sd_fd, sd_lba, SEEK_SET) < 0 ||
-			write(sd_fd, sd_in, 512) != 512) {
-			if (trace & TRACE_SD)
-				fprintf(stderr, "Write failed.\n");
-			return 0x1E;	/* Need to look up real values */
-		}
-		return 0x05;	/* Indicate it worked */
-	default:
-		sd_mode = 0;
-		return 0xFF;
-	}
-}
-
-static uint8_t sd_card_byte(uint8_t in)
-{
-	/* No card present */
-	if (sd_fd == -1)
-		return 0xFF;
-
-	if (sd_mode == 0) {
-		if (in != 0xFF) {
-			sd_mode = 1;	/* Command wait */
-			sd_cmdp = 1;
-			sd_cmd[0] = in;
-		}
-		return 0xFF;
-	}
-	if (sd_mode == 1) {
-		sd_cmd[sd_cmdp++] = in;
-		if (sd_cmdp == 6) {	/* Command complete */
-			sd_cmdp = 0;
-			sd_mode = 0;
-			/* Reply with either a stuff byte (CMD12) or a
-			   status */
-			return sd_process_command();
-		}
-		/* Keep talking */
-		return 0xFF;
-	}
-	/* Writing out the response */
-	if (sd_mode == 2) {
-		if (sd_outp + 1 == sd_outlen)
-			sd_mode = 0;
-		return sd_out[sd_outp++];
-	}
-	/* Commands that need input blocks first */
-	if (sd_mode == 3) {
-		sd_in[sd_inp++] = in;
-		if (sd_inp == sd_inlen)
-			return sd_process_data();
-		/* Keep sending */
-		return 0xFF;
-	}
-	/* Sync up before data flow starts */
-	if (sd_mode == 4) {
-		/* Sync */
-		if (in == 0xFE)
-			sd_mode = 3;
-		return 0xFF;
-	}
-	return 0xFF;
-}
+static struct sdcard *sdcard;
 
 struct z80_pio {
 	uint8_t data[2];
@@ -1418,44 +883,57 @@ static uint8_t pio_cs;
 
 static uint8_t spi_byte_sent(uint8_t val)
 {
-	uint8_t r = sd_card_byte(val);
+	uint8_t r = sdcard_byte(sdcard, val);
 	if (trace & TRACE_SPI)
 		fprintf(stderr,	"[SPI %02X:%02X]\n", val, r);
 	return r;
 }
 
+static uint8_t spi_bits;
+static uint8_t spi_bitct;
+static uint8_t rxbits = 0xFF;
+
+#define spi_deselected()	((pio_cs & 0x03) == 0x01)
+
+/* Port C bits 1-0 are the card select */
+static void spi_select(uint8_t val)
+{
+	uint8_t was = spi_deselected();
+
+	pio_cs = val & 7;
+	if (was == spi_deselected())
+		return;
+	if (was) {
+		if (trace & TRACE_SPI)
+			fprintf(stderr, "[Lowered \\CS]\n");
+		return;
+	}
+	if (trace & TRACE_SPI)
+		fprintf(stderr,	"[Raised \\CS]\n");
+	spi_bits = 0;
+	spi_bitct = 0;
+	rxbits = 0xFF;
+	sdcard_select(sdcard, 0);
+}
+
 /* Bit 2: CLK, 1: MOSI, 0: MISO */
 static void bitbang_spi(uint8_t val)
 {
 	static uint8_t old = 0xFF;
-	static uint8_t oldcs = 1;
-	static uint8_t bits;
-	static uint8_t bitct;
-	static uint8_t rxbits = 0xFF;
 	uint8_t delta = old ^ val;
 
 	old = val;
 
-	if ((pio_cs & 0x03) == 0x01) {		/* CS high - deselected */
-		if ((trace & TRACE_SPI) && !oldcs)
-			fprintf(stderr,	"[Raised \\CS]\n");
-		bits = 0;
-		sd_mode = 0;	/* FIXME: layering */
-		oldcs = 1;
+	if (spi_deselected())
 		return;
-	}
-	if ((trace & TRACE_SPI) && oldcs)
-		fprintf(stderr, "[Lowered \\CS]\n");
-	oldcs = 0;
 	/* Capture clock edge */
 	if (delta & 0x04) {		/* Clock edge */
 		if (val & 0x04) {	/* Rising - capture in SPI0 */
-			bits <<= 1;
-			bits |= (val & 0x02) ? 1 : 0;
-			bitct++;
-			if (bitct == 8) {
-				rxbits = spi_byte_sent(bits);
-				bitct = 0;
+			spi_bits <<= 1;
+			spi_bits |= (val & 0x02) ? 1 : 0;
+			if (++spi_bitct == 8) {
+				rxbits = spi_byte_sent(spi_bits);
+				spi_bitct = 0;
 			}
 		} else {
 			/* Falling edge */
@@ -1474,7 +952,7 @@ void pio_data_write(struct z80_pio *pio, uint8_t port, uint8_t val)
 	if (port == 1)
 		bitbang_spi(val);
 	else if (port == 2)
-		pio_cs = val & 7;
+		spi_select(val);
 }
 
 void pio_strobe(struct z80_pio *pio, uint8_t port)
@@ -1785,13 +1263,15 @@ static uint8_t io_read_2014(uint16_t addr)
 	if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
 		return acia_read(acia, addr & 1);
 	if ((addr >= 0x80 && addr <= 0x83) && sio2)
-		return sio2_read(addr & 3);
+		return sio_read(sio, addr & 3);
 	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
 		return my_ide_read(addr & 7);
 	if (addr >= 0x20 && addr <= 0x27 && ide == 2)
 		return ppide_read(ppide, addr & 3);
 	if (addr >= 0x28 && addr <= 0x2C && wiznet)
 		return nic_w5100_read(wiz, addr & 3);
+	if (addr == 0x04 && dma)
+		return z80dma_read(dma);
 	if (addr == 0xC0 && rtc)
 		return rtc_read(rtc);
 	/* Scott Baker is 0x90-93, suggested defaults for the
@@ -1800,7 +1280,7 @@ static uint8_t io_read_2014(uint16_t addr)
 	if (addr >= 0x88 && addr <= 0x8B && have_ctc)
 		return ctc_read(addr & 3);
 	if (addr >= 0xC8 && addr <= 0xD0 && has_16x50)
-		return uart_read(&uart[0], addr & 7);
+		return uart16x50_read(uart, addr & 7);
 	if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
@@ -1818,13 +1298,15 @@ static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
 	else if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
 		acia_write(acia, addr & 1, val);
 	else if ((addr >= 0x80 && addr <= 0x83) && sio2)
-		sio2_write(addr & 3, val);
+		sio_write(sio, addr & 3, val);
 	else if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
 		my_ide_write(addr & 7, val);
 	else if (addr >= 0x20 && addr <= 0x27 && ide == 2)
 		ppide_write(ppide, addr & 3, val);
 	else if (addr >= 0x28 && addr <= 0x2C && wiznet)
 		nic_w5100_write(wiz, addr & 3, val);
+	else if (addr == 0x04 && dma)
+		z80dma_write(dma, val);
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
@@ -1839,7 +1321,7 @@ static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
 	else if (addr >= 0x88 && addr <= 0x8B && have_ctc)
 		ctc_write(addr & 3, val);
 	else if (addr >= 0xC8 && addr <= 0xCF && has_16x50)
-		uart_write(&uart[0], addr & 7, val);
+		uart16x50_write(uart, addr & 7, val);
 	else if (switchrom && addr == 0x38)
 		toggle_rom();
 	else if (addr == 0xFD) {
@@ -1860,7 +1342,7 @@ static uint8_t io_read_4(uint16_t addr)
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr >= 0x80 && addr <= 0x83)
-		return sio2_read((addr & 3) ^ 1);
+		return sio_read(sio, (addr & 3) ^ 1);
 	if ((addr >= 0x10 && addr <= 0x17) && ide)
 		return my_ide_read(addr & 7);
 	if (addr >= 0x28 && addr <= 0x2C && wiznet)
@@ -1880,7 +1362,7 @@ static void io_write_4(uint16_t addr, uint8_t val)
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr >= 0x80 && addr <= 0x83)
-		sio2_write((addr & 3) ^ 1, val);
+		sio_write(sio, (addr & 3) ^ 1, val);
 	else if ((addr >= 0x10 && addr <= 0x17) && ide)
 		my_ide_write(addr & 7, val);
 	else if (addr >= 0x28 && addr <= 0x2C && wiznet)
@@ -2002,13 +1484,16 @@ static uint8_t io_read_micro80(uint16_t addr)
 	if (r >= 0x10 && r <= 0x13)
 		return ctc_read(addr & 3);
 	else if (r >= 0x18 && r <= 0x1B)
-		return sio2_read((r & 3) ^ 1);
+		return sio_read(sio, (r & 3) ^ 1);
 	else if (r >= 0x1C && r <= 0x1F)
 		return pio_read(r & 3);
 	else if (r >= 0xEE && r <= 0xF1)
 		return z84c15_read(r);
 	else if (r >= 0x90 && r <= 0x97)
 		return my_ide_read(r & 7);
+	/* Not real hardware: a byte wide SPI port, chip select is the PIO */
+	else if (r == 0xFC)
+		return spi_deselected() ? 0xFF : sdcard_spi_port(sdcard, 0xFF);
 	else if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
@@ -2020,13 +1505,17 @@ static void io_write_micro80(uint16_t addr, uint8_t val)
 	if (r >= 0x10 && r <= 0x13)
 		ctc_write(addr & 3, val);
 	else if (r >= 0x18 && r <= 0x1B)
-		sio2_write((r & 3) ^ 1, val);
+		sio_write(sio, (r & 3) ^ 1, val);
 	else if (r >= 0x1C && r <= 0x1F)
 		pio_write(r & 3, val);
 	else if ((r >= 0xEE && r <= 0xF1) || r == 0xF4)
 		z84c15_write(r, val);
 	else if (r >= 0x90 && r <= 0x97)
 		my_ide_write(r & 0x07, val);
+	else if (r == 0xFC) {
+		if (!spi_deselected())
+			sdcard_spi_port(sdcard, val);
+	}
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
@@ -2088,16 +1577,18 @@ static void poll_irq_event(void)
 	if (has_im2) {
 		if (acia)
 			acia_check_irq(acia);
-		uart_check_irq(&uart[0]);
+		if (uart)
+			uart_check_irq(uart);
 		if (!live_irq) {
-			!sio2_check_im2(sio) && !sio2_check_im2(sio + 1) &&
+			!sio2_check_im2(0) && !sio2_check_im2(1) &&
 			!ctc_check_im2();
 		}
 	} else {
 		if (acia)
 			acia_check_irq(acia);
-		uart_check_irq(&uart[0]);
-		!sio2_check_im2(sio) && !sio2_check_im2(sio + 1);
+		if (uart)
+			uart_check_irq(uart);
+		!sio2_check_im2(0) && !sio2_check_im2(1);
 		ctc_check_im2();
 	}
 }
@@ -2109,10 +1600,10 @@ static void reti_event(void)
 	if (has_im2) {
 		switch(live_irq) {
 		case IRQ_SIOA:
-			sio2_reti(sio);
+			sio_reti(sio, 0);
 			break;
 		case IRQ_SIOB:
-			sio2_reti(sio + 1);
+			sio_reti(sio, 1);
 			break;
 		case IRQ_CTC:
 		case IRQ_CTC + 1:
@@ -2126,8 +1617,8 @@ static void reti_event(void)
 		   time. I think they can also fight over the vector but ignore
 		   that */
 		if (sio2) {
-			sio2_reti(sio);
-			sio2_reti(sio + 1);
+			sio_reti(sio, 0);
+			sio_reti(sio, 1);
 		}
 		if (have_ctc) {
 			ctc_reti(0);
@@ -2155,7 +1646,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014: [-a] [-A] [-b] [-c] [-f] [-R] [-m mainboard] [-r rompath] [-e rombank] [-s] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014: [-a] [-A] [-b] [-c] [-D] [-f] [-R] [-m mainboard] [-r rompath] [-e rombank] [-s] [-T real|max] [-P port] [-w] [-N loop|bench] [-W] [-d debug] [-C clock]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -2169,9 +1660,14 @@ int main(int argc, char *argv[])
 	char *rompath = "rc2014.rom";
 	char *sdpath = NULL;
 	char *idepath = NULL;
+	char *portspec = NULL;
+	unsigned int baud = SERIAL_BAUD_DEFAULT;
 	int save = 0;
+	int synctick = 0;
 	int has_acia = 0;
 	int indev;
+	unsigned int blkflags = 0;
+	int vnet = -1;
 
 #define INDEV_ACIA	1
 #define INDEV_SIO	2
@@ -2182,7 +1678,7 @@ int main(int argc, char *argv[])
 	while (p < ramrom + sizeof(ramrom))
 		*p++= rand();
 
-	while ((opt = getopt(argc, argv, "Aabcd:e:fi:I:m:pr:sRuw8")) != -1) {
+	while ((opt = getopt(argc, argv, "C:AabcDd:e:fi:I:m:N:pP:r:sRT:uwW8")) != -1) {
 		switch (opt) {
 		case 'a':
 			has_acia = 1;
@@ -2239,6 +1735,7 @@ int main(int argc, char *argv[])
 			break;
 		case 'u':
 			has_16x50 = 1;
+			indev = INDEV_16C550A;
 			break;
 		case 'm':
 			/* Default Z80 board */
@@ -2308,12 +1805,37 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'C':
+			if (vclock_option(optarg))
+				usage();
+			break;
 		case 'R':
 			rtc = rtc_create();
 			break;
+		case 'D':
+			dma = z80dma_create();
+			break;
 		case 'w':
 			wiznet = 1;
 			break;
+		case 'N':
+			if (strcmp(optarg, "loop") == 0)
+				vnet = 0;
+			else if (strcmp(optarg, "bench") == 0)
+				vnet = 1;
+			else
+				usage();
+			wiznet = 1;
+			break;
+		case 'W':
+			blkflags |= BLKDEV_WRITEBACK;
+			break;
+		case 'P':
+			portspec = optarg;
+			break;
+		case 'T':
+			baud = serial_baud_mode(optarg);
+			break;
 		default:
 			usage();
 		}
@@ -2321,10 +1843,18 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	if (portspec) {
+		if (!sio2) {
+			fprintf(stderr, "rc2014: -P needs an SIO.\n");
+			exit(EXIT_FAILURE);
+		}
+		sio_port = serial_open(portspec);
+	}
+
 	if (cpuboard == CPUBOARD_Z80SBC64) {
 		cpld_serial = 1;
 		indev = INDEV_CPLD;
-	} else if (acia == 0 && sio2 == 0) {
+	} else if (acia == 0 && sio2 == 0 && !has_16x50) {
 		if (cpuboard != 3) {
 			fprintf(stderr, "rc2014: no UART selected, defaulting to 68B50\n");
 			has_acia = 1;
@@ -2419,7 +1949,7 @@ int main(int argc, char *argv[])
 				perror(idepath);
 				ide = 0;
 			}
-			if (ide_attach(ide0, 0, ide_fd) == 0) {
+			if (ide_attach_blkdev(ide0, 0, blkdev_open(ide_fd, blkflags)) == 0) {
 				ide = 1;
 				ide_reset_begin(ide0);
 			}
@@ -2435,37 +1965,61 @@ int main(int argc, char *argv[])
 			perror(idepath);
 			ide = 0;
 		} else
-			ppide_attach(ppide, 0, ide_fd);
+			ide_attach_blkdev(ppide->ide, 0, blkdev_open(ide_fd, blkflags));
 		if (trace & TRACE_PPIDE)
 			ppide_trace(ppide, 1);
 		ide = 0;
 	}
 
+	sdcard = sdcard_create();
+	if (trace & TRACE_SD)
+		sdcard_trace(sdcard, 1);
 	if (sdpath) {
-		sd_fd = open(sdpath, O_RDWR);
+		int sd_fd = open(sdpath, O_RDWR);
 		if (sd_fd == -1) {
 			perror(sdpath);
 			exit(1);
 		}
+		sdcard_attach(sdcard, blkdev_open(sd_fd, blkflags));
 	}
 
 	if (has_acia) {
 		acia = acia_create();
 		if (trace & TRACE_ACIA)
 			acia_trace(acia, 1);
+		acia_set_baud(acia, baud);
 	}
 	if (rtc && (trace & TRACE_RTC))
 		rtc_trace(rtc, 1);
-	if (sio2)
-		sio_reset();
+	if (dma) {
+		z80dma_set_mmu(dma, dma_mmu);
+		z80dma_set_io_block(dma, dma_io_block);
+		if (trace & TRACE_DMA)
+			z80dma_trace(dma, 1);
+	}
+	if (sio2) {
+		sio = sio_create();
+		if (trace & TRACE_SIO)
+			sio_trace(sio, 1);
+		sio_set_input(sio, 0, sio2_input);
+		sio_set_baud(sio, 0, baud);
+		sio_attach(sio, 1, sio_port);
+	}
 	if (have_ctc)
 		ctc_init();
-	if (has_16x50)
-		uart_init(&uart[0]);
+	if (has_16x50) {
+		uart = uart16x50_create();
+		if (trace & TRACE_UART)
+			uart16x50_trace(uart, 1);
+		uart16x50_set_output(uart, 1);
+		uart16x50_set_baud(uart, baud);
+	}
 
 	if (wiznet) {
 		wiz = nic_w5100_alloc();
 		nic_w5100_reset(wiz);
+		if (vnet != -1)
+			nic_w5100_set_vnet(wiz, vnet_create(vnet));
 	}
 
 
@@ -2475,10 +2029,13 @@ int main(int argc, char *argv[])
 		acia_set_input(acia, 1);
 		break;
 	case INDEV_SIO:
-		sio2_input = 1;
+		sio_set_input(sio, 0, 1);
 		break;
 	case INDEV_CPLD:
 		break;
+	case INDEV_16C550A:
+		uart16x50_set_input(uart, 1);
+		break;
 	default:
 		fprintf(stderr, "Invalid input device %d.\n", indev);
 	}
@@ -2490,6 +2047,9 @@ int main(int argc, char *argv[])
 	tc.tv_sec = 0;
 	tc.tv_nsec = 5000000L;
 
+	/* Make sure a write back disk cache is flushed if we are killed */
+	signal(SIGTERM, cleanup);
+
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -2523,13 +2083,21 @@ int main(int argc, char *argv[])
 		int i;
 		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
-			Z80ExecuteTStates(&cpu_z80, tstate_steps);
+			/* The DMA takes its share of the bus first */
+			if (dma)
+				Z80ExecuteTStates(&cpu_z80, z80_dma_run(dma, tstate_steps));
+			else
+				Z80ExecuteTStates(&cpu_z80, tstate_steps);
 			if (acia)
-				acia_timer(acia);
+				acia_timer(acia, 50000);
 			if (sio2)
-				sio2_timer();
-			if (has_16x50)
-				uart_event(&uart[0]);
+				sio_timer(sio, 50000);
+			if (wiznet)
+				w5100_timer(wiz, 50000);
+			serial_poll();
+			/* Every board runs 50us slices */
+			if (uart)
+				uart16x50_timer(uart, 50000);
 			if (cpld_serial)
 				sbc64_cpld_timer();
 			if (have_ctc) {
@@ -2539,21 +2107,22 @@ int main(int argc, char *argv[])
 					ctc_tick(184);
 			}
 			if (cpuboard == CPUBOARD_EASYZ80) {
-				/* Feed the uart clock into the CTC */
-				int c;
-				/* 10Mhz so calculate for 500 tstates.
+				/* Feed the uart clock into the CTC.
+				   10Mhz so calculate for 500 tstates.
 				   CTC 2 runs at half uart clock */
-				for (c = 0; c < 46; c++) {
-					ctc_receive_pulse(0);
-					ctc_receive_pulse(1);
-					ctc_receive_pulse(2);
-					ctc_receive_pulse(0);
-					ctc_receive_pulse(1);
-				}
+				ctc_receive_pulses(0, 92);
+				ctc_receive_pulses(1, 92);
+				ctc_receive_pulses(2, 46);
 			}
 		}
 		if (wiznet)
 			w5100_process(wiz);
+		/* Write back dirty disk blocks about once a second */
+		if ((blkflags & BLKDEV_WRITEBACK) && ++synctick == 200) {
+			blkdev_sync_all();
+			synctick = 0;
+		}
+		vclock_tick(tc.tv_nsec);
 		/* Do 5ms of I/O and delays */
 		if (!fast)
 			nanosleep(&tc, NULL);
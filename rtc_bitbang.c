@@ -5,11 +5,12 @@
 #include <time.h>
 #include "system.h"
 #include "rtc_bitbang.h"
+#include "vclock.h"
 
 
 /* Real time clock state machine and related state.
 
-   Give the host time and don't emulate time setting except for
+   Give the guest clock time and don't emulate time setting except for
    the 24/12 hour setting.
    
  */
@@ -26,7 +27,7 @@ struct rtc {
 	uint8_t clock24;
 	uint8_t bp;
 	uint8_t bc;
-	struct tm *tm;
+	const struct tm *tm;
 	int trace;
 };
 
@@ -204,8 +205,7 @@ void rtc_write(struct rtc *rtc, uint8_t val)
 			rtc->state = 0;
 		} else {
 			/* Latch imaginary registers on rising edge */
-			time_t t = time(NULL);
-			rtc->tm = localtime(&t);
+			rtc->tm = vclock_tm(1);
 			if (rtc->trace)
 				fprintf(stderr, "RTC CE raised and latched time.\n");
 		}
@@ -35,6 +35,8 @@
 #include <time.h>
 #include <unistd.h>
 #include "libz80/z80.h"
+#include "sio.h"
+#include "serial.h"
 #include "ide.h"
 
 static uint8_t ram[512 * 1024];
@@ -123,7 +125,7 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
 	ram[addr + banknum * 32768] = val;
 }
 
-static int check_chario(void)
+int check_chario(void)
 {
 	fd_set i, o;
 	struct timeval tv;
@@ -147,7 +149,7 @@ static int check_chario(void)
 	return r;
 }
 
-static unsigned int next_char(void)
+unsigned int next_char(void)
 {
 	char c;
 	if (read(0, &c, 1) != 1) {
@@ -159,353 +161,40 @@ static unsigned int next_char(void)
 	return c;
 }
 
-static void recalc_interrupts(void)
+void recalc_interrupts(void)
 {
 	int_recalc = 1;
 }
 
 
-struct z80_sio_chan {
-	uint8_t wr[8];
-	uint8_t rr[3];
-	uint8_t data[3];
-	uint8_t dptr;
-	uint8_t irq;
-	uint8_t rxint;
-	uint8_t txint;
-	uint8_t intbits;
-#define INT_TX	1
-#define INT_RX	2
-#define INT_ERR	4
-	uint8_t pending;	/* Interrupt bits pending as an IRQ cause */
-	uint8_t vector;		/* Vector pending to deliver */
-};
-
-static struct z80_sio_chan sio[2];
+static struct sio *sio;
 
-/*
- *	Interrupts. We don't handle IM2 yet.
- */
-
-static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	if (trace & TRACE_IRQ) {
-		fprintf(stderr, "Clear intbits %d %x\n",
-			(int)(chan - sio), m);
-	}
-	chan->intbits &= ~m;
-	chan->pending &= ~m;
-	/* Check me - does it auto clear down or do you have to reti it ? */
-	if (!(sio->intbits | sio[1].intbits)) {
-		sio->rr[1] &= ~0x02;
-		chan->irq = 0;
-	}
-	recalc_interrupts();
-}
-
-static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	uint8_t new = (chan->intbits ^ m) & m;
-	uint8_t vector;
-	chan->intbits |= m;
-	if ((trace & TRACE_SIO) && new)
-		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
-	if (new) {
-		if (!sio->irq) {
-			chan->irq = 1;
-			sio->rr[1] |= 0x02;
-			vector = 0; /* sio[1].wr[2]; */
-			/* This is a subset of the real options. FIXME: add
-			   external status change */
-			if (sio[1].wr[1] & 0x04) {
-				vector &= 0xF1;
-				if (chan == sio)
-					vector |= 1 << 3;
-				if (chan->intbits & INT_RX)
-					vector |= 4;
-				else if (chan->intbits & INT_ERR)
-					vector |= 2;
-			}
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "SIO2 interrupt %02X\n", vector);
-			chan->vector = vector;
-			recalc_interrupts();
-		}
-	}
-}
-
-static void sio2_reti(struct z80_sio_chan *chan)
-{
-	/* Recalculate the pending state and vectors */
-	/* FIXME: what really goes here */
-	sio->irq = 0;
-	recalc_interrupts();
-}
-
-static int sio2_check_im2(struct z80_sio_chan *chan)
-{
-	/* See if we have an IRQ pending and if so deliver it and return 1 */
-	if (chan->irq) {
-		/* FIXME: quick fix for now but the vector calculation should all be
-		   done here it seems */
-		if (sio[1].wr[1] & 0x04)
-			chan->vector += (sio[1].wr[2] & 0xF1);
-		else
-			chan->vector += sio[1].wr[2];
-		if (trace & (TRACE_IRQ|TRACE_SIO))
-			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
-				(int)(chan - sio), chan->vector);
-		if (chan == sio)
-			live_irq = IRQ_SIOA;
-		else
-			live_irq = IRQ_SIOB;
-		Z80INT(&cpu_z80, chan->vector);
-		return 1;
-	}
-	return 0;
-}
-
-
-/*
- *	The SIO replaces the last character in the FIFO on an
- *	overrun.
- */
-static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
-{
-	if (trace & TRACE_SIO)
-		fprintf(stderr, "SIO %d queue %d: ",
-			(int) (chan - sio), c);
-	/* Receive disabled */
-	if (!(chan->wr[3] & 1)) {
-		fprintf(stderr, "RX disabled.\n");
-		return;
-	}
-	/* Overrun */
-	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Overrun.\n");
-		chan->data[2] = c;
-		chan->rr[1] |= 0x20;	/* Overrun flagged */
-		/* What are the rules for overrun delivery FIXME */
-		sio2_raise_int(chan, INT_ERR);
-	} else {
-		/* FIFO add */
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Queued %d (mode %d)\n",
-				chan->dptr, chan->wr[1] & 0x18);
-		chan->data[chan->dptr++] = c;
-		chan->rr[0] |= 1;
-		switch (chan->wr[1] & 0x18) {
-		case 0x00:
-			break;
-		case 0x08:
-			if (chan->dptr == 1)
-				sio2_raise_int(chan, INT_RX);
-			break;
-		case 0x10:
-		case 0x18:
-			sio2_raise_int(chan, INT_RX);
-			break;
-		}
-	}
-	/* Need to deal with interrupt results */
-}
-
-static void sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
-{
-	if (ab == 0) {
-		int c = check_chario();
-		if (c & 1)
-			sio2_queue(chan, next_char());
-		if (c & 2) {
-			if (!(chan->rr[0] & 0x04)) {
-				chan->rr[0] |= 0x04;
-				if (chan->wr[1] & 0x02)
-					sio2_raise_int(chan, INT_TX);
-			}
-		}
-	} else {
-		if (!(chan->rr[0] & 0x04)) {
-			chan->rr[0] |= 0x04;
-			if (chan->wr[1] & 0x02)
-				sio2_raise_int(chan, INT_TX);
-		}
-	}
-}
-
-static void sio2_timer(void)
-{
-	sio2_channel_timer(sio, 0);
-	sio2_channel_timer(sio + 1, 1);
-}
-
-static void sio2_channel_reset(struct z80_sio_chan *chan)
-{
-	chan->rr[0] = 0x2C;
-	chan->rr[1] = 0x01;
-	chan->rr[2] = 0;
-	sio2_clear_int(chan, INT_RX | INT_TX | INT_ERR);
-}
-
-static void sio_reset(void)
+static int sio2_check_im2(unsigned int chan)
 {
-	sio2_channel_reset(sio);
-	sio2_channel_reset(sio + 1);
+	int vector = sio_check_im2(sio, chan);
+	if (vector < 0)
+		return 0;
+	live_irq = chan ? IRQ_SIOB : IRQ_SIOA;
+	Z80INT(&cpu_z80, vector);
+	return 1;
 }
 
-static uint8_t sio2_read(uint16_t addr)
+/* The channel is on A0 and control/data on A1 */
+static uint8_t sio_addr(uint16_t addr)
 {
-	struct z80_sio_chan *chan = (addr & 1) ? sio + 1 : sio;
-	if (addr & 2) {
-		/* Control */
-		uint8_t r = chan->wr[0] & 007;
-		chan->wr[0] &= ~007;
-
-		chan->rr[0] &= ~2;
-		if (chan == sio && (sio[0].intbits | sio[1].intbits))
-			chan->rr[0] |= 2;
-
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read reg %d = ",
-				(addr & 1) ? 'b' : 'a', r);
-		switch (r) {
-		case 0:
-		case 1:
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "%02X\n", chan->rr[r]);
-			return chan->rr[r];
-		case 2:
-			if (chan != sio) {
-				if (trace & TRACE_SIO)
-					fprintf(stderr, "%02X\n",
-						chan->rr[2]);
-				return chan->rr[2];
-			}
-		case 3:
-			/* What does the hw report ?? */
-			fprintf(stderr, "INVALID(0xFF)\n");
-			return 0xFF;
-		}
-	} else {
-		/* FIXME: irq handling */
-		uint8_t c = chan->data[0];
-		chan->data[0] = chan->data[1];
-		chan->data[1] = chan->data[2];
-		if (chan->dptr)
-			chan->dptr--;
-		if (chan->dptr == 0)
-			chan->rr[0] &= 0xFE;	/* Clear RX pending */
-		sio2_clear_int(chan, INT_RX);
-		chan->rr[0] &= 0x3F;
-		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read data %d\n",
-				(addr & 1) ? 'b' : 'a', c);
-		if (chan->dptr && (chan->wr[1] & 0x10))
-			sio2_raise_int(chan, INT_RX);
-		return c;
-	}
-	return 0xFF;
+	return ((addr & 1) << 1) | !(addr & 2);
 }
 
-static void sio2_write(uint16_t addr, uint8_t val)
-{
-	struct z80_sio_chan *chan = (addr & 1) ? sio + 1 : sio;
-	uint8_t r;
-	if (addr & 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr,
-				"sio%c write reg %d with %02X\n",
-				(addr & 1) ? 'b' : 'a',
-				chan->wr[0] & 7, val);
-		switch (chan->wr[0] & 007) {
-		case 0:
-			chan->wr[0] = val;
-			/* FIXME: CRC reset bits ? */
-			switch (val & 070) {
-			case 000:	/* NULL */
-				break;
-			case 010:	/* Send Abort SDLC */
-				/* SDLC specific no-op for async */
-				break;
-			case 020:	/* Reset external/status interrupts */
-				sio2_clear_int(chan, INT_ERR);
-				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
-				if (trace & TRACE_SIO)
-					fprintf(stderr,
-						"[extint reset]\n");
-				break;
-			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
-					fprintf(stderr,
-						"[channel reset]\n");
-				sio2_channel_reset(chan);
-				break;
-			case 040:	/* Enable interrupt on next rx */
-				chan->rxint = 1;
-				break;
-			case 050:	/* Reset transmitter interrupt pending */
-				chan->txint = 0;
-				break;
-			case 060:	/* Reset the error latches */
-				chan->rr[1] &= 0x8F;
-				break;
-			case 070:	/* Return from interrupt (channel A) */
-				if (chan == sio) {
-					sio->irq = 0;
-					sio->rr[1] &= ~0x02;
-					sio2_clear_int(sio,
-						       INT_RX |
-						       INT_TX | INT_ERR);
-					sio2_clear_int(sio + 1,
-						       INT_RX |
-						       INT_TX | INT_ERR);
-				}
-				break;
-			}
-			break;
-		case 1:
-		case 2:
-		case 3:
-		case 4:
-		case 5:
-		case 6:
-		case 7:
-			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
-					(addr & 1) ? 'b' : 'a', r, val);
-			chan->wr[r] = val;
-			if (chan != sio && r == 2)
-				chan->rr[2] = val;
-			chan->wr[0] &= ~007;
-			break;
-		}
-		/* Control */
-	} else {
-		/* Strictly we should emulate this as two bytes, one going out and
-		   the visible queue - FIXME */
-		/* FIXME: irq handling */
-		chan->rr[0] &= ~(1 << 2);	/* Transmit buffer no longer empty */
-		chan->txint = 1;
-		/* Should check chan->wr[5] & 8 */
-		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c write data %d\n",
-				(addr & 1) ? 'b' : 'a', val);
-		write(1, &val, 1);
-	}
-}
 
-/* Clock timer hack. 10Hz timer wired to DCD */
 static void timer_pulse(void)
 {
+    static int dcd = 1;	/* Comes out of reset high */
+
     if (timerhack) {
-	sio[0].rr[0] ^= 0x08;
+	dcd = !dcd;
 	if (trace & TRACE_SIO)
-	    fprintf(stderr, "DCD1 is now %s.\n", sio[0].rr[0]&0x08 ? "high" : "low");
-	if (sio[0].wr[1] & 1)
-	    sio2_raise_int(sio, INT_ERR);	/* External / status int */
+	    fprintf(stderr, "DCD1 is now %s.\n", dcd ? "high" : "low");
+	sio_set_dcd(sio, 0, dcd);	/* External / status int */
     }
 }
 
@@ -550,7 +239,7 @@ static uint8_t io_read(int unused, uint16_t addr)
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x03)
-		return sio2_read(addr & 3);
+		return sio_read(sio, sio_addr(addr));
 	if (addr >= 0x10 && addr <= 0x17)
 		return my_ide_read(addr & 7);
 	if (trace & TRACE_UNK)
@@ -564,7 +253,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x03)
-		sio2_write(addr & 3, val);
+		sio_write(sio, sio_addr(addr), val);
 	else if (addr >= 0x10 && addr <= 0x17)
 		my_ide_write(addr & 7, val);
 	else if (addr == 0x30)
@@ -578,12 +267,14 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 
 static void poll_irq_event(void)
 {
-	sio2_check_im2(sio);
+	if (!sio2_check_im2(0))
+		sio2_check_im2(1);
 }
 
 static void reti_event(void)
 {
-	sio2_reti(sio);
+	sio_reti(sio, 0);
+	sio_reti(sio, 1);
 	live_irq = 0;
 	poll_irq_event();
 }
@@ -604,7 +295,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "sbc2g: [-f] [-b] [-t] [-i path] [-r path] [-d debug]\n");
+	fprintf(stderr, "sbc2g: [-f] [-b] [-t] [-i path] [-r path] [-T real|max] [-P port] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -616,8 +307,10 @@ int main(int argc, char *argv[])
 	int l;
 	char *rompath = "sbc2g.rom";
 	char *idepath = "sbc2g.cf";
+	unsigned int baud = SERIAL_BAUD_DEFAULT;
+	char *portspec = NULL;
 
-	while ((opt = getopt(argc, argv, "d:i:r:ft")) != -1) {
+	while ((opt = getopt(argc, argv, "d:i:r:ftT:P:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -635,6 +328,12 @@ int main(int argc, char *argv[])
 		case 't':
 			timerhack = 1;
 			break;
+		case 'T':
+			baud = serial_baud_mode(optarg);
+			break;
+		case 'P':
+			portspec = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -667,7 +366,13 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	sio_reset();
+	sio = sio_create();
+	if (trace & TRACE_SIO)
+		sio_trace(sio, 1);
+	sio_set_input(sio, 0, 1);
+	sio_set_baud(sio, 0, baud);
+	if (portspec)
+		sio_attach(sio, 1, serial_open(portspec));
 
 	/* 5ms - it's a balance between nice behaviour and simulation
 	   smoothness */
@@ -707,8 +412,10 @@ int main(int argc, char *argv[])
 			/* 36400 T states */
 			for (i = 0; i < 100; i++) {
 				Z80ExecuteTStates(&cpu_z80, 364);
-				sio2_timer();
+				sio_timer(sio, 50000);
 			}
+			/* Console input and any attached port */
+			serial_poll();
 			/* Do 5ms of I/O and delays */
 			if (!fast)
 				nanosleep(&tc, NULL);
@@ -0,0 +1,412 @@
+/*
+ *	SD/MMC card in SPI mode
+ *
+ *	Single (CMD17/CMD24) and multiple (CMD18/CMD25) block transfers. A
+ *	multiple block read keeps streaming blocks until CMD12 arrives, and
+ *	relies on the block cache read-ahead to turn that into a few large
+ *	host reads. Images over 2GB behave as SDHC: a host that asks for
+ *	high capacity in ACMD41 gets CCS set in the OCR, a version 2 CSD and
+ *	block rather than byte addressing. Anything else sees a byte
+ *	addressed card as before.
+ *
+ *	No CRC checking, erase, CID or SD status.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blkdev.h"
+#include "sdcard.h"
+
+#define SD_READY	0	/* Waiting for a command */
+#define SD_COMMAND	1	/* Collecting the command bytes */
+#define SD_SEND		2	/* Sending out[] */
+#define SD_RECEIVE	3	/* Collecting a data block */
+#define SD_SYNC		4	/* Waiting for a data token */
+
+#define SD_HC_BLOCKS	4194304	/* Over 2GB is high capacity */
+
+/* R1 bits */
+#define R1_IDLE		0x01
+#define R1_ILLEGAL	0x04
+#define R1_ADDRESS	0x20
+#define R1_PARAMETER	0x40
+
+struct sdcard {
+	struct blkdev *blk;
+	unsigned int mode;
+	uint8_t cmd[6];
+	unsigned int cmdp;
+	uint8_t ext;		/* Previous command was CMD55 */
+	uint8_t idle;		/* Not yet initialised */
+	uint8_t hccap;		/* Image is big enough to be SDHC */
+	uint8_t hc;		/* Block addressing agreed */
+	uint8_t multi;		/* CMD18/CMD25 in progress */
+	off_t lba;		/* Next block to transfer */
+	uint8_t in[514];	/* Data and CRC */
+	unsigned int inp;
+	uint8_t out[516];	/* Gap, token, data and CRC */
+	unsigned int outlen, outp;
+	uint8_t ncr;		/* Random response delays */
+	unsigned int stuff;
+	uint8_t poststuff;
+	uint8_t reply;		/* Last byte shifted back */
+	uint8_t trace;
+};
+
+static const uint8_t sd_csd[17] = {
+
+	0xFE,		/* Sync byte before CSD */
+	/* Taken from a Toshiba 64MB card c/o softgun */
+	0x00, 0x2D, 0x00, 0x32,
+	0x13, 0x59, 0x83, 0xB1,
+	0xF6, 0xD9, 0xCF, 0x80,
+	0x16, 0x40, 0x00, 0x00
+};
+
+static uint32_t sd_arg(struct sdcard *sd)
+{
+	return ((uint32_t)sd->cmd[1] << 24) | ((uint32_t)sd->cmd[2] << 16) |
+		(sd->cmd[3] << 8) | sd->cmd[4];
+}
+
+/* Turn the command argument into a block number */
+static int sd_address(struct sdcard *sd)
+{
+	uint32_t arg = sd_arg(sd);
+
+	if (sd->hc) {
+		sd->lba = arg;
+		return 0;
+	}
+	if (arg & 511)
+		return -1;
+	sd->lba = arg >> 9;
+	return 0;
+}
+
+static void sd_send(struct sdcard *sd, unsigned int len)
+{
+	sd->outlen = len;
+	sd->outp = 0;
+	sd->mode = SD_SEND;
+}
+
+/* Queue the next block of a read, or an error token if it fails */
+static int sd_read_block(struct sdcard *sd)
+{
+	if (sd->trace)
+		fprintf(stderr, "Read LBA %llx\n", (long long)sd->lba);
+	/* Gap, then the data token */
+	sd->out[0] = 0xFF;
+	sd->out[1] = 0xFE;
+	if (blkdev_read(sd->blk, sd->lba, sd->out + 2) < 0) {
+		if (sd->trace)
+			fprintf(stderr, "Read LBA failed.\n");
+		sd->out[1] = 0x08;	/* Out of range */
+		sd->multi = 0;
+		sd_send(sd, 2);
+		return -1;
+	}
+	/* We don't do CRCs */
+	sd->out[514] = 0xFF;
+	sd->out[515] = 0xFF;
+	sd->lba++;
+	sd_send(sd, 516);
+	return 0;
+}
+
+/* Version 2 CSD describing the image */
+static void sd_csd_v2(struct sdcard *sd)
+{
+	uint32_t csize = blkdev_blocks(sd->blk) / 1024 - 1;
+	uint8_t *p = sd->out;
+
+	memset(p, 0, 17);
+	p[0] = 0xFE;
+	p[1] = 0x40;		/* CSD_STRUCTURE 1 */
+	p[2] = 0x0E;		/* TAAC */
+	p[4] = 0x32;		/* 25MHz */
+	p[5] = 0x5B;		/* Command classes, 512 byte blocks */
+	p[6] = 0x59;
+	p[8] = (csize >> 16) & 0x3F;
+	p[9] = csize >> 8;
+	p[10] = csize;
+	p[11] = 0x7F;
+	p[12] = 0x80;
+	p[13] = 0x0A;
+	p[14] = 0x40;
+	p[16] = 0x01;
+}
+
+static uint8_t sd_app_command(struct sdcard *sd)
+{
+	switch(sd->cmd[0]) {
+	case 0x40+41:		/* ACMD 41 - initialise */
+		sd->idle = 0;
+		if (sd->hccap && (sd->cmd[1] & 0x40))
+			sd->hc = 1;
+		return 0x00;
+	case 0x40+23:		/* ACMD 23 - pre-erase count for CMD25 */
+		return 0x00;
+	default:
+		return 0xFF;
+	}
+}
+
+static uint8_t sd_process_command(struct sdcard *sd)
+{
+	uint8_t r1;
+
+	if (sd->ext) {
+		sd->ext = 0;
+		return sd_app_command(sd);
+	}
+	if (sd->trace)
+		fprintf(stderr, "Command received %x\n", sd->cmd[0]);
+	r1 = sd->idle ? R1_IDLE : 0;
+	switch(sd->cmd[0]) {
+	case 0x40+0:		/* CMD 0 */
+		sd->idle = 1;
+		sd->hc = 0;
+		sd->multi = 0;
+		return R1_IDLE;
+	case 0x40+1:		/* CMD 1 - leave idle */
+		sd->idle = 0;
+		return 0x00;	/* Immediately indicate we did */
+	case 0x40+8:		/* CMD 8 - interface condition */
+		/* Voltage accepted and the check pattern echoed */
+		sd->out[0] = 0x00;
+		sd->out[1] = 0x00;
+		sd->out[2] = sd->cmd[3] & 0x0F;
+		sd->out[3] = sd->cmd[4];
+		sd_send(sd, 4);
+		return r1;
+	case 0x40+9:		/* CMD 9 - read the CSD */
+		if (sd->hc)
+			sd_csd_v2(sd);
+		else
+			memcpy(sd->out, sd_csd, 17);
+		sd_send(sd, 17);
+		return r1;
+	case 0x40+12:		/* CMD 12 - stop a multiple block read */
+		sd->multi = 0;
+		/* A stuff byte then R1 */
+		sd->out[0] = r1;
+		sd_send(sd, 1);
+		return 0xFF;
+	case 0x40+13:		/* CMD 13 - status */
+		sd->out[0] = 0x00;
+		sd_send(sd, 1);
+		return r1;
+	case 0x40+16:		/* CMD 16 - set block size */
+		if (sd_arg(sd) != 512)
+			return r1 | R1_PARAMETER;
+		return r1;
+	case 0x40+17:		/* CMD 17 - read a block */
+	case 0x40+18:		/* CMD 18 - read until CMD 12 */
+		if (sd_address(sd))
+			return r1 | R1_ADDRESS;
+		sd->multi = sd->cmd[0] == 0x40+18;
+		if (sd_read_block(sd) && !sd->multi) {
+			sd->mode = SD_READY;
+			return r1 | R1_PARAMETER;
+		}
+		return r1;
+	case 0x40+24:		/* CMD 24 - write a block */
+	case 0x40+25:		/* CMD 25 - write until stop token */
+		/* Will send us FE data CRC, or FC data CRC .. FD */
+		if (sd_address(sd))
+			return r1 | R1_ADDRESS;
+		if (sd->trace)
+			fprintf(stderr, "Write LBA %llx\n", (long long)sd->lba);
+		sd->multi = sd->cmd[0] == 0x40+25;
+		sd->mode = SD_SYNC;
+		return r1;
+	case 0x40+55:		/* CMD 55 - application command follows */
+		sd->ext = 1;
+		return r1;
+	case 0x40+58:		/* CMD 58 - read the OCR */
+		sd->out[0] = (sd->idle ? 0x00 : 0x80) | (sd->hc ? 0x40 : 0x00);
+		sd->out[1] = 0xFF;	/* 2.7-3.6V */
+		sd->out[2] = 0x80;
+		sd->out[3] = 0x00;
+		sd_send(sd, 4);
+		return r1;
+	default:
+		return r1 | R1_ILLEGAL;
+	}
+}
+
+/* Command complete: reply now or after a random Ncr delay */
+static uint8_t sd_response(struct sdcard *sd)
+{
+	uint8_t r = sd_process_command(sd);
+	if (!sd->ncr)
+		return r;
+	sd->stuff = 1 + (rand() & 7);
+	sd->poststuff = r;
+	return 0xFF;
+}
+
+static uint8_t sd_process_data(struct sdcard *sd)
+{
+	sd->mode = SD_READY;
+	if (blkdev_write(sd->blk, sd->lba, sd->in) < 0) {
+		if (sd->trace)
+			fprintf(stderr, "Write failed.\n");
+		sd->multi = 0;
+		return 0x0D;	/* Write error */
+	}
+	sd->lba++;
+	if (sd->multi)
+		sd->mode = SD_SYNC;
+	return 0x05;	/* Indicate it worked */
+}
+
+static uint8_t sd_byte(struct sdcard *sd, uint8_t in)
+{
+	uint8_t r;
+
+	/* No card present */
+	if (sd->blk == NULL)
+		return 0xFF;
+
+	/* Stuffing on commands */
+	if (sd->stuff) {
+		if (--sd->stuff)
+			return 0xFF;
+		return sd->poststuff;
+	}
+
+	switch(sd->mode) {
+	case SD_READY:
+		if (in != 0xFF) {
+			sd->mode = SD_COMMAND;
+			sd->cmdp = 1;
+			sd->cmd[0] = in;
+		}
+		return 0xFF;
+	case SD_COMMAND:
+		sd->cmd[sd->cmdp++] = in;
+		if (sd->cmdp == 6) {	/* Command complete */
+			sd->cmdp = 0;
+			sd->mode = SD_READY;
+			return sd_response(sd);
+		}
+		/* Keep talking */
+		return 0xFF;
+	case SD_SEND:
+		/* A multiple block read listens for CMD 12 as it goes */
+		if (sd->multi && (sd->cmdp || (in & 0xC0) == 0x40)) {
+			sd->cmd[sd->cmdp++] = in;
+			if (sd->cmdp == 6) {
+				sd->cmdp = 0;
+				sd->mode = SD_READY;
+				return sd_response(sd);
+			}
+		}
+		r = sd->out[sd->outp++];
+		if (sd->outp == sd->outlen) {
+			if (sd->multi)
+				sd_read_block(sd);
+			else
+				sd->mode = SD_READY;
+		}
+		return r;
+	case SD_RECEIVE:
+		sd->in[sd->inp++] = in;
+		if (sd->inp == sizeof(sd->in))
+			return sd_process_data(sd);
+		/* Keep sending */
+		return 0xFF;
+	case SD_SYNC:
+		/* Data token, or the end of a multiple block write */
+		if (in == (sd->multi ? 0xFC : 0xFE)) {
+			sd->inp = 0;
+			sd->mode = SD_RECEIVE;
+		} else if (in == 0xFD && sd->multi) {
+			sd->multi = 0;
+			sd->mode = SD_READY;
+		}
+		return 0xFF;
+	}
+	return 0xFF;
+}
+
+uint8_t sdcard_byte(struct sdcard *sd, uint8_t in)
+{
+	sd->reply = sd_byte(sd, in);
+	return sd->reply;
+}
+
+/*
+ *	Emulator only byte wide SPI port. Each access sends a byte (FF for
+ *	a read) and returns the reply to the byte before, the same one byte
+ *	lag a bit banged PIO loop sees.
+ */
+uint8_t sdcard_spi_port(struct sdcard *sd, uint8_t in)
+{
+	uint8_t r = sd->reply;
+
+	sdcard_byte(sd, in);
+	return r;
+}
+
+/* Chip select: dropping it abandons whatever was going on */
+void sdcard_select(struct sdcard *sd, int onoff)
+{
+	if (onoff)
+		return;
+	sd->reply = 0xFF;
+	sd->mode = SD_READY;
+	sd->cmdp = 0;
+	sd->multi = 0;
+	sd->stuff = 0;
+}
+
+void sdcard_attach(struct sdcard *sd, struct blkdev *blk)
+{
+	sd->blk = blk;
+	sd->hccap = blkdev_blocks(blk) > SD_HC_BLOCKS;
+}
+
+void sdcard_set_ncr(struct sdcard *sd, int onoff)
+{
+	sd->ncr = onoff;
+}
+
+void sdcard_trace(struct sdcard *sd, int onoff)
+{
+	sd->trace = onoff;
+}
+
+void sdcard_reset(struct sdcard *sd)
+{
+	sd->mode = SD_READY;
+	sd->cmdp = 0;
+	sd->ext = 0;
+	sd->idle = 1;
+	sd->hc = 0;
+	sd->multi = 0;
+	sd->stuff = 0;
+	sd->reply = 0xFF;
+}
+
+struct sdcard *sdcard_create(void)
+{
+	struct sdcard *sd = malloc(sizeof(struct sdcard));
+	if (sd == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	memset(sd, 0, sizeof(struct sdcard));
+	sdcard_reset(sd);
+	return sd;
+}
+
+void sdcard_free(struct sdcard *sd)
+{
+	free(sd);
+}
@@ -0,0 +1,25 @@
+#ifndef __SDCARD_H
+#define __SDCARD_H
+
+#include <stdint.h>
+
+struct sdcard;
+struct blkdev;
+
+/*
+ *	SD card in SPI mode. The board's SPI layer passes each byte the
+ *	host clocks out to sdcard_byte() and gets back the byte the card
+ *	shifts out in exchange.
+ */
+
+extern struct sdcard *sdcard_create(void);
+extern void sdcard_free(struct sdcard *sd);
+extern void sdcard_reset(struct sdcard *sd);
+extern void sdcard_trace(struct sdcard *sd, int onoff);
+extern void sdcard_attach(struct sdcard *sd, struct blkdev *blk);
+extern void sdcard_set_ncr(struct sdcard *sd, int onoff);
+extern void sdcard_select(struct sdcard *sd, int onoff);
+extern uint8_t sdcard_byte(struct sdcard *sd, uint8_t in);
+extern uint8_t sdcard_spi_port(struct sdcard *sd, uint8_t in);
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ *	Host side serial ports for the emulated UARTs
+ *
+ *	The console is stdin/stdout. Any other channel can be attached to a
+ *	pseudo terminal, a socket or a file (see serial.h). A UART can also
+ *	take the console as a port, so that its input is gathered here with
+ *	everything else instead of the UART polling stdin itself.
+ *	Each port has a receive and a transmit ring buffer. The UART side
+ *	only ever touches the rings, and serial_poll() is called by the board
+ *	at slice boundaries to move data between the rings and the host with
+ *	a single epoll_wait for all the ports, plus a readv/writev per busy
+ *	port. A bulk transfer on one port thus costs a few system calls per
+ *	slice rather than several per byte, and never holds up the console.
+ */
+
+#define _GNU_SOURCE		/* posix_openpt and friends */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "serial.h"
+
+#define SERIAL_RING	4096
+
+#define SERIAL_PTY	0
+#define SERIAL_SOCKET	1
+#define SERIAL_FILE	2
+#define SERIAL_READ	3
+#define SERIAL_CONSOLE	4
+
+struct ring {
+	uint8_t buf[SERIAL_RING];
+	unsigned int head;
+	unsigned int count;
+};
+
+struct serial {
+	struct serial *next;
+	char *name;
+	unsigned int type;
+	unsigned int baud;
+	int fd;			/* Data descriptor, -1 if none */
+	int lfd;		/* Listening socket */
+	int slave;		/* Our hold on the pty slave */
+	int armed;		/* Descriptor is in the epoll set */
+	uint32_t events;	/* and the events asked for */
+	uint8_t nopoll;		/* Console on a plain file, just read it */
+	struct ring rx;
+	struct ring tx;
+};
+
+static struct serial *ports;
+static struct serial *console;
+static int epfd = -1;
+
+/* The free part of a ring as at most two pieces */
+static int ring_space(struct ring *r, struct iovec *iov)
+{
+	unsigned int tail = (r->head + r->count) % SERIAL_RING;
+	unsigned int free = SERIAL_RING - r->count;
+
+	iov[0].iov_base = r->buf + tail;
+	if (tail + free <= SERIAL_RING) {
+		iov[0].iov_len = free;
+		return 1;
+	}
+	iov[0].iov_len = SERIAL_RING - tail;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = free - iov[0].iov_len;
+	return 2;
+}
+
+/* The used part of a ring as at most two pieces */
+static int ring_data(struct ring *r, struct iovec *iov)
+{
+	iov[0].iov_base = r->buf + r->head;
+	if (r->head + r->count <= SERIAL_RING) {
+		iov[0].iov_len = r->count;
+		return 1;
+	}
+	iov[0].iov_len = SERIAL_RING - r->head;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = r->count - iov[0].iov_len;
+	return 2;
+}
+
+static void serial_disarm(struct serial *s, int fd)
+{
+	if (s->armed)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	s->armed = 0;
+}
+
+/* Ask for input only while there is room and output only when there is
+   something to send. A socket with no client just waits for one */
+static void serial_arm(struct serial *s)
+{
+	struct epoll_event ev;
+	uint32_t want = 0;
+	int fd = s->fd;
+
+	if (fd == -1) {
+		if (s->lfd == -1)
+			return;
+		fd = s->lfd;
+		want = EPOLLIN;
+	} else {
+		if (s->rx.count < SERIAL_RING)
+			want |= EPOLLIN;
+		if (s->tx.count)
+			want |= EPOLLOUT;
+	}
+	if (s->armed && want == s->events)
+		return;
+	ev.events = want;
+	ev.data.ptr = s;
+	if (epoll_ctl(epfd, s->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	s->armed = 1;
+	s->events = want;
+}
+
+/* Client gone, pty broken or the replayed file has run out */
+static void serial_hangup(struct serial *s)
+{
+	serial_disarm(s, s->fd);
+	/* Leave stdin to anyone else using it, and carry on printing */
+	if (s->type == SERIAL_CONSOLE) {
+		s->fd = -1;
+		return;
+	}
+	if (s->type != SERIAL_READ)
+		fprintf(stderr, "serial: %s disconnected.\n", s->name);
+	close(s->fd);
+	s->fd = -1;
+	s->tx.count = 0;
+}
+
+static void serial_accept(struct serial *s)
+{
+	int fd = accept(s->lfd, NULL, NULL);
+
+	if (fd == -1)
+		return;
+	/* One client at a time, the rest wait in the backlog */
+	serial_disarm(s, s->lfd);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	s->fd = fd;
+	fprintf(stderr, "serial: %s connected.\n", s->name);
+}
+
+static void serial_fill(struct serial *s)
+{
+	struct iovec iov[2];
+	ssize_t n;
+
+	if (s->rx.count == SERIAL_RING)
+		return;
+	n = readv(s->fd, iov, ring_space(&s->rx, iov));
+	if (n > 0)
+		s->rx.count += n;
+	else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+		serial_hangup(s);
+}
+
+static void serial_drain(struct serial *s)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	if (s->tx.count == 0)
+		return;
+	if (s->type == SERIAL_SOCKET) {
+		/* A client going away mid write must not kill the emulator */
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = ring_data(&s->tx, iov);
+		n = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+	} else
+		n = writev(s->fd, iov, ring_data(&s->tx, iov));
+	if (n > 0) {
+		s->tx.head = (s->tx.head + n) % SERIAL_RING;
+		s->tx.count -= n;
+	} else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+		if (s->type == SERIAL_FILE) {
+			perror(s->name);
+			exit(1);
+		}
+		serial_hangup(s);
+	}
+}
+
+void serial_poll(void)
+{
+	struct epoll_event ev[16];
+	struct serial *s;
+	int n, i;
+
+	for (s = ports; s; s = s->next) {
+		/* Plain files can't be polled and never block */
+		if (s->type == SERIAL_FILE)
+			serial_drain(s);
+		else if (s->type == SERIAL_READ || s->nopoll) {
+			if (s->fd != -1)
+				serial_fill(s);
+		} else
+			serial_arm(s);
+	}
+	if (epfd == -1)
+		return;
+	n = epoll_wait(epfd, ev, 16, 0);
+	if (n == -1) {
+		if (errno == EINTR)
+			return;
+		perror("epoll_wait");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		s = ev[i].data.ptr;
+		if (s->fd == -1) {
+			serial_accept(s);
+			continue;
+		}
+		if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			serial_fill(s);
+		if (s->fd != -1 && (ev[i].events & EPOLLOUT))
+			serial_drain(s);
+	}
+}
+
+/* Bit 0: a byte is waiting, bit 1: there is room to send, as check_chario */
+unsigned int serial_ready(struct serial *s)
+{
+	unsigned int r = 0;
+
+	if (s->rx.count)
+		r |= 1;
+	if (s->tx.count < SERIAL_RING)
+		r |= 2;
+	return r;
+}
+
+uint8_t serial_getc(struct serial *s)
+{
+	uint8_t c;
+
+	if (s->rx.count == 0)
+		return 0;
+	c = s->rx.buf[s->rx.head];
+	s->rx.head = (s->rx.head + 1) % SERIAL_RING;
+	s->rx.count--;
+	return c;
+}
+
+void serial_putc(struct serial *s, uint8_t c)
+{
+	/* Console output isn't held back, it goes out as it always did */
+	if (s->type == SERIAL_CONSOLE) {
+		write(1, &c, 1);
+		return;
+	}
+	/* Nobody listening, or nowhere for it to go */
+	if (s->fd == -1 || s->type == SERIAL_READ || s->tx.count == SERIAL_RING)
+		return;
+	s->tx.buf[(s->tx.head + s->tx.count) % SERIAL_RING] = c;
+	s->tx.count++;
+}
+
+const char *serial_name(struct serial *s)
+{
+	return s->name;
+}
+
+unsigned int serial_baud(struct serial *s)
+{
+	return s->baud;
+}
+
+unsigned int serial_baud_mode(const char *name)
+{
+	if (strcmp(name, "real") == 0)
+		return SERIAL_BAUD_REAL;
+	if (strcmp(name, "max") == 0)
+		return SERIAL_BAUD_MAX;
+	fprintf(stderr, "serial: baud mode must be real or max.\n");
+	exit(1);
+}
+
+static int serial_pty(struct serial *s)
+{
+	struct termios t;
+	const char *slave;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd == -1 || grantpt(fd) || unlockpt(fd) ||
+	    (slave = ptsname(fd)) == NULL)
+		return -1;
+	/* Hold the slave open so the master doesn't see a hangup every time
+	   the program on the other end exits */
+	s->slave = open(slave, O_RDWR | O_NOCTTY);
+	if (s->slave == -1)
+		return -1;
+	if (tcgetattr(s->slave, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(s->slave, TCSANOW, &t);
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fprintf(stderr, "serial: %s is %s.\n", s->name, slave);
+	s->fd = fd;
+	return 0;
+}
+
+static int serial_listen(struct serial *s, const char *spec)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *sa;
+	socklen_t len;
+	int one = 1;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(spec + 5) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(sun.sun_path, spec + 5);
+		unlink(sun.sun_path);
+		sa = (struct sockaddr *)&sun;
+		len = sizeof(sun);
+	} else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(spec + 4));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa = (struct sockaddr *)&sin;
+		len = sizeof(sin);
+	}
+	s->lfd = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (s->lfd == -1)
+		return -1;
+	setsockopt(s->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(s->lfd, sa, len) == -1 || listen(s->lfd, 1) == -1)
+		return -1;
+	fcntl(s->lfd, F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+struct serial *serial_open(const char *name)
+{
+	struct serial *s = calloc(1, sizeof(struct serial));
+	const char *opt = strchr(name, ',');
+	char *spec;
+	int r;
+
+	if (s == NULL || (s->name = strdup(name)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	/* The name is the port, then any options */
+	spec = s->name;
+	if (opt) {
+		if (strncmp(opt, ",baud=", 6)) {
+			fprintf(stderr, "serial: unknown option '%s'.\n", opt + 1);
+			exit(1);
+		}
+		s->baud = serial_baud_mode(opt + 6);
+		spec = strndup(name, opt - name);
+		if (spec == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	s->fd = -1;
+	s->lfd = -1;
+	s->slave = -1;
+
+	if (strcmp(spec, "pty") == 0) {
+		s->type = SERIAL_PTY;
+		r = serial_pty(s);
+	} else if (strncmp(spec, "unix:", 5) == 0 || strncmp(spec, "tcp:", 4) == 0) {
+		s->type = SERIAL_SOCKET;
+		r = serial_listen(s, spec);
+	} else if (strncmp(spec, "file:", 5) == 0) {
+		s->type = SERIAL_FILE;
+		r = s->fd = open(spec + 5, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	} else if (strncmp(spec, "read:", 5) == 0) {
+		s->type = SERIAL_READ;
+		r = s->fd = open(spec + 5, O_RDONLY);
+	} else {
+		fprintf(stderr, "serial: unknown port type '%s'.\n", spec);
+		exit(1);
+	}
+	if (r == -1) {
+		perror(spec);
+		exit(1);
+	}
+	if (epfd == -1 && (s->type == SERIAL_PTY || s->type == SERIAL_SOCKET)) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1) {
+			perror("epoll_create1");
+			exit(1);
+		}
+	}
+	if (spec != s->name)
+		free(spec);
+	s->next = ports;
+	ports = s;
+	return s;
+}
+
+/*
+ *	The console as a port. Only input goes through the ring. If stdin is
+ *	a plain file it can't go in the epoll set, so it is read directly at
+ *	each poll.
+ */
+struct serial *serial_console(void)
+{
+	struct serial *s;
+	struct epoll_event ev;
+
+	if (console)
+		return console;
+	s = calloc(1, sizeof(struct serial));
+	if (s == NULL || (s->name = strdup("console")) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	s->type = SERIAL_CONSOLE;
+	s->fd = 0;
+	s->lfd = -1;
+	s->slave = -1;
+	if (epfd == -1) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1) {
+			perror("epoll_create1");
+			exit(1);
+		}
+	}
+	/* Try it now so we know which way to read it */
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, 0, &ev) == 0) {
+		s->armed = 1;
+		s->events = EPOLLIN;
+	} else if (errno == EPERM)
+		s->nopoll = 1;
+	else {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	s->next = ports;
+	ports = s;
+	console = s;
+	return s;
+}
+
+void serial_close(struct serial *s)
+{
+	struct serial **p = &ports;
+
+	while (*p != s)
+		p = &(*p)->next;
+	*p = s->next;
+	if (s->type == SERIAL_FILE)
+		serial_drain(s);
+	if (s == console) {
+		console = NULL;
+		serial_disarm(s, 0);
+	} else if (s->fd != -1) {
+		serial_disarm(s, s->fd);
+		close(s->fd);
+	} else if (s->lfd != -1)
+		serial_disarm(s, s->lfd);
+	if (s->lfd != -1)
+		close(s->lfd);
+	if (s->slave != -1)
+		close(s->slave);
+	free(s->name);
+	free(s);
+}
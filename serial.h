@@ -0,0 +1,38 @@
+#ifndef __SERIAL_H
+#define __SERIAL_H
+
+#include <stdint.h>
+
+/*
+ *	Host side of an emulated serial port. A port is one of
+ *
+ *	pty		a pseudo terminal, the slave name is reported on stderr
+ *	unix:path	a listening Unix domain socket
+ *	tcp:port	a listening TCP socket on localhost
+ *	file:path	output is captured to a file
+ *	read:path	the file is replayed as input
+ *
+ *	Sockets take one client at a time, output with nobody connected is
+ *	discarded. Any of them can be followed by ,baud=real or ,baud=max to
+ *	set the pacing of the UART the port is attached to.
+ */
+
+/* How fast an emulated UART moves bytes */
+#define SERIAL_BAUD_DEFAULT	0	/* Whatever the UART normally does */
+#define SERIAL_BAUD_REAL	1	/* At the programmed bit rate */
+#define SERIAL_BAUD_MAX		2	/* As soon as the guest takes the last */
+
+struct serial;
+
+extern unsigned int serial_baud_mode(const char *name);
+extern struct serial *serial_open(const char *spec);
+extern struct serial *serial_console(void);
+extern void serial_close(struct serial *s);
+extern unsigned int serial_ready(struct serial *s);
+extern uint8_t serial_getc(struct serial *s);
+extern void serial_putc(struct serial *s, uint8_t c);
+extern const char *serial_name(struct serial *s);
+extern unsigned int serial_baud(struct serial *s);
+extern void serial_poll(void);
+
+#endif
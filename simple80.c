@@ -42,7 +42,10 @@
 #include <time.h>
 #include <unistd.h>
 #include "libz80/z80.h"
+#include "sio.h"
+#include "serial.h"
 #include "ide.h"
+#include "vclock.h"
 
 static uint8_t ram[512 * 1024];
 static uint8_t rom[65536];
@@ -137,7 +140,7 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
 	ram[addr + 65536 * banknum] = val;
 }
 
-static int check_chario(void)
+int check_chario(void)
 {
 	fd_set i, o;
 	struct timeval tv;
@@ -161,7 +164,7 @@ static int check_chario(void)
 	return r;
 }
 
-static unsigned int next_char(void)
+unsigned int next_char(void)
 {
 	char c;
 	if (read(0, &c, 1) != 1) {
@@ -173,391 +176,97 @@ static unsigned int next_char(void)
 	return c;
 }
 
-static void recalc_interrupts(void)
+void recalc_interrupts(void)
 {
 	int_recalc = 1;
 }
 
 
-struct z80_sio_chan {
-	uint8_t wr[8];
-	uint8_t rr[3];
-	uint8_t data[3];
-	uint8_t dptr;
-	uint8_t irq;
-	uint8_t rxint;
-	uint8_t txint;
-	uint8_t intbits;
-#define INT_TX	1
-#define INT_RX	2
-#define INT_ERR	4
-	uint8_t pending;	/* Interrupt bits pending as an IRQ cause */
-	uint8_t vector;		/* Vector pending to deliver */
-};
-
-static struct z80_sio_chan sio[2];
+static struct sio *sio;
 
-/*
- *	Interrupts. We don't handle IM2 yet.
- */
-
-static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
+static int sio2_check_im2(unsigned int chan)
 {
-	if (trace & TRACE_IRQ) {
-		fprintf(stderr, "Clear intbits %d %x\n",
-			(int)(chan - sio), m);
-	}
-	chan->intbits &= ~m;
-	chan->pending &= ~m;
-	/* Check me - does it auto clear down or do you have to reti it ? */
-	if (!(sio->intbits | sio[1].intbits)) {
-		sio->rr[1] &= ~0x02;
-		chan->irq = 0;
-	}
-	recalc_interrupts();
+	int vector = sio_check_im2(sio, chan);
+	if (vector < 0)
+		return 0;
+	live_irq = chan ? IRQ_SIOB : IRQ_SIOA;
+	Z80INT(&cpu_z80, vector);
+	return 1;
 }
 
-static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
-{
-	uint8_t new = (chan->intbits ^ m) & m;
-	uint8_t vector;
-	chan->intbits |= m;
-	if ((trace & TRACE_SIO) && new)
-		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
-	if (new) {
-		if (!sio->irq) {
-			chan->irq = 1;
-			sio->rr[1] |= 0x02;
-			vector = 0; /* sio[1].wr[2]; */
-			/* This is a subset of the real options. FIXME: add
-			   external status change */
-			if (sio[1].wr[1] & 0x04) {
-				vector &= 0xF1;
-				if (chan == sio)
-					vector |= 1 << 3;
-				if (chan->intbits & INT_RX)
-					vector |= 4;
-				else if (chan->intbits & INT_ERR)
-					vector |= 2;
-			}
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "SIO2 interrupt %02X\n", vector);
-			chan->vector = vector;
-			recalc_interrupts();
-		}
-	}
-}
-
-static void sio2_reti(struct z80_sio_chan *chan)
-{
-	/* Recalculate the pending state and vectors */
-	/* FIXME: what really goes here */
-	sio->irq = 0;
-	recalc_interrupts();
-}
-
-static int sio2_check_im2(struct z80_sio_chan *chan)
+/* Data and control are the other way around to the usual SIO wiring */
+static uint8_t sio2_read(uint16_t addr)
 {
-	/* See if we have an IRQ pending and if so deliver it and return 1 */
-	if (chan->irq) {
-		/* FIXME: quick fix for now but the vector calculation should all be
-		   done here it seems */
-		if (sio[1].wr[1] & 0x04)
-			chan->vector += (sio[1].wr[2] & 0xF1);
-		else
-			chan->vector += sio[1].wr[2];
-		if (trace & (TRACE_IRQ|TRACE_SIO))
-			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
-				(int)(chan - sio), chan->vector);
-		if (chan == sio)
-			live_irq = IRQ_SIOA;
-		else
-			live_irq = IRQ_SIOB;
-		Z80INT(&cpu_z80, chan->vector);
-		return 1;
-	}
-	return 0;
+	return sio_read(sio, addr ^ 1);
 }
 
-
 /*
- *	The SIO replaces the last character in the FIFO on an
- *	overrun.
+ *	The memory mapping hangs off the W/RDY pins (WR1 bit 6) and the
+ *	DTR/RTS outputs in WR5. Work out which register the write lands in
+ *	then follow the pins.
  */
-static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
+static void sio2_write(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_SIO)
-		fprintf(stderr, "SIO %d queue %d: ",
-			(int) (chan - sio), c);
-	/* Receive disabled */
-	if (!(chan->wr[3] & 1)) {
-		fprintf(stderr, "RX disabled.\n");
-		return;
-	}
-	/* Overrun */
-	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Overrun.\n");
-		chan->data[2] = c;
-		chan->rr[1] |= 0x20;	/* Overrun flagged */
-		/* What are the rules for overrun delivery FIXME */
-		sio2_raise_int(chan, INT_ERR);
-	} else {
-		/* FIFO add */
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "Queued %d (mode %d)\n",
-				chan->dptr, chan->wr[1] & 0x18);
-		chan->data[chan->dptr++] = c;
-		chan->rr[0] |= 1;
-		switch (chan->wr[1] & 0x18) {
-		case 0x00:
-			break;
-		case 0x08:
-			if (chan->dptr == 1)
-				sio2_raise_int(chan, INT_RX);
-			break;
-		case 0x10:
-		case 0x18:
-			sio2_raise_int(chan, INT_RX);
-			break;
+	unsigned int chan = (addr & 2) ? 1 : 0;
+	uint8_t r = 0;
+
+	if (addr & 1)
+		r = sio_get_wr(sio, chan, 0) & 7;
+	sio_write(sio, addr ^ 1, val);
+
+	if (r == 1) {
+		if (chan == 0) {
+			romen = (val & 0x40) ? 0 : 1;
+			if (trace & TRACE_BANK)
+				fprintf(stderr, "[ROMen = %d.]\n", romen);
+		} else if (!r16bug && !boardmod) {
+			banknum = (val & 0x40) ? 0 : 1;
+			if (trace & TRACE_BANK)
+				fprintf(stderr, "[RAM A16 = %d.]\n", banknum);
 		}
 	}
-	/* Need to deal with interrupt results */
-}
-
-static void sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
-{
-	if (ab == 0) {
-		int c = check_chario();
-		if (c & 1)
-			sio2_queue(chan, next_char());
-		if (c & 2) {
-			if (!(chan->rr[0] & 0x04)) {
-				chan->rr[0] |= 0x04;
-				if (chan->wr[1] & 0x02)
-					sio2_raise_int(chan, INT_TX);
-			}
-		}
-	} else {
-		if (!(chan->rr[0] & 0x04)) {
-			chan->rr[0] |= 0x04;
-			if (chan->wr[1] & 0x02)
-				sio2_raise_int(chan, INT_TX);
+	if (r != 5)
+		return;
+	if (chan == 0) {
+		/* Setting DTRA high sets the pin low which turns on
+		   the RAM */
+		ramen = (val & 0x80) ? 1 : 0;
+		if (trace & TRACE_BANK)
+			fprintf(stderr, "[RAMen = %d.]\n", ramen);
+	}
+	if (boardmod) {
+		/* Modified board */
+		if (chan == 0 && ram512) {
+			banknum &= ~0x04;
+			/* RTSA is A18 */
+			banknum |= (val & 0x02) ? 0x00 : 0x04;
+			if (trace & TRACE_BANK)
+				fprintf(stderr, "[banknum = %d.]\n", banknum);
 		}
-	}
-}
-
-static void sio2_timer(void)
-{
-	sio2_channel_timer(sio, 0);
-	sio2_channel_timer(sio + 1, 1);
-}
-
-static void sio2_channel_reset(struct z80_sio_chan *chan)
-{
-	chan->rr[0] = 0x2C;
-	chan->rr[1] = 0x01;
-	chan->rr[2] = 0;
-	sio2_clear_int(chan, INT_RX | INT_TX | INT_ERR);
-}
-
-static void sio_reset(void)
-{
-	sio2_channel_reset(sio);
-	sio2_channel_reset(sio + 1);
-}
-
-static uint8_t sio2_read(uint16_t addr)
-{
-	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
-	if (addr & 1) {
-		/* Control */
-		uint8_t r = chan->wr[0] & 007;
-		chan->wr[0] &= ~007;
-
-		chan->rr[0] &= ~2;
-		if (chan == sio && (sio[0].intbits | sio[1].intbits))
-			chan->rr[0] |= 2;
-
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read reg %d = ",
-				(addr & 2) ? 'b' : 'a', r);
-		switch (r) {
-		case 0:
-		case 1:
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "%02X\n", chan->rr[r]);
-			return chan->rr[r];
-		case 2:
-			if (chan != sio) {
-				if (trace & TRACE_SIO)
-					fprintf(stderr, "%02X\n",
-						chan->rr[2]);
-				return chan->rr[2];
+		/* DTRB is A17, RTSB is A16 */
+		if (chan == 1) {
+			banknum &= ~0x03;
+			/* DTRB is A17 */
+			banknum |= (val & 0x80) ? 0x00 : 0x02;
+			/* RTSB is A16 */
+			banknum |= (val & 0x02) ? 0x00 : 0x01;
+			/* If the RAM chip is a 128K RAM then A18
+			   is not connected and A17 actually drives
+			   CS1 which needs to be high */
+			if (ram128) {
+				/* DTRB high so !DTRB pin low */
+				if (banknum & 0x02)
+					ramen2 = 0;
+				else
+					ramen2 = 1;
+				banknum &= 1;
 			}
-		case 3:
-			/* What does the hw report ?? */
-			fprintf(stderr, "INVALID(0xFF)\n");
-			return 0xFF;
+			if (trace & TRACE_BANK)
+				fprintf(stderr, "[banknum = %d, RAMen2 = %d.]\n", banknum, ramen2);
 		}
-	} else {
-		/* FIXME: irq handling */
-		uint8_t c = chan->data[0];
-		chan->data[0] = chan->data[1];
-		chan->data[1] = chan->data[2];
-		if (chan->dptr)
-			chan->dptr--;
-		if (chan->dptr == 0)
-			chan->rr[0] &= 0xFE;	/* Clear RX pending */
-		sio2_clear_int(chan, INT_RX);
-		chan->rr[0] &= 0x3F;
-		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c read data %d\n",
-				(addr & 2) ? 'b' : 'a', c);
-		if (chan->dptr && (chan->wr[1] & 0x10))
-			sio2_raise_int(chan, INT_RX);
-		return c;
 	}
-	return 0xFF;
 }
 
-static void sio2_write(uint16_t addr, uint8_t val)
-{
-	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
-	uint8_t r;
-	if (addr & 1) {
-		if (trace & TRACE_SIO)
-			fprintf(stderr,
-				"sio%c write reg %d with %02X\n",
-				(addr & 2) ? 'b' : 'a',
-				chan->wr[0] & 7, val);
-		switch (chan->wr[0] & 007) {
-		case 0:
-			chan->wr[0] = val;
-			/* FIXME: CRC reset bits ? */
-			switch (val & 070) {
-			case 000:	/* NULL */
-				break;
-			case 010:	/* Send Abort SDLC */
-				/* SDLC specific no-op for async */
-				break;
-			case 020:	/* Reset external/status interrupts */
-				sio2_clear_int(chan, INT_ERR);
-				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
-				if (trace & TRACE_SIO)
-					fprintf(stderr,
-						"[extint reset]\n");
-				break;
-			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
-					fprintf(stderr,
-						"[channel reset]\n");
-				sio2_channel_reset(chan);
-				break;
-			case 040:	/* Enable interrupt on next rx */
-				chan->rxint = 1;
-				break;
-			case 050:	/* Reset transmitter interrupt pending */
-				chan->txint = 0;
-				break;
-			case 060:	/* Reset the error latches */
-				chan->rr[1] &= 0x8F;
-				break;
-			case 070:	/* Return from interrupt (channel A) */
-				if (chan == sio) {
-					sio->irq = 0;
-					sio->rr[1] &= ~0x02;
-					sio2_clear_int(sio,
-						       INT_RX |
-						       INT_TX | INT_ERR);
-					sio2_clear_int(sio + 1,
-						       INT_RX |
-						       INT_TX | INT_ERR);
-				}
-				break;
-			}
-			break;
-		case 1:
-			if (chan == sio) {
-				romen = (val & 0x40) ? 0 : 1;
-				if (trace & TRACE_BANK)
-					fprintf(stderr, "[ROMen = %d.]\n", romen);
-			} else if (!r16bug && !boardmod) {
-				banknum = (val & 0x40) ? 0 : 1;
-				if (trace & TRACE_BANK)
-					fprintf(stderr, "[RAM A16 = %d.]\n", banknum);
-			}
-			/* Fall through */
-		case 2:
-		case 3:
-		case 4:
-		case 5:
-		case 6:
-		case 7:
-			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
-					(addr & 2) ? 'b' : 'a', r, val);
-			chan->wr[r] = val;
-			if (chan != sio && r == 2)
-				chan->rr[2] = val;
-			chan->wr[0] &= ~007;
-			if (r == 5 && chan == sio) {
-				/* Setting DTRA high sets the pin low which turns on
-				   the RAM */
-				ramen = (val & 0x80) ? 1 : 0;
-				if (trace & TRACE_BANK)
-					fprintf(stderr, "[RAMen = %d.]\n", ramen);
-			}
-			if (boardmod) {
-				/* Modified board */
-				if (r == 5 && chan == sio && ram512) {
-					banknum &= ~0x04;
-					/* RTSA is A18 */
-					banknum |= (val & 0x02) ? 0x00 : 0x04;
-					if (trace & TRACE_BANK)
-						fprintf(stderr, "[banknum = %d.]\n", banknum);
-				}
-				/* DTRB is A17, RTSB is A16 */
-				if (r == 5 && chan == sio + 1) {
-					banknum &= ~0x03;
-					/* DTRB is A17 */
-					banknum |= (val & 0x80) ? 0x00 : 0x02;
-					/* RTSB is A16 */
-					banknum |= (val & 0x02) ? 0x00 : 0x01;
-					/* If the RAM chip is a 128K RAM then A18
-					   is not connected and A17 actually drives
-					   CS1 which needs to be high */
-					if (ram128) {
-						/* DTRB high so !DTRB pin low */
-						if (banknum & 0x02)
-							ramen2 = 0;
-						else
-							ramen2 = 1;
-						banknum &= 1;
-					}
-					if (trace & TRACE_BANK)
-						fprintf(stderr, "[banknum = %d, RAMen2 = %d.]\n", banknum, ramen2);
-				}
-			}
-			break;
-		}
-		/* Control */
-	} else {
-		/* Strictly we should emulate this as two bytes, one going out and
-		   the visible queue - FIXME */
-		/* FIXME: irq handling */
-		chan->rr[0] &= ~(1 << 2);	/* Transmit buffer no longer empty */
-		chan->txint = 1;
-		/* Should check chan->wr[5] & 8 */
-		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
-			fprintf(stderr, "sio%c write data %d\n",
-				(addr & 2) ? 'b' : 'a', val);
-		write(1, &val, 1);
-	}
-}
 
 static int ide = 0;
 struct ide_controller *ide0;
@@ -592,7 +301,7 @@ static uint8_t rtcwp = 0x80;
 static uint8_t rtc24 = 1;
 static uint8_t rtcbp = 0;
 static uint8_t rtcbc = 0;
-static struct tm *rtc_tm;
+static const struct tm *rtc_tm;
 
 static uint8_t rtc_read(void)
 {
@@ -768,8 +477,7 @@ static void rtc_write(uint8_t val)
 			rtcstate = 0;
 		} else {
 			/* Latch imaginary registers on rising edge */
-			time_t t = time(NULL);
-			rtc_tm = localtime(&t);
+			rtc_tm = vclock_tm(1);
 			if (trace & TRACE_RTC)
 				fprintf(stderr, "RTC CE raised and latched time.\n");
 		}
@@ -783,10 +491,12 @@ static void rtc_write(uint8_t val)
  */
 
 struct z80_ctc {
-	uint16_t count;
+	uint32_t count;
 	uint16_t reload;
 	uint8_t vector;
 	uint8_t ctrl;
+	uint64_t when;		/* CTC clock count was last worked out */
+	uint64_t due;		/* CTC clock it next passes zero */
 #define CTC_IRQ		0x80
 #define CTC_COUNTER	0x40
 #define CTC_PRESCALER	0x20
@@ -801,9 +511,13 @@ struct z80_ctc {
 };
 
 #define CTC_STOPPED(c)	(((c)->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET))
+/* Count units per clock, the count is held scaled by 256 */
+#define CTC_SCALE(c)	(((c)->ctrl & CTC_PRESCALER) ? 1 : 16)
 
 struct z80_ctc ctc[4];
 uint8_t ctc_irqmask;
+static uint64_t ctc_now;	/* CTC clocks elapsed */
+static uint64_t ctc_next;	/* Earliest timer event */
 
 static void ctc_reset(struct z80_ctc *c)
 {
@@ -864,33 +578,80 @@ static int ctc_check_im2(void)
 }
 
 /* Model the chains between the CTC devices */
-static void ctc_receive_pulse(int i);
+static void ctc_receive_pulses(int i, unsigned int n);
 
-static void ctc_pulse(int i)
+static void ctc_pulse(int i, unsigned int n)
 {
 	/* Model CTC 2 chained into CTC 3 */
 	if (i == 2)
-		ctc_receive_pulse(3);
+		ctc_receive_pulses(3, n);
 }
 
 /* We don't worry about edge directions just a logical pulse model */
-static void ctc_receive_pulse(int i)
+static void ctc_receive_pulses(int i, unsigned int n)
 {
 	struct z80_ctc *c = ctc + i;
-	if (c->ctrl & CTC_COUNTER) {
-		if (CTC_STOPPED(c))
-			return;
-		if (c->count >= 0x0100)
-			c->count -= 0x100;	/* No scaling on pulses */
-		if ((c->count & 0xFF00) == 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			c->count = c->reload << 8;
-		}
-	} else {
+	unsigned int count, period;
+
+	if (n == 0)
+		return;
+	if (!(c->ctrl & CTC_COUNTER)) {
 		if (c->ctrl & CTC_PULSE)
 			c->ctrl &= ~CTC_PULSE;
+		return;
+	}
+	if (CTC_STOPPED(c))
+		return;
+	/* Pulses until we next hit zero, then whole reload periods */
+	count = c->count >> 8;
+	if (count == 0)
+		count = 1;
+	if (n < count) {
+		c->count -= n << 8;
+		return;
 	}
+	n -= count;
+	period = c->reload ? c->reload : 256;
+	c->count = (period - n % period) << 8;
+	ctc_interrupt(c);
+	ctc_pulse(i, 1 + n / period);
+}
+
+/*
+ *	Timers are not stepped. Each one holds its count as of CTC clock
+ *	'when' and the clock at which it next passes zero, so that between
+ *	events a tick is just a compare and reads work the count out.
+ */
+static void ctc_catchup(struct z80_ctc *c)
+{
+	int64_t n;
+	unsigned int period, k;
+
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER)) {
+		c->when = ctc_now;
+		return;
+	}
+	n = (int64_t)c->count - (int64_t)(ctc_now - c->when) * CTC_SCALE(c);
+	c->when = ctc_now;
+	if (n >= 0) {
+		c->count = n;
+		return;
+	}
+	period = (c->reload ? c->reload : 256) << 8;
+	k = (-n + period - 1) / period;
+	c->count = n + (int64_t)k * period;
+	ctc_interrupt(c);
+	ctc_pulse(c - ctc, k);
+}
+
+static void ctc_schedule(struct z80_ctc *c)
+{
+	if (CTC_STOPPED(c) || (c->ctrl & CTC_COUNTER))
+		c->due = UINT64_MAX;
+	else
+		c->due = c->when + c->count / CTC_SCALE(c) + 1;
+	if (c->due < ctc_next)
+		ctc_next = c->due;
 }
 
 /* Model counters */
@@ -898,45 +659,29 @@ static void ctc_tick(unsigned int clocks)
 {
 	struct z80_ctc *c = ctc;
 	int i;
-	int n;
-	int decby;
 
+	ctc_now += clocks;
+	if (ctc_now < ctc_next)
+		return;
+	ctc_next = UINT64_MAX;
 	for (i = 0; i < 4; i++, c++) {
-		/* Waiting a value */
-		if (CTC_STOPPED(c))
-			continue;
-		/* Pulse trigger mode */
-		if (c->ctrl & CTC_COUNTER)
-			continue;
-		/* 256x downscaled */
-		decby = clocks;
-		/* 16x not 256x downscale - so increase by 16x */
-		if (!(c->ctrl & CTC_PRESCALER))
-			decby <<= 4;
-		/* Now iterate over the events. We need to deal with wraps
-		   because we might have something counters chained */
-		n = c->count - decby;
-		while (n < 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			if (c->reload == 0)
-				n += 256 << 8;
-			else
-				n += c->reload << 8;
-		}
-		c->count = n;
+		if (c->due <= ctc_now)
+			ctc_catchup(c);
+		ctc_schedule(c);
 	}
 }
 
 static void ctc_write(uint8_t channel, uint8_t val)
 {
 	struct z80_ctc *c = ctc + channel;
+	/* Bring the count up to date under the old settings */
+	ctc_catchup(c);
 	if (c->ctrl & CTC_TCONST) {
 		if (trace & TRACE_CTC)
 			fprintf(stderr, "CTC %d constant loaded with %02X\n", channel, val);
 		c->reload = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET)) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -948,7 +693,7 @@ static void ctc_write(uint8_t channel, uint8_t val)
 			fprintf(stderr, "CTC %d control loaded with %02X\n", channel, val);
 		c->ctrl = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == CTC_RESET) {
-			c->count = (c->reload - 1) << 8;
+			c->count = ((c->reload - 1) & 0xFF) << 8;
 			if (trace & TRACE_CTC)
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
@@ -966,11 +711,17 @@ static void ctc_write(uint8_t channel, uint8_t val)
 			fprintf(stderr, "CTC %d vector loaded with %02X\n", channel, val);
 		c->vector = val;
 	}
+	ctc_schedule(c);
 }
 
 static uint8_t ctc_read(uint8_t channel)
 {
-	uint8_t val = ctc[channel].count >> 8;
+	struct z80_ctc *c = ctc + channel;
+	uint8_t val;
+
+	ctc_catchup(c);
+	ctc_schedule(c);
+	val = c->count >> 8;
 	if (trace & TRACE_CTC)
 		fprintf(stderr, "CTC %d reads %02x\n", channel, val);
 	return val;
@@ -1017,15 +768,15 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 
 static void poll_irq_event(void)
 {
-	if (!sio2_check_im2(sio))
-		sio2_check_im2(sio + 1);
+	if (!sio2_check_im2(0))
+		sio2_check_im2(1);
 	ctc_check_im2();
 }
 
 static void reti_event(void)
 {
-	sio2_reti(sio);
-	sio2_reti(sio + 1);
+	sio_reti(sio, 0);
+	sio_reti(sio, 1);
 	ctc_reti(0);
 	ctc_reti(1);
 	ctc_reti(2);
@@ -1050,7 +801,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "simple80: [-f] [-t] [-i path] [-r path] [-d debug]\n");
+	fprintf(stderr, "simple80: [-C clock] [-f] [-t] [-i path] [-r path] [-T real|max] [-P port] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -1062,8 +813,10 @@ int main(int argc, char *argv[])
 	int l;
 	char *rompath = "simple80.rom";
 	char *idepath = "simple80.cf";
+	unsigned int baud = SERIAL_BAUD_DEFAULT;
+	char *portspec = NULL;
 
-	while ((opt = getopt(argc, argv, "d:i:r:ftb15")) != -1) {
+	while ((opt = getopt(argc, argv, "C:d:i:r:ftb15T:P:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -1078,6 +831,10 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'C':
+			if (vclock_option(optarg))
+				usage();
+			break;
 		case 'b':
 			r16bug = 1;
 			break;
@@ -1093,6 +850,12 @@ int main(int argc, char *argv[])
 			ram128 = 0;
 			boardmod = 1;
 			break;
+		case 'T':
+			baud = serial_baud_mode(optarg);
+			break;
+		case 'P':
+			portspec = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -1124,7 +887,13 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	sio_reset();
+	sio = sio_create();
+	if (trace & TRACE_SIO)
+		sio_trace(sio, 1);
+	sio_set_input(sio, 0, 1);
+	sio_set_baud(sio, 0, baud);
+	if (portspec)
+		sio_attach(sio, 1, serial_open(portspec));
 	ctc_init();
 
 	/* 5ms - it's a balance between nice behaviour and simulation
@@ -1165,9 +934,12 @@ int main(int argc, char *argv[])
 			/* 36400 T states */
 			for (i = 0; i < 100; i++) {
 				Z80ExecuteTStates(&cpu_z80, 364);
-				sio2_timer();
+				sio_timer(sio, 50000);
 				ctc_tick(364);
 			}
+			/* Console input and any attached port */
+			serial_poll();
+			vclock_tick(tc.tv_nsec);
 			/* Do 5ms of I/O and delays */
 			if (!fast)
 				nanosleep(&tc, NULL);
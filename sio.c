@@ -0,0 +1,502 @@
+/*
+ *	Zilog SIO/2 (and the near identical DART for async use)
+ *
+ *	Channel A or B can take console input and either can be attached to
+ *	a host serial port. The console is itself a serial.c port so its
+ *	input is picked up by serial_poll() like any other. Anything not
+ *	attached is written to stdout.
+ *	Receive and transmit are driven by events scheduled from the
+ *	programmed clock rate and format so an idle channel costs nothing.
+ *
+ *	Not convinced we have all the INT clear cases right for SIO error
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "system.h"
+#include "serial.h"
+#include "sio.h"
+
+/* Every board we emulate feeds the SIO the RC2014 7.3728MHz clock */
+#define SIO_CLOCK	7372800
+
+struct sio_chan {
+	uint8_t wr[8];
+	uint8_t rr[3];
+	uint8_t data[3];
+	uint8_t dptr;
+	uint8_t irq;
+	uint8_t rxint;
+	uint8_t txint;
+	uint8_t intbits;
+#define INT_TX	1
+#define INT_RX	2
+#define INT_ERR	4
+	uint8_t pending;	/* Interrupt bits pending as an IRQ cause */
+	uint8_t vector;		/* Vector pending to deliver */
+	uint8_t input;		/* Console input arrives on this channel */
+	uint8_t console;	/* and port is the console */
+	uint8_t baud;		/* SERIAL_BAUD_ pacing */
+	struct serial *port;	/* Host side if attached */
+	uint64_t rxdue;		/* Next time to look for input */
+	uint64_t txdue;		/* Time the transmitter empties, 0 if idle */
+};
+
+struct sio {
+	struct sio_chan chan[2];
+	uint64_t now;		/* ns of emulated time */
+	uint64_t next;		/* Earliest event either channel needs */
+	uint8_t trace;
+};
+
+#define CHAN(sio, c)	((int)((c) - (sio)->chan))
+#define NAME(sio, c)	((c) == (sio)->chan ? 'a' : 'b')
+
+static void sio_clear_int(struct sio *sio, struct sio_chan *chan, uint8_t m)
+{
+	if (sio->trace)
+		fprintf(stderr, "Clear intbits %d %x\n", CHAN(sio, chan), m);
+	chan->intbits &= ~m;
+	chan->pending &= ~m;
+	/* Check me - does it auto clear down or do you have to reti it ? */
+	if (!(sio->chan[0].intbits | sio->chan[1].intbits)) {
+		sio->chan[0].rr[1] &= ~0x02;
+		chan->irq = 0;
+	}
+	recalc_interrupts();
+}
+
+static void sio_raise_int(struct sio *sio, struct sio_chan *chan, uint8_t m)
+{
+	uint8_t new = (chan->intbits ^ m) & m;
+	chan->intbits |= m;
+	if (sio->trace && new)
+		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
+	if (new) {
+		if (!sio->chan[0].irq) {
+			chan->irq = 1;
+			sio->chan[0].rr[1] |= 0x02;
+			recalc_interrupts();
+		}
+	}
+}
+
+void sio_reti(struct sio *sio, unsigned int n)
+{
+	/* Recalculate the pending state and vectors */
+	/* FIXME: what really goes here */
+	sio->chan[0].irq = 0;
+	recalc_interrupts();
+}
+
+/* Returns the vector to deliver if the channel is interrupting, or -1 */
+int sio_check_im2(struct sio *sio, unsigned int n)
+{
+	struct sio_chan *chan = sio->chan + n;
+	uint8_t vector = sio->chan[1].wr[2];
+
+	if (!chan->irq)
+		return -1;
+	/* This is a subset of the real options. FIXME: add
+	   external status change */
+	if (sio->chan[1].wr[1] & 0x04) {
+		vector &= 0xF1;
+		if (n == 0)
+			vector |= 1 << 3;
+		if (chan->intbits & INT_RX)
+			vector |= 4;
+		else if (chan->intbits & INT_ERR)
+			vector |= 2;
+	}
+	chan->vector = vector;
+	if (sio->trace)
+		fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
+			n, vector);
+	return vector;
+}
+
+uint8_t sio_irq_pending(struct sio *sio)
+{
+	return sio->chan[0].irq | sio->chan[1].irq;
+}
+
+/*
+ *	The SIO replaces the last character in the FIFO on an
+ *	overrun.
+ */
+static void sio_queue(struct sio *sio, struct sio_chan *chan, uint8_t c)
+{
+	if (sio->trace)
+		fprintf(stderr, "SIO %d queue %d: ", CHAN(sio, chan), c);
+	/* Receive disabled */
+	if (!(chan->wr[3] & 1)) {
+		fprintf(stderr, "RX disabled.\n");
+		return;
+	}
+	/* Overrun */
+	if (chan->dptr == 2) {
+		if (sio->trace)
+			fprintf(stderr, "Overrun.\n");
+		chan->data[2] = c;
+		chan->rr[1] |= 0x20;	/* Overrun flagged */
+		/* What are the rules for overrun delivery FIXME */
+		sio_raise_int(sio, chan, INT_ERR);
+	} else {
+		/* FIFO add */
+		if (sio->trace)
+			fprintf(stderr, "Queued %d (mode %d)\n", chan->dptr, chan->wr[1] & 0x18);
+		chan->data[chan->dptr++] = c;
+		chan->rr[0] |= 1;
+		switch (chan->wr[1] & 0x18) {
+		case 0x00:
+			break;
+		case 0x08:
+			if (chan->dptr == 1)
+				sio_raise_int(sio, chan, INT_RX);
+			break;
+		case 0x10:
+		case 0x18:
+			sio_raise_int(sio, chan, INT_RX);
+			break;
+		}
+	}
+}
+
+static unsigned int sio_ready(struct sio_chan *chan)
+{
+	if (chan->port)
+		return serial_ready(chan->port);
+	return 2;
+}
+
+static uint8_t sio_getc(struct sio_chan *chan)
+{
+	uint8_t c = serial_getc(chan->port);
+
+	if (chan->console && c == 0x0A)
+		c = '\r';
+	return c;
+}
+
+static void sio_putc(struct sio_chan *chan, uint8_t c)
+{
+	if (chan->port)
+		serial_putc(chan->port, c);
+	else
+		write(1, &c, 1);
+}
+
+/* The console by default overruns like the real thing. Anything else
+   waits for FIFO space so bulk transfers don't lose bytes */
+static int sio_rx_room(struct sio_chan *chan)
+{
+	if (chan->console && chan->baud == SERIAL_BAUD_DEFAULT)
+		return 1;
+	return chan->dptr < 2 && (chan->wr[3] & 1);
+}
+
+/* Line time of one character from the clock mode and format */
+static uint64_t sio_chartime(struct sio *sio, struct sio_chan *chan)
+{
+	static const uint8_t clkmul[4] = { 1, 16, 32, 64 };
+	static const uint8_t data[4] = { 5, 7, 6, 8 };
+	unsigned int bits = 1 + data[chan->wr[3] >> 6];
+
+	if (chan->wr[4] & 1)
+		bits++;
+	/* 1.5 stop bits rounds up */
+	bits += (chan->wr[4] & 0x0C) >= 0x08 ? 2 : 1;
+	return (uint64_t)bits * clkmul[chan->wr[4] >> 6] * 1000000000ULL / SIO_CLOCK;
+}
+
+static void sio_schedule(struct sio *sio, uint64_t when)
+{
+	if (when < sio->next)
+		sio->next = when;
+}
+
+static void sio_tx_empty(struct sio *sio, struct sio_chan *chan)
+{
+	if (!(chan->rr[0] & 0x04)) {
+		chan->rr[0] |= 0x04;
+		if (chan->wr[1] & 0x02)
+			sio_raise_int(sio, chan, INT_TX);
+	}
+}
+
+/*
+ *	Run any events that have come due on a channel and book the next
+ *	one. A time of now + 1 means the next call to sio_timer.
+ */
+static void sio_channel_event(struct sio *sio, struct sio_chan *chan)
+{
+	if (chan->txdue && sio->now >= chan->txdue) {
+		/* A full host port holds the transmitter like CTS */
+		if (sio_ready(chan) & 2) {
+			chan->txdue = 0;
+			sio_tx_empty(sio, chan);
+		} else
+			chan->txdue = sio->now + 1;
+	}
+	if (chan->txdue)
+		sio_schedule(sio, chan->txdue);
+
+	if (!chan->port)
+		return;
+	if (sio->now >= chan->rxdue) {
+		chan->rxdue = sio->now + 1;
+		if (sio_rx_room(chan) && (sio_ready(chan) & 1)) {
+			sio_queue(sio, chan, sio_getc(chan));
+			if (chan->baud == SERIAL_BAUD_REAL)
+				chan->rxdue = sio->now + sio_chartime(sio, chan);
+		}
+	}
+	sio_schedule(sio, chan->rxdue);
+}
+
+void sio_timer(struct sio *sio, unsigned int ns)
+{
+	sio->now += ns;
+	if (sio->now < sio->next)
+		return;
+	sio->next = ~0ULL;
+	sio_channel_event(sio, sio->chan);
+	sio_channel_event(sio, sio->chan + 1);
+}
+
+static void sio_channel_reset(struct sio *sio, struct sio_chan *chan)
+{
+	chan->rr[0] = 0x2C;
+	chan->rr[1] = 0x01;
+	chan->rr[2] = 0;
+	chan->txdue = 0;
+	sio_clear_int(sio, chan, INT_RX | INT_TX | INT_ERR);
+}
+
+void sio_reset(struct sio *sio)
+{
+	sio_channel_reset(sio, sio->chan);
+	sio_channel_reset(sio, sio->chan + 1);
+	sio->next = 0;
+}
+
+uint8_t sio_read(struct sio *sio, uint8_t addr)
+{
+	struct sio_chan *chan = sio->chan + ((addr >> 1) & 1);
+	if (!(addr & 1)) {
+		/* Control */
+		uint8_t r = chan->wr[0] & 007;
+		chan->wr[0] &= ~007;
+
+		chan->rr[0] &= ~2;
+		if (chan == sio->chan && (sio->chan[0].intbits | sio->chan[1].intbits))
+			chan->rr[0] |= 2;
+		if (sio->trace)
+			fprintf(stderr, "sio%c read reg %d = ", NAME(sio, chan), r);
+		switch (r) {
+		case 0:
+		case 1:
+			if (sio->trace)
+				fprintf(stderr, "%02X\n", chan->rr[r]);
+			return chan->rr[r];
+		case 2:
+			if (chan != sio->chan) {
+				if (sio->trace)
+					fprintf(stderr, "%02X\n", chan->rr[2]);
+				return chan->rr[2];
+			}
+		case 3:
+			/* What does the hw report ?? */
+			fprintf(stderr, "INVALID(0xFF)\n");
+			return 0xFF;
+		}
+	} else {
+		uint8_t c = chan->data[0];
+		chan->data[0] = chan->data[1];
+		chan->data[1] = chan->data[2];
+		if (chan->dptr)
+			chan->dptr--;
+		if (chan->dptr == 0)
+			chan->rr[0] &= 0xFE;	/* Clear RX pending */
+		sio_clear_int(sio, chan, INT_RX);
+		chan->rr[0] &= 0x3F;
+		chan->rr[1] &= 0x3F;
+		if (sio->trace)
+			fprintf(stderr, "sio%c read data %d\n", NAME(sio, chan), c);
+		if (chan->dptr && (chan->wr[1] & 0x10))
+			sio_raise_int(sio, chan, INT_RX);
+		/* Flat out the next byte arrives as soon as the FIFO is empty */
+		if (chan->baud == SERIAL_BAUD_MAX && chan->dptr == 0 &&
+		    chan->port && (sio_ready(chan) & 1))
+			sio_queue(sio, chan, sio_getc(chan));
+		return c;
+	}
+	return 0xFF;
+}
+
+void sio_write(struct sio *sio, uint8_t addr, uint8_t val)
+{
+	struct sio_chan *chan = sio->chan + ((addr >> 1) & 1);
+	uint8_t r;
+	if (!(addr & 1)) {
+		/* Control */
+		if (sio->trace)
+			fprintf(stderr, "sio%c write reg %d with %02X\n", NAME(sio, chan), chan->wr[0] & 7, val);
+		switch (chan->wr[0] & 007) {
+		case 0:
+			chan->wr[0] = val;
+			/* FIXME: CRC reset bits ? */
+			switch (val & 070) {
+			case 000:	/* NULL */
+				break;
+			case 010:	/* Send Abort SDLC */
+				/* SDLC specific no-op for async */
+				break;
+			case 020:	/* Reset external/status interrupts */
+				sio_clear_int(sio, chan, INT_ERR);
+				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
+				break;
+			case 030:	/* Channel reset */
+				if (sio->trace)
+					fprintf(stderr, "[channel reset]\n");
+				sio_channel_reset(sio, chan);
+				break;
+			case 040:	/* Enable interrupt on next rx */
+				chan->rxint = 1;
+				break;
+			case 050:	/* Reset transmitter interrupt pending */
+				chan->txint = 0;
+				sio_clear_int(sio, chan, INT_TX);
+				break;
+			case 060:	/* Reset the error latches */
+				chan->rr[1] &= 0x8F;
+				break;
+			case 070:	/* Return from interrupt (channel A) */
+				if (chan == sio->chan) {
+					chan->irq = 0;
+					chan->rr[1] &= ~0x02;
+					sio_clear_int(sio, sio->chan, INT_RX | INT_TX | INT_ERR);
+					sio_clear_int(sio, sio->chan + 1, INT_RX | INT_TX | INT_ERR);
+				}
+				break;
+			}
+			break;
+		case 1:
+		case 2:
+		case 3:
+		case 4:
+		case 5:
+		case 6:
+		case 7:
+			r = chan->wr[0] & 7;
+			if (sio->trace)
+				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
+					NAME(sio, chan), r, val);
+			chan->wr[r] = val;
+			if (chan != sio->chan && r == 2)
+				chan->rr[2] = val;
+			chan->wr[0] &= ~007;
+			break;
+		}
+	} else {
+		/* Strictly we should emulate this as two bytes, one going out and
+		   the visible queue - FIXME */
+		chan->rr[0] &= ~(1 << 2);	/* Transmit buffer no longer empty */
+		chan->txint = 1;
+		/* Should check chan->wr[5] & 8 */
+		sio_clear_int(sio, chan, INT_TX);
+		if (sio->trace)
+			fprintf(stderr, "sio%c write data %d\n", NAME(sio, chan), val);
+		sio_putc(chan, val);
+		/* Flat out the transmitter is free again straight away,
+		   otherwise it empties a character time or a tick from now */
+		if (chan->baud == SERIAL_BAUD_MAX && (sio_ready(chan) & 2))
+			sio_tx_empty(sio, chan);
+		else {
+			if (chan->baud == SERIAL_BAUD_REAL)
+				chan->txdue = sio->now + sio_chartime(sio, chan);
+			else
+				chan->txdue = sio->now + 1;
+			sio_schedule(sio, chan->txdue);
+		}
+	}
+}
+
+/* For boards that hang banking and the like off the WR1 and WR5 pins */
+uint8_t sio_get_wr(struct sio *sio, unsigned int chan, unsigned int reg)
+{
+	return sio->chan[chan].wr[reg];
+}
+
+/* Drive the DCD input, some boards wire a timer to it */
+void sio_set_dcd(struct sio *sio, unsigned int n, int onoff)
+{
+	struct sio_chan *chan = sio->chan + n;
+	uint8_t old = chan->rr[0];
+
+	if (onoff)
+		chan->rr[0] |= 0x08;
+	else
+		chan->rr[0] &= ~0x08;
+	if (old != chan->rr[0] && (chan->wr[1] & 0x01))
+		sio_raise_int(sio, chan, INT_ERR);
+}
+
+/* A channel with no host port of its own reads the console port */
+static void sio_console(struct sio_chan *chan)
+{
+	if (chan->input && chan->port == NULL) {
+		chan->port = serial_console();
+		chan->console = 1;
+	} else if (!chan->input && chan->console) {
+		chan->port = NULL;
+		chan->console = 0;
+	}
+}
+
+void sio_set_input(struct sio *sio, unsigned int n, int onoff)
+{
+	sio->chan[n].input = onoff;
+	sio_console(sio->chan + n);
+	sio->next = 0;
+}
+
+void sio_set_baud(struct sio *sio, unsigned int n, unsigned int mode)
+{
+	sio->chan[n].baud = mode;
+}
+
+void sio_attach(struct sio *sio, unsigned int n, struct serial *port)
+{
+	sio->chan[n].port = port;
+	sio->chan[n].console = 0;
+	if (port)
+		sio->chan[n].baud = serial_baud(port);
+	sio_console(sio->chan + n);
+	sio->next = 0;
+}
+
+void sio_trace(struct sio *sio, int onoff)
+{
+	sio->trace = onoff;
+}
+
+struct sio *sio_create(void)
+{
+	struct sio *sio = malloc(sizeof(struct sio));
+	if (sio == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	memset(sio, 0, sizeof(struct sio));
+	sio_reset(sio);
+	return sio;
+}
+
+void sio_free(struct sio *sio)
+{
+	free(sio);
+}
@@ -0,0 +1,20 @@
+struct sio;
+struct serial;
+
+/* Port addresses: bit 1 selects channel B, bit 0 data rather than control */
+
+extern struct sio *sio_create(void);
+extern void sio_free(struct sio *sio);
+extern void sio_reset(struct sio *sio);
+extern void sio_trace(struct sio *sio, int onoff);
+extern uint8_t sio_read(struct sio *sio, uint8_t addr);
+extern void sio_write(struct sio *sio, uint8_t addr, uint8_t val);
+extern void sio_timer(struct sio *sio, unsigned int ns);
+extern int sio_check_im2(struct sio *sio, unsigned int chan);
+extern void sio_reti(struct sio *sio, unsigned int chan);
+extern uint8_t sio_irq_pending(struct sio *sio);
+extern uint8_t sio_get_wr(struct sio *sio, unsigned int chan, unsigned int reg);
+extern void sio_set_dcd(struct sio *sio, unsigned int chan, int onoff);
+extern void sio_set_input(struct sio *sio, unsigned int chan, int onoff);
+extern void sio_set_baud(struct sio *sio, unsigned int chan, unsigned int mode);
+extern void sio_attach(struct sio *sio, unsigned int chan, struct serial *port);
@@ -13,6 +13,9 @@
  *	RTC setting
  *
  *	The only IRQ on this system is from the RTC.
+ *
+ *	The first UART is the console, -P attaches the others in turn to a
+ *	host serial port (see serial.h).
  */
 
 #include <stdio.h>
@@ -28,6 +31,9 @@
 #include <sys/mman.h>
 #include "libz80/z80.h"
 #include "ide.h"
+#include "uart16x50.h"
+#include "serial.h"
+#include "vclock.h"
 
 static uint8_t eeprom[32768];
 static uint8_t fixedram[32768];
@@ -110,7 +116,7 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
         fprintf(stderr, "] <- %02X\n", val);
 }
 
-static int check_chario(void)
+int check_chario(void)
 {
     fd_set i, o;
     struct timeval tv;
@@ -134,7 +140,7 @@ static int check_chario(void)
     return r;
 }
 
-static unsigned int next_char(void)
+unsigned int next_char(void)
 {
     char c;
     if (read(0, &c, 1) != 1) {
@@ -146,243 +152,15 @@ static unsigned int next_char(void)
     return c;
 }
 
-/* UART: very mimimal for the moment */
-
-struct uart16x50 {
-    uint8_t ier;
-    uint8_t iir;
-    uint8_t fcr;
-    uint8_t lcr;
-    uint8_t mcr;
-    uint8_t lsr;
-    uint8_t msr;
-    uint8_t scratch;
-    uint8_t ls;
-    uint8_t ms;
-    uint8_t dlab;
-    uint8_t irq;
-#define RXDA	1
-#define TEMT	2
-#define MODEM	8
-    uint8_t irqline;
-};
-
-static struct uart16x50 uart[4];
-
-static void uart_init(struct uart16x50 *uptr)
-{
-    uptr->dlab = 0;
-}
-
-/* Compute the interrupt indicator register from what is pending */
-static void uart_recalc_iir(struct uart16x50 *uptr)
+/* The UART interrupt is not wired up on the board by default */
+void recalc_interrupts(void)
 {
-    if (uptr->irq & RXDA)
-        uptr->iir = 0x04;
-    else if (uptr->irq & TEMT)
-        uptr->iir = 0x02;
-    else if (uptr->irq & MODEM)
-        uptr->iir = 0x00;
-    else {
-        uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
-    uptr->irqline = uptr->irq;
-#ifdef UART_IRQ    
+#ifdef UART_IRQ
     Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
 #endif
 }
 
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
-        return;
-    uptr->irq |= n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (!(uptr->irq & n))
-        return;
-    uptr->irq &= ~n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_event(struct uart16x50 *uptr)
-{
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-    if (r & 1)
-        uptr->lsr |= 0x01;	/* RX not empty */
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart_interrupt(uptr, TEMT);
-}
-
-static void show_settings(struct uart16x50 *uptr)
-{
-    uint32_t baud;
-
-    if (!(trace & TRACE_UART))
-        return;
-
-    baud = uptr->ls + (uptr->ms << 8);
-    if (baud == 0)
-        baud = 14745600;
-    baud = 14745600 / baud;
-    baud /= 16;
-    fprintf(stderr, "[%d:%d",
-            baud, (uptr->lcr &3) + 5);
-    switch(uptr->lcr & 0x38) {
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-            fprintf(stderr, "N");
-            break;
-        case 0x08:
-            fprintf(stderr, "O");
-            break;
-        case 0x18:
-            fprintf(stderr, "E");
-            break;
-        case 0x28:
-            fprintf(stderr, "M");
-            break;
-        case 0x38:
-            fprintf(stderr, "S");
-            break;
-    }
-    fprintf(stderr, "%d ",
-            (uptr->lcr & 4) ? 2 : 1);
-
-    if (uptr->lcr & 0x40)
-        fprintf(stderr, "break ");
-    if (uptr->lcr & 0x80)
-        fprintf(stderr, "dlab ");
-    if (uptr->mcr & 1)
-        fprintf(stderr, "DTR ");
-    if (uptr->mcr & 2)
-        fprintf(stderr, "RTS ");
-    if (uptr->mcr & 4)
-        fprintf(stderr, "OUT1 ");
-    if (uptr->mcr & 8)
-        fprintf(stderr, "OUT2 ");
-    if (uptr->mcr & 16)
-        fprintf(stderr, "LOOP ");
-    fprintf(stderr, "ier %02x]\n", uptr->ier);
-}
-
-static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
-{
-    switch(addr) {
-    case 0:	/* If dlab = 0, then write else LS*/
-        if (uptr->dlab == 0) {
-            if (uptr == &uart[0]) {
-                putchar(val);
-                fflush(stdout);
-            }
-            uart_clear_interrupt(uptr, TEMT);
-            uart_interrupt(uptr, TEMT);
-        } else {
-            uptr->ls = val;
-            show_settings(uptr);
-        }
-        break;
-    case 1:	/* If dlab = 0, then IER */
-        if (uptr->dlab) {
-            uptr->ms= val;
-            show_settings(uptr);
-        }
-        else
-            uptr->ier = val;
-        break;
-    case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
-        break;
-    case 3:	/* LCR */
-        uptr->lcr = val;
-        uptr->dlab = (uptr->lcr & 0x80);
-        show_settings(uptr);
-        break;
-    case 4:	/* MCR */
-        uptr->mcr = val & 0x3F;
-        show_settings(uptr);
-        break;
-    case 5:	/* LSR (r/o) */
-        break;
-    case 6:	/* MSR (r/o) */
-        break;
-    case 7:	/* Scratch */
-        uptr->scratch = val;
-        break;
-    }
-}
-
-static uint8_t uart_read(struct uart16x50 *uptr, uint8_t addr)
-{
-    uint8_t r;
-
-    switch(addr) {
-    case 0:
-        /* receive buffer */
-        if (uptr == &uart[0] && uptr->dlab == 0) {
-            uart_clear_interrupt(uptr, RXDA);
-            return next_char();
-        }
-        break;
-    case 1:
-        /* IER */
-        return uptr->ier;
-    case 2:
-        /* IIR */
-        return uptr->iir;
-    case 3:
-        /* LCR */
-        return uptr->lcr;
-    case 4:
-        /* mcr */
-        return uptr->mcr;
-    case 5:
-        if (uptr != &uart[0])
-            return 0x60;
-        /* lsr */
-        r = check_chario();
-        uptr->lsr = 0;
-        if (r & 1)
-             uptr->lsr |= 0x01;	/* Data ready */
-        if (r & 2)
-             uptr->lsr |= 0x60;	/* TX empty | holding empty */
-        /* Reading the LSR causes these bits to clear */
-        r = uptr->lsr;
-        uptr->lsr &= 0xF0;
-        return r;
-    case 6:
-        /* msr */
-        r = uptr->msr;
-        /* Reading clears the delta bits */
-        uptr->msr &= 0xF0;
-        uart_clear_interrupt(uptr, MODEM);
-        return r;
-    case 7:
-        return uptr->scratch;
-    }
-    return 0xFF;
-}
+static struct uart16x50 *uart[4];
 
 uint8_t fdc_read(uint8_t addr)
 {
@@ -393,7 +171,7 @@ void fdc_write(uint8_t addr, uint8_t val)
 {
 }
 
-static struct tm *tmhold;
+static const struct tm *tmhold;
 uint8_t rtc_status = 2;
 uint8_t rtc_ce = 0;
 uint8_t rtc_cf = 0;
@@ -467,10 +245,8 @@ void rtc_write(uint8_t addr, uint8_t val)
             if ((val & 0x04) == 0)
                 rtc_status &= ~4;
             if (val & 0x01) {
-                time_t t;
                 rtc_status &= ~2;
-                time(&t);
-                tmhold = gmtime(&t);
+                tmhold = vclock_tm(0);
             } else
                 rtc_status |= 2;
             /* FIXME: sort out hold behaviour */
@@ -567,13 +343,13 @@ static uint8_t io_read(int unused, uint16_t addr)
         fprintf(stderr, "read %02x\n", addr);
     addr &= 0xFF;
     if (addr >= 0x10 && addr <= 0x17)
-        return uart_read(&uart[0], addr & 7);
+        return uart16x50_read(uart[0], addr & 7);
     if (addr >= 0x18 && addr <= 0x1F)
-        return uart_read(&uart[1], addr & 7);
+        return uart16x50_read(uart[1], addr & 7);
     if (addr >= 0x48 && addr <= 0x4F)
-        return uart_read(&uart[2], addr & 7);
+        return uart16x50_read(uart[2], addr & 7);
     if (addr >= 0x50 && addr <= 0x57)
-        return uart_read(&uart[3], addr & 7);
+        return uart16x50_read(uart[3], addr & 7);
     if (addr >= 0x20 && addr <= 0x2F)
         return rtc_read(addr & 0x0F);
     if (addr >= 0x30 && addr <= 0x3F)
@@ -593,13 +369,13 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
         fprintf(stderr, "write %02x <- %02x\n", addr & 0xFF, val);
     addr &= 0xFF;
     if (addr >= 0x10 && addr <= 0x17)
-        uart_write(&uart[0], addr & 7, val);
+        uart16x50_write(uart[0], addr & 7, val);
     else if (addr >= 0x18 && addr <= 0x1F)
-        uart_write(&uart[1], addr & 7, val);
+        uart16x50_write(uart[1], addr & 7, val);
     else if (addr >= 0x48 && addr <= 0x4F)
-        uart_write(&uart[2], addr & 7, val);
+        uart16x50_write(uart[2], addr & 7, val);
     else if (addr >= 0x50 && addr <= 0x57)
-        uart_write(&uart[3], addr & 7, val);
+        uart16x50_write(uart[3], addr & 7, val);
     else if (addr >= 0x20 && addr <= 0x2F)
         rtc_write(addr & 0x0F, val);
     else if(addr >= 0x30 && addr <= 0x3F)
@@ -632,7 +408,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-    fprintf(stderr, "smallz80: [-f] [-r rompath] [-i idepath] [-d tracemask]\n");
+    fprintf(stderr, "smallz80: [-C clock] [-f] [-r rompath] [-i idepath] [-P port] [-T real|max] [-d tracemask]\n");
     exit(EXIT_FAILURE);
 }
 
@@ -641,10 +417,14 @@ int main(int argc, char *argv[])
     static struct timespec tc;
     int opt;
     int fd;
+    int i;
     char *rompath = "smallz80.rom";
     char *idepath[2] = { NULL, NULL };
+    char *portspec[3];
+    int ports = 0;
+    unsigned int baud = SERIAL_BAUD_DEFAULT;
 
-    while((opt = getopt(argc, argv, "r:i:d:f")) != -1) {
+    while((opt = getopt(argc, argv, "C:r:i:d:fP:T:")) != -1) {
         switch(opt) {
             case 'r':
                 rompath = optarg;
@@ -661,6 +441,19 @@ int main(int argc, char *argv[])
             case 'f':
                 fast = 1;
                 break;
+            case 'C':
+                if (vclock_option(optarg))
+                    usage();
+                break;
+            case 'P':
+                if (ports == 3)
+                    fprintf(stderr, "smallz80: only three spare UARTs.\n");
+                else
+                    portspec[ports++] = optarg;
+                break;
+            case 'T':
+                baud = serial_baud_mode(optarg);
+                break;
             default:
                 usage();
         }
@@ -700,10 +493,20 @@ int main(int argc, char *argv[])
 
     ide_reset_begin(ide0);
 
-    uart_init(&uart[0]);
-    uart_init(&uart[1]);
-    uart_init(&uart[2]);
-    uart_init(&uart[3]);
+    for (i = 0; i < 4; i++) {
+        uart[i] = uart16x50_create();
+        uart16x50_set_clock(uart[i], 14745600);
+        if (trace & TRACE_UART)
+            uart16x50_trace(uart[i], 1);
+    }
+    uart16x50_set_input(uart[0], 1);
+    uart16x50_set_output(uart[0], 1);
+    uart16x50_set_baud(uart[0], baud);
+    for (i = 0; i < ports; i++) {
+        struct serial *port = serial_open(portspec[i]);
+        uart16x50_attach(uart[i + 1], port);
+        uart16x50_set_baud(uart[i + 1], serial_baud(port));
+    }
 
     /* 1/64th of a second */
     tc.tv_sec = 0;
@@ -744,9 +547,15 @@ int main(int argc, char *argv[])
 	    if (!(rtc_ce & 1) && (rtc_status & 4))
                 Z80INT(&cpu_z80, 0xFF);
 	    Z80ExecuteTStates(&cpu_z80, 31250);
-	    uart_event(&uart[0]);
+	    /* 1.5625ms at 20MHz */
+	    uart16x50_timer(uart[0], 1562500);
+	    uart16x50_timer(uart[1], 1562500);
+	    uart16x50_timer(uart[2], 1562500);
+	    uart16x50_timer(uart[3], 1562500);
+	    serial_poll();
 	}
         rtc_status |= 4;
+	vclock_tick(tc.tv_nsec);
         /* Do 1/64th of a second of I/O and delays */
 	if (!fast)
 		nanosleep(&tc, NULL);
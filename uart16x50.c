@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "system.h"
+#include "serial.h"
+#include "uart16x50.h"
+
+/*
+ *	16x50 UART. With the FIFO disabled this behaves as a 16450, with it
+ *	enabled as a 16550A with 16 byte FIFOs, receive trigger levels and
+ *	the character timeout interrupt. Characters move at the rate set by
+ *	the divisor and line format, driven by uart16x50_timer(), or in
+ *	SERIAL_BAUD_MAX mode as fast as the guest will take them. The UART
+ *	talks to the console unless it is attached to a serial port.
+ */
+
+#define FIFO_SIZE	16
+
+struct uart16x50 {
+    uint8_t ier;
+    uint8_t iir;
+    uint8_t fcr;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t msr;
+    uint8_t scratch;
+    uint8_t ls;
+    uint8_t ms;
+    uint8_t rxfifo[FIFO_SIZE];
+    uint8_t rxhead;
+    uint8_t rxcount;
+    uint8_t txfifo[FIFO_SIZE];
+    uint8_t txhead;
+    uint8_t txcount;
+    uint8_t thre;		/* THR empty interrupt pending */
+    uint8_t timeout;		/* Character timeout pending */
+    uint8_t irq;		/* Interrupt line asserted */
+    uint32_t clock;		/* Baud clock in Hz */
+    uint64_t chartime;		/* ns per character on the wire */
+    uint64_t rxtime;		/* ns of receive line time not yet used */
+    uint64_t txbusy;		/* ns until the shifter is empty */
+    uint64_t idle;		/* ns since the rx FIFO was last touched */
+    struct serial *port;	/* Host port, or NULL for the console */
+    uint8_t max;		/* Unpaced */
+    uint8_t input;
+    uint8_t output;
+    uint8_t trace;
+};
+
+#define FIFO_ON(u)	((u)->fcr & 0x01)
+#define FIFO_DEPTH(u)	(FIFO_ON(u) ? FIFO_SIZE : 1)
+
+static const uint8_t trigger[4] = { 1, 4, 8, 14 };
+
+static void uart16x50_recalc_iir(struct uart16x50 *uptr)
+{
+    uint8_t old = uptr->irq;
+    unsigned int level = FIFO_ON(uptr) ? trigger[uptr->fcr >> 6] : 1;
+
+    if ((uptr->ier & 0x01) && uptr->rxcount >= level)
+        uptr->iir = 0x04;
+    else if ((uptr->ier & 0x01) && uptr->timeout)
+        uptr->iir = 0x0C;
+    else if ((uptr->ier & 0x02) && uptr->thre)
+        uptr->iir = 0x02;
+    else if ((uptr->ier & 0x08) && (uptr->msr & 0x0F))
+        uptr->iir = 0x00;
+    else
+        uptr->iir = 0x01;	/* No interrupt */
+    uptr->irq = !(uptr->iir & 0x01);
+    if (FIFO_ON(uptr))
+        uptr->iir |= 0xC0;
+    if (uptr->irq && !old) {
+        if (uptr->trace)
+            fprintf(stderr, "[UART interrupt %02X]\n", uptr->iir);
+        recalc_interrupts();
+    }
+}
+
+static void uart16x50_settings(struct uart16x50 *uptr)
+{
+    uint32_t div = uptr->ls + (uptr->ms << 8);
+    unsigned int bits;
+
+    if (div == 0)
+        div = 1;
+    /* Start, data, parity and stop bits */
+    bits = 1 + 5 + (uptr->lcr & 3);
+    if (uptr->lcr & 0x08)
+        bits++;
+    bits += (uptr->lcr & 0x04) ? 2 : 1;
+    uptr->chartime = (uint64_t)bits * 16 * div * 1000000000ULL / uptr->clock;
+
+    if (!uptr->trace)
+        return;
+
+    fprintf(stderr, "[%d:%d", uptr->clock / 16 / div, (uptr->lcr &3) + 5);
+    switch(uptr->lcr & 0x38) {
+        case 0x00:
+        case 0x10:
+        case 0x20:
+        case 0x30:
+            fprintf(stderr, "N");
+            break;
+        case 0x08:
+            fprintf(stderr, "O");
+            break;
+        case 0x18:
+            fprintf(stderr, "E");
+            break;
+        case 0x28:
+            fprintf(stderr, "M");
+            break;
+        case 0x38:
+            fprintf(stderr, "S");
+            break;
+    }
+    fprintf(stderr, "%d ",
+            (uptr->lcr & 4) ? 2 : 1);
+
+    if (uptr->lcr & 0x40)
+        fprintf(stderr, "break ");
+    if (uptr->lcr & 0x80)
+        fprintf(stderr, "dlab ");
+    if (uptr->mcr & 1)
+        fprintf(stderr, "DTR ");
+    if (uptr->mcr & 2)
+        fprintf(stderr, "RTS ");
+    if (uptr->mcr & 4)
+        fprintf(stderr, "OUT1 ");
+    if (uptr->mcr & 8)
+        fprintf(stderr, "OUT2 ");
+    if (uptr->mcr & 16)
+        fprintf(stderr, "LOOP ");
+    if (FIFO_ON(uptr))
+        fprintf(stderr, "FIFO %d ", trigger[uptr->fcr >> 6]);
+    fprintf(stderr, "ier %02x]\n", uptr->ier);
+}
+
+static int uart16x50_rx_ready(struct uart16x50 *uptr)
+{
+    if (uptr->port)
+        return serial_ready(uptr->port) & 1;
+    return uptr->input && (check_chario() & 1);
+}
+
+/* A port that is backed up holds the transmitter as CTS would */
+static int uart16x50_tx_ready(struct uart16x50 *uptr)
+{
+    return uptr->port == NULL || (serial_ready(uptr->port) & 2);
+}
+
+static void uart16x50_rx_char(struct uart16x50 *uptr)
+{
+    uptr->rxfifo[(uptr->rxhead + uptr->rxcount) % FIFO_SIZE] =
+        uptr->port ? serial_getc(uptr->port) : next_char();
+    uptr->rxcount++;
+    uptr->idle = 0;
+}
+
+/* Move the next byte into the shifter and off to the host */
+static void uart16x50_tx_start(struct uart16x50 *uptr)
+{
+    uint8_t c = uptr->txfifo[uptr->txhead];
+
+    uptr->txhead = (uptr->txhead + 1) % FIFO_SIZE;
+    uptr->txcount--;
+    uptr->txbusy = uptr->max ? 0 : uptr->chartime;
+    if (uptr->port)
+        serial_putc(uptr->port, c);
+    else if (uptr->output)
+        putchar(c);
+    if (uptr->txcount == 0)
+        uptr->thre = 1;
+}
+
+void uart16x50_timer(struct uart16x50 *uptr, unsigned int ns)
+{
+    unsigned int depth = FIFO_DEPTH(uptr);
+    uint64_t t = ns;
+    int sent = 0;
+
+    /* Transmit whatever the line time allows */
+    while (uptr->txbusy <= t) {
+        t -= uptr->txbusy;
+        uptr->txbusy = 0;
+        if (uptr->txcount == 0 || !uart16x50_tx_ready(uptr))
+            break;
+        uart16x50_tx_start(uptr);
+        sent = 1;
+    }
+    if (uptr->txbusy)
+        uptr->txbusy -= t;
+    if (sent && uptr->output && !uptr->port)
+        fflush(stdout);
+
+    /* Receive at most one character per character time and only while
+       there is room, so the host side acts as flow control */
+    uptr->rxtime += ns;
+    if (uptr->max || uptr->rxtime > depth * uptr->chartime)
+        uptr->rxtime = depth * uptr->chartime;
+    uptr->idle += ns;
+    while (uptr->rxtime >= uptr->chartime && uptr->rxcount < depth &&
+        uart16x50_rx_ready(uptr)) {
+        uart16x50_rx_char(uptr);
+        uptr->rxtime -= uptr->chartime;
+    }
+    /* Data below the trigger level that nobody has touched for four
+       character times */
+    if (FIFO_ON(uptr) && uptr->rxcount && uptr->idle >= 4 * uptr->chartime)
+        uptr->timeout = 1;
+    uart16x50_recalc_iir(uptr);
+}
+
+static void uart16x50_fifo_reset(struct uart16x50 *uptr, uint8_t which)
+{
+    if (which & 0x02) {
+        uptr->rxcount = 0;
+        uptr->timeout = 0;
+    }
+    if (which & 0x04) {
+        uptr->txcount = 0;
+        uptr->thre = 1;
+    }
+}
+
+void uart16x50_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
+{
+    switch(addr) {
+    case 0:	/* If dlab = 0, then write else LS*/
+        if (uptr->lcr & 0x80) {
+            uptr->ls = val;
+            uart16x50_settings(uptr);
+            break;
+        }
+        uptr->thre = 0;
+        /* A full FIFO or holding register just loses the byte */
+        if (uptr->txcount < FIFO_DEPTH(uptr)) {
+            uptr->txfifo[(uptr->txhead + uptr->txcount) % FIFO_SIZE] = val;
+            uptr->txcount++;
+        }
+        if (uptr->txbusy == 0 && uart16x50_tx_ready(uptr)) {
+            uart16x50_tx_start(uptr);
+            if (uptr->output && !uptr->port)
+                fflush(stdout);
+        }
+        break;
+    case 1:	/* If dlab = 0, then IER */
+        if (uptr->lcr & 0x80) {
+            uptr->ms= val;
+            uart16x50_settings(uptr);
+            break;
+        }
+        /* Enabling the THR interrupt with the THR empty fires it */
+        if ((val & ~uptr->ier & 0x02) && uptr->txcount == 0)
+            uptr->thre = 1;
+        uptr->ier = val & 0x0F;
+        break;
+    case 2:	/* FCR */
+        /* Switching the FIFO on or off clears it */
+        if ((val ^ uptr->fcr) & 0x01)
+            val |= 0x06;
+        uart16x50_fifo_reset(uptr, val);
+        uptr->fcr = val & 0xC9;
+        if (uptr->trace)
+            uart16x50_settings(uptr);
+        break;
+    case 3:	/* LCR */
+        uptr->lcr = val;
+        uart16x50_settings(uptr);
+        break;
+    case 4:	/* MCR */
+        uptr->mcr = val & 0x1F;
+        if (uptr->trace)
+            uart16x50_settings(uptr);
+        break;
+    case 5:	/* LSR (r/o) */
+        break;
+    case 6:	/* MSR (r/o) */
+        break;
+    case 7:	/* Scratch */
+        uptr->scratch = val;
+        break;
+    }
+    uart16x50_recalc_iir(uptr);
+}
+
+uint8_t uart16x50_read(struct uart16x50 *uptr, uint8_t addr)
+{
+    uint8_t r;
+
+    switch(addr) {
+    case 0:
+        /* receive buffer */
+        if (uptr->lcr & 0x80)
+            return uptr->ls;
+        if (uptr->rxcount == 0)
+            return 0x00;
+        r = uptr->rxfifo[uptr->rxhead];
+        uptr->rxhead = (uptr->rxhead + 1) % FIFO_SIZE;
+        uptr->rxcount--;
+        uptr->idle = 0;
+        uptr->timeout = 0;
+        /* Flat out the next byte arrives as soon as the guest has
+           emptied the FIFO */
+        if (uptr->max && uptr->rxcount == 0 && uart16x50_rx_ready(uptr))
+            uart16x50_rx_char(uptr);
+        uart16x50_recalc_iir(uptr);
+        return r;
+    case 1:
+        /* IER */
+        if (uptr->lcr & 0x80)
+            return uptr->ms;
+        return uptr->ier;
+    case 2:
+        /* IIR: reading it acknowledges a THR empty interrupt */
+        r = uptr->iir;
+        if ((r & 0x0F) == 0x02) {
+            uptr->thre = 0;
+            uart16x50_recalc_iir(uptr);
+        }
+        return r;
+    case 3:
+        /* LCR */
+        return uptr->lcr;
+    case 4:
+        /* mcr */
+        return uptr->mcr;
+    case 5:
+        /* lsr */
+        r = 0;
+        if (uptr->rxcount)
+            r |= 0x01;	/* Data ready */
+        if (uptr->txcount == 0) {
+            r |= 0x20;	/* Holding register/FIFO empty */
+            if (uptr->txbusy == 0)
+                r |= 0x40;	/* and the shifter too */
+        }
+        return r;
+    case 6:
+        /* msr */
+        r = uptr->msr;
+        /* Reading clears the delta bits */
+        uptr->msr &= 0xF0;
+        uart16x50_recalc_iir(uptr);
+        return r;
+    case 7:
+        return uptr->scratch;
+    }
+    return 0xFF;
+}
+
+/* The board has changed the modem input lines (MSR bits 4-7) */
+void uart16x50_signal_change(struct uart16x50 *uptr, uint8_t msr)
+{
+    uint8_t delta = (uptr->msr ^ msr) & 0xF0;
+    uint8_t dbits = (delta & 0xB0) >> 4;
+
+    /* RI only flags the trailing edge */
+    if ((delta & 0x40) && !(msr & 0x40))
+        dbits |= 0x04;
+    uptr->msr = (msr & 0xF0) | (uptr->msr & 0x0F) | dbits;
+    uart16x50_recalc_iir(uptr);
+}
+
+uint8_t uart16x50_irq_pending(struct uart16x50 *uptr)
+{
+    return uptr->irq;
+}
+
+void uart16x50_set_clock(struct uart16x50 *uptr, uint32_t hz)
+{
+    uptr->clock = hz;
+    uart16x50_settings(uptr);
+}
+
+void uart16x50_set_input(struct uart16x50 *uptr, int onoff)
+{
+    uptr->input = onoff;
+}
+
+void uart16x50_set_output(struct uart16x50 *uptr, int onoff)
+{
+    uptr->output = onoff;
+}
+
+void uart16x50_attach(struct uart16x50 *uptr, struct serial *port)
+{
+    uptr->port = port;
+}
+
+/* The default pacing is already the real rate */
+void uart16x50_set_baud(struct uart16x50 *uptr, unsigned int mode)
+{
+    uptr->max = (mode == SERIAL_BAUD_MAX);
+    if (uptr->max)
+        uptr->txbusy = 0;
+}
+
+void uart16x50_reset(struct uart16x50 *uptr)
+{
+    struct serial *port = uptr->port;
+    uint8_t max = uptr->max;
+    uint32_t clock = uptr->clock;
+    uint8_t input = uptr->input;
+    uint8_t output = uptr->output;
+    uint8_t trace = uptr->trace;
+
+    memset(uptr, 0, sizeof(struct uart16x50));
+    uptr->clock = clock ? clock : 1843200;
+    uptr->port = port;
+    uptr->max = max;
+    uptr->input = input;
+    uptr->output = output;
+    uptr->trace = trace;
+    uptr->iir = 0x01;
+    uart16x50_settings(uptr);
+}
+
+struct uart16x50 *uart16x50_create(void)
+{
+    struct uart16x50 *uptr = calloc(1, sizeof(struct uart16x50));
+    if (uptr == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    uart16x50_reset(uptr);
+    return uptr;
+}
+
+void uart16x50_free(struct uart16x50 *uptr)
+{
+    free(uptr);
+}
+
+void uart16x50_trace(struct uart16x50 *uptr, int onoff)
+{
+    uptr->trace = onoff;
+}
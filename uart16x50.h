@@ -0,0 +1,17 @@
+struct uart16x50;
+struct serial;
+
+extern struct uart16x50 *uart16x50_create(void);
+extern void uart16x50_free(struct uart16x50 *uptr);
+extern void uart16x50_reset(struct uart16x50 *uptr);
+extern void uart16x50_trace(struct uart16x50 *uptr, int onoff);
+extern uint8_t uart16x50_read(struct uart16x50 *uptr, uint8_t addr);
+extern void uart16x50_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val);
+extern void uart16x50_timer(struct uart16x50 *uptr, unsigned int ns);
+extern uint8_t uart16x50_irq_pending(struct uart16x50 *uptr);
+extern void uart16x50_signal_change(struct uart16x50 *uptr, uint8_t msr);
+extern void uart16x50_set_clock(struct uart16x50 *uptr, uint32_t hz);
+extern void uart16x50_set_input(struct uart16x50 *uptr, int onoff);
+extern void uart16x50_set_output(struct uart16x50 *uptr, int onoff);
+extern void uart16x50_attach(struct uart16x50 *uptr, struct serial *port);
+extern void uart16x50_set_baud(struct uart16x50 *uptr, unsigned int mode);
@@ -0,0 +1,95 @@
+/*
+ *	Guest wall clock (see vclock.h)
+ *
+ *	Boards call vclock_tick() with the emulated time of each pass of
+ *	their main loop. The broken down time is only worked out again when
+ *	the second changes.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vclock.h"
+
+static time_t base;		/* Guest time when we started */
+static int anchored;
+static unsigned int rate = 1;	/* 0 is frozen */
+static uint64_t elapsed;	/* Guest ns since then */
+
+static time_t cached[2] = { -1, -1 };
+static struct tm cached_tm[2];
+
+static void vclock_anchor(void)
+{
+	if (!anchored) {
+		base = time(NULL);
+		anchored = 1;
+	}
+}
+
+/* Returns -1 if the spec makes no sense */
+int vclock_option(const char *spec)
+{
+	char *p = strdup(spec);
+	char *s, *e;
+	char *save;
+	unsigned long v;
+	int r = 0;
+
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (s = strtok_r(p, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+		if (strcmp(s, "freeze") == 0) {
+			rate = 0;
+			continue;
+		}
+		if (*s != '@' && *s != 'x') {
+			r = -1;
+			break;
+		}
+		v = strtoul(s + 1, &e, 0);
+		if (s[1] == 0 || *e) {
+			r = -1;
+			break;
+		}
+		if (*s == '@') {
+			base = v;
+			anchored = 1;
+		} else
+			rate = v;
+	}
+	free(p);
+	return r;
+}
+
+void vclock_tick(uint64_t ns)
+{
+	vclock_anchor();
+	elapsed += ns * rate;
+}
+
+time_t vclock_time(void)
+{
+	vclock_anchor();
+	return base + elapsed / 1000000000ULL;
+}
+
+/* Local or UTC time. Stays put until the next call */
+const struct tm *vclock_tm(int local)
+{
+	time_t t = vclock_time();
+
+	local = !!local;
+	if (t != cached[local]) {
+		if (local)
+			localtime_r(&t, &cached_tm[local]);
+		else
+			gmtime_r(&t, &cached_tm[local]);
+		cached[local] = t;
+	}
+	return &cached_tm[local];
+}
@@ -0,0 +1,23 @@
+#ifndef __VCLOCK_H
+#define __VCLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ *	The wall clock the guest sees. It starts at host time and then moves
+ *	with emulated time rather than host time, so reading it costs no
+ *	system calls and a run replays the same times. The -C option takes
+ *	a comma separated list of
+ *
+ *	@secs		start at this many seconds since 1970 instead
+ *	freeze		stop the clock where it starts
+ *	xN		run the clock N times faster than emulated time
+ */
+
+extern int vclock_option(const char *spec);
+extern void vclock_tick(uint64_t ns);
+extern time_t vclock_time(void);
+extern const struct tm *vclock_tm(int local);
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ *	A network with nobody on it but us (see vnet.h)
+ *
+ *	Each guest socket is one end of a socketpair. We hold the other end
+ *	and run whatever service the guest connected to on it, all from
+ *	vnet_poll() which the W5100 calls when it services its own sockets.
+ *	Everything stays in the process so the numbers measure the emulator
+ *	and the guest, not the host network.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "vnet.h"
+
+#define VNET_ENDS	8
+#define VNET_BUF	4096
+#define VNET_PAGE	16384		/* Body size of the http page */
+#define VNET_REPORT	5000000000ULL	/* ns between benchmark reports */
+
+#define SVC_NONE	0
+#define SVC_ECHO	1
+#define SVC_DISCARD	2
+#define SVC_CHARGEN	3
+#define SVC_HTTP	4
+#define SVC_CLIENT	5	/* We are the client of a guest server */
+#define SVC_UDP		6
+#define SVC_MAX		7
+
+static const char *svc_name[SVC_MAX] = {
+	"none", "echo", "discard", "chargen", "http", "http client", "udp"
+};
+
+struct vnet_stats {
+	uint64_t rx;		/* Bytes from the guest */
+	uint64_t tx;		/* Bytes to the guest */
+	unsigned int conns;
+	unsigned int done;	/* Requests answered (client) */
+	uint64_t lat;		/* Total ns to first byte (client) */
+	uint64_t latmax;
+};
+
+struct vnet_end {
+	int fd;			/* Our end, -1 if free */
+	int guest;		/* The guest end it pairs with */
+	unsigned int svc;
+	uint32_t events;	/* Registered in the epoll set for */
+	uint8_t buf[VNET_BUF];	/* Waiting to go to the guest */
+	unsigned int len;
+	unsigned int off;
+	unsigned int left;	/* Page bytes still to send (http) */
+	unsigned int match;	/* How much of the end of request we have seen */
+	uint64_t start;		/* When the request went out (client) */
+	int answered;		/* Seen the first byte back (client) */
+};
+
+struct vnet {
+	struct vnet_end end[VNET_ENDS];
+	struct vnet_stats stats[SVC_MAX];
+	int epfd;
+	int bench;
+	uint64_t last;		/* Time of the last report */
+};
+
+static uint8_t pattern[VNET_BUF];
+
+static void vnet_input(struct vnet *v, struct vnet_end *e);
+
+static uint64_t vnet_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vnet_drop(struct vnet_end *e)
+{
+	/* Closing takes it out of the epoll set too */
+	close(e->fd);
+	e->fd = -1;
+	e->events = 0;
+}
+
+static void vnet_arm(struct vnet *v, struct vnet_end *e)
+{
+	struct epoll_event ev;
+	uint32_t want = 0;
+
+	if (e->svc != SVC_ECHO || e->len < VNET_BUF)
+		want |= EPOLLIN;
+	if (e->len || e->left || e->svc == SVC_CHARGEN)
+		want |= EPOLLOUT;
+	if (want == e->events)
+		return;
+	ev.events = want;
+	ev.data.u32 = e - v->end;
+	if (epoll_ctl(v->epfd, e->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		      e->fd, &ev) == -1) {
+		perror("vnet: epoll_ctl");
+		return;
+	}
+	e->events = want;
+}
+
+static struct vnet_end *vnet_find(struct vnet *v, int fd)
+{
+	struct vnet_end *e = v->end;
+	int i;
+
+	for (i = 0; i < VNET_ENDS; i++, e++)
+		if (e->fd != -1 && e->guest == fd)
+			return e;
+	return NULL;
+}
+
+/* Returns the guest end of a new socket, -1 if there is no room */
+int vnet_socket(struct vnet *v, int udp)
+{
+	struct vnet_end *e;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, (udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK |
+		       SOCK_CLOEXEC, 0, sv) == -1)
+		return -1;
+	/* The guest end number may have been used by a socket the guest
+	   closed that we have not noticed yet. Finish with it first as it
+	   may still have the last of a reply in it */
+	e = vnet_find(v, sv[0]);
+	if (e) {
+		while (e->svc != SVC_UDP && e->fd != -1)
+			vnet_input(v, e);
+		if (e->fd != -1)
+			vnet_drop(e);
+	}
+	for (e = v->end; e < v->end + VNET_ENDS; e++)
+		if (e->fd == -1)
+			break;
+	if (e == v->end + VNET_ENDS) {
+		close(sv[0]);
+		close(sv[1]);
+		errno = EMFILE;
+		return -1;
+	}
+	memset(e, 0, sizeof(*e));
+	e->fd = sv[1];
+	e->guest = sv[0];
+	e->svc = udp ? SVC_UDP : SVC_NONE;
+	vnet_arm(v, e);
+	return sv[0];
+}
+
+/* Any address will do, the port picks the service. -1 is refused */
+int vnet_connect(struct vnet *v, int fd, const uint8_t *ip, uint16_t port)
+{
+	struct vnet_end *e = vnet_find(v, fd);
+
+	if (e == NULL)
+		return -1;
+	switch (port) {
+	case 7:
+		e->svc = SVC_ECHO;
+		break;
+	case 9:
+		e->svc = SVC_DISCARD;
+		break;
+	case 19:
+		e->svc = SVC_CHARGEN;
+		break;
+	case 80:
+		e->svc = SVC_HTTP;
+		break;
+	default:
+		return -1;
+	}
+	v->stats[e->svc].conns++;
+	vnet_arm(v, e);
+	return 0;
+}
+
+/* Only the benchmark ever calls on a guest server */
+void vnet_listen(struct vnet *v, int fd, uint16_t port)
+{
+	struct vnet_end *e = vnet_find(v, fd);
+
+	if (e == NULL || !v->bench)
+		return;
+	e->svc = SVC_CLIENT;
+	e->len = sprintf((char *)e->buf, "GET / HTTP/1.0\r\n\r\n");
+	e->start = vnet_now();
+	v->stats[SVC_CLIENT].conns++;
+	vnet_arm(v, e);
+}
+
+static void vnet_udp(struct vnet *v, struct vnet_end *e)
+{
+	uint8_t buf[2048];
+	ssize_t n;
+	unsigned int svc;
+
+	while ((n = recv(e->fd, buf, sizeof(buf), 0)) >= VNET_UDP_HDR) {
+		switch ((buf[4] << 8) | buf[5]) {
+		case 7:
+			svc = SVC_ECHO;
+			/* The address stays as is so it comes from where
+			   it went */
+			if (send(e->fd, buf, n, 0) == n)
+				v->stats[svc].tx += n - VNET_UDP_HDR;
+			break;
+		case 9:
+			svc = SVC_DISCARD;
+			break;
+		default:
+			svc = SVC_UDP;
+			break;
+		}
+		v->stats[svc].rx += n - VNET_UDP_HDR;
+	}
+}
+
+static void vnet_http_request(struct vnet_end *e, uint8_t *p, ssize_t n)
+{
+	static const char eoh[] = "\r\n\r\n";
+
+	while (n-- && e->match < 4) {
+		if (*p == eoh[e->match])
+			e->match++;
+		else
+			e->match = (*p == '\r');
+		p++;
+	}
+	if (e->match == 4 && e->len == 0 && e->left == 0) {
+		e->len = sprintf((char *)e->buf,
+			"HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+			"Content-Length: %d\r\n\r\n", VNET_PAGE);
+		e->left = VNET_PAGE;
+		e->match++;	/* Only answer the once */
+	}
+}
+
+static void vnet_input(struct vnet *v, struct vnet_end *e)
+{
+	struct vnet_stats *s = v->stats + e->svc;
+	uint8_t buf[VNET_BUF];
+	uint8_t *p = buf;
+	size_t room = sizeof(buf);
+	ssize_t n;
+
+	if (e->svc == SVC_UDP) {
+		vnet_udp(v, e);
+		return;
+	}
+	if (e->svc == SVC_ECHO) {
+		p = e->buf + e->len;
+		room = VNET_BUF - e->len;
+	}
+	n = read(e->fd, p, room);
+	if (n == -1 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		/* The guest has closed, which ends a request to a guest
+		   server */
+		if (e->svc == SVC_CLIENT && e->answered)
+			s->done++;
+		vnet_drop(e);
+		return;
+	}
+	s->rx += n;
+	switch (e->svc) {
+	case SVC_ECHO:
+		e->len += n;
+		break;
+	case SVC_HTTP:
+		vnet_http_request(e, p, n);
+		break;
+	case SVC_CLIENT:
+		if (!e->answered) {
+			uint64_t t = vnet_now() - e->start;
+			e->answered = 1;
+			s->lat += t;
+			if (t > s->latmax)
+				s->latmax = t;
+		}
+		break;
+	}
+}
+
+static void vnet_output(struct vnet *v, struct vnet_end *e)
+{
+	struct vnet_stats *s = v->stats + e->svc;
+	ssize_t n;
+
+	if (e->len) {
+		n = write(e->fd, e->buf + e->off, e->len - e->off);
+		if (n <= 0)
+			return;
+		/* Our request is not traffic from the guest's view */
+		if (e->svc != SVC_CLIENT)
+			s->tx += n;
+		e->off += n;
+		if (e->off == e->len)
+			e->len = e->off = 0;
+		return;
+	}
+	if (e->left || e->svc == SVC_CHARGEN) {
+		size_t len = sizeof(pattern);
+		if (e->left && e->left < len)
+			len = e->left;
+		n = write(e->fd, pattern, len);
+		if (n <= 0)
+			return;
+		s->tx += n;
+		if (e->left) {
+			e->left -= n;
+			/* HTTP/1.0 so we hang up when done */
+			if (e->left == 0)
+				shutdown(e->fd, SHUT_WR);
+		}
+	}
+}
+
+static void vnet_report(struct vnet *v, uint64_t now)
+{
+	double secs = (now - v->last) / 1e9;
+	struct vnet_stats *s;
+	int i;
+
+	for (i = 1, s = v->stats + 1; i < SVC_MAX; i++, s++) {
+		if (s->conns == 0 && s->rx == 0 && s->tx == 0)
+			continue;
+		fprintf(stderr, "vnet: %-11s %3u conn in %8.1fKB/s out %8.1fKB/s",
+			svc_name[i], s->conns, s->rx / secs / 1024, s->tx / secs / 1024);
+		if (i == SVC_CLIENT && s->done)
+			fprintf(stderr, " %u req latency avg %.2fms max %.2fms",
+				s->done, s->lat / 1e6 / s->done, s->latmax / 1e6);
+		fputc('\n', stderr);
+	}
+	memset(v->stats, 0, sizeof(v->stats));
+	v->last = now;
+}
+
+void vnet_poll(struct vnet *v)
+{
+	struct epoll_event ev[VNET_ENDS];
+	struct vnet_end *e;
+	int i, n;
+
+	n = epoll_wait(v->epfd, ev, VNET_ENDS, 0);
+	for (i = 0; i < n; i++) {
+		e = v->end + ev[i].data.u32;
+		if (e->fd == -1)
+			continue;
+		if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			vnet_input(v, e);
+		if (e->fd != -1 && (ev[i].events & EPOLLOUT))
+			vnet_output(v, e);
+		if (e->fd != -1)
+			vnet_arm(v, e);
+	}
+	if (v->bench) {
+		uint64_t now = vnet_now();
+		if (now - v->last >= VNET_REPORT)
+			vnet_report(v, now);
+	}
+}
+
+struct vnet *vnet_create(int bench)
+{
+	struct vnet *v = malloc(sizeof(struct vnet));
+	int i;
+
+	if (v == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	memset(v, 0, sizeof(struct vnet));
+	v->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (v->epfd == -1) {
+		perror("vnet: epoll_create1");
+		exit(1);
+	}
+	for (i = 0; i < VNET_ENDS; i++)
+		v->end[i].fd = -1;
+	/* Chargen style lines, which also serve as the http page */
+	for (i = 0; i < VNET_BUF; i++)
+		pattern[i] = (i % 74) == 73 ? '\n' : ' ' + 1 + (i / 74 + i % 74) % 94;
+	v->bench = bench;
+	v->last = vnet_now();
+	return v;
+}
+
+void vnet_free(struct vnet *v)
+{
+	int i;
+
+	if (v->bench)
+		vnet_report(v, vnet_now());
+	for (i = 0; i < VNET_ENDS; i++)
+		if (v->end[i].fd != -1)
+			vnet_drop(v->end + i);
+	close(v->epfd);
+	free(v);
+}
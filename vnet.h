@@ -0,0 +1,34 @@
+#ifndef __VNET_H
+#define __VNET_H
+
+#include <stdint.h>
+
+/*
+ *	A private network for the W5100 with nothing on it but some built in
+ *	services, so network code can be exercised and timed without any host
+ *	networking. Guest sockets are one end of a socketpair and a service
+ *	sits on the other end, picked by the port the guest connects to
+ *
+ *	7	echo
+ *	9	discard
+ *	19	chargen
+ *	80	http, answers any request with a fixed page
+ *
+ *	UDP gets echo and discard. A guest listening on a TCP port is sent
+ *	HTTP requests back to back when benchmarking. vnet_create(1) turns on
+ *	the benchmark, which reports throughput and latency every few seconds.
+ */
+
+/* UDP messages on a vnet socket lead with the peer address and port */
+#define VNET_UDP_HDR	6
+
+struct vnet;
+
+extern struct vnet *vnet_create(int bench);
+extern void vnet_free(struct vnet *v);
+extern int vnet_socket(struct vnet *v, int udp);
+extern int vnet_connect(struct vnet *v, int fd, const uint8_t *ip, uint16_t port);
+extern void vnet_listen(struct vnet *v, int fd, uint16_t port);
+extern void vnet_poll(struct vnet *v);
+
+#endif
@@ -39,9 +39,12 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "w5100.h"
+#include "vnet.h"
 
 typedef enum w5100_socket_mode {
   W5100_SOCKET_MODE_CLOSED = 0x00,
@@ -138,10 +141,7 @@ typedef struct nic_w5100_socket_t {
   int datagram_lengths[0x20]; /* The lengths of datagrams to be sent */
   int datagram_count;
 
-  /* Flag used to indicate that a socket has been closed since we started
-     waiting for it in a select() call and therefore the socket should no
-     longer be used */
-  int ok_for_io;
+  uint32_t events;          /* What fd is registered for in the epoll set */
 
 } nic_w5100_socket_t;
 
@@ -153,8 +153,24 @@ struct nic_w5100_t {
   uint8_t mr;
   uint16_t ar;
   nic_w5100_socket_t socket[4];
+  int epfd;        /* Every open host socket is watched from here */
+  struct vnet *vnet; /* If set the sockets go here rather than the host */
+  uint64_t now;    /* Emulated ns, from w5100_timer */
+  uint64_t polled; /* When the sockets were last serviced */
 };
 
+/* Least emulated time between the extra polls made for an idle register */
+#define W5100_POLL_NS 50000
+
+/* A guest spinning on an empty status register gets the sockets serviced
+   early, but no more than once per W5100_POLL_NS */
+static void
+w5100_idle_poll( nic_w5100_t *self )
+{
+  if( self->now - self->polled >= W5100_POLL_NS )
+    w5100_process( self );
+}
+
 /* Define this to spew debugging info to stdout */
 #define W5100_DEBUG 0
 
@@ -243,8 +259,8 @@ static void w5100_socket_init_common( nic_w5100_socket_t *socket )
   socket->fd = -1;
   socket->bind_count = 0;
   socket->socket_bound = 0;
-  socket->ok_for_io = 0;
   socket->write_pending = 0;
+  socket->events = 0;
 }
 
 void nic_w5100_socket_init( nic_w5100_socket_t *socket, int which )
@@ -326,7 +342,7 @@ w5100_write_socket_mr( nic_w5100_socket_t *socket, uint8_t b )
 }
 
 static void
-w5100_socket_open( nic_w5100_socket_t *socket_obj )
+w5100_socket_open( nic_w5100_t *self, nic_w5100_socket_t *socket_obj )
 {
   if( ( socket_obj->mode == W5100_SOCKET_MODE_UDP ||
       socket_obj->mode == W5100_SOCKET_MODE_TCP ) &&
@@ -343,7 +359,10 @@ w5100_socket_open( nic_w5100_socket_t *socket_obj )
 
     w5100_socket_clean( socket_obj );
 
-    socket_obj->fd = socket( AF_INET, type, protocol );
+    if( self->vnet )
+      socket_obj->fd = vnet_socket( self->vnet, !tcp );
+    else
+      socket_obj->fd = socket( AF_INET, type, protocol );
     if( socket_obj->fd == -1) {
       fprintf(stderr,
         "w5100: failed to open %s socket for socket %d; errno %d: %s\n",
@@ -352,7 +371,7 @@ w5100_socket_open( nic_w5100_socket_t *socket_obj )
     }
     fcntl(socket_obj->fd, F_SETFL, FNDELAY);
 
-    if( setsockopt( socket_obj->fd, SOL_SOCKET, SO_REUSEADDR, &one,
+    if( !self->vnet && setsockopt( socket_obj->fd, SOL_SOCKET, SO_REUSEADDR, &one,
       sizeof(one) ) == -1 ) {
       fprintf(stderr,
         "w5100: failed to set SO_REUSEADDR on socket %d; errno %d: %s\n",
@@ -370,6 +389,12 @@ w5100_socket_bind_port( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   struct sockaddr_in sa;
 
+  /* Nothing else on a virtual network to clash with */
+  if( self->vnet ) {
+    socket->socket_bound = 1;
+    return 0;
+  }
+
   memset( &sa, 0, sizeof(sa) );
   sa.sin_family = AF_INET;
   memcpy( &sa.sin_port, socket->port, 2 );
@@ -400,7 +425,9 @@ w5100_socket_listen( nic_w5100_t *self, nic_w5100_socket_t *socket )
       if( w5100_socket_bind_port( self, socket ) )
         return;
 
-    if( listen( socket->fd, 1 ) == -1 ) {
+    if( self->vnet )
+      vnet_listen( self->vnet, socket->fd, (socket->port[0] << 8) | socket->port[1] );
+    else if( listen( socket->fd, 1 ) == -1 ) {
       fprintf(stderr, "w5100: failed to listen on socket %d; errno %d: %s\n",
                        socket->id, errno, strerror(errno));
       return;
@@ -422,6 +449,19 @@ w5100_socket_connect( nic_w5100_t *self, nic_w5100_socket_t *socket )
       if( w5100_socket_bind_port( self, socket ) )
         return;
 
+    if( self->vnet ) {
+      if( vnet_connect( self->vnet, socket->fd, socket->dip,
+                        (socket->dport[0] << 8) | socket->dport[1] ) == -1 ) {
+        nic_w5100_debug( "w5100: socket %d refused\n", socket->id );
+        socket->ir |= 1 << 3;
+        socket->state = W5100_SOCKET_STATE_CLOSED;
+        return;
+      }
+      socket->ir |= 1 << 0;
+      socket->state = W5100_SOCKET_STATE_ESTABLISHED;
+      return;
+    }
+
     memset( &sa, 0, sizeof(sa) );
     sa.sin_family = AF_INET;
     memcpy( &sa.sin_port, socket->dport, 2 );
@@ -456,7 +496,7 @@ w5100_socket_close( nic_w5100_t *self, nic_w5100_socket_t *socket )
     close( socket->fd );
     socket->fd = -1;
     socket->socket_bound = 0;
-    socket->ok_for_io = 0;
+    socket->events = 0;
     socket->state = W5100_SOCKET_STATE_CLOSED;
     nic_w5100_debug( "w5100: closed socket %d\n", socket->id );
   }
@@ -513,7 +553,7 @@ w5100_write_socket_cr( nic_w5100_t *self, nic_w5100_socket_t *socket, uint8_t b
 
   switch( b ) {
     case W5100_SOCKET_COMMAND_OPEN:
-      w5100_socket_open( socket );
+      w5100_socket_open( self, socket );
       break;
     case W5100_SOCKET_COMMAND_LISTEN:
       w5100_socket_listen( self, socket );
@@ -571,6 +611,8 @@ nic_w5100_socket_read( nic_w5100_t *self, uint16_t reg )
       nic_w5100_debug( "w5100: reading 0x%02x from S%d_MR\n", b, socket->id );
       break;
     case W5100_SOCKET_IR:
+      if( !socket->ir )
+        w5100_idle_poll( self );
       b = socket->ir;
       nic_w5100_debug( "w5100: reading 0x%02x from S%d_IR\n", b, socket->id );
       break;
@@ -600,6 +642,8 @@ nic_w5100_socket_read( nic_w5100_t *self, uint16_t reg )
       break;
     case W5100_SOCKET_RX_RSR0: case W5100_SOCKET_RX_RSR1:
       reg_offset = socket_reg - W5100_SOCKET_RX_RSR0;
+      if( reg_offset == 0 && !socket->rx_rsr )
+        w5100_idle_poll( self );
       b = ( socket->rx_rsr >> ( 8 * ( 1 - reg_offset ) ) ) & 0xff;
       nic_w5100_debug( "w5100: reading 0x%02x from S%d_RX_RSR%d\n", b, socket->id, reg_offset );
       break;
@@ -689,48 +733,81 @@ nic_w5100_socket_write_tx_buffer( nic_w5100_t *self, uint16_t reg, uint8_t b )
   socket->tx_buffer[offset] = b;
 }
 
-void
-nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
-  fd_set *writefds, int *max_fd )
+/* Keep the epoll registration for a socket in step with what it can do */
+static void
+w5100_socket_arm( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
-  if( socket->fd != -1 ) {
-    /* We can process a UDP read if we're in a UDP state and there are at least
-       9 bytes free in our buffer (8 byte UDP header and 1 byte of actual
-       data). */
-    int udp_read = socket->state == W5100_SOCKET_STATE_UDP &&
-      0x800 - socket->rx_rsr >= 9;
-    /* We can process a TCP read if we're in the established state and have
-       any room in our buffer (no header necessary for TCP). */
-    int tcp_read = socket->state == W5100_SOCKET_STATE_ESTABLISHED &&
-      0x800 - socket->rx_rsr >= 1;
-
-    int tcp_listen = socket->state == W5100_SOCKET_STATE_LISTEN;
-
-    socket->ok_for_io = 1;
-
-    if( udp_read || tcp_read || tcp_listen ) {
-      FD_SET( socket->fd, readfds );
-      if( socket->fd > *max_fd )
-        *max_fd = socket->fd;
-      nic_w5100_debug( "w5100: checking for read on socket %d with fd %d; max fd %d\n", socket->id, socket->fd, *max_fd );
-    }
+  struct epoll_event ev;
+  uint32_t want = 0;
+  int op;
 
-    if( socket->write_pending || socket->state == W5100_SOCKET_STATE_CONNECTING) {
-      FD_SET( socket->fd, writefds );
-      if( socket->fd > *max_fd )
-        *max_fd = socket->fd;
-      nic_w5100_debug( "w5100: write pending on socket %d with fd %d; max fd %d\n", socket->id, socket->fd, *max_fd );
-    }
+  if( socket->fd == -1 )
+    return;
+
+  /* We can process a UDP read if we're in a UDP state and there are at least
+     9 bytes free in our buffer (8 byte UDP header and 1 byte of actual
+     data). */
+  if( socket->state == W5100_SOCKET_STATE_UDP && 0x800 - socket->rx_rsr >= 9 )
+    want |= EPOLLIN;
+  /* We can process a TCP read if we're in the established state and have
+     any room in our buffer (no header necessary for TCP). */
+  if( socket->state == W5100_SOCKET_STATE_ESTABLISHED && socket->rx_rsr < 0x800 )
+    want |= EPOLLIN;
+  if( socket->state == W5100_SOCKET_STATE_LISTEN )
+    want |= EPOLLIN;
+  if( socket->write_pending || socket->state == W5100_SOCKET_STATE_CONNECTING )
+    want |= EPOLLOUT;
+
+  if( want == socket->events )
+    return;
+  if( socket->events == 0 )
+    op = EPOLL_CTL_ADD;
+  else if( want == 0 )
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+
+  ev.events = want;
+  ev.data.u32 = socket->id;
+  if( epoll_ctl( self->epfd, op, socket->fd, &ev ) == -1 ) {
+    fprintf( stderr, "w5100: epoll_ctl on socket %d; errno %d: %s\n",
+             socket->id, errno, strerror(errno) );
+    return;
   }
+  nic_w5100_debug( "w5100: socket %d fd %d now watching %x\n", socket->id, socket->fd, want );
+  socket->events = want;
+}
+
+/* Describe len bytes of a 2K ring starting at offset, wrapping as needed */
+static int
+w5100_ring_iov( uint8_t *ring, int offset, int len, struct iovec *iov )
+{
+  offset &= 0x7ff;
+  iov[0].iov_base = ring + offset;
+  if( offset + len <= 0x800 ) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = 0x800 - offset;
+  iov[1].iov_base = ring;
+  iov[1].iov_len = len - iov[0].iov_len;
+  return 2;
 }
 
 static void
-w5100_socket_process_accept( nic_w5100_socket_t *socket )
+w5100_socket_process_accept( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   struct sockaddr_in sa;
   socklen_t sa_length = sizeof(sa);
   int new_fd;
 
+  /* A virtual client just starts talking on the socket we have */
+  if( self->vnet ) {
+    nic_w5100_debug( "w5100: virtual connection on socket %d\n", socket->id );
+    socket->state = W5100_SOCKET_STATE_ESTABLISHED;
+    return;
+  }
+
   new_fd = accept( socket->fd, (struct sockaddr*)&sa, &sa_length );
   if( new_fd == -1 ) {
     nic_w5100_debug( "w5100: error from accept on socket %d; errno %d: %s\n",
@@ -740,59 +817,77 @@ w5100_socket_process_accept( nic_w5100_socket_t *socket )
 
   nic_w5100_debug( "w5100: accepted connection from %s:%d on socket %d\n", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port), socket->id );
 
+  fcntl( new_fd, F_SETFL, FNDELAY );
   if( close( socket->fd ) == -1 )
     nic_w5100_debug( "w5100: error attempting to close fd %d for socket %d\n", socket->fd, socket->id );
   socket->fd = new_fd;
+  socket->events = 0;
   socket->state = W5100_SOCKET_STATE_ESTABLISHED;
 }
 
+/* Data lands straight in the RX ring, UDP leaves room for the header */
 static void
 w5100_socket_process_read( nic_w5100_socket_t *socket , nic_w5100_t *self)
 {
-  uint8_t buffer[0x800];
   int bytes_free = 0x800 - socket->rx_rsr;
+  int offset = (socket->old_rx_rd + socket->rx_rsr) & 0x7ff;
   ssize_t bytes_read;
   struct sockaddr_in sa;
+  struct iovec iov[2];
+  struct msghdr msg;
 
   int udp = socket->state == W5100_SOCKET_STATE_UDP;
   const char *description = udp ? "UDP" : "TCP";
 
   nic_w5100_debug( "w5100: reading from socket %d\n", socket->id );
 
-  if( udp ) {
-    socklen_t sa_length = sizeof(sa);
-    bytes_read = recvfrom( socket->fd, (char*)buffer + 8, bytes_free - 8, 0,
-      (struct sockaddr*)&sa, &sa_length );
+  if( udp && self->vnet ) {
+    struct iovec viov[4];
+    int n;
+
+    /* The peer address leads the message so it can go straight into
+       the header, the length goes in after */
+    n = w5100_ring_iov( socket->rx_buffer, offset, VNET_UDP_HDR, viov );
+    n += w5100_ring_iov( socket->rx_buffer, offset + 8, bytes_free - 8, viov + n );
+    bytes_read = readv( socket->fd, viov, n ) - VNET_UDP_HDR;
+    if( bytes_read < 0 )
+      return;
+  }
+  else if( udp ) {
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_name = &sa;
+    msg.msg_namelen = sizeof(sa);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = w5100_ring_iov( socket->rx_buffer, offset + 8,
+                                     bytes_free - 8, iov );
+    bytes_read = recvmsg( socket->fd, &msg, 0 );
   }
   else
-    bytes_read = recv( socket->fd, (char*)buffer, bytes_free, 0 );
+    bytes_read = readv( socket->fd, iov,
+                        w5100_ring_iov( socket->rx_buffer, offset, bytes_free, iov ) );
 
   nic_w5100_debug( "w5100: read 0x%03x bytes from %s socket %d\n", (int)bytes_read, description, socket->id );
 
   if( bytes_read > 0 || (udp && bytes_read == 0) ) {
-    int offset = (socket->old_rx_rd + socket->rx_rsr) & 0x7ff;
-    uint8_t *dest = &socket->rx_buffer[offset];
-
     if( udp ) {
       /* Add the W5100's UDP header */
-      memcpy( buffer, &sa.sin_addr.s_addr, 4 );
-      memcpy( buffer + 4, &sa.sin_port, 2 );
-      buffer[6] = (bytes_read >> 8) & 0xff;
-      buffer[7] = bytes_read & 0xff;
+      uint8_t header[8];
+      int i = 6;
+
+      if( !self->vnet ) {
+        memcpy( header, &sa.sin_addr.s_addr, 4 );
+        memcpy( header + 4, &sa.sin_port, 2 );
+        i = 0;
+      }
+      header[6] = (bytes_read >> 8) & 0xff;
+      header[7] = bytes_read & 0xff;
+      for( ; i < 8; i++ )
+        socket->rx_buffer[(offset + i) & 0x7ff] = header[i];
       bytes_read += 8;
     }
 
     socket->rx_rsr += bytes_read;
     socket->ir |= 1 << 2;
-
-    if( offset + bytes_read <= 0x800 ) {
-      memcpy( dest, buffer, bytes_read );
-    }
-    else {
-      int first_chunk = 0x800 - offset;
-      memcpy( dest, buffer, first_chunk );
-      memcpy( socket->rx_buffer, buffer + first_chunk, bytes_read - first_chunk );
-    }
   }
   else if( bytes_read == 0 ) {  /* TCP */
     if (socket->state == W5100_SOCKET_STATE_CLOSE_WAIT) {
@@ -811,32 +906,46 @@ w5100_socket_process_read( nic_w5100_socket_t *socket , nic_w5100_t *self)
 }
 
 static void
-w5100_socket_process_udp_write( nic_w5100_socket_t *socket )
+w5100_socket_process_udp_write( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   ssize_t bytes_sent;
-  int offset = socket->tx_rr & 0x7ff;
   uint16_t length = socket->datagram_lengths[0];
-  uint8_t *data = &socket->tx_buffer[ offset ];
   struct sockaddr_in sa;
-  uint8_t buffer[0x800];
+  struct iovec iov[3];
+  struct msghdr msg;
 
   nic_w5100_debug( "w5100: writing to UDP socket %d\n", socket->id );
 
-  /* If the data wraps round the write buffer, we need to coalesce it into
-     one chunk for the call to sendto() */
-  if( offset + length > 0x800 ) {
-    int first_chunk = 0x800 - offset;
-    memcpy( buffer, data, first_chunk );
-    memcpy( buffer + first_chunk, socket->tx_buffer, length - first_chunk );
-    data = buffer;
-  }
-
   memset( &sa, 0, sizeof(sa) );
   sa.sin_family = AF_INET;
   memcpy( &sa.sin_port, socket->dport, 2 );
   memcpy( &sa.sin_addr.s_addr, socket->dip, 4 );
 
-  bytes_sent = sendto( socket->fd, (const char*)data, length, 0, (struct sockaddr*)&sa, sizeof(sa) );
+  /* The datagram goes out in one piece even if it wraps the buffer */
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_name = &sa;
+  msg.msg_namelen = sizeof(sa);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = w5100_ring_iov( socket->tx_buffer, socket->tx_rr, length, iov );
+
+  if( self->vnet ) {
+    /* Where it is going leads the message instead */
+    uint8_t header[VNET_UDP_HDR];
+
+    memcpy( header, socket->dip, 4 );
+    memcpy( header + 4, socket->dport, 2 );
+    memmove( iov + 1, iov, msg.msg_iovlen * sizeof(struct iovec) );
+    iov[0].iov_base = header;
+    iov[0].iov_len = VNET_UDP_HDR;
+    msg.msg_iovlen++;
+    msg.msg_name = NULL;
+    msg.msg_namelen = 0;
+    bytes_sent = sendmsg( socket->fd, &msg, 0 );
+    if( bytes_sent != -1 )
+      bytes_sent -= VNET_UDP_HDR;
+  }
+  else
+    bytes_sent = sendmsg( socket->fd, &msg, 0 );
   nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to UDP socket %d\n",
                    (int)bytes_sent, length, socket->id );
 
@@ -862,17 +971,13 @@ static void
 w5100_socket_process_tcp_write( nic_w5100_socket_t *socket )
 {
   ssize_t bytes_sent;
-  int offset = socket->tx_rr & 0x7ff;
   uint16_t length = socket->tx_wr - socket->tx_rr;
-  uint8_t *data = &socket->tx_buffer[ offset ];
+  struct iovec iov[2];
 
   nic_w5100_debug( "w5100: writing to TCP socket %d\n", socket->id );
 
-  /* If the data wraps round the write buffer, write it in two chunks */
-  if( offset + length > 0x800 )
-    length = 0x800 - offset;
-
-  bytes_sent = send( socket->fd, (const char*)data, length, 0 );
+  bytes_sent = writev( socket->fd, iov,
+                       w5100_ring_iov( socket->tx_buffer, socket->tx_rr, length, iov ) );
   nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to TCP socket %d\n",
                    (int)bytes_sent, length, socket->id );
 
@@ -906,33 +1011,29 @@ void w5100_socket_process_connect(nic_w5100_socket_t *socket)
     }
 }
 
-void
-nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
-  fd_set writefds, nic_w5100_t *self )
+static void
+w5100_socket_process_io( nic_w5100_socket_t *socket, uint32_t events,
+  nic_w5100_t *self )
 {
-  /* Process only if we're an open socket, and we haven't been closed and
-     re-opened since the select() started */
-  if( socket->fd != -1 && socket->ok_for_io ) {
-//    printf("Socket %d scan\n", socket->id);
-    if( FD_ISSET( socket->fd, &readfds ) ) {
-//      printf("Read ready on socket %d\n", socket->id);
-      if( socket->state == W5100_SOCKET_STATE_LISTEN )
-        w5100_socket_process_accept( socket );
-      else
-        w5100_socket_process_read( socket , self);
-    }
+  if( events & (EPOLLIN | EPOLLERR | EPOLLHUP) ) {
+    if( socket->state == W5100_SOCKET_STATE_LISTEN )
+      w5100_socket_process_accept( self, socket );
+    else if( socket->events & EPOLLIN )
+      w5100_socket_process_read( socket , self);
+  }
 
-    if( FD_ISSET( socket->fd, &writefds ) ) {
-//      fprintf(stderr, "Write ready on socket %d\n", socket->id);
-      if( socket->state == W5100_SOCKET_STATE_UDP ) {
-        w5100_socket_process_udp_write( socket );
-      }
-      else if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ) {
+  /* The read may have closed the socket under us */
+  if( socket->fd != -1 && (events & (EPOLLOUT | EPOLLERR)) ) {
+    if( socket->state == W5100_SOCKET_STATE_UDP ) {
+      if( socket->write_pending )
+        w5100_socket_process_udp_write( self, socket );
+    }
+    else if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ) {
+      if( socket->write_pending )
         w5100_socket_process_tcp_write( socket );
-      }
-      else if (socket->state == W5100_SOCKET_STATE_CONNECTING) {
-        w5100_socket_process_connect( socket );
-      }
+    }
+    else if (socket->state == W5100_SOCKET_STATE_CONNECTING) {
+      w5100_socket_process_connect( socket );
     }
   }
 }
@@ -955,45 +1056,37 @@ nic_w5100_reset( nic_w5100_t *self )
 
 void w5100_process(nic_w5100_t *self)
 {
-  int i;
-  fd_set readfds, writefds;
-  int active;
-  int max_fd = 0;
-  static struct timeval nowait = { 0, 0 };
-
-  FD_ZERO( &readfds );
-  FD_ZERO( &writefds );
-
-  for( i = 0; i < 4; i++ ) {
-    nic_w5100_socket_add_to_sets( &self->socket[i], &readfds, &writefds,
-      &max_fd );
+  struct epoll_event ev[4];
+  int i, n;
 
-    /* Note that if a socket is closed between when we added it to the sets
-       above and when we call select() below, it will cause the select to fail
-       with EBADF. We catch this and just run around the loop again - the
-       offending socket will not be added to the sets again as it's now been
-       closed */
+  self->polled = self->now;
 
-//    nic_w5100_debug( "w5100: io thread select\n" );
+  /* Let the services answer first so it is all there to pick up */
+  if( self->vnet )
+    vnet_poll( self->vnet );
 
-    active = select( max_fd + 1, &readfds, &writefds, NULL, &nowait );
-
-//    nic_w5100_debug( "w5100: io thread wake; %d active\n", active );
+  for( i = 0; i < 4; i++ )
+    w5100_socket_arm( self, &self->socket[i] );
 
-    if( active != -1 ) {
-      for( i = 0; i < 4; i++ )
-        nic_w5100_socket_process_io( &self->socket[i], readfds, writefds , self);
-    }
-    else if( errno == EBADF ) {
-      /* Do nothing - just loop again */
-    }
-    else {
-      nic_w5100_debug( "w5100: select returned unexpected errno %d: %s\n",
+  n = epoll_wait( self->epfd, ev, 4, 0 );
+  if( n == -1 ) {
+    if( errno != EINTR )
+      nic_w5100_debug( "w5100: epoll_wait returned unexpected errno %d: %s\n",
                        errno, strerror(errno));
-    }
+    return;
+  }
+  for( i = 0; i < n; i++ ) {
+    nic_w5100_socket_t *socket = &self->socket[ev[i].data.u32];
+    if( socket->fd != -1 )
+      w5100_socket_process_io( socket, ev[i].events, self );
   }
 }
 
+void w5100_timer(nic_w5100_t *self, unsigned int ns)
+{
+  self->now += ns;
+}
+
 nic_w5100_t *nic_w5100_alloc( void )
 {
   int i;
@@ -1003,6 +1096,11 @@ nic_w5100_t *nic_w5100_alloc( void )
     fprintf(stderr, "%s:%d out of memory", __FILE__, __LINE__ );
     exit(1);
   }
+  self->epfd = epoll_create1( EPOLL_CLOEXEC );
+  if( self->epfd == -1 ) {
+    perror( "w5100: epoll_create1" );
+    exit(1);
+  }
   for( i = 0; i < 4; i++ )
     nic_w5100_socket_init( &self->socket[i], i );
   nic_w5100_reset( self );
@@ -1017,10 +1115,21 @@ nic_w5100_free( nic_w5100_t *self )
   if( self ) {
     for( i = 0; i < 4; i++ )
       nic_w5100_socket_end( &self->socket[i] );
+    close( self->epfd );
+    if( self->vnet )
+      vnet_free( self->vnet );
     free(self);
   }
 }
 
+/* Put the chip on a virtual network instead of the host's. The chip owns
+   it from here on */
+void
+nic_w5100_set_vnet( nic_w5100_t *self, struct vnet *vnet )
+{
+  self->vnet = vnet;
+}
+
 static uint8_t nic_w5100_compute_ir(nic_w5100_t *self)
 {
   uint8_t r = 0x00;
@@ -1076,7 +1185,13 @@ uint8_t nic_w5100_read( nic_w5100_t *self, uint16_t reg )
         nic_w5100_debug( "w5100: reading 0x%02x from SIPR%d\n", b, reg - W5100_SIPR0 );
         break;
       case W5100_IR:
+        /* A guest spinning here gets its answer without waiting for the
+           next poll from the main loop */
         b = nic_w5100_compute_ir(self);
+        if (!b) {
+          w5100_idle_poll(self);
+          b = nic_w5100_compute_ir(self);
+        }
         if (b)
           nic_w5100_debug( "w5100: reading 0x%02x from IR\n", b);
         break;
@@ -29,6 +29,7 @@
 */
 
 typedef struct nic_w5100_t nic_w5100_t;
+struct vnet;
 
 nic_w5100_t* nic_w5100_alloc( void );
 void nic_w5100_free( nic_w5100_t *self );
@@ -38,4 +39,6 @@ void nic_w5100_reset( nic_w5100_t *self );
 uint8_t nic_w5100_read( nic_w5100_t *self, uint16_t reg);
 void nic_w5100_write( nic_w5100_t *self, uint16_t reg, uint8_t b );
 void w5100_process(nic_w5100_t *self);
+void w5100_timer(nic_w5100_t *self, unsigned int ns);
+void nic_w5100_set_vnet( nic_w5100_t *self, struct vnet *vnet );
 
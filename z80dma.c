@@ -21,6 +21,8 @@ struct z80dma {
 	uint8_t enabled;
 	uint8_t trace;
 	uint8_t idle;
+	uint8_t *(*mmu)(uint16_t addr, int write);
+	unsigned int (*iob)(uint16_t port, uint8_t *buf, unsigned int len, int write);
 };
 
 #define	RR0		0
@@ -99,7 +101,14 @@ static void z80dma_wr(struct z80dma *dma, uint8_t val)
 
 void z80dma_reset(struct z80dma *dma)
 {
+	uint8_t *(*mmu)(uint16_t, int) = dma->mmu;
+	unsigned int (*iob)(uint16_t, uint8_t *, unsigned int, int) = dma->iob;
+	uint8_t trace = dma->trace;
 	memset(dma, 0, sizeof(struct z80dma));
+	/* The wiring to the board survives a reset */
+	dma->mmu = mmu;
+	dma->iob = iob;
+	dma->trace = trace;
 	/* TODO */
 }
 
@@ -245,6 +254,54 @@ void z80dma_write(struct z80dma *dma, uint8_t val)
 	}
 }
 
+static uint16_t z80_dma_addr_b(struct z80dma *dma)
+{
+	/* Weird rules about register B */
+	if (dma->reg[WR2] & 0x20) 
+		return dma->reg[WR_B_L] | (dma->reg[WR_B_H] << 8);
+	if ((dma->reg[RR1] | dma->reg[RR2]) == 0) {
+		dma->reg[RR5] = dma->reg[WR_B_L];
+		dma->reg[RR6] = dma->reg[WR_B_H];
+	}
+	return dma->reg[RR5] | (dma->reg[RR6] << 8);
+}
+
+/* Adjust addresses and counters for n bytes moved */
+static void z80_dma_advance(struct z80dma *dma, unsigned int n)
+{
+	uint16_t count = (dma->reg[RR1] | (dma->reg[RR2] << 8)) + n;
+	uint16_t addr;
+
+	dma->reg[RR1] = count;
+	dma->reg[RR2] = count >> 8;
+	if (!(dma->reg[WR1] & 0x20)) {
+		addr = dma->reg[RR3] | (dma->reg[RR4] << 8);
+		if (dma->reg[WR1] & 0x10)
+			addr += n;
+		else
+			addr -= n;
+		dma->reg[RR3] = addr;
+		dma->reg[RR4] = addr >> 8;
+	}
+	if (!(dma->reg[WR2] & 0x20)) {
+		addr = dma->reg[RR5] | (dma->reg[RR6] << 8);
+		if (dma->reg[WR2] & 0x10)
+			addr += n;
+		else
+			addr -= n;
+		dma->reg[RR5] = addr;
+		dma->reg[RR6] = addr >> 8;
+	}
+	if (dma->reg[RR1] == dma->reg[WR_LEN_L] &&
+	    dma->reg[RR2] == dma->reg[WR_LEN_H]) {
+		/* Completed */
+		dma->enabled = 0;
+		dma->forcerdy = 0;
+		dma->reg[RR0] |= 1;
+		/* TODO: interrupt emulation */
+	}
+}
+
 static uint8_t z80_dma_one_cycle(struct z80dma *dma)
 {
 	uint16_t addr_a, addr_b;
@@ -258,17 +315,7 @@ static uint8_t z80_dma_one_cycle(struct z80dma *dma)
 
 	addr_a = dma->reg[RR3] | (dma->reg[RR4] << 8);
 	port_a = dma->reg[WR1] & 0x08;
-
-	/* Weird rules about register B */
-	if (dma->reg[WR2] & 0x20) 
-		addr_b = dma->reg[WR_B_L] | (dma->reg[WR_B_H] << 8);
-	else {
-		if ((dma->reg[RR1] | dma->reg[RR2]) == 0) {
-			dma->reg[RR5] = dma->reg[WR_B_L];
-			dma->reg[RR6] = dma->reg[WR_B_H];
-		}
-		addr_b = dma->reg[RR5] | (dma->reg[RR6] << 8);
-	}
+	addr_b = z80_dma_addr_b(dma);
 	port_b = dma->reg[WR2] & 0x08;
 
 	/* FIXME: add match/mask to this loop */
@@ -294,41 +341,104 @@ static uint8_t z80_dma_one_cycle(struct z80dma *dma)
 			mem_write(0, addr_a, byte);
 	}
 
-	/* Adjust addresses and counters */
-	dma->reg[RR1]++;
-	if (dma->reg[RR1] == 0)
-		dma->reg[RR2]++;
-	if (!(dma->reg[WR1] & 0x20)) {
-		if (dma->reg[WR1] & 0x10) {
-			dma->reg[RR3]++;
-			if (dma->reg[RR3] == 0)
-				dma->reg[RR4]++;
+	z80_dma_advance(dma, 1);
+	return 2;	/* 2 tstates per simple bus hog */
+}
+
+/* How a side of a transfer can be done in bulk */
+#define SIDE_SLOW	0
+#define SIDE_MEM	1	/* Memory counting up */
+#define SIDE_PORT	2	/* A fixed I/O port */
+
+static int z80_dma_side(struct z80dma *dma, uint8_t wr)
+{
+	if ((wr & 0x38) == 0x10 && dma->mmu)
+		return SIDE_MEM;
+	if ((wr & 0x28) == 0x28 && dma->iob)
+		return SIDE_PORT;
+	return SIDE_SLOW;
+}
+
+/* Do up to n bytes of a transfer in bulk. Memory goes through the board
+   mmu, which hands back where an address lives or NULL if it is not plain
+   memory (ROM on a write, or being traced), and a mapping must hold for
+   the rest of its 4K page. A fixed port goes through the board block I/O
+   hook, which moves what it can and returns 0 for a port it cannot
+   stream. Returns the number of bytes moved, anything else is left to
+   the byte at a time path */
+static unsigned int z80_dma_block(struct z80dma *dma, unsigned int n)
+{
+	unsigned int done = 0;
+	uint16_t src, dst, count, left;
+	uint8_t *s, *d;
+	unsigned int len;
+	int a = z80_dma_side(dma, dma->reg[WR1]);
+	int b = z80_dma_side(dma, dma->reg[WR2]);
+	int from, to;
+
+	if (dma->reg[WR0] & 4) {
+		from = a;
+		to = b;
+	} else {
+		from = b;
+		to = a;
+	}
+	if (from == SIDE_SLOW || to == SIDE_SLOW || (from == SIDE_PORT && to == SIDE_PORT))
+		return 0;
+
+	while (done < n && dma->enabled) {
+		if (dma->reg[WR0] & 4) {
+			src = dma->reg[RR3] | (dma->reg[RR4] << 8);
+			dst = z80_dma_addr_b(dma);
 		} else {
-			dma->reg[RR3]--;
-			if (dma->reg[RR3] == 255)
-				dma->reg[RR4]--;
+			src = z80_dma_addr_b(dma);
+			dst = dma->reg[RR3] | (dma->reg[RR4] << 8);
 		}
-	}
-	if (!(dma->reg[WR2] & 0x20)) {
-		if (dma->reg[WR2] & 0x10) {
-			dma->reg[RR5]++;
-			if (dma->reg[RR5] == 0)
-				dma->reg[RR6]++;
+		count = dma->reg[RR1] | (dma->reg[RR2] << 8);
+		left = dma->reg[WR_LEN_L] | (dma->reg[WR_LEN_H] << 8);
+		left -= count + 1;
+
+		len = n - done;
+		if (len > left + 1U)
+			len = left + 1U;
+		if (from == SIDE_MEM && len > 0x1000 - (src & 0xFFF))
+			len = 0x1000 - (src & 0xFFF);
+		if (to == SIDE_MEM && len > 0x1000 - (dst & 0xFFF))
+			len = 0x1000 - (dst & 0xFFF);
+
+		if (from == SIDE_PORT) {
+			d = dma->mmu(dst, 1);
+			if (d == NULL)
+				break;
+			len = dma->iob(src, d, len, 0);
+		} else if (to == SIDE_PORT) {
+			s = dma->mmu(src, 0);
+			if (s == NULL)
+				break;
+			len = dma->iob(dst, s, len, 1);
 		} else {
-			dma->reg[RR5]--;
-			if (dma->reg[RR5] == 255)
-				dma->reg[RR6]--;
+			s = dma->mmu(src, 0);
+			d = dma->mmu(dst, 1);
+			if (s == NULL || d == NULL)
+				break;
+			/* A copy onto itself a little higher up repeats the
+			   start as it goes, which is also how a fill is done */
+			if (d == s + 1)
+				memset(d, *s, len);
+			else {
+				if (d > s && d < s + len)
+					len = d - s;
+				memmove(d, s, len);
+			}
 		}
+		if (len == 0)
+			break;
+		if (dma->trace)
+			fprintf(stderr, "dma: %04X->%04X %u bytes.\n", src, dst, len);
+		z80_dma_advance(dma, len);
+		done += len;
 	}
-	if (dma->reg[RR1] == dma->reg[WR_LEN_L] &&
-	    dma->reg[RR2] == dma->reg[WR_LEN_H]) {
-		/* Completed */
-		dma->enabled = 0;
-		dma->forcerdy = 0;
-		dma->reg[RR0] |= 1;
-		/* TODO: interrupt emulation */
-	}
-	return 2;	/* 2 tstates per simple bus hog */
+	return done;
 }
 
 static uint8_t z80_dma_calc_idle(struct z80dma *dma)
@@ -366,10 +476,33 @@ int z80_dma_run(struct z80dma *dma, int cycles)
 	if (!dma->enabled)
 		return cycles;
 
-	while(cycles) {
-		int n = z80_dma_do_run(dma);
-		if (n == 0) {
+	/* Each byte is 2 clocks of DMA and then the idle ones for the CPU,
+	   so charge for all the whole bytes that fit at once */
+	if (dma->idle == 0) {
+		int period = 2 + z80_dma_calc_idle(dma);
+		int n = z80_dma_block(dma, cycles / period);
+		cycles -= n * period;
+		spare += n * (period - 2);
+	}
+
+	while(cycles > 0) {
+		int n;
+		if (!dma->enabled) {
+			spare += cycles;
+			break;
+		}
+		if (dma->idle) {
 			/* CPU time */
+			n = dma->idle;
+			if (n > cycles)
+				n = cycles;
+			dma->idle -= n;
+			spare += n;
+			cycles -= n;
+			continue;
+		}
+		n = z80_dma_do_run(dma);
+		if (n == 0) {
 			spare++;
 			cycles--;
 		} else
@@ -386,6 +519,9 @@ struct z80dma *z80dma_create(void)
 		fprintf(stderr, "Out of memory.\n");
 		exit(1);
 	}
+	dma->mmu = NULL;
+	dma->iob = NULL;
+	dma->trace = 0;
 	z80dma_reset(dma);
 	return dma;
 }
@@ -399,3 +535,13 @@ void z80dma_trace(struct z80dma *dma, int on)
 {
 	dma->trace = on;
 }
+
+void z80dma_set_mmu(struct z80dma *dma, uint8_t *(*mmu)(uint16_t addr, int write))
+{
+	dma->mmu = mmu;
+}
+
+void z80dma_set_io_block(struct z80dma *dma, unsigned int (*iob)(uint16_t port, uint8_t *buf, unsigned int len, int write))
+{
+	dma->iob = iob;
+}
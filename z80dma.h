@@ -6,6 +6,8 @@ extern int z80_dma_run(struct z80dma *dma, int cycles);
 extern struct z80dma *z80dma_create(void);
 extern void z80dma_free(struct z80dma *d);
 extern void z80dma_trace(struct z80dma *d, int onoff);
+extern void z80dma_set_mmu(struct z80dma *d, uint8_t *(*mmu)(uint16_t addr, int write));
+extern void z80dma_set_io_block(struct z80dma *d, unsigned int (*iob)(uint16_t port, uint8_t *buf, unsigned int len, int write));
 
 
 
@@ -17,6 +17,9 @@
  *	128K or 512K RAM (banked low 32K over EPROM)
  *	MicroSD card
  *
+ *	Emulator
+ *	Byte wide SPI port at 0xFC for the SD card (see sdcard_spi_port)
+ *
  *	TODO
  *	Is there any sane way to handle the 7 segment displays ?
  */
@@ -33,6 +36,10 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include "libz80/z80.h"
+#include "blkdev.h"
+#include "sdcard.h"
+#include "uart16x50.h"
+#include "serial.h"
 
 static uint8_t bankram[16][32768];
 static uint8_t eprom[32768];
@@ -90,172 +97,17 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
 }
 
 
-static int sd_mode = 0;
 static uint8_t sd_bits;
 static uint8_t sd_bitct;
 static uint8_t sd_miso;
-static int sd_cmdp = 0;
-static int sd_ext = 0;
-static uint8_t sd_cmd[6];
-static uint8_t sd_in[520];
-static int sd_inlen, sd_inp;
-static uint8_t sd_out[520];
-static int sd_outlen, sd_outp;
-static int sd_fd = -1;
-static off_t sd_lba;
-static const uint8_t sd_csd[17] = {
-
-	0xFE,		/* Sync byte before CSD */
-	/* Taken from a Toshiba 64MB card c/o softgun */
-	0x00, 0x2D, 0x00, 0x32,
-	0x13, 0x59, 0x83, 0xB1,
-	0xF6, 0xD9, 0xCF, 0x80,
-	0x16, 0x40, 0x00, 0x00
-};
-
-static uint8_t sd_process_command(void)
-{
-	if (sd_ext) {
-		sd_ext = 0;
-		switch(sd_cmd[0]) {
-		case 0x40+41:
-		        return 0x00;
-		default:
-			return 0xFF;
-		}
-	}
-	if (trace & TRACE_SD)
-		fprintf(stderr, "Command received %x\n", sd_cmd[0]);
-	switch(sd_cmd[0]) {
-	case 0x40+0:		/* CMD 0 */
-		return 0x01;	/* Just respond 0x01 */
-	case 0x40+1:		/* CMD 1 - leave idle */
-		return 0x00;	/* Immediately indicate we did */
-	case 0x40+9:		/* CMD 9 - read the CSD */
-		memcpy(sd_out,sd_csd, 17);
-		sd_outlen = 17;
-		sd_mode = 2;
-                sd_outp = 0;
-		return 0x00;
-	case 0x40+16:		/* CMD 16 - set block size */
-		/* Should check data is 512 !! FIXME */
-		return 0x00;	/* Sure */
-        case 0x40+13:		/* Status */
-                sd_out[0] = 0;
-                sd_outlen = 1;
-                sd_outp = 0;
-                sd_mode = 2;
-                return 0x00;	/* Whatever */
-	case 0x40+17:		/* Read */
-		sd_outlen = 514;
-		sd_outp = 0;
-		/* Sync mark then data */
-		sd_out[0] = 0xFF;
-		sd_out[1] = 0xFE;
-		sd_lba = sd_cmd[4] + 256 * sd_cmd[3] + 65536 * sd_cmd[2] +
-			16777216 * sd_cmd[1];
-		if (trace & TRACE_SD)
-			fprintf(stderr, "Read LBA %lx\n", sd_lba);
-		if (lseek(sd_fd, sd_lba, SEEK_SET) < 0 || read(sd_fd, sd_out + 2, 512) != 512) {
-			if (trace & TRACE_SD)
-				fprintf(stderr, "Read LBA failed.\n");
-			return 0x01;
-		}
-		sd_mode = 2;
-		/* Result */
-		return 0x00;
-	case 0x40+24:		/* Write */
-		/* Will send us FE data FF FF */
-		if (trace & TRACE_SD)
-			fprintf(stderr, "Write LBA %lx\n", sd_lba);
-		sd_inlen = 514;	/* Data FF FF */
-		sd_lba = sd_cmd[4] + 256 * sd_cmd[3] + 65536 * sd_cmd[2] +
-			16777216 * sd_cmd[1];
-		sd_inp = 0;
-		sd_mode = 4;	/* Send a pad then go to mode 3 */
-		return 0x00;	/* The expected OK */
-	case 0x40+55:
-		sd_ext = 1;
-		return 0x01;
-	default:
-		return 0x7F;
-	}
-}
-
-static uint8_t sd_process_data(void)
-{
-	switch(sd_cmd[0]) {
-	case 0x40+24:		/* Write */
-		sd_mode = 0;
-		if (lseek(sd_fd, sd_lba, SEEK_SET) < 0 ||
-			write(sd_fd, sd_in, 512) != 512) {
-			if (trace & TRACE_SD)
-				fprintf(stderr, "Write failed.\n");
-			return 0x1E;	/* Need to look up real values */
-		}
-		return 0x05;	/* Indicate it worked */
-	default:
-		sd_mode = 0;
-		return 0xFF;
-	}
-}
-
-static uint8_t sd_card_byte(uint8_t in)
-{
-	/* No card present */
-	if (sd_fd == -1)
-		return 0xFF;
-
-	if (sd_mode == 0) {
-		if (in != 0xFF) {
-			sd_mode = 1;	/* Command wait */
-			sd_cmdp = 1;
-			sd_cmd[0] = in;
-		}
-		return 0xFF;
-	}
-	if (sd_mode == 1) {
-		sd_cmd[sd_cmdp++] = in;
-		if (sd_cmdp == 6) {	/* Command complete */
-			sd_cmdp = 0;
-			sd_mode = 0;
-			/* Reply with either a stuff byte (CMD12) or a
-			   status */
-			return sd_process_command();
-		}
-		/* Keep talking */
-		return 0xFF;
-	}
-	/* Writing out the response */
-	if (sd_mode == 2) {
-		if (sd_outp + 1 == sd_outlen)
-			sd_mode = 0;
-		return sd_out[sd_outp++];
-	}
-	/* Commands that need input blocks first */
-	if (sd_mode == 3) {
-		sd_in[sd_inp++] = in;
-		if (sd_inp == sd_inlen)
-			return sd_process_data();
-		/* Keep sending */
-		return 0xFF;
-	}
-	/* Sync up before data flow starts */
-	if (sd_mode == 4) {
-		/* Sync */
-		if (in == 0xFE)
-			sd_mode = 3;
-		return 0xFF;
-	}
-	return 0xFF;
-}
+static uint8_t sd_rxbits = 0xFF;
+static struct sdcard *sdcard;
 
 static uint8_t spi_byte_sent(uint8_t val)
 {
-	uint8_t r = sd_card_byte(val);
+	uint8_t r = sdcard_byte(sdcard, val);
 	if (trace & TRACE_SPI)
 		fprintf(stderr,	"[SPI %02X:%02X]\n", val, r);
-	fflush(stdout);
 	return r;
 }
 
@@ -266,7 +118,8 @@ static void spi_select(uint8_t val)
 	    fprintf(stderr,	"[Raised \\CS]\n");
 	sd_bits = 0;
 	sd_bitct = 0;
-	sd_mode = 0;	/* FIXME: layering */
+	sd_rxbits = 0xFF;
+	sdcard_select(sdcard, 0);
 	return;
     } else {
 	if (trace & TRACE_SPI)
@@ -276,8 +129,6 @@ static void spi_select(uint8_t val)
 
 static void spi_clock(void)
 {
-	static uint8_t rxbits = 0xFF;
-
 	if (!qreg[0]) {
 	    fprintf(stderr, "SPI clock: no op.\n");
 	    return;
@@ -289,18 +140,18 @@ static void spi_clock(void)
 	sd_bits |= qreg[5];
 	sd_bitct++;
 	if (sd_bitct == 8) {
-		rxbits = spi_byte_sent(sd_bits);
+		sd_rxbits = spi_byte_sent(sd_bits);
 		sd_bitct = 0;
 	}
 	/* Falling edge */
-	sd_miso = (rxbits & 0x80) ? 0x01 : 0x00;
-	rxbits <<= 1;
-	rxbits |= 0x01;
+	sd_miso = (sd_rxbits & 0x80) ? 0x01 : 0x00;
+	sd_rxbits <<= 1;
+	sd_rxbits |= 0x01;
 	if (trace & TRACE_SPI)
 	    fprintf(stderr, "rxbit = %d]\n", sd_miso);
 }
 
-static int check_chario(void)
+int check_chario(void)
 {
     fd_set i, o;
     struct timeval tv;
@@ -324,7 +175,7 @@ static int check_chario(void)
     return r;
 }
 
-static unsigned int next_char(void)
+unsigned int next_char(void)
 {
     char c;
     if (read(0, &c, 1) != 1) {
@@ -336,251 +187,33 @@ static unsigned int next_char(void)
     return c;
 }
 
-/* UART: very mimimal for the moment */
-
-struct uart16x50 {
-    uint8_t ier;
-    uint8_t iir;
-    uint8_t fcr;
-    uint8_t lcr;
-    uint8_t mcr;
-    uint8_t lsr;
-    uint8_t msr;
-    uint8_t scratch;
-    uint8_t ls;
-    uint8_t ms;
-    uint8_t dlab;
-    uint8_t irq;
-#define RXDA	1
-#define TEMT	2
-#define MODEM	8
-    uint8_t irqline;
-};
-
-static struct uart16x50 uart[1];
-
-static void uart_init(struct uart16x50 *uptr)
-{
-    uptr->dlab = 0;
-}
-
-/* Compute the interrupt indicator register from what is pending */
-static void uart_recalc_iir(struct uart16x50 *uptr)
+void recalc_interrupts(void)
 {
-    if (uptr->irq & RXDA)
-        uptr->iir = 0x04;
-    else if (uptr->irq & TEMT)
-        uptr->iir = 0x02;
-    else if (uptr->irq & MODEM)
-        uptr->iir = 0x00;
-    else {
-        uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
-    uptr->irqline = uptr->irq;
     Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
-    
 }
 
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
-        return;
-    uptr->irq |= n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (!(uptr->irq & n))
-        return;
-    uptr->irq &= ~n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_event(struct uart16x50 *uptr)
-{
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-    if (r & 1)
-        uptr->lsr |= 0x01;	/* RX not empty */
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart_interrupt(uptr, TEMT);
-}
+/* The UART modem lines double as bank select and SD card MISO */
+static struct uart16x50 *uart;
 
-static void show_settings(struct uart16x50 *uptr)
+static uint8_t my_uart_read(uint8_t addr)
 {
-    uint32_t baud;
-
-    if (!(trace & TRACE_UART))
-        return;
-
-    baud = uptr->ls + (uptr->ms << 8);
-    if (baud == 0)
-        baud = 1843200;
-    baud = 1843200 / baud;
-    baud /= 16;
-    fprintf(stderr, "[%d:%d",
-            baud, (uptr->lcr &3) + 5);
-    switch(uptr->lcr & 0x38) {
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-            fprintf(stderr, "N");
-            break;
-        case 0x08:
-            fprintf(stderr, "O");
-            break;
-        case 0x18:
-            fprintf(stderr, "E");
-            break;
-        case 0x28:
-            fprintf(stderr, "M");
-            break;
-        case 0x38:
-            fprintf(stderr, "S");
-            break;
-    }
-    fprintf(stderr, "%d ",
-            (uptr->lcr & 4) ? 2 : 1);
-
-    if (uptr->lcr & 0x40)
-        fprintf(stderr, "break ");
-    if (uptr->lcr & 0x80)
-        fprintf(stderr, "dlab ");
-    if (uptr->mcr & 1)
-        fprintf(stderr, "DTR ");
-    if (uptr->mcr & 2)
-        fprintf(stderr, "RTS ");
-    if (uptr->mcr & 4)
-        fprintf(stderr, "OUT1 ");
-    if (uptr->mcr & 8)
-        fprintf(stderr, "OUT2 ");
-    if (uptr->mcr & 16)
-        fprintf(stderr, "LOOP ");
-    fprintf(stderr, "ier %02x]\n", uptr->ier);
+    uint8_t r = uart16x50_read(uart, addr);
+    /* MSR is used for the SD card MISO line */
+    if (addr == 6)
+        r = (r & 0x7F) | (sd_miso ? 0x00 : 0x80);
+    return r;
 }
 
-static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
+static void my_uart_write(uint8_t addr, uint8_t val)
 {
-    switch(addr) {
-    case 0:	/* If dlab = 0, then write else LS*/
-        if (uptr->dlab == 0) {
-            if (uptr == &uart[0]) {
-                putchar(val);
-                fflush(stdout);
-            }
-            uart_clear_interrupt(uptr, TEMT);
-            uart_interrupt(uptr, TEMT);
-        } else {
-            uptr->ls = val;
-            show_settings(uptr);
-        }
-        break;
-    case 1:	/* If dlab = 0, then IER */
-        if (uptr->dlab) {
-            uptr->ms= val;
-            show_settings(uptr);
-        }
-        else
-            uptr->ier = val;
-        break;
-    case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
-        break;
-    case 3:	/* LCR */
-        uptr->lcr = val;
-        uptr->dlab = (uptr->lcr & 0x80);
-        show_settings(uptr);
-        break;
-    case 4:	/* MCR */
-        uptr->mcr = val & 0x3F;
-        bankreg = uptr->mcr & 0x0F;
+    uart16x50_write(uart, addr, val);
+    if (addr == 4) {
+        bankreg = val & 0x0F;
         if (trace & TRACE_BANK)
             fprintf(stderr, "[Bank %d selected.\n]", bankreg);
-        break;
-    case 5:	/* LSR (r/o) */
-        break;
-    case 6:	/* MSR (r/o) */
-        break;
-    case 7:	/* Scratch */
-        uptr->scratch = val;
-        break;
     }
 }
 
-static uint8_t uart_read(struct uart16x50 *uptr, uint8_t addr)
-{
-    uint8_t r;
-
-    switch(addr) {
-    case 0:
-        /* receive buffer */
-        if (uptr == &uart[0] && uptr->dlab == 0) {
-            uart_clear_interrupt(uptr, RXDA);
-            if (check_chario() & 1)
-                return next_char();
-            return 0x00;
-        } else
-            return uptr->ls;
-        break;
-    case 1:
-        /* IER */
-        if (uptr->dlab == 0)
-            return uptr->ier;
-        return uptr->ms;
-    case 2:
-        /* IIR */
-        return uptr->iir;
-    case 3:
-        /* LCR */
-        return uptr->lcr;
-    case 4:
-        /* mcr */
-        return uptr->mcr;
-    case 5:
-        /* lsr */
-        r = check_chario();
-        uptr->lsr &=0x90;
-        if (r & 1)
-             uptr->lsr |= 0x01;	/* Data ready */
-        if (r & 2)
-             uptr->lsr |= 0x60;	/* TX empty | holding empty */
-        /* Reading the LSR causes these bits to clear */
-        r = uptr->lsr;
-        uptr->lsr &= 0xF0;
-        return r;
-    case 6:
-        /* MSR is used for the SD card MISO line */
-        /* msr */
-        uptr->msr &= 0x7F;
-        uptr->msr |= sd_miso ? 0x00 : 0x80;
-        r = uptr->msr;
-        /* Reading clears the delta bits */
-        uptr->msr &= 0xF0;
-        uart_clear_interrupt(uptr, MODEM);
-        return r;
-    case 7:
-        return uptr->scratch;
-    }
-    return 0xFF;
-}
-
 static void fpreg_write(uint8_t val)
 {
     fpreg &= ~0x47;	/* IRQ clear, clear counter */
@@ -604,10 +237,9 @@ static void qreg_write(uint8_t reg, uint8_t v)
 {
     if (trace & TRACE_QREG)
         fprintf(stderr, "Q%d -> %d.\n", reg, v);
-    qreg[reg] = v;
-
     if (qreg[reg] == v)
         return;
+    qreg[reg] = v;
 
     if ((trace & TRACE_LED) && reg == 2)
         fprintf(stderr, "Yellow LED to %d.\n", v);
@@ -628,7 +260,10 @@ static uint8_t io_read(int unused, uint16_t addr)
     if (addr >= 0xC0 && addr <= 0xC7)
         qreg_read(addr & 7);
     if (addr >= 0xC8 && addr <= 0xCF)
-        return uart_read(&uart[0], addr & 7);
+        return my_uart_read(addr & 7);
+    /* Byte wide SPI, chip select stays on Q4 */
+    if (addr == 0xFC)
+        return qreg[4] ? 0xFF : sdcard_spi_port(sdcard, 0xFF);
     if (trace & TRACE_UNK)
         fprintf(stderr, "Unknown read from port %04X\n", addr);
     return 0xFF;
@@ -644,7 +279,11 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
     else if (addr >= 0xC0 && addr <= 0xC7)
         qreg_write(addr & 7, val & 1);
     else if (addr >= 0xC8 && addr <= 0xCF)
-        uart_write(&uart[0], addr & 7, val);
+        my_uart_write(addr & 7, val);
+    else if (addr == 0xFC) {
+        if (!qreg[4])
+            sdcard_spi_port(sdcard, val);
+    }
     else if (addr == 0xFD) {
         printf("trace set to %d\n", val);
         trace = val;
@@ -669,7 +308,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-    fprintf(stderr, "z80mc: [-f] [-r rompath] [-s sdcardpath] [-d tracemask]\n");
+    fprintf(stderr, "z80mc: [-f] [-r rompath] [-s sdcardpath] [-T real|max] [-d tracemask]\n");
     exit(EXIT_FAILURE);
 }
 
@@ -680,8 +319,9 @@ int main(int argc, char *argv[])
     int fd;
     char *rompath = "z80mc.rom";
     char *sdpath = NULL;
+    unsigned int baud = SERIAL_BAUD_DEFAULT;
 
-    while((opt = getopt(argc, argv, "r:s:d:f")) != -1) {
+    while((opt = getopt(argc, argv, "r:s:d:fT:")) != -1) {
         switch(opt) {
             case 'r':
                 rompath = optarg;
@@ -695,6 +335,9 @@ int main(int argc, char *argv[])
             case 'f':
                 fast = 1;
                 break;
+            case 'T':
+                baud = serial_baud_mode(optarg);
+                break;
             default:
                 usage();
         }
@@ -713,15 +356,24 @@ int main(int argc, char *argv[])
     }
     close(fd);
 
+    sdcard = sdcard_create();
+    if (trace & TRACE_SD)
+	sdcard_trace(sdcard, 1);
     if (sdpath) {
-	sd_fd = open(sdpath, O_RDWR);
+	int sd_fd = open(sdpath, O_RDWR);
 	if (sd_fd == -1) {
 		perror(sdpath);
 		exit(1);
 	}
+	sdcard_attach(sdcard, blkdev_open(sd_fd, 0));
     }
 
-    uart_init(&uart[0]);
+    uart = uart16x50_create();
+    if (trace & TRACE_UART)
+        uart16x50_trace(uart, 1);
+    uart16x50_set_input(uart, 1);
+    uart16x50_set_output(uart, 1);
+    uart16x50_set_baud(uart, baud);
 
     /* No real need for interrupt accuracy so just go with the timer. If we
        ever do the UART as timer hack it'll need addressing! */
@@ -761,7 +413,7 @@ int main(int argc, char *argv[])
 	/* Do 1ms of I/O and delays */
 	if (!fast)
 	    nanosleep(&tc, NULL);
-	uart_event(uart);
+	uart16x50_timer(uart, 1000000);
 	fpreg |= 0x40;
         Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
     }